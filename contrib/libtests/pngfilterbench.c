@@ -0,0 +1,744 @@
+
+/* pngfilterbench.c
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Compare the png_set_filter_heuristics methods.  Each PNG file named on the
+ * command line is read then written again, with all the filters allowed, by
+ * each method in turn; the output is read back and checked.  The total size of
+ * the output of each method is reported with the processor time the writes
+ * took.  With --presets each png_set_encode_preset value is compared instead,
+ * with the filters left to the preset.  With --frames each write after the
+ * first changes one row near the end of the image and uses a frame cache
+ * (png_set_frame_cache), as when writing the frames of a screen; the output
+ * must be the same as that of a write without the cache.  With --presets
+ * PNG_ENCODE_PRESET_AUTO must also do no worse than the default on a small
+ * generated image.
+ */
+
+#define _ISOC90_SOURCE 1
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(HAVE_CONFIG_H) && !defined(PNG_NO_CONFIG_H)
+#  include <config.h>
+#endif
+
+/* Define the following to use this test against your installed libpng, rather
+ * than the one being built here:
+ */
+#ifdef PNG_FREESTANDING_TESTS
+#  include <png.h>
+#else
+#  include "../../png.h"
+#endif
+
+/* As in pngstest, 77 indicates a skipped test to the configure harness: */
+#if PNG_LIBPNG_VER >= 10601 && defined(HAVE_CONFIG_H)
+#  define SKIP 77
+#else
+#  define SKIP 0
+#endif
+
+#if defined(PNG_WRITE_WEIGHTED_FILTER_SUPPORTED) &&\
+    defined(PNG_WRITE_FILTER_SUPPORTED) &&\
+    defined(PNG_INFO_IMAGE_SUPPORTED) &&\
+    defined(PNG_SEQUENTIAL_READ_SUPPORTED) &&\
+    defined(PNG_STDIO_SUPPORTED) &&\
+    defined(PNG_FLOATING_POINT_SUPPORTED)
+
+/* The following is to support direct compilation of this file as C++ */
+#ifdef __cplusplus
+#  define voidcast(type, value) static_cast<type>(value)
+#else
+#  define voidcast(type, value) (value)
+#endif /* __cplusplus */
+
+#define METHODS 4
+
+typedef struct
+{
+   const char *name;
+   int         method;
+} method;
+
+static const method heuristics[METHODS] =
+{
+   { "unweighted", PNG_FILTER_HEURISTIC_UNWEIGHTED },
+   { "weighted",   PNG_FILTER_HEURISTIC_WEIGHTED },
+   { "entropy",    PNG_FILTER_HEURISTIC_ENTROPY },
+   { "zlib",       PNG_FILTER_HEURISTIC_ZLIB }
+};
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+static const method presets[PNG_ENCODE_PRESET_LAST] =
+{
+   { "default",    PNG_ENCODE_PRESET_DEFAULT },
+   { "fastest",    PNG_ENCODE_PRESET_FASTEST },
+   { "speed",      PNG_ENCODE_PRESET_HIGH_SPEED },
+   { "balanced",   PNG_ENCODE_PRESET_BALANCED },
+   { "size",       PNG_ENCODE_PRESET_HIGH_COMPRESSION },
+   { "read-speed", PNG_ENCODE_PRESET_HIGH_READ_SPEED },
+   { "low-memory", PNG_ENCODE_PRESET_LOW_MEMORY },
+   { "optimal",    PNG_ENCODE_PRESET_OPTIMAL },
+   { "auto",       PNG_ENCODE_PRESET_AUTO }
+};
+#  define MAX_METHODS PNG_ENCODE_PRESET_LAST
+#else
+#  define MAX_METHODS METHODS
+#endif
+
+/* The methods compared and how many there are: */
+static const method *methods = heuristics;
+static int num_methods = METHODS;
+static int use_presets = 0;
+static int use_frames = 0;
+
+/* Weights for the WEIGHTED method: a filter used by the rows just before is a
+ * little cheaper.
+ */
+#define NUM_WEIGHTS 3
+static const double weights[NUM_WEIGHTS] = { .8, .9, .95 };
+
+typedef struct
+{
+   png_bytep data;
+   size_t    size;
+   size_t    allocated;
+} buffer;
+
+static void PNGCBAPI
+write_buffer(png_structp png_ptr, png_bytep data, size_t size)
+{
+   buffer *b = voidcast(buffer*, png_get_io_ptr(png_ptr));
+
+   if (b->size + size > b->allocated)
+   {
+      size_t allocated = 2 * (b->size + size);
+      png_bytep data2 = voidcast(png_bytep, realloc(b->data, allocated));
+
+      if (data2 == NULL)
+         png_error(png_ptr, "out of memory");
+
+      b->data = data2;
+      b->allocated = allocated;
+   }
+
+   memcpy(b->data + b->size, data, size);
+   b->size += size;
+}
+
+static void PNGCBAPI
+read_buffer(png_structp png_ptr, png_bytep data, size_t size)
+{
+   buffer *b = voidcast(buffer*, png_get_io_ptr(png_ptr));
+
+   if (size > b->allocated - b->size)
+      png_error(png_ptr, "read beyond end of data");
+
+   memcpy(data, b->data + b->size, size);
+   b->size += size;
+}
+
+static void PNGCBAPI
+flush_buffer(png_structp png_ptr)
+{
+   (void)png_ptr;
+}
+
+/* Write the image in 'read_ptr' and 'read_info' with the given method, a
+ * filter heuristic or, with --presets, an encode preset, and the frame cache
+ * 'cache' if it is not NULL.  Returns the size of the output, or 0 on error.
+ */
+static size_t
+write_image(png_structp read_ptr, png_infop read_info, buffer *out,
+    int method, void *cache)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   png_uint_32 width, height;
+   int bit_depth, color_type, interlace;
+
+   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   if (png_ptr == NULL)
+      return 0;
+
+   info_ptr = png_create_info_struct(png_ptr);
+   if (info_ptr == NULL || setjmp(png_jmpbuf(png_ptr)))
+   {
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      return 0;
+   }
+
+   out->size = 0;
+   png_set_write_fn(png_ptr, out, write_buffer, flush_buffer);
+
+   png_get_IHDR(read_ptr, read_info, &width, &height, &bit_depth, &color_type,
+       &interlace, NULL, NULL);
+   png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
+       interlace, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+   if (color_type == PNG_COLOR_TYPE_PALETTE)
+   {
+      png_colorp palette;
+      int num_palette;
+
+      if (png_get_PLTE(read_ptr, read_info, &palette, &num_palette) != 0)
+         png_set_PLTE(png_ptr, info_ptr, palette, num_palette);
+   }
+
+   png_set_rows(png_ptr, info_ptr, png_get_rows(read_ptr, read_info));
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+   if (use_presets)
+      png_set_encode_preset(png_ptr, method);
+
+   else
+#endif
+   {
+      png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+
+      if (method == PNG_FILTER_HEURISTIC_WEIGHTED)
+         png_set_filter_heuristics(png_ptr, method, NUM_WEIGHTS, weights,
+             NULL);
+
+      else
+         png_set_filter_heuristics(png_ptr, method, 0, NULL, NULL);
+   }
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+   png_set_frame_cache(png_ptr, voidcast(png_frame_cachep, cache));
+#else
+   (void)cache;
+#endif
+
+   png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+   png_destroy_write_struct(&png_ptr, &info_ptr);
+
+   return out->size;
+}
+
+/* Read 'in' back and compare the rows with those of 'read_info'. */
+static int
+check_image(png_structp read_ptr, png_infop read_info, const buffer *in)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   buffer view;
+   volatile int ok = 0; /* set after setjmp */
+
+   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   if (png_ptr == NULL)
+      return 0;
+
+   info_ptr = png_create_info_struct(png_ptr);
+   if (info_ptr == NULL || setjmp(png_jmpbuf(png_ptr)))
+   {
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      return 0;
+   }
+
+   /* The reader stops at the end of the output: */
+   view.data = in->data;
+   view.size = 0;
+   view.allocated = in->size;
+   png_set_read_fn(png_ptr, &view, read_buffer);
+   png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+
+   {
+      png_bytepp rows = png_get_rows(read_ptr, read_info);
+      png_bytepp rows2 = png_get_rows(png_ptr, info_ptr);
+      png_uint_32 height = png_get_image_height(read_ptr, read_info);
+      size_t rowbytes = png_get_rowbytes(read_ptr, read_info);
+      unsigned int bits = (png_get_image_width(read_ptr, read_info) *
+          png_get_bit_depth(read_ptr, read_info) *
+          png_get_channels(read_ptr, read_info)) & 7;
+      /* The bits after the last pixel of a row need not be kept: */
+      unsigned int mask = bits > 0 ? (0xff00U >> bits) & 0xff : 0xff;
+      png_uint_32 y;
+
+      if (png_get_image_height(png_ptr, info_ptr) == height &&
+          png_get_rowbytes(png_ptr, info_ptr) == rowbytes)
+      {
+         for (y = 0; y < height; ++y)
+            if (memcmp(rows[y], rows2[y], rowbytes-1) != 0 ||
+                ((rows[y][rowbytes-1] ^ rows2[y][rowbytes-1]) & mask) != 0)
+               break;
+
+         ok = y == height;
+      }
+   }
+
+   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+   return ok;
+}
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+/* Change the image a little for the next frame: swap the first and last bytes
+ * of a row three quarters of the way down.
+ */
+static void
+change_frame(png_structp read_ptr, png_infop read_info)
+{
+   png_bytep row = png_get_rows(read_ptr, read_info)
+       [png_get_image_height(read_ptr, read_info) / 4 * 3];
+   size_t last = png_get_rowbytes(read_ptr, read_info) - 1;
+   png_byte b = row[0];
+
+   row[0] = row[last];
+   row[last] = b;
+}
+
+/* Write the frames for one method; the first fills the cache and is not
+ * timed.  Returns the size of the last frame, or 0 on error.
+ */
+static size_t
+write_frames(png_structp read_ptr, png_infop read_info, buffer *out,
+    int method, int repeat, double *seconds)
+{
+   png_frame_cachep cache = png_create_frame_cache();
+   buffer check;
+   size_t size = 0;
+   clock_t start;
+   int r;
+
+   if (cache == NULL)
+      return 0;
+
+   memset(&check, 0, sizeof check);
+
+   if (write_image(read_ptr, read_info, out, method, cache) != 0)
+   {
+      start = clock();
+
+      for (r = 0; r < repeat; ++r)
+      {
+         change_frame(read_ptr, read_info);
+         size = write_image(read_ptr, read_info, out, method, cache);
+
+         if (size == 0)
+            break;
+      }
+
+      *seconds += (double)(clock() - start) / CLOCKS_PER_SEC / repeat;
+
+      /* The cache must not change the output: */
+      if (size != 0 &&
+          (write_image(read_ptr, read_info, &check, method, NULL) != size ||
+           memcmp(check.data, out->data, size) != 0))
+      {
+         fprintf(stderr, "pngfilterbench: frame cache output differs\n");
+         size = 0;
+      }
+   }
+
+   free(check.data);
+   png_destroy_frame_cache(&cache);
+   return size;
+}
+#endif /* WRITE_FRAME_CACHE */
+
+#if defined(PNG_WRITE_COMPRESSED_TEXT_SUPPORTED) &&\
+    defined(PNG_READ_COMPRESSED_TEXT_SUPPORTED) &&\
+    (defined(PNG_WRITE_FAST_ENCODER_SUPPORTED) ||\
+     defined(PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED))
+#  define TEXT_LEVELS
+/* The compression levels that do not use zlib for the image data; the other
+ * compressed chunks must still be written with zlib.
+ */
+static const int text_levels[] =
+{
+#  ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+   PNG_COMPRESSION_LEVEL_FASTEST,
+#  endif
+#  ifdef PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED
+   PNG_COMPRESSION_LEVEL_OPTIMAL,
+#  endif
+};
+
+/* png_text has non-const strings: */
+static char text_key[] = "Comment";
+static char text_value[] =
+   "A zTXt chunk written with a compression level that zlib does not have.";
+
+/* Write the image with a zTXt chunk at 'level', as the compression level of
+ * both the image data and the text, and read the text back.
+ */
+static int
+check_text_level(png_structp read_ptr, png_infop read_info, buffer *out,
+    int level)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   png_text text;
+   png_uint_32 width, height;
+   int bit_depth, color_type, interlace;
+   volatile int ok = 0; /* set after setjmp */
+
+   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   if (png_ptr == NULL)
+      return 0;
+
+   info_ptr = png_create_info_struct(png_ptr);
+   if (info_ptr == NULL || setjmp(png_jmpbuf(png_ptr)))
+   {
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      return 0;
+   }
+
+   out->size = 0;
+   png_set_write_fn(png_ptr, out, write_buffer, flush_buffer);
+
+   png_get_IHDR(read_ptr, read_info, &width, &height, &bit_depth, &color_type,
+       &interlace, NULL, NULL);
+   png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
+       interlace, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+   if (color_type == PNG_COLOR_TYPE_PALETTE)
+   {
+      png_colorp palette;
+      int num_palette;
+
+      if (png_get_PLTE(read_ptr, read_info, &palette, &num_palette) != 0)
+         png_set_PLTE(png_ptr, info_ptr, palette, num_palette);
+   }
+
+   memset(&text, 0, sizeof text);
+   text.compression = PNG_TEXT_COMPRESSION_zTXt;
+   text.key = text_key;
+   text.text = text_value;
+   png_set_text(png_ptr, info_ptr, &text, 1);
+
+   png_set_rows(png_ptr, info_ptr, png_get_rows(read_ptr, read_info));
+   png_set_compression_level(png_ptr, level);
+#  ifdef PNG_WRITE_CUSTOMIZE_ZTXT_COMPRESSION_SUPPORTED
+   png_set_text_compression_level(png_ptr, level);
+#  endif
+   png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+   png_destroy_write_struct(&png_ptr, &info_ptr);
+
+   if (check_image(read_ptr, read_info, out))
+   {
+      buffer view;
+
+      png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+          NULL);
+      if (png_ptr == NULL)
+         return 0;
+
+      info_ptr = png_create_info_struct(png_ptr);
+      if (info_ptr == NULL || setjmp(png_jmpbuf(png_ptr)))
+      {
+         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+         return 0;
+      }
+
+      view.data = out->data;
+      view.size = 0;
+      view.allocated = out->size;
+      png_set_read_fn(png_ptr, &view, read_buffer);
+      png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+
+      {
+         png_textp text_ptr;
+         int num_text = png_get_text(png_ptr, info_ptr, &text_ptr, NULL);
+
+         ok = num_text == 1 &&
+            text_ptr[0].compression == PNG_TEXT_COMPRESSION_zTXt &&
+            strcmp(text_ptr[0].key, text_key) == 0 &&
+            strcmp(text_ptr[0].text, text_value) == 0;
+      }
+
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+   }
+
+   return ok;
+}
+#endif /* TEXT_LEVELS */
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+#define AUTO_SIZE 64
+
+/* PNG_ENCODE_PRESET_AUTO holds the first rows while it samples the image; a
+ * small image may be entirely held, so check that AUTO still filters those
+ * rows and does not do worse than the default on a small photographic image,
+ * here smooth gradients with a little noise, with 'channels' channels.
+ */
+static int
+check_auto(int channels)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   png_bytep rows[AUTO_SIZE];
+   png_byte image[AUTO_SIZE][AUTO_SIZE * 3];
+   buffer out, view;
+   size_t default_size, auto_size;
+   png_uint_32 seed = 1;
+   int x, y;
+
+   for (y = 0; y < AUTO_SIZE; ++y)
+   {
+      for (x = 0; x < AUTO_SIZE * channels; ++x)
+      {
+         seed = seed * 1103515245U + 12345U;
+         image[y][x] = (png_byte)(16 + x * 2 / channels + y +
+             (x % channels) * 16 + (int)((seed >> 16) % 5));
+      }
+
+      rows[y] = image[y];
+   }
+
+   memset(&out, 0, sizeof out);
+
+   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   if (png_ptr == NULL)
+      return 0;
+
+   info_ptr = png_create_info_struct(png_ptr);
+   if (info_ptr == NULL || setjmp(png_jmpbuf(png_ptr)))
+   {
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      free(out.data);
+      return 0;
+   }
+
+   png_set_write_fn(png_ptr, &out, write_buffer, flush_buffer);
+   png_set_IHDR(png_ptr, info_ptr, AUTO_SIZE, AUTO_SIZE, 8,
+       channels == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY,
+       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+   png_set_rows(png_ptr, info_ptr, rows);
+   png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+   png_destroy_write_struct(&png_ptr, &info_ptr);
+
+   /* Read it back as bench_file reads a file: */
+   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   info_ptr = png_ptr != NULL ? png_create_info_struct(png_ptr) : NULL;
+
+   if (info_ptr == NULL || setjmp(png_jmpbuf(png_ptr)))
+   {
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      free(out.data);
+      return 0;
+   }
+
+   view = out;
+   view.size = 0;
+   view.allocated = out.size;
+   png_set_read_fn(png_ptr, &view, read_buffer);
+   png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+
+   default_size = write_image(png_ptr, info_ptr, &out,
+       PNG_ENCODE_PRESET_DEFAULT, NULL);
+   auto_size = write_image(png_ptr, info_ptr, &out, PNG_ENCODE_PRESET_AUTO,
+       NULL);
+
+   if (auto_size == 0 || !check_image(png_ptr, info_ptr, &out))
+      auto_size = 0;
+
+   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+   free(out.data);
+
+   if (default_size == 0 || auto_size == 0)
+   {
+      fprintf(stderr, "pngfilterbench: auto: %d channel image: write failed\n",
+          channels);
+      return 0;
+   }
+
+   if (auto_size > default_size)
+   {
+      fprintf(stderr, "pngfilterbench: auto: %d channel image: %lu bytes, "
+          "default %lu\n", channels, (unsigned long)auto_size,
+          (unsigned long)default_size);
+      return 0;
+   }
+
+   return 1;
+}
+#endif /* WRITE_ENCODE_PRESET */
+
+static int
+bench_file(const char *file_name, int repeat, double *bytes, double *seconds)
+{
+   FILE *fp = fopen(file_name, "rb");
+   png_structp read_ptr;
+   png_infop read_info;
+   buffer out;
+   int ok = 1;
+   int m;
+
+   if (fp == NULL)
+   {
+      perror(file_name);
+      return 0;
+   }
+
+   read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   read_info = read_ptr != NULL ? png_create_info_struct(read_ptr) : NULL;
+
+   if (read_info == NULL || setjmp(png_jmpbuf(read_ptr)))
+   {
+      fprintf(stderr, "pngfilterbench: %s: cannot be read\n", file_name);
+      png_destroy_read_struct(&read_ptr, &read_info, NULL);
+      fclose(fp);
+      /* Not an error: pngsuite includes files libpng rejects. */
+      return 1;
+   }
+
+   png_init_io(read_ptr, fp);
+   png_read_png(read_ptr, read_info, PNG_TRANSFORM_IDENTITY, NULL);
+   fclose(fp);
+
+   memset(&out, 0, sizeof out);
+
+   for (m = 0; m < num_methods && ok; ++m)
+   {
+      size_t size = 0;
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+      if (use_frames)
+      {
+         size = write_frames(read_ptr, read_info, &out, methods[m].method,
+             repeat, &seconds[m]);
+
+         if (size == 0)
+         {
+            fprintf(stderr, "pngfilterbench: %s: %s: write failed\n",
+                file_name, methods[m].name);
+            ok = 0;
+         }
+      }
+
+      else
+#endif
+      {
+         clock_t start = clock();
+         int r;
+
+         for (r = 0; r < repeat && ok; ++r)
+         {
+            size = write_image(read_ptr, read_info, &out, methods[m].method,
+                NULL);
+
+            if (size == 0)
+            {
+               fprintf(stderr, "pngfilterbench: %s: %s: write failed\n",
+                   file_name, methods[m].name);
+               ok = 0;
+            }
+         }
+
+         seconds[m] += (double)(clock() - start) / CLOCKS_PER_SEC / repeat;
+      }
+
+      bytes[m] += (double)size;
+
+      if (ok && !check_image(read_ptr, read_info, &out))
+      {
+         fprintf(stderr, "pngfilterbench: %s: %s: image changed\n", file_name,
+             methods[m].name);
+         ok = 0;
+      }
+   }
+
+#ifdef TEXT_LEVELS
+   /* With --presets also check the levels the presets use without zlib. */
+   for (m = 0; use_presets && ok &&
+       m < (int)(sizeof text_levels / sizeof text_levels[0]); ++m)
+      if (!check_text_level(read_ptr, read_info, &out, text_levels[m]))
+      {
+         fprintf(stderr, "pngfilterbench: %s: level %d: zTXt write failed\n",
+             file_name, text_levels[m]);
+         ok = 0;
+      }
+#endif
+
+   free(out.data);
+   png_destroy_read_struct(&read_ptr, &read_info, NULL);
+   return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+   double bytes[MAX_METHODS], seconds[MAX_METHODS];
+   int repeat = 1;
+   int files = 0;
+   int argi, m;
+
+   memset(bytes, 0, sizeof bytes);
+   memset(seconds, 0, sizeof seconds);
+
+   for (argi = 1; argi < argc; ++argi)
+   {
+      if (strcmp(argv[argi], "--repeat") == 0 && argi+1 < argc)
+      {
+         repeat = atoi(argv[++argi]);
+
+         if (repeat < 1)
+            repeat = 1;
+      }
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+      else if (strcmp(argv[argi], "--presets") == 0 && files == 0)
+      {
+         methods = presets;
+         num_methods = PNG_ENCODE_PRESET_LAST;
+         use_presets = 1;
+      }
+#endif
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+      else if (strcmp(argv[argi], "--frames") == 0 && files == 0)
+         use_frames = 1;
+#endif
+
+      else if (argv[argi][0] == '-')
+      {
+         fprintf(stderr, "pngfilterbench: usage: pngfilterbench [--presets] "
+             "[--frames] [--repeat n] files...\n");
+         return 99;
+      }
+
+      else if (bench_file(argv[argi], repeat, bytes, seconds))
+         ++files;
+
+      else
+         return 1;
+   }
+
+   if (files == 0)
+   {
+      fprintf(stderr, "pngfilterbench: no files\n");
+      return 99;
+   }
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+   if (use_presets && (!check_auto(1) || !check_auto(3)))
+      return 1;
+#endif
+
+   printf("%-12s %12s %8s %10s\n", use_presets ? "preset" : "heuristic",
+       "bytes", "size", "seconds");
+
+   for (m = 0; m < num_methods; ++m)
+      printf("%-12s %12.0f %8.4f %10.4f\n", methods[m].name, bytes[m],
+          bytes[0] > 0 ? bytes[m] / bytes[0] : 1, seconds[m]);
+
+   return 0;
+}
+#else /* !WRITE_WEIGHTED_FILTER */
+int
+main(void)
+{
+   fprintf(stderr, "pngfilterbench: no support for filter heuristics\n");
+   /* So the test is skipped: */
+   return SKIP;
+}
+#endif
@@ -262,6 +262,10 @@ static struct transform_info
       /* scales 16-bit components to 8-bits. */
 #endif
 
+   /* PNG_TRANSFORM_CONTIGUOUS only changes where the rows are in memory; it is
+    * tested separately.
+    */
+
    { NULL /*name*/, 0, 0, 0, 0, 0, 0, 0/*!tested*/ }
 
 #undef T
@@ -579,10 +583,36 @@ struct display
    png_structp    read_pp;
    png_infop      read_ip;
 
+#  ifdef PNG_READ_PIPELINE_SUPPORTED
+      png_uint_32   pipeline_rows;  /* passed to png_set_read_pipeline */
+#  endif
+#  ifdef PNG_READ_TRANSFORM_THREADS_SUPPORTED
+      int           transform_threads; /* png_set_read_transform_threads */
+#  endif
+#  ifdef PNG_READ_CONTIGUOUS_SUPPORTED
+      unsigned int  row_alignment;  /* passed to png_set_image_layout */
+#  endif
+
 #  ifdef PNG_WRITE_PNG_SUPPORTED
       /* Used to write a new image (the original info_ptr is used) */
       png_structp   write_pp;
       struct buffer written_file;   /* where the file gets written */
+#     ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+         int compression_threads; /* png_set_compression_threads */
+#     endif
+#     ifdef PNG_WRITE_PIPELINE_SUPPORTED
+         png_uint_32 write_pipeline_rows; /* png_set_write_pipeline */
+#     endif
+#     if defined(PNG_EXECUTOR_SUPPORTED) &&\
+         defined(PNG_WRITE_COMPRESSION_THREADS_SUPPORTED)
+         struct buffer threaded_file; /* written on libpng's own tasks */
+#     endif
+#  endif
+
+#  ifdef PNG_EXECUTOR_SUPPORTED
+      int           executor;       /* use the counting executor */
+      unsigned long submits;        /* tasks given to it, for all files */
+      unsigned long waits;          /* tasks waited for */
 #  endif
 
    struct buffer  original_file;     /* Data read from the original file */
@@ -609,6 +639,10 @@ display_init(struct display *dp)
 #  ifdef PNG_WRITE_PNG_SUPPORTED
       dp->write_pp = NULL;
       buffer_init(&dp->written_file);
+#     if defined(PNG_EXECUTOR_SUPPORTED) &&\
+         defined(PNG_WRITE_COMPRESSION_THREADS_SUPPORTED)
+         buffer_init(&dp->threaded_file);
+#     endif
 #  endif
 }
 
@@ -651,6 +685,10 @@ display_destroy(struct display *dp)
     /* Release any memory held in the display. */
 #  ifdef PNG_WRITE_PNG_SUPPORTED
       buffer_destroy(&dp->written_file);
+#     if defined(PNG_EXECUTOR_SUPPORTED) &&\
+         defined(PNG_WRITE_COMPRESSION_THREADS_SUPPORTED)
+         buffer_destroy(&dp->threaded_file);
+#     endif
 #  endif
 
    buffer_destroy(&dp->original_file);
@@ -857,6 +895,33 @@ buffer_read(struct display *dp, struct buffer *bp, png_bytep data,
    bp->read_count = read_count;
 }
 
+#ifdef PNG_EXECUTOR_SUPPORTED
+/* An executor that runs each task as it is submitted and counts the tasks;
+ * libpng must wait for every task it submits.
+ */
+static png_voidp PNGCBAPI
+executor_submit(png_voidp executor_ptr, png_work_ptr work, png_voidp arg)
+{
+   struct display *dp = (struct display*)executor_ptr;
+
+   ++dp->submits;
+   (*work)(arg);
+
+   return dp; /* any non-NULL handle */
+}
+
+static void PNGCBAPI
+executor_wait(png_voidp executor_ptr, png_voidp handle)
+{
+   struct display *dp = (struct display*)executor_ptr;
+
+   if (handle != dp)
+      display_log(dp, LIBPNG_BUG, "executor: wrong handle");
+
+   ++dp->waits;
+}
+#endif
+
 static void PNGCBAPI
 read_function(png_structp pp, png_bytep data, size_t size)
 {
@@ -902,6 +967,20 @@ read_png(struct display *dp, struct buffer *bp, const char *operation,
    buffer_start_read(bp);
    png_set_read_fn(pp, bp, read_function);
 
+#  ifdef PNG_READ_PIPELINE_SUPPORTED
+      png_set_read_pipeline(pp, dp->pipeline_rows);
+#  endif
+#  ifdef PNG_READ_TRANSFORM_THREADS_SUPPORTED
+      png_set_read_transform_threads(pp, dp->transform_threads);
+#  endif
+#  ifdef PNG_READ_CONTIGUOUS_SUPPORTED
+      png_set_image_layout(pp, 0/*stride*/, dp->row_alignment);
+#  endif
+#  ifdef PNG_EXECUTOR_SUPPORTED
+      if (dp->executor)
+         png_set_executor(pp, executor_submit, executor_wait, dp);
+#  endif
+
    png_read_png(pp, ip, transforms, NULL/*params*/);
 
 #if 0 /* crazy debugging */
@@ -1325,6 +1404,52 @@ write_function(png_structp pp, png_bytep data, size_t size)
    buffer_write(get_dp(pp), get_buffer(pp), data, size);
 }
 
+#if defined(PNG_EXECUTOR_SUPPORTED) &&\
+   defined(PNG_WRITE_COMPRESSION_THREADS_SUPPORTED)
+static void
+buffer_copy(struct display *dp, struct buffer *to, struct buffer *from)
+{
+   struct buffer_list *list = &from->first;
+
+   buffer_start_write(to);
+
+   for (;;)
+   {
+      if (list == from->last)
+      {
+         buffer_write(dp, to, list->buffer, from->end_count);
+         return;
+      }
+
+      buffer_write(dp, to, list->buffer, sizeof list->buffer);
+      list = list->next;
+   }
+}
+
+static int
+buffer_equal(const struct buffer *a, const struct buffer *b)
+   /* Returns 1 if the two written buffers hold the same bytes */
+{
+   const struct buffer_list *la = &a->first;
+   const struct buffer_list *lb = &b->first;
+
+   for (;;)
+   {
+      size_t ca = la == a->last ? a->end_count : sizeof la->buffer;
+      size_t cb = lb == b->last ? b->end_count : sizeof lb->buffer;
+
+      if (ca != cb || memcmp(la->buffer, lb->buffer, ca) != 0)
+         return 0;
+
+      if (la == a->last || lb == b->last)
+         return la == a->last && lb == b->last;
+
+      la = la->next;
+      lb = lb->next;
+   }
+}
+#endif /* EXECUTOR && WRITE_COMPRESSION_THREADS */
+
 static void
 write_png(struct display *dp, png_infop ip, int transforms)
 {
@@ -1348,6 +1473,22 @@ write_png(struct display *dp, png_infop ip, int transforms)
       png_set_user_limits(dp->write_pp, 0x7fffffff, 0x7fffffff);
 #  endif
 
+#  ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+      /* Use the smallest block so that the test images are divided: */
+      png_set_compression_threads(dp->write_pp, dp->compression_threads,
+         1024);
+#  endif
+
+#  ifdef PNG_WRITE_PIPELINE_SUPPORTED
+      png_set_write_pipeline(dp->write_pp, dp->write_pipeline_rows,
+         2/*threads*/);
+#  endif
+
+#  ifdef PNG_EXECUTOR_SUPPORTED
+      if (dp->executor)
+         png_set_executor(dp->write_pp, executor_submit, executor_wait, dp);
+#  endif
+
    /* Certain transforms require the png_info to be zapped to allow the
     * transform to work correctly.
     */
@@ -1434,6 +1575,79 @@ test_one_file(struct display *dp, const char *filename)
          return; /* no point testing more */
    }
 
+#ifdef PNG_READ_PIPELINE_SUPPORTED
+   /* The pipelined reader must produce the same rows; use a small ring so that
+    * the small test images still need several batches.
+    */
+   dp->pipeline_rows = 4;
+   read_png(dp, &dp->original_file, "pipelined read", 0/*transforms*/);
+   dp->pipeline_rows = 0;
+
+   if (!compare_read(dp, 0/*transforms applied*/))
+      return;
+#endif
+
+#ifdef PNG_READ_TRANSFORM_THREADS_SUPPORTED
+   /* And the same with the rows of each batch divided between tasks: */
+   dp->pipeline_rows = 8;
+   dp->transform_threads = 3;
+   read_png(dp, &dp->original_file, "threaded read", 0/*transforms*/);
+   dp->pipeline_rows = 0;
+   dp->transform_threads = 0;
+
+   if (!compare_read(dp, 0/*transforms applied*/))
+      return;
+#endif
+
+#ifdef PNG_READ_CONTIGUOUS_SUPPORTED
+   /* Reading the image into one block must not change it either; check the
+    * default layout (alignment 0) then rows packed with no padding at all.
+    */
+   for (dp->row_alignment = 0; dp->row_alignment <= 1; ++dp->row_alignment)
+   {
+      png_bytepp rows;
+      size_t alignment, stride;
+      png_uint_32 y;
+
+      read_png(dp, &dp->original_file, "contiguous read",
+         PNG_TRANSFORM_CONTIGUOUS);
+
+      if (!compare_read(dp, 0/*transforms applied*/))
+         return;
+
+      rows = png_get_rows(dp->read_pp, dp->read_ip);
+      alignment = dp->row_alignment ? dp->row_alignment :
+         PNG_IMAGE_ROW_ALIGNMENT;
+      stride = png_get_rowbytes(dp->read_pp, dp->read_ip);
+      stride = (stride + alignment-1) & ~(alignment-1);
+
+      for (y=0; y<dp->height; ++y)
+         if ((size_t)(rows[y] - (png_bytep)0) % alignment != 0 ||
+            (size_t)(rows[y] - rows[0]) != y * stride)
+            display_log(dp, LIBPNG_BUG, "contiguous read: row %lu misplaced",
+               (unsigned long)y);
+
+      /* An application that takes the rows over frees each one; libpng must
+       * copy them out of the block first.
+       */
+      png_data_freer(dp->read_pp, dp->read_ip, PNG_USER_WILL_FREE_DATA,
+         PNG_FREE_ROWS);
+
+      if (!compare_read(dp, 0/*transforms applied*/))
+         return;
+
+      rows = png_get_rows(dp->read_pp, dp->read_ip);
+
+      for (y=0; y<dp->height; ++y)
+         png_free(dp->read_pp, rows[y]);
+
+      png_free(dp->read_pp, rows);
+      png_set_rows(dp->read_pp, dp->read_ip, NULL);
+   }
+
+   dp->row_alignment = 0;
+#endif
+
 #ifdef PNG_WRITE_PNG_SUPPORTED
    /* Second test: write the original PNG data out to a new file (to test the
     * write side) then read the result back in and make sure that it hasn't
@@ -1444,6 +1658,64 @@ test_one_file(struct display *dp, const char *filename)
    read_png(dp, &dp->written_file, NULL, 0/*transforms*/);
    if (!compare_read(dp, 0/*transforms applied*/))
       return;
+
+#  ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+   /* And again with the image data deflated in blocks by several tasks: */
+   dp->compression_threads = 3;
+   write_png(dp, dp->original_ip, 0/*transforms*/);
+   dp->compression_threads = 0;
+   read_png(dp, &dp->written_file, NULL, 0/*transforms*/);
+   if (!compare_read(dp, 0/*transforms applied*/))
+      return;
+#  endif
+
+#  ifdef PNG_WRITE_PIPELINE_SUPPORTED
+   /* And with the rows filtered in small batches by two tasks: */
+   dp->write_pipeline_rows = 3;
+   write_png(dp, dp->original_ip, 0/*transforms*/);
+   dp->write_pipeline_rows = 0;
+   read_png(dp, &dp->written_file, NULL, 0/*transforms*/);
+   if (!compare_read(dp, 0/*transforms applied*/))
+      return;
+#  endif
+#endif
+
+#ifdef PNG_EXECUTOR_SUPPORTED
+   /* The tasks again, given to the counting executor instead of libpng's own
+    * threads; the results must not change at all.
+    */
+   dp->executor = 1;
+
+#  ifdef PNG_READ_TRANSFORM_THREADS_SUPPORTED
+   dp->pipeline_rows = 8;
+   dp->transform_threads = 3;
+   read_png(dp, &dp->original_file, "executor read", 0/*transforms*/);
+   dp->pipeline_rows = 0;
+   dp->transform_threads = 0;
+
+   if (!compare_read(dp, 0/*transforms applied*/))
+      return;
+#  endif
+
+#  if defined(PNG_WRITE_PNG_SUPPORTED) &&\
+      defined(PNG_WRITE_COMPRESSION_THREADS_SUPPORTED)
+   dp->compression_threads = 3;
+   dp->executor = 0;
+   write_png(dp, dp->original_ip, 0/*transforms*/);
+   buffer_copy(dp, &dp->threaded_file, &dp->written_file);
+   dp->executor = 1;
+   write_png(dp, dp->original_ip, 0/*transforms*/);
+   dp->compression_threads = 0;
+
+   if (!buffer_equal(&dp->threaded_file, &dp->written_file))
+      display_log(dp, LIBPNG_BUG, "executor write: different output");
+#  endif
+
+   dp->executor = 0;
+
+   if (dp->waits != dp->submits)
+      display_log(dp, LIBPNG_BUG, "executor: %lu tasks, %lu waited for",
+         dp->submits, dp->waits);
 #endif
 
    /* Third test: the active options.  Test each in turn, or, with the
@@ -1706,6 +1978,15 @@ main(int argc, char **argv)
          display_clean(&d);
       }
 
+#     ifdef PNG_EXECUTOR_SUPPORTED
+         /* At least one of the files must have needed a task: */
+         if (option_end < argc && d.submits == 0)
+         {
+            fprintf(stderr, "pngimage: the executor was not used\n");
+            ++errors;
+         }
+#     endif
+
       /* Release allocated memory */
       display_destroy(&d);
 
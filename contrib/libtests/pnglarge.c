@@ -0,0 +1,442 @@
+
+/* pnglarge.c
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Test the simplified API with images too big for 32-bit sizes.  An image of
+ * more than 4GByte is written a row at a time with
+ * png_image_write_rows_to_stdio then read back a few rows at a time with
+ * png_image_finish_read_rows, so the test only needs memory for a few rows.
+ * The _large APIs are checked against the 32-bit ones on a small image.
+ *
+ * Writing and reading the large image takes about a minute, so by default a
+ * small image is streamed instead; pass --large, or set PNG_LARGE_TESTS in the
+ * environment, to use the large one.
+ */
+
+#define _ISOC90_SOURCE 1
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(HAVE_CONFIG_H) && !defined(PNG_NO_CONFIG_H)
+#  include <config.h>
+#endif
+
+/* Define the following to use this test against your installed libpng, rather
+ * than the one being built here:
+ */
+#ifdef PNG_FREESTANDING_TESTS
+#  include <png.h>
+#else
+#  include "../../png.h"
+#endif
+
+/* As in pngstest, 77 indicates a skipped test to the configure harness: */
+#if PNG_LIBPNG_VER >= 10601 && defined(HAVE_CONFIG_H)
+#  define SKIP 77
+#else
+#  define SKIP 0
+#endif
+
+#if defined(PNG_SIMPLIFIED_READ_ROWS_SUPPORTED) &&\
+    defined(PNG_SIMPLIFIED_WRITE_ROWS_SUPPORTED) &&\
+    defined(PNG_SIMPLIFIED_WRITE_STDIO_SUPPORTED) &&\
+    defined(PNG_STDIO_SUPPORTED)
+
+/* The following is to support direct compilation of this file as C++ */
+#ifdef __cplusplus
+#  define voidcast(type, value) static_cast<type>(value)
+#else
+#  define voidcast(type, value) (value)
+#endif /* __cplusplus */
+
+/* The default image is as wide as libpng will read by default and just tall
+ * enough for its RGBA pixels to need more than 32 bits to count.
+ */
+#define DEFAULT_WIDTH 1000000
+#define DEFAULT_HEIGHT 1074
+#define SMALL_WIDTH 1024
+#define SMALL_HEIGHT 64
+#define ROWS_PER_BATCH 4
+
+/* The pixels are a function of their position so that any row can be checked
+ * without keeping the image.  The pattern repeats every 256 pixels, which
+ * deflate reduces to almost nothing.
+ */
+static png_byte
+pixel(png_uint_32 x, png_uint_32 y, unsigned int c)
+{
+   return (png_byte)(x + 3*y + 85*c);
+}
+
+static void
+make_row(png_bytep row, png_uint_32 width, png_uint_32 y)
+{
+   png_uint_32 x;
+
+   for (x = 0; x < width; ++x)
+   {
+      unsigned int c;
+
+      for (c = 0; c < 4; ++c)
+         *row++ = pixel(x, y, c);
+   }
+}
+
+static int
+check_row(png_const_bytep row, png_uint_32 width, png_uint_32 y)
+{
+   png_uint_32 x;
+
+   for (x = 0; x < width; ++x)
+   {
+      unsigned int c;
+
+      for (c = 0; c < 4; ++c)
+         if (*row++ != pixel(x, y, c))
+         {
+            fprintf(stderr, "pnglarge: row %lu pixel %lu channel %u wrong\n",
+                (unsigned long)y, (unsigned long)x, c);
+            return 0;
+         }
+   }
+
+   return 1;
+}
+
+typedef struct
+{
+   png_bytep        row;   /* the row handed to libpng by write_row */
+   png_uint_32      next;  /* the next row expected */
+   png_alloc_size_t bytes; /* count of bytes of image data */
+}  large_control;
+
+static const void *
+write_row(png_imagep image, void *user_ptr, png_uint_32 y)
+{
+   large_control *lc = voidcast(large_control*, user_ptr);
+
+   if (y != lc->next)
+   {
+      fprintf(stderr, "pnglarge: write asked for row %lu, expected %lu\n",
+          (unsigned long)y, (unsigned long)lc->next);
+      return NULL;
+   }
+
+   make_row(lc->row, image->width, y);
+   lc->next = y+1;
+   lc->bytes += (png_alloc_size_t)PNG_IMAGE_ROW_STRIDE_LARGE(*image);
+
+   return lc->row;
+}
+
+static int
+read_rows(png_imagep image, void *user_ptr, png_uint_32 y, png_uint_32 count,
+    const void *rows)
+{
+   large_control *lc = voidcast(large_control*, user_ptr);
+   png_const_bytep row = voidcast(png_const_bytep, rows);
+   png_ptrdiff_t stride = PNG_IMAGE_ROW_STRIDE_LARGE(*image);
+
+   if (y != lc->next)
+   {
+      fprintf(stderr, "pnglarge: read passed row %lu, expected %lu\n",
+          (unsigned long)y, (unsigned long)lc->next);
+      return 0;
+   }
+
+   for (; count > 0; --count, ++y, row += stride)
+   {
+      if (!check_row(row, image->width, y))
+         return 0;
+
+      lc->bytes += (png_alloc_size_t)stride;
+   }
+
+   lc->next = y;
+   return 1;
+}
+
+/* Write then read an RGBA image of the given size through a temporary file. */
+static int
+test_stream(png_uint_32 width, png_uint_32 height, int verbose)
+{
+   png_image image;
+   large_control lc;
+   FILE *fp;
+   int ok = 0;
+
+   memset(&lc, 0, sizeof lc);
+   lc.row = voidcast(png_bytep, malloc((size_t)width * 4));
+
+   if (lc.row == NULL)
+   {
+      fprintf(stderr, "pnglarge: out of memory for a row\n");
+      return 0;
+   }
+
+   fp = tmpfile();
+
+   if (fp == NULL)
+   {
+      fprintf(stderr, "pnglarge: cannot create a temporary file\n");
+      free(lc.row);
+      return 0;
+   }
+
+   memset(&image, 0, sizeof image);
+   image.version = PNG_IMAGE_VERSION;
+   image.width = width;
+   image.height = height;
+   image.format = PNG_FORMAT_RGBA;
+   image.flags = PNG_IMAGE_FLAG_FAST;
+
+   if (png_image_write_rows_to_stdio(&image, fp, 0, write_row, &lc, NULL) &&
+       lc.next == height)
+   {
+      png_alloc_size_t written = lc.bytes;
+
+      if (verbose)
+         printf("pnglarge: %lux%lu: wrote %.0f bytes of pixels as %ld\n",
+             (unsigned long)width, (unsigned long)height, (double)written,
+             ftell(fp));
+
+      rewind(fp);
+      memset(&lc, 0, sizeof lc);
+      memset(&image, 0, sizeof image);
+      image.version = PNG_IMAGE_VERSION;
+
+      if (png_image_begin_read_from_stdio(&image, fp))
+      {
+         image.format = PNG_FORMAT_RGBA;
+
+         if (image.width != width || image.height != height)
+         {
+            fprintf(stderr, "pnglarge: read back as %lux%lu\n",
+                (unsigned long)image.width, (unsigned long)image.height);
+            png_image_free(&image);
+         }
+
+         else if (png_image_finish_read_rows(&image, NULL, read_rows, &lc,
+             ROWS_PER_BATCH, NULL) && lc.next == height)
+         {
+            if (lc.bytes == written)
+               ok = 1;
+
+            else
+               fprintf(stderr, "pnglarge: read %.0f bytes, wrote %.0f\n",
+                   (double)lc.bytes, (double)written);
+         }
+
+         else if (image.warning_or_error)
+            fprintf(stderr, "pnglarge: read: %s\n", image.message);
+
+         else
+            fprintf(stderr, "pnglarge: read stopped at row %lu\n",
+                (unsigned long)lc.next);
+      }
+
+      else
+         fprintf(stderr, "pnglarge: begin read: %s\n", image.message);
+   }
+
+   else if (image.warning_or_error)
+      fprintf(stderr, "pnglarge: write: %s\n", image.message);
+
+   else
+      fprintf(stderr, "pnglarge: write stopped at row %lu\n",
+          (unsigned long)lc.next);
+
+   fclose(fp);
+   free(lc.row);
+   return ok;
+}
+
+/* Check that the _large APIs give the same results as the 32-bit ones for a
+ * small image, with either sign of stride, and reject a stride that is too
+ * small.
+ */
+static int
+test_large_api(void)
+{
+   const png_uint_32 width = 37, height = 11;
+   const png_ptrdiff_t stride = 4*37 + 5;
+   png_image image;
+   png_bytep buffer, copy, png;
+   png_alloc_size_t size, size_large;
+   int ok = 0;
+   int sign;
+
+   buffer = voidcast(png_bytep, calloc(height, (size_t)stride));
+   copy = voidcast(png_bytep, calloc(height, (size_t)stride));
+   png = NULL;
+
+   if (buffer == NULL || copy == NULL)
+   {
+      fprintf(stderr, "pnglarge: out of memory\n");
+      free(buffer);
+      free(copy);
+      return 0;
+   }
+
+   for (sign = 1; sign >= -1; sign -= 2)
+   {
+      png_bytep first = buffer + (sign < 0 ? (height-1) * stride : 0);
+      png_uint_32 y;
+
+      for (y = 0; y < height; ++y)
+         make_row(first + (png_ptrdiff_t)y * sign * stride, width, y);
+
+      memset(&image, 0, sizeof image);
+      image.version = PNG_IMAGE_VERSION;
+      image.width = width;
+      image.height = height;
+      image.format = PNG_FORMAT_RGBA;
+
+      if (!png_image_write_to_memory(&image, NULL, &size, 0, buffer,
+          (png_int_32)(sign * stride), NULL))
+      {
+         fprintf(stderr, "pnglarge: size: %s\n", image.message);
+         break;
+      }
+
+      png = voidcast(png_bytep, malloc(size));
+
+      if (png == NULL)
+      {
+         fprintf(stderr, "pnglarge: out of memory\n");
+         break;
+      }
+
+      size_large = size;
+
+      if (!png_image_write_to_memory_large(&image, png, &size_large, 0, buffer,
+          sign * stride, NULL) || size_large != size)
+      {
+         fprintf(stderr, "pnglarge: write_to_memory_large: %s\n",
+             image.message);
+         break;
+      }
+
+      memset(&image, 0, sizeof image);
+      image.version = PNG_IMAGE_VERSION;
+
+      if (!png_image_begin_read_from_memory(&image, png, size))
+      {
+         fprintf(stderr, "pnglarge: begin read: %s\n", image.message);
+         break;
+      }
+
+      image.format = PNG_FORMAT_RGBA;
+      memset(copy, 0, height * (size_t)stride);
+
+      if (!png_image_finish_read_large(&image, NULL, copy, sign * stride,
+          NULL))
+      {
+         fprintf(stderr, "pnglarge: finish_read_large: %s\n", image.message);
+         break;
+      }
+
+      if (memcmp(buffer, copy, height * (size_t)stride) != 0)
+      {
+         fprintf(stderr, "pnglarge: stride %ld: image changed\n",
+             (long)(sign * stride));
+         break;
+      }
+
+      /* A stride shorter than a row must be rejected. */
+      memset(&image, 0, sizeof image);
+      image.version = PNG_IMAGE_VERSION;
+
+      if (!png_image_begin_read_from_memory(&image, png, size))
+      {
+         fprintf(stderr, "pnglarge: begin read: %s\n", image.message);
+         break;
+      }
+
+      image.format = PNG_FORMAT_RGBA;
+
+      if (png_image_finish_read_large(&image, NULL, copy, sign * 4 *
+          (png_ptrdiff_t)(width-1), NULL))
+      {
+         fprintf(stderr, "pnglarge: short stride accepted\n");
+         break;
+      }
+
+      free(png);
+      png = NULL;
+
+      if (sign < 0)
+         ok = 1;
+   }
+
+   free(png);
+   free(buffer);
+   free(copy);
+   return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+   png_uint_32 width = SMALL_WIDTH, height = SMALL_HEIGHT;
+   const char *large = getenv("PNG_LARGE_TESTS");
+   int verbose = 0;
+   int argi;
+
+   if (large != NULL && large[0] != 0)
+   {
+      width = DEFAULT_WIDTH;
+      height = DEFAULT_HEIGHT;
+   }
+
+   for (argi = 1; argi < argc; ++argi)
+   {
+      if (strcmp(argv[argi], "--verbose") == 0)
+         verbose = 1;
+
+      else if (strcmp(argv[argi], "--large") == 0)
+      {
+         width = DEFAULT_WIDTH;
+         height = DEFAULT_HEIGHT;
+      }
+
+      else if (strcmp(argv[argi], "--size") == 0 && argi+2 < argc)
+      {
+         width = (png_uint_32)strtoul(argv[++argi], NULL, 0);
+         height = (png_uint_32)strtoul(argv[++argi], NULL, 0);
+      }
+
+      else
+      {
+         fprintf(stderr, "pnglarge: usage: pnglarge [--verbose] "
+             "[--large | --size width height]\n");
+         return 99;
+      }
+   }
+
+   if (!test_large_api())
+      return 1;
+
+   if (!test_stream(width, height, verbose))
+      return 1;
+
+   if (verbose)
+      printf("pnglarge: PASS\n");
+
+   return 0;
+}
+#else /* !(SIMPLIFIED_READ_ROWS && SIMPLIFIED_WRITE_ROWS && STDIO) */
+int
+main(void)
+{
+   fprintf(stderr, "pnglarge: no support for streamed simplified I/O\n");
+   /* So the test is skipped: */
+   return SKIP;
+}
+#endif
@@ -0,0 +1,359 @@
+/* pnglimits.c
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Test png_set_inflate_limits.  Two PNG files are made in memory, one with an
+ * IDAT stream and one with a zTXt chunk that decompress to much more than
+ * they take, then each is read with each of the limits set low enough to be
+ * exceeded.  A limit exceeded in IDAT must stop the read with an error; in
+ * zTXt the chunk must be discarded with a warning, or stop the read if benign
+ * errors are errors.  Limits that are not exceeded must change nothing.
+ */
+
+#define _ISOC90_SOURCE 1
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(HAVE_CONFIG_H) && !defined(PNG_NO_CONFIG_H)
+#  include <config.h>
+#endif
+
+/* Define the following to use this test against your installed libpng, rather
+ * than the one being built here:
+ */
+#ifdef PNG_FREESTANDING_TESTS
+#  include <png.h>
+#else
+#  include "../../png.h"
+#endif
+
+/* As in pngstest, 77 indicates a skipped test to the configure harness: */
+#if PNG_LIBPNG_VER >= 10601 && defined(HAVE_CONFIG_H)
+#  define SKIP 77
+#else
+#  define SKIP 0
+#endif
+
+#if defined(PNG_INFLATE_LIMITS_SUPPORTED) &&\
+    defined(PNG_SEQUENTIAL_READ_SUPPORTED) &&\
+    defined(PNG_READ_zTXt_SUPPORTED) && defined(PNG_WRITE_zTXt_SUPPORTED) &&\
+    defined(PNG_BENIGN_ERRORS_SUPPORTED) && defined(PNG_SETJMP_SUPPORTED)
+
+#include <setjmp.h>
+
+/* The following is to support direct compilation of this file as C++ */
+#ifdef __cplusplus
+#  define voidcast(type, value) static_cast<type>(value)
+#else
+#  define voidcast(type, value) (value)
+#endif /* __cplusplus */
+
+/* The image is all zero and the text all the same character, so both deflate
+ * by a ratio of several hundred.
+ */
+#define WIDTH 1024
+#define HEIGHT 1024
+#define TEXT_SIZE (1024*1024)
+
+typedef struct
+{
+   png_bytep   data;
+   size_t      size;
+   size_t      allocated;
+   size_t      read;
+   char        error[128];   /* the last error message */
+   char        warning[128]; /* the last warning message */
+}  limits_file;
+
+static void PNGCBAPI
+write_fn(png_structp png_ptr, png_bytep data, size_t size)
+{
+   limits_file *file = voidcast(limits_file*, png_get_io_ptr(png_ptr));
+
+   if (file->size + size > file->allocated)
+   {
+      size_t allocated = 2 * (file->size + size);
+      png_bytep new_data = voidcast(png_bytep, realloc(file->data, allocated));
+
+      if (new_data == NULL)
+         png_error(png_ptr, "out of memory for the file");
+
+      file->data = new_data;
+      file->allocated = allocated;
+   }
+
+   memcpy(file->data + file->size, data, size);
+   file->size += size;
+}
+
+static void PNGCBAPI
+read_fn(png_structp png_ptr, png_bytep data, size_t size)
+{
+   limits_file *file = voidcast(limits_file*, png_get_io_ptr(png_ptr));
+
+   if (size > file->size - file->read)
+      png_error(png_ptr, "read beyond end of file");
+
+   memcpy(data, file->data + file->read, size);
+   file->read += size;
+}
+
+static void PNGCBAPI
+error_fn(png_structp png_ptr, png_const_charp message)
+{
+   limits_file *file = voidcast(limits_file*, png_get_error_ptr(png_ptr));
+
+   strncpy(file->error, message, (sizeof file->error)-1);
+   png_longjmp(png_ptr, 1);
+}
+
+static void PNGCBAPI
+warning_fn(png_structp png_ptr, png_const_charp message)
+{
+   limits_file *file = voidcast(limits_file*, png_get_error_ptr(png_ptr));
+
+   strncpy(file->warning, message, (sizeof file->warning)-1);
+}
+
+/* Make a PNG with a WIDTHxHEIGHT image, or a 1x1 image followed by a zTXt
+ * chunk of TEXT_SIZE bytes.  The limits on the totals cover every stream, so
+ * the text is after the IDAT; this lets the read finish once it is discarded.
+ */
+static int
+make_file(limits_file *file, int text)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   png_bytep volatile row; /* freed after longjmp */
+   png_uint_32 width = text ? 1 : WIDTH, height = text ? 1 : HEIGHT, y;
+   png_charp volatile value = NULL;
+
+   memset(file, 0, sizeof *file);
+   row = voidcast(png_bytep, calloc(WIDTH, 1));
+
+   if (text)
+      value = voidcast(png_charp, malloc(TEXT_SIZE+1));
+
+   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, file, error_fn,
+       warning_fn);
+   info_ptr = png_create_info_struct(png_ptr);
+
+   if (row == NULL || (text && value == NULL) || info_ptr == NULL)
+   {
+      fprintf(stderr, "pnglimits: out of memory\n");
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      free(value);
+      free(row);
+      return 0;
+   }
+
+   if (setjmp(png_jmpbuf(png_ptr)))
+   {
+      fprintf(stderr, "pnglimits: write: %s\n", file->error);
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      free(value);
+      free(row);
+      return 0;
+   }
+
+   png_set_write_fn(png_ptr, file, write_fn, NULL);
+   png_set_compression_level(png_ptr, 9);
+   png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_GRAY,
+       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+   png_write_info(png_ptr, info_ptr);
+
+   for (y = 0; y < height; ++y)
+      png_write_row(png_ptr, row);
+
+   if (text)
+   {
+      png_text t;
+      char key[] = "Comment";
+
+      memset(value, 'a', TEXT_SIZE);
+      value[TEXT_SIZE] = 0;
+
+      memset(&t, 0, sizeof t);
+      t.compression = PNG_TEXT_COMPRESSION_zTXt;
+      t.key = key;
+      t.text = value;
+      png_set_text(png_ptr, info_ptr, &t, 1);
+   }
+
+   png_write_end(png_ptr, info_ptr);
+   png_destroy_write_struct(&png_ptr, &info_ptr);
+   free(value);
+   free(row);
+
+   return 1;
+}
+
+/* Read the file with the given limits.  Returns 0 if the read stopped with an
+ * error, else 1 and sets *texts to the number of text chunks kept.
+ */
+static int
+read_file(limits_file *file, png_uint_32 ratio_max,
+    png_alloc_size_t inflate_max, png_alloc_size_t work_max, int benign_errors,
+    int *texts)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   png_bytep row;
+   png_textp text;
+
+   file->read = 0;
+   file->error[0] = 0;
+   file->warning[0] = 0;
+   row = voidcast(png_bytep, malloc(WIDTH));
+
+   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, file, error_fn,
+       warning_fn);
+   info_ptr = png_create_info_struct(png_ptr);
+
+   if (row == NULL || info_ptr == NULL)
+   {
+      fprintf(stderr, "pnglimits: out of memory\n");
+      exit(99);
+   }
+
+   if (setjmp(png_jmpbuf(png_ptr)))
+   {
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      free(row);
+      return 0;
+   }
+
+   png_set_read_fn(png_ptr, file, read_fn);
+   png_set_benign_errors(png_ptr, benign_errors);
+   png_set_inflate_limits(png_ptr, ratio_max, inflate_max, work_max);
+   png_read_info(png_ptr, info_ptr);
+
+   {
+      png_uint_32 y, height = png_get_image_height(png_ptr, info_ptr);
+
+      for (y = 0; y < height; ++y)
+         png_read_row(png_ptr, row, NULL);
+   }
+
+   png_read_end(png_ptr, info_ptr);
+   *texts = png_get_text(png_ptr, info_ptr, &text, NULL);
+
+   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+   free(row);
+   return 1;
+}
+
+/* The limits, each low enough to stop both streams part of the way through. */
+static const struct
+{
+   const char       *name;
+   png_uint_32       ratio_max;
+   png_alloc_size_t  inflate_max;
+   png_alloc_size_t  work_max;
+   const char       *message; /* in the error or warning */
+}  limits[] =
+{
+   { "ratio", 100, 0, 0, "compression ratio limit exceeded" },
+   { "total", 0, 500000, 0, "inflate limit exceeded" },
+   { "work",  0, 0, 500000, "inflate work limit exceeded" }
+};
+
+#define LIMITS ((sizeof limits)/(sizeof limits[0]))
+
+static int
+check_message(const char *test, const char *message, const char *expected)
+{
+   if (strstr(message, expected) == NULL)
+   {
+      fprintf(stderr, "pnglimits: %s: \"%s\", expected \"%s\"\n", test,
+          message, expected);
+      return 0;
+   }
+
+   return 1;
+}
+
+int
+main(void)
+{
+   limits_file image, text;
+   int errors = 0, texts = 0;
+   unsigned int i;
+
+   if (!make_file(&image, 0) || !make_file(&text, 1))
+      return 99;
+
+   /* Without limits, and with limits that are not exceeded, both read: */
+   if (!read_file(&image, 0, 0, 0, 1, &texts) ||
+       !read_file(&image, 10000, 4*WIDTH*HEIGHT, 4*WIDTH*HEIGHT, 0, &texts) ||
+       !read_file(&text, 10000, 4*TEXT_SIZE, 4*TEXT_SIZE, 0, &texts) ||
+       texts != 1)
+   {
+      fprintf(stderr, "pnglimits: read without limits failed: %s\n",
+          image.error[0] != 0 ? image.error : text.error);
+      ++errors;
+   }
+
+   for (i = 0; i < LIMITS; ++i)
+   {
+      /* IDAT: always an error */
+      if (read_file(&image, limits[i].ratio_max, limits[i].inflate_max,
+          limits[i].work_max, 1, &texts))
+      {
+         fprintf(stderr, "pnglimits: %s limit: IDAT read\n", limits[i].name);
+         ++errors;
+      }
+
+      else if (!check_message(limits[i].name, image.error, limits[i].message))
+         ++errors;
+
+      /* zTXt: discarded with a warning: */
+      if (!read_file(&text, limits[i].ratio_max, limits[i].inflate_max,
+          limits[i].work_max, 1, &texts))
+      {
+         fprintf(stderr, "pnglimits: %s limit: zTXt: %s\n", limits[i].name,
+             text.error);
+         ++errors;
+      }
+
+      else if (texts != 0)
+      {
+         fprintf(stderr, "pnglimits: %s limit: zTXt kept\n", limits[i].name);
+         ++errors;
+      }
+
+      else if (!check_message(limits[i].name, text.warning, limits[i].message))
+         ++errors;
+
+      /* zTXt: an error if benign errors are errors: */
+      if (read_file(&text, limits[i].ratio_max, limits[i].inflate_max,
+          limits[i].work_max, 0, &texts))
+      {
+         fprintf(stderr, "pnglimits: %s limit: zTXt read without error\n",
+             limits[i].name);
+         ++errors;
+      }
+
+      else if (!check_message(limits[i].name, text.error, limits[i].message))
+         ++errors;
+   }
+
+   free(image.data);
+   free(text.data);
+
+   return errors != 0;
+}
+#else /* !(INFLATE_LIMITS && SEQUENTIAL_READ && zTXt && BENIGN_ERRORS) */
+int
+main(void)
+{
+   fprintf(stderr, "pnglimits: no support for png_set_inflate_limits\n");
+   /* So the test is skipped: */
+   return SKIP;
+}
+#endif
@@ -0,0 +1,574 @@
+/* pngskip.c
+ *
+ * This code is released under the libpng license.
+ * For conditions of distribution and use, see the disclaimer
+ * and license in png.h
+ *
+ * Test png_set_skip_IDAT and png_set_read_seek_fn.  A PNG with several IDAT
+ * chunks and a tEXt chunk after them is made in memory, then png_read_end is
+ * called after png_read_info, or after a few rows, in each skip mode.  The
+ * text must be read each time.  The IDAT data must be seeked over only when
+ * the CRC is ignored and there is a seek function that works; otherwise it
+ * must be read, and a damaged IDAT CRC must then be handled as
+ * png_set_crc_action says.  The IDAT chunks are also copied to a new PNG with
+ * png_set_copy_IDAT, which must leave their bytes unchanged.
+ */
+
+#define _ISOC90_SOURCE 1
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(HAVE_CONFIG_H) && !defined(PNG_NO_CONFIG_H)
+#  include <config.h>
+#endif
+
+/* Define the following to use this test against your installed libpng, rather
+ * than the one being built here:
+ */
+#ifdef PNG_FREESTANDING_TESTS
+#  include <png.h>
+#else
+#  include "../../png.h"
+#endif
+
+/* As in pngstest, 77 indicates a skipped test to the configure harness: */
+#if PNG_LIBPNG_VER >= 10601 && defined(HAVE_CONFIG_H)
+#  define SKIP 77
+#else
+#  define SKIP 0
+#endif
+
+#if defined(PNG_READ_SKIP_IDAT_SUPPORTED) && defined(PNG_WRITE_SUPPORTED) &&\
+    defined(PNG_READ_tEXt_SUPPORTED) && defined(PNG_WRITE_tEXt_SUPPORTED) &&\
+    defined(PNG_SETJMP_SUPPORTED)
+
+#include <setjmp.h>
+
+/* The following is to support direct compilation of this file as C++ */
+#ifdef __cplusplus
+#  define voidcast(type, value) static_cast<type>(value)
+#else
+#  define voidcast(type, value) (value)
+#endif /* __cplusplus */
+
+#define WIDTH 64
+#define HEIGHT 64
+#define IDAT_SIZE 256 /* The most data in each IDAT chunk */
+
+typedef struct
+{
+   png_bytep   data;
+   size_t      size;
+   size_t      allocated;
+   size_t      position;
+   size_t      read;         /* bytes passed to the read function */
+   size_t      seeked;       /* bytes skipped by the seek function */
+   size_t      idat;         /* bytes of IDAT data and CRCs */
+   size_t      damage;       /* the offset of a byte of IDAT data */
+   int         seek;         /* 0: none, 1: works, -1: fails */
+   char        error[128];   /* the last error message */
+}  skip_file;
+
+static void PNGCBAPI
+write_fn(png_structp png_ptr, png_bytep data, size_t size)
+{
+   skip_file *file = voidcast(skip_file*, png_get_io_ptr(png_ptr));
+
+   if (file->size + size > file->allocated)
+   {
+      size_t allocated = 2 * (file->size + size);
+      png_bytep new_data = voidcast(png_bytep, realloc(file->data, allocated));
+
+      if (new_data == NULL)
+         png_error(png_ptr, "out of memory for the file");
+
+      file->data = new_data;
+      file->allocated = allocated;
+   }
+
+   memcpy(file->data + file->size, data, size);
+   file->size += size;
+}
+
+static void PNGCBAPI
+read_fn(png_structp png_ptr, png_bytep data, size_t size)
+{
+   skip_file *file = voidcast(skip_file*, png_get_io_ptr(png_ptr));
+
+   if (size > file->size - file->position)
+      png_error(png_ptr, "read beyond end of file");
+
+   memcpy(data, file->data + file->position, size);
+   file->position += size;
+   file->read += size;
+}
+
+static int PNGCBAPI
+seek_fn(png_structp png_ptr, png_uint_32 length)
+{
+   skip_file *file = voidcast(skip_file*, png_get_io_ptr(png_ptr));
+
+   if (file->seek < 0 || length > file->size - file->position)
+      return 0;
+
+   file->position += length;
+   file->seeked += length;
+   return 1;
+}
+
+static void PNGCBAPI
+error_fn(png_structp png_ptr, png_const_charp message)
+{
+   skip_file *file = voidcast(skip_file*, png_get_error_ptr(png_ptr));
+
+   strncpy(file->error, message, (sizeof file->error)-1);
+   png_longjmp(png_ptr, 1);
+}
+
+static void PNGCBAPI
+warning_fn(png_structp png_ptr, png_const_charp message)
+{
+   (void)png_ptr;
+   (void)message;
+}
+
+static png_uint_32
+get_uint_32(png_const_bytep buf)
+{
+   return ((png_uint_32)buf[0] << 24) + ((png_uint_32)buf[1] << 16) +
+      ((png_uint_32)buf[2] << 8) + buf[3];
+}
+
+/* Make the PNG, then find the IDAT chunks in it. */
+static int
+make_file(skip_file *file)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   png_byte row[3*WIDTH];
+   png_uint_32 x, y;
+   size_t offset;
+
+   memset(file, 0, sizeof *file);
+
+   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, file, error_fn,
+       warning_fn);
+   info_ptr = png_create_info_struct(png_ptr);
+
+   if (info_ptr == NULL)
+   {
+      fprintf(stderr, "pngskip: out of memory\n");
+      png_destroy_write_struct(&png_ptr, NULL);
+      return 0;
+   }
+
+   if (setjmp(png_jmpbuf(png_ptr)))
+   {
+      fprintf(stderr, "pngskip: write: %s\n", file->error);
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      return 0;
+   }
+
+   png_set_write_fn(png_ptr, file, write_fn, NULL);
+   png_set_compression_buffer_size(png_ptr, IDAT_SIZE);
+   png_set_IHDR(png_ptr, info_ptr, WIDTH, HEIGHT, 8, PNG_COLOR_TYPE_RGB,
+       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+   png_write_info(png_ptr, info_ptr);
+
+   for (y = 0; y < HEIGHT; ++y)
+   {
+      for (x = 0; x < 3*WIDTH; ++x)
+         row[x] = (png_byte)((x * 7 + y * 13) ^ (x * y));
+
+      png_write_row(png_ptr, row);
+   }
+
+   {
+      png_text text;
+      char key[] = "Comment", value[] = "after the image data";
+
+      memset(&text, 0, sizeof text);
+      text.compression = PNG_TEXT_COMPRESSION_NONE;
+      text.key = key;
+      text.text = value;
+      png_set_text(png_ptr, info_ptr, &text, 1);
+   }
+
+   png_write_end(png_ptr, info_ptr);
+   png_destroy_write_struct(&png_ptr, &info_ptr);
+
+   for (offset = 8; offset + 12 <= file->size;)
+   {
+      png_uint_32 length = get_uint_32(file->data + offset);
+
+      if (memcmp(file->data + offset + 4, "IDAT", 4) == 0)
+      {
+         /* Damage the last IDAT, which is not needed for the first rows: */
+         file->damage = offset + 8;
+         file->idat += length + 4;
+      }
+
+      offset += length + 12;
+   }
+
+   if (file->idat < 4 * IDAT_SIZE)
+   {
+      fprintf(stderr, "pngskip: %lu bytes of IDAT, expected more\n",
+          (unsigned long)file->idat);
+      return 0;
+   }
+
+   return 1;
+}
+
+/* Read 'rows' rows then call png_read_end.  Returns 0 if the read stopped with
+ * an error, else 1 if the text was read or -1 if it was not.
+ */
+static int
+read_file(skip_file *file, int mode, int crc_action, png_uint_32 rows)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   png_byte row[3*WIDTH];
+   png_textp text;
+   png_uint_32 y;
+   int result;
+
+   file->position = file->read = file->seeked = 0;
+   file->error[0] = 0;
+
+   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, file, error_fn,
+       warning_fn);
+   info_ptr = png_create_info_struct(png_ptr);
+
+   if (info_ptr == NULL)
+   {
+      fprintf(stderr, "pngskip: out of memory\n");
+      exit(99);
+   }
+
+   if (setjmp(png_jmpbuf(png_ptr)))
+   {
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      return 0;
+   }
+
+   png_set_read_fn(png_ptr, file, read_fn);
+
+   if (file->seek != 0)
+      png_set_read_seek_fn(png_ptr, seek_fn);
+
+   png_set_crc_action(png_ptr, crc_action, PNG_CRC_DEFAULT);
+   png_set_skip_IDAT(png_ptr, mode);
+   png_read_info(png_ptr, info_ptr);
+
+   for (y = 0; y < rows; ++y)
+      png_read_row(png_ptr, row, NULL);
+
+   png_read_end(png_ptr, info_ptr);
+
+   result = png_get_text(png_ptr, info_ptr, &text, NULL) == 1 &&
+      strcmp(text[0].text, "after the image data") == 0 ? 1 : -1;
+
+   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+   return result;
+}
+
+static int
+check(skip_file *file, const char *test, int mode, int crc_action,
+    png_uint_32 rows, int expected)
+{
+   int result = read_file(file, mode, crc_action, rows);
+   size_t seeked = 0;
+
+   /* Only the IDAT data, and only when the CRC is not checked, is seeked
+    * over; the header of the first IDAT is read by png_read_info.
+    */
+   if (result > 0 && mode == PNG_SKIP_IDAT_IGNORE_CRC && file->seek > 0)
+      seeked = file->seeked;
+
+   if (result != expected)
+   {
+      fprintf(stderr, "pngskip: %s: %s\n", test,
+          result == 0 ? file->error : result > 0 ? "read" : "no text");
+      return 0;
+   }
+
+   if (result > 0 && (file->position != file->size ||
+       file->read + file->seeked != file->size || file->seeked != seeked))
+   {
+      fprintf(stderr, "pngskip: %s: %lu bytes read, %lu seeked of %lu\n",
+          test, (unsigned long)file->read, (unsigned long)file->seeked,
+          (unsigned long)file->size);
+      return 0;
+   }
+
+   /* After png_read_info all the IDAT data and CRCs are seeked over: */
+   if (seeked > 0 && rows == 0 && seeked != file->idat)
+   {
+      fprintf(stderr, "pngskip: %s: %lu bytes seeked of %lu IDAT bytes\n",
+          test, (unsigned long)seeked, (unsigned long)file->idat);
+      return 0;
+   }
+
+   return 1;
+}
+
+#ifdef PNG_READ_COPY_IDAT_SUPPORTED
+/* Return the number of IDAT chunks and the range of the file they occupy. */
+static unsigned int
+find_IDAT(const skip_file *file, size_t *start, size_t *end)
+{
+   unsigned int chunks = 0;
+   size_t offset;
+
+   *start = *end = 0;
+
+   for (offset = 8; offset + 12 <= file->size;)
+   {
+      png_uint_32 length = get_uint_32(file->data + offset);
+
+      if (memcmp(file->data + offset + 4, "IDAT", 4) == 0)
+      {
+         if (chunks++ == 0)
+            *start = offset;
+
+         *end = offset + length + 12;
+      }
+
+      offset += length + 12;
+   }
+
+   return chunks;
+}
+
+/* Copy the IDAT chunks of 'file' to a new PNG with png_set_copy_IDAT, the
+ * text being read with png_read_end and written after the image data.
+ * 'width' is that of the new PNG.  Returns 0 if the copy stopped with an
+ * error, else 1 if the IDAT chunks and the text were copied or -1 if they
+ * were not.
+ */
+static int
+copy_file(skip_file *file, int mode, png_uint_32 rows, png_uint_32 width)
+{
+   png_structp read_ptr, write_ptr;
+   png_infop info_ptr, end_ptr;
+   png_byte row[3*WIDTH];
+   png_uint_32 y;
+   skip_file out;
+   volatile int result = 1; /* set after setjmp */
+
+   memset(&out, 0, sizeof out);
+   file->position = file->read = file->seeked = 0;
+   file->error[0] = 0;
+
+   read_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, file, error_fn,
+       warning_fn);
+   info_ptr = png_create_info_struct(read_ptr);
+   end_ptr = png_create_info_struct(read_ptr);
+   write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, &out, error_fn,
+       warning_fn);
+
+   if (info_ptr == NULL || end_ptr == NULL || write_ptr == NULL)
+   {
+      fprintf(stderr, "pngskip: out of memory\n");
+      exit(99);
+   }
+
+   if (setjmp(png_jmpbuf(read_ptr)) || setjmp(png_jmpbuf(write_ptr)))
+   {
+      if (file->error[0] == 0)
+         strcpy(file->error, out.error);
+
+      png_destroy_write_struct(&write_ptr, NULL);
+      png_destroy_read_struct(&read_ptr, &info_ptr, &end_ptr);
+      free(out.data);
+      return 0;
+   }
+
+   png_set_read_fn(read_ptr, file, read_fn);
+
+   if (file->seek != 0)
+      png_set_read_seek_fn(read_ptr, seek_fn);
+
+   png_set_skip_IDAT(read_ptr, mode);
+   png_read_info(read_ptr, info_ptr);
+
+   for (y = 0; y < rows; ++y)
+      png_read_row(read_ptr, row, NULL);
+
+   png_set_write_fn(write_ptr, &out, write_fn, NULL);
+   png_set_IHDR(write_ptr, info_ptr, width, HEIGHT, 8, PNG_COLOR_TYPE_RGB,
+       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+   png_write_info(write_ptr, info_ptr);
+   png_set_copy_IDAT(read_ptr, write_ptr);
+   png_read_end(read_ptr, end_ptr);
+   png_write_end(write_ptr, end_ptr);
+
+   {
+      size_t in_start, in_end, out_start, out_end;
+      unsigned int chunks = find_IDAT(file, &in_start, &in_end);
+      png_textp text;
+
+      /* The copy reads all the data; only an ignored CRC may be seeked. */
+      if (file->read + file->seeked != file->size ||
+          file->seeked > (mode == PNG_SKIP_IDAT_IGNORE_CRC ? 4*chunks : 0) ||
+          find_IDAT(&out, &out_start, &out_end) != chunks ||
+          out_end - out_start != in_end - in_start ||
+          memcmp(out.data + out_start, file->data + in_start,
+             in_end - in_start) != 0 ||
+          png_get_text(read_ptr, end_ptr, &text, NULL) != 1)
+         result = -1;
+
+      else if (out.size - out_end != file->size - in_end)
+         result = -1; /* the text was not written after the IDAT */
+   }
+
+   png_destroy_write_struct(&write_ptr, NULL);
+   png_destroy_read_struct(&read_ptr, &info_ptr, &end_ptr);
+   free(out.data);
+   return result;
+}
+
+static int
+check_copy(skip_file *file, const char *test, int mode, png_uint_32 rows,
+    png_uint_32 width, int expected)
+{
+   int result = copy_file(file, mode, rows, width);
+
+   if (result != expected)
+   {
+      fprintf(stderr, "pngskip: copy, %s: %s\n", test,
+          result == 0 ? file->error : result > 0 ? "copied" : "not copied");
+      return 0;
+   }
+
+   return 1;
+}
+#endif /* READ_COPY_IDAT */
+
+#ifdef PNG_STDIO_SUPPORTED
+/* With png_init_io png_read_end seeks with fseek when the CRC is ignored. */
+static int
+check_stdio(skip_file *file)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   png_textp text;
+   FILE *volatile fp = tmpfile();
+   int ok = 0;
+
+   if (fp == NULL || fwrite(file->data, file->size, 1, fp) != 1 ||
+       fseek(fp, 0, SEEK_SET) != 0)
+   {
+      fprintf(stderr, "pngskip: cannot write a temporary file\n");
+      if (fp != NULL)
+         fclose(fp);
+      return 0;
+   }
+
+   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, file, error_fn,
+       warning_fn);
+   info_ptr = png_create_info_struct(png_ptr);
+
+   if (info_ptr == NULL)
+   {
+      fprintf(stderr, "pngskip: out of memory\n");
+      exit(99);
+   }
+
+   if (setjmp(png_jmpbuf(png_ptr)))
+      fprintf(stderr, "pngskip: stdio: %s\n", file->error);
+
+   else
+   {
+      png_init_io(png_ptr, fp);
+      png_set_skip_IDAT(png_ptr, PNG_SKIP_IDAT_IGNORE_CRC);
+      png_read_info(png_ptr, info_ptr);
+      png_read_end(png_ptr, info_ptr);
+
+      if (png_get_text(png_ptr, info_ptr, &text, NULL) != 1 ||
+          ftell(fp) != (long)file->size)
+         fprintf(stderr, "pngskip: stdio: text not read\n");
+
+      else
+         ok = 1;
+   }
+
+   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+   fclose(fp);
+   return ok;
+}
+#endif
+
+int
+main(void)
+{
+   skip_file file;
+   int errors = 0;
+   int seek;
+
+   if (!make_file(&file))
+      return 99;
+
+   for (seek = -1; seek <= 1; ++seek)
+   {
+      file.seek = seek;
+
+      errors += !check(&file, "off", PNG_SKIP_IDAT_OFF, PNG_CRC_DEFAULT,
+          HEIGHT, 1);
+      errors += !check(&file, "check CRC", PNG_SKIP_IDAT_CHECK_CRC,
+          PNG_CRC_DEFAULT, 0, 1);
+      errors += !check(&file, "ignore CRC", PNG_SKIP_IDAT_IGNORE_CRC,
+          PNG_CRC_DEFAULT, 0, 1);
+      errors += !check(&file, "check CRC after rows", PNG_SKIP_IDAT_CHECK_CRC,
+          PNG_CRC_DEFAULT, 3, 1);
+      errors += !check(&file, "ignore CRC after rows",
+          PNG_SKIP_IDAT_IGNORE_CRC, PNG_CRC_DEFAULT, 3, 1);
+
+      /* Damage the IDAT data; it is only noticed if the CRC is checked. */
+      file.data[file.damage] ^= 0x55;
+      errors += !check(&file, "damaged, check CRC", PNG_SKIP_IDAT_CHECK_CRC,
+          PNG_CRC_DEFAULT, 0, 0);
+      errors += !check(&file, "damaged, check CRC, warn",
+          PNG_SKIP_IDAT_CHECK_CRC, PNG_CRC_WARN_USE, 0, 1);
+      errors += !check(&file, "damaged, check CRC, quiet",
+          PNG_SKIP_IDAT_CHECK_CRC, PNG_CRC_QUIET_USE, 3, 1);
+      errors += !check(&file, "damaged, ignore CRC", PNG_SKIP_IDAT_IGNORE_CRC,
+          PNG_CRC_DEFAULT, 0, 1);
+      errors += !check(&file, "damaged, ignore CRC after rows",
+          PNG_SKIP_IDAT_IGNORE_CRC, PNG_CRC_DEFAULT, 3, 1);
+      file.data[file.damage] ^= 0x55;
+
+#     ifdef PNG_READ_COPY_IDAT_SUPPORTED
+         errors += !check_copy(&file, "check CRC", PNG_SKIP_IDAT_CHECK_CRC,
+             0, WIDTH, 1);
+         errors += !check_copy(&file, "ignore CRC", PNG_SKIP_IDAT_IGNORE_CRC,
+             0, WIDTH, 1);
+         errors += !check_copy(&file, "after rows", PNG_SKIP_IDAT_OFF, 3,
+             WIDTH, 0);
+         errors += !check_copy(&file, "different IHDR", PNG_SKIP_IDAT_OFF, 0,
+             WIDTH-1, 0);
+#     endif
+   }
+
+#  ifdef PNG_STDIO_SUPPORTED
+      errors += !check_stdio(&file);
+#  endif
+
+   free(file.data);
+
+   return errors != 0;
+}
+#else /* !(READ_SKIP_IDAT && WRITE && tEXt && SETJMP) */
+int
+main(void)
+{
+   fprintf(stderr, "pngskip: no support for png_set_skip_IDAT\n");
+   /* So the test is skipped: */
+   return SKIP;
+}
+#endif
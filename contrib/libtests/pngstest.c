@@ -336,6 +336,12 @@ compare_16bit(int v1, int v2, int error_limit, int multiple_algorithms)
 #define NO_RESEED  512   /* do not reseed on each new file */
 #define GBG_ERROR 1024   /* do not ignore the gamma+background_rgb_to_gray
                           * libpng warning. */
+#define USE_BATCH 2048   /* read with png_image_read_batch */
+#define USE_ROWS  4096   /* read and write a row at a time with the
+                          * png_image_finish_read_rows and
+                          * png_image_write_rows_to_memory callbacks */
+#define FASTEST_WRITE 8192 /* write with PNG_IMAGE_FLAG_FASTEST */
+#define REDUCE_WRITE 16384 /* write with PNG_IMAGE_FLAG_REDUCE */
 
 static void
 print_opts(png_uint_32 opts)
@@ -360,6 +366,14 @@ print_opts(png_uint_32 opts)
       printf(" --sRGB-16bit");
    if (opts & NO_RESEED)
       printf(" --noreseed");
+   if (opts & USE_BATCH)
+      printf(" --batch");
+   if (opts & USE_ROWS)
+      printf(" --rows");
+   if (opts & FASTEST_WRITE)
+      printf(" --fastest");
+   if (opts & REDUCE_WRITE)
+      printf(" --reduce");
 #if PNG_LIBPNG_VER < 10700 /* else on by default */
    if (opts & GBG_ERROR)
       printf(" --fault-gbg-warning");
@@ -2947,12 +2961,167 @@ compare_two_images(Image *a, Image *b, int via_linear,
    return 1;
 }
 
+/* Set the format to read an image in, once the header has been read into
+ * image->image, and allocate the buffer for it.
+ */
+static void
+prepare_read(Image *image, png_uint_32 format, png_const_colorp background)
+{
+   png_uint_32 image_format;
+
+   /* Print both original and output formats. */
+   image_format = image->image.format;
+
+   if (image->opts & VERBOSE)
+   {
+      printf("%s %lu x %lu %s -> %s", image->file_name,
+         (unsigned long)image->image.width,
+         (unsigned long)image->image.height,
+         format_names[image_format & FORMAT_MASK],
+         (format & FORMAT_NO_CHANGE) != 0 || image->image.format == format
+         ? "no change" : format_names[format & FORMAT_MASK]);
+
+      if (background != NULL)
+         printf(" background(%d,%d,%d)\n", background->red,
+            background->green, background->blue);
+      else
+         printf("\n");
+
+      fflush(stdout);
+   }
+
+   /* 'NO_CHANGE' combined with the color-map flag forces the base format
+    * flags to be set on read to ensure that the original representation is
+    * not lost in the pass through a colormap format.
+    */
+   if ((format & FORMAT_NO_CHANGE) != 0)
+   {
+      if ((format & PNG_FORMAT_FLAG_COLORMAP) != 0 &&
+         (image_format & PNG_FORMAT_FLAG_COLORMAP) != 0)
+         format = (image_format & ~BASE_FORMATS) | (format & BASE_FORMATS);
+
+      else
+         format = image_format;
+   }
+
+   image->image.format = format;
+
+   image->stride = PNG_IMAGE_ROW_STRIDE(image->image) + image->stride_extra;
+   allocbuffer(image);
+}
+
+#ifdef PNG_SIMPLIFIED_READ_BATCH_SUPPORTED
+static int
+batch_allocate(png_batch_job *job)
+{
+   Image *image = voidcast(Image*, job->user_ptr);
+
+   image->image = job->image;
+   prepare_read(image, job->format, job->background);
+
+   job->format = image->image.format;
+   job->buffer = image->buffer+16;
+   job->row_stride = (png_int_32)image->stride;
+   job->colormap = image->colormap;
+
+   return 1;
+}
+
+/* Read the file as a batch of one with png_image_read_batch, which does its
+ * own begin_read.
+ */
+static int
+read_batch(Image *image, png_uint_32 format, png_const_colorp background)
+{
+   png_batch_job job;
+   png_batch_options options;
+
+   memset(&job, 0, sizeof job);
+   memset(&options, 0, sizeof options);
+
+   if (image->input_memory != NULL)
+   {
+      job.memory = image->input_memory;
+      job.size = image->input_memory_size;
+   }
+
+   else
+      job.file_name = image->file_name;
+
+   job.format = format;
+   job.background = background;
+   job.user_ptr = image;
+
+   if (image->opts & sRGB_16BIT)
+      job.flags = PNG_IMAGE_FLAG_16BIT_sRGB;
+
+   options.allocate = batch_allocate;
+
+   (void)png_image_read_batch(&job, 1, &options);
+   image->image = job.image;
+
+   if (image->buffer != NULL)
+      checkbuffer(image, image->file_name);
+
+   if (job.result)
+      return checkopaque(image);
+
+   else
+      return logerror(image, image->file_name, ": batch read failed: ",
+         image->image.message);
+}
+#endif
+
+#ifdef PNG_SIMPLIFIED_READ_ROWS_SUPPORTED
+/* Copy rows from png_image_finish_read_rows into the buffer, checking that they
+ * arrive in order.
+ */
+typedef struct
+{
+   Image       *image;
+   png_uint_32  next_row;
+} ReadRows;
+
+static int
+read_rows_fn(png_imagep png_image, void *user_ptr, png_uint_32 y,
+   png_uint_32 count, const void *rows)
+{
+   ReadRows *rr = voidcast(ReadRows*, user_ptr);
+   Image *image = rr->image;
+   size_t row_bytes = PNG_IMAGE_ROW_STRIDE(*png_image) *
+      PNG_IMAGE_PIXEL_COMPONENT_SIZE(png_image->format);
+   size_t stride = image->stride *
+      PNG_IMAGE_PIXEL_COMPONENT_SIZE(png_image->format);
+   png_const_bytep row = voidcast(png_const_bytep, rows);
+
+   if (y != rr->next_row || count == 0 || count > png_image->height - y)
+      return 0;
+
+   rr->next_row = y + count;
+
+   while (count-- > 0)
+   {
+      memcpy(image->buffer+16 + y++ * stride, row, row_bytes);
+      row += row_bytes;
+   }
+
+   return 1;
+}
+#endif
+
 /* Read the file; how the read gets done depends on which of input_file and
  * input_memory have been set.
  */
 static int
 read_file(Image *image, png_uint_32 format, png_const_colorp background)
 {
+#  ifdef PNG_SIMPLIFIED_READ_BATCH_SUPPORTED
+      /* The batch API cannot read from a FILE*: */
+      if ((image->opts & USE_BATCH) != 0 && (image->input_memory != NULL ||
+         image->input_file == NULL))
+         return read_batch(image, format, background);
+#  endif
+
    memset(&image->image, 0, sizeof image->image);
    image->image.version = PNG_IMAGE_VERSION;
 
@@ -2992,48 +3161,33 @@ read_file(Image *image, png_uint_32 format, png_const_colorp background)
     */
    {
       int result;
-      png_uint_32 image_format;
+      png_uint_32 in_format = image->image.format;
 
-      /* Print both original and output formats. */
-      image_format = image->image.format;
+      prepare_read(image, format, background);
 
-      if (image->opts & VERBOSE)
-      {
-         printf("%s %lu x %lu %s -> %s", image->file_name,
-            (unsigned long)image->image.width,
-            (unsigned long)image->image.height,
-            format_names[image_format & FORMAT_MASK],
-            (format & FORMAT_NO_CHANGE) != 0 || image->image.format == format
-            ? "no change" : format_names[format & FORMAT_MASK]);
+#     ifdef PNG_SIMPLIFIED_READ_ROWS_SUPPORTED
+         /* There is no buffer to compose onto when the rows are passed to a
+          * callback, so that case is read in the normal way.
+          */
+         if ((image->opts & USE_ROWS) != 0 && (background != NULL ||
+            (in_format & ~image->image.format & PNG_FORMAT_FLAG_ALPHA) == 0 ||
+            (image->image.format & PNG_FORMAT_FLAG_LINEAR) != 0))
+         {
+            ReadRows rr;
 
-         if (background != NULL)
-            printf(" background(%d,%d,%d)\n", background->red,
-               background->green, background->blue);
-         else
-            printf("\n");
+            rr.image = image;
+            rr.next_row = 0;
 
-         fflush(stdout);
-      }
+            /* A few rows at a time, to exercise the batching: */
+            result = png_image_finish_read_rows(&image->image, background,
+               read_rows_fn, &rr, 3, image->colormap);
 
-      /* 'NO_CHANGE' combined with the color-map flag forces the base format
-       * flags to be set on read to ensure that the original representation is
-       * not lost in the pass through a colormap format.
-       */
-      if ((format & FORMAT_NO_CHANGE) != 0)
-      {
-         if ((format & PNG_FORMAT_FLAG_COLORMAP) != 0 &&
-            (image_format & PNG_FORMAT_FLAG_COLORMAP) != 0)
-            format = (image_format & ~BASE_FORMATS) | (format & BASE_FORMATS);
+            if (result && rr.next_row != image->image.height)
+               return logerror(image, image->file_name, ": rows missing", "");
+         }
 
          else
-            format = image_format;
-      }
-
-      image->image.format = format;
-
-      image->stride = PNG_IMAGE_ROW_STRIDE(image->image) + image->stride_extra;
-      allocbuffer(image);
-
+#     endif
       result = png_image_finish_read(&image->image, background,
          image->buffer+16, (png_int_32)image->stride, image->colormap);
 
@@ -3134,12 +3288,83 @@ read_one_file(Image *image)
 }
 
 #ifdef PNG_SIMPLIFIED_WRITE_SUPPORTED
+#ifdef PNG_SIMPLIFIED_WRITE_ROWS_SUPPORTED
+/* Give png_image_write_rows_to_memory a row of the buffer. */
+static const void *
+write_row_fn(png_imagep png_image, void *user_ptr, png_uint_32 y)
+{
+   Image *image = voidcast(Image*, user_ptr);
+
+   return image->buffer+16 + y * image->stride *
+      PNG_IMAGE_PIXEL_COMPONENT_SIZE(png_image->format);
+}
+#endif
+
+/* The png_image_write_to_memory_realloc callback; counts the calls. */
+static void *
+realloc_fn(void *user_ptr, void *memory, png_alloc_size_t size)
+{
+   int *calls = voidcast(int*, user_ptr);
+
+   ++*calls;
+   return realloc(memory, size);
+}
+
+/* Write the image again in one pass with png_image_write_to_memory_realloc,
+ * which must give the same bytes as the two pass write in 'output'.  This is
+ * done with realloc_fn, then with libpng's allocator starting from a buffer
+ * that is too small.
+ */
+static int
+check_realloc_write(Image *output, Image *image, int convert_to_8bit)
+{
+   void *memory = NULL;
+   png_alloc_size_t size = 0;
+   int calls = 0;
+   int ok;
+
+   ok = png_image_write_to_memory_realloc(&image->image, &memory, &size,
+      realloc_fn, &calls, convert_to_8bit, image->buffer+16,
+      (png_ptrdiff_t)image->stride, image->colormap);
+
+   if (ok)
+      ok = calls > 0 && size == output->input_memory_size &&
+         memcmp(memory, output->input_memory, size) == 0;
+
+   free(memory);
+
+   if (ok)
+   {
+      size = 64;
+      memory = png_image_realloc_memory(NULL, size);
+      ok = memory != NULL && png_image_write_to_memory_realloc(&image->image,
+         &memory, &size, NULL, NULL, convert_to_8bit, image->buffer+16,
+         (png_ptrdiff_t)image->stride, image->colormap);
+
+      if (ok)
+         ok = size == output->input_memory_size &&
+            memcmp(memory, output->input_memory, size) == 0;
+
+      png_image_free_memory(memory);
+   }
+
+   return ok;
+}
+
 static int
 write_one_file(Image *output, Image *image, int convert_to_8bit)
 {
    if (image->opts & FAST_WRITE)
       image->image.flags |= PNG_IMAGE_FLAG_FAST;
 
+   if (image->opts & FASTEST_WRITE)
+      image->image.flags |= PNG_IMAGE_FLAG_FASTEST;
+
+#ifdef PNG_SIMPLIFIED_WRITE_REDUCE_SUPPORTED
+   if (image->opts & REDUCE_WRITE)
+      image->image.flags |= PNG_IMAGE_FLAG_REDUCE;
+#endif
+
    if (image->opts & USE_STDIO)
    {
 #ifdef PNG_SIMPLIFIED_WRITE_STDIO_SUPPORTED
@@ -3255,16 +3480,34 @@ write_one_file(Image *output, Image *image, int convert_to_8bit)
 
          if (output->input_memory != NULL)
          {
+            int written;
+
             output->input_memory_size = size;
 
-            if (png_image_write_to_memory(&image->image, output->input_memory,
-                  &output->input_memory_size, convert_to_8bit, image->buffer+16,
-                  (png_int_32)image->stride, image->colormap))
+#           ifdef PNG_SIMPLIFIED_WRITE_ROWS_SUPPORTED
+               if (image->opts & USE_ROWS)
+                  written = png_image_write_rows_to_memory(&image->image,
+                     output->input_memory, &output->input_memory_size,
+                     convert_to_8bit, write_row_fn, image, image->colormap);
+
+               else
+#           endif
+            written = png_image_write_to_memory(&image->image,
+               output->input_memory, &output->input_memory_size,
+               convert_to_8bit, image->buffer+16, (png_int_32)image->stride,
+               image->colormap);
+
+            if (written)
             {
                /* This is also non-fatal but it safes safer to error out anyway:
                 */
                if (size != output->input_memory_size)
                   return logerror(image, "memory", ": memory size wrong", "");
+
+               if (!(image->opts & USE_ROWS) &&
+                  !check_realloc_write(output, image, convert_to_8bit))
+                  return logerror(image, "memory", ": realloc write differs",
+                     "");
             }
 
             else
@@ -3285,14 +3528,25 @@ write_one_file(Image *output, Image *image, int convert_to_8bit)
     * However, if the original image was color-mapped, a simple read will zap
     * the linear, color and maybe alpha flags, this will cause spurious failures
     * under some circumstances.
+    *
+    * A reduced file has a different format, so it is read back in the format
+    * that would have been written without the flag.
     */
-   if (read_file(output, image->image.format | FORMAT_NO_CHANGE, NULL))
    {
       png_uint_32 original_format = image->image.format;
+      png_uint_32 read_format = original_format | FORMAT_NO_CHANGE;
 
       if (convert_to_8bit)
          original_format &= ~PNG_FORMAT_FLAG_LINEAR;
 
+      if ((image->opts & REDUCE_WRITE) != 0 &&
+         (original_format & PNG_FORMAT_FLAG_COLORMAP) == 0)
+         read_format = original_format & BASE_FORMATS;
+
+      if (!read_file(output, read_format, NULL))
+         return logerror(output, output->tmpfile_name,
+            ": read of new file failed", "");
+
       if ((output->image.format & BASE_FORMATS) !=
          (original_format & BASE_FORMATS))
          return logerror(image, image->file_name, ": format changed on read: ",
@@ -3300,10 +3554,6 @@ write_one_file(Image *output, Image *image, int convert_to_8bit)
 
       return compare_two_images(image, output, 0/*via linear*/, NULL);
    }
-
-   else
-      return logerror(output, output->tmpfile_name,
-         ": read of new file failed", "");
 }
 #endif
 
@@ -3569,6 +3819,30 @@ main(int argc, char **argv)
          opts &= ~sRGB_16BIT;
       else if (strcmp(arg, "--noreseed") == 0)
          opts |= NO_RESEED;
+      else if (strcmp(arg, "--batch") == 0)
+#        ifdef PNG_SIMPLIFIED_READ_BATCH_SUPPORTED
+            opts |= USE_BATCH;
+#        else
+            return SKIP; /* skipped: no support */
+#        endif
+      else if (strcmp(arg, "--rows") == 0)
+#        ifdef PNG_SIMPLIFIED_READ_ROWS_SUPPORTED
+            opts |= USE_ROWS;
+#        else
+            return SKIP; /* skipped: no support */
+#        endif
+      else if (strcmp(arg, "--fastest") == 0)
+#        ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+            opts |= FASTEST_WRITE;
+#        else
+            return SKIP; /* skipped: no support */
+#        endif
+      else if (strcmp(arg, "--reduce") == 0)
+#        ifdef PNG_SIMPLIFIED_WRITE_REDUCE_SUPPORTED
+            opts |= REDUCE_WRITE;
+#        else
+            return SKIP; /* skipped: no support */
+#        endif
       else if (strcmp(arg, "--fault-gbg-warning") == 0)
          opts |= GBG_ERROR;
       else if (strcmp(arg, "--tmpfile") == 0)
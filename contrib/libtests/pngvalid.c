@@ -6563,10 +6563,23 @@ transform_info_imp(transform_display *dp, png_structp pp, png_infop pi)
    /* Update the info structure for these transforms: */
    {
       int i = dp->this.use_update_info;
+#     ifdef PNG_READ_DECODE_COST_SUPPORTED
+         png_decode_cost cost;
+
+         /* The row size is estimated before png_read_update_info: */
+         if (png_get_decode_cost(pp, pi, &cost) == 0)
+            png_error(pp, "png_get_decode_cost failed");
+#     endif
+
       /* Always do one call, even if use_update_info is 0. */
       do
          png_read_update_info(pp, pi);
       while (--i > 0);
+
+#     ifdef PNG_READ_DECODE_COST_SUPPORTED
+         if (cost.rowbytes != png_get_rowbytes(pp, pi))
+            png_error(pp, "png_get_decode_cost: wrong rowbytes");
+#     endif
    }
 
    /* And get the output information into the standard_display */
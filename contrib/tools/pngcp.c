@@ -11,6 +11,9 @@
  * This is an example of copying a PNG without changes using the png_read_png
  * and png_write_png interfaces.  A considerable number of options are provided
  * to manipulate the compression of the PNG data and other compressed chunks.
+ * With --copy-IDAT the image data is instead copied unchanged using
+ * png_set_copy_IDAT, which is much faster when only the ancillary chunks need
+ * to change; --strip-text and --text-after-IDAT then control the text chunks.
  *
  * For a more extensive example that uses the transforms see
  * contrib/libtests/pngimage.c in the libpng distribution.
@@ -144,6 +147,11 @@ typedef enum
 #     define FIX_INDEX  0x800 /* 'Fix' out of range palette indices (OK) */
 #  endif /* GET_PALETTE_MAX */
 #endif /* CHECK_FOR_INVALID_INDEX */
+#ifdef PNG_READ_COPY_IDAT_SUPPORTED
+#  define COPY_IDAT    0x1000 /* Copy the IDAT chunks without re-encoding */
+#  define STRIP_TEXT   0x2000 /* copy-IDAT: remove all text chunks */
+#  define TEXT_AFTER   0x4000 /* copy-IDAT: write text after the IDAT chunks */
+#endif /* READ_COPY_IDAT */
 #define OPTION     0x80000000 /* Used for handling options */
 #define LIST       0x80000001 /* Used for handling options */
 
@@ -257,6 +265,27 @@ vl_IDAT_size[] = /* for png_set_IDAT_size */
    { "minimal", 1 },
    RANGE(1, 0x7FFFFFFF)
 },
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+vl_preset[] = /* for png_set_encode_preset */
+{
+   { "default",          PNG_ENCODE_PRESET_DEFAULT },
+   { "fastest",          PNG_ENCODE_PRESET_FASTEST },
+   { "high-speed",       PNG_ENCODE_PRESET_HIGH_SPEED },
+   { "balanced",         PNG_ENCODE_PRESET_BALANCED },
+   { "high-compression", PNG_ENCODE_PRESET_HIGH_COMPRESSION },
+   { "high-read-speed",  PNG_ENCODE_PRESET_HIGH_READ_SPEED },
+   { "low-memory",       PNG_ENCODE_PRESET_LOW_MEMORY },
+   { "optimal",          PNG_ENCODE_PRESET_OPTIMAL },
+   { "auto",             PNG_ENCODE_PRESET_AUTO }
+},
+#endif /* WRITE_ENCODE_PRESET */
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+vl_threads[] = /* for png_set_compression_threads */
+{
+   { "off", 0 },
+   RANGE(1, 16)
+},
+#endif /* WRITE_COMPRESSION_THREADS */
 #ifndef PNG_SW_IDAT_size
    /* Pre 1.7 API: */
 #  define png_set_IDAT_size(p,v) png_set_compression_buffer_size(p, v)
@@ -305,6 +334,11 @@ static const option options[] =
 #  ifdef FIX_INDEX
       S(fix-palette-index, FIX_INDEX)
 #  endif /* FIX_INDEX */
+#  ifdef COPY_IDAT
+      S(copy-IDAT, COPY_IDAT)
+      S(strip-text, STRIP_TEXT)
+      S(text-after-IDAT, TEXT_AFTER)
+#  endif /* COPY_IDAT */
 #  undef S
 
    /* OPTION settings, these and LIST settings are read on demand */
@@ -352,6 +386,12 @@ static const option options[] =
    VLC(level)
    VLC(memLevel)
    VLO("IDAT-size", IDAT_size, 0)
+#  ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+      VLO("preset", preset, 0)
+#  endif /* WRITE_ENCODE_PRESET */
+#  ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+      VLO("threads", threads, 0)
+#  endif /* WRITE_COMPRESSION_THREADS */
    VLO("log-depth", log_depth, 0)
 
 #  undef VLO
@@ -406,6 +446,13 @@ struct display
    png_alloc_size_t read_size;
    png_structp      read_pp;
    png_infop        ip;
+#  ifdef COPY_IDAT
+      /* With copy-IDAT the read is completed during the write, so the input
+       * file and the information from after the IDAT chunks are kept here.
+       */
+      FILE         *read_fp;
+      png_infop     end_ip;
+#  endif /* COPY_IDAT */
 #  if PNG_LIBPNG_VER < 10700 && defined PNG_TEXT_SUPPORTED
       png_textp     text_ptr; /* stash of text chunks */
       int           num_text;
@@ -494,6 +541,10 @@ display_init(struct display *dp)
    dp->read_pp = NULL;
    dp->ip = NULL;
    dp->write_pp = NULL;
+#  ifdef COPY_IDAT
+      dp->read_fp = NULL;
+      dp->end_ip = NULL;
+#  endif /* COPY_IDAT */
    dp->min_windowBits = -1; /* this is an OPTIND, so -1 won't match anything */
 #  if PNG_LIBPNG_VER < 10700 && defined PNG_TEXT_SUPPORTED
       dp->text_ptr = NULL;
@@ -505,8 +556,20 @@ display_init(struct display *dp)
 static void
 display_clean_read(struct display *dp)
 {
-   if (dp->read_pp != NULL)
-      png_destroy_read_struct(&dp->read_pp, NULL, NULL);
+#  ifdef COPY_IDAT
+      if (dp->read_pp != NULL)
+         png_destroy_read_struct(&dp->read_pp, NULL, &dp->end_ip);
+
+      if (dp->read_fp != NULL)
+      {
+         FILE *fp = dp->read_fp;
+         dp->read_fp = NULL;
+         (void)fclose(fp);
+      }
+#  else
+      if (dp->read_pp != NULL)
+         png_destroy_read_struct(&dp->read_pp, NULL, NULL);
+#  endif /* !COPY_IDAT */
 
    if (dp->fp != NULL)
    {
@@ -1728,13 +1791,18 @@ static void PNGCBAPI
 read_function(png_structp pp, png_bytep data, size_t size)
 {
    struct display *dp = get_dp(pp);
+#  ifdef COPY_IDAT
+      FILE *fp = dp->read_fp != NULL ? dp->read_fp : dp->fp;
+#  else
+      FILE *fp = dp->fp;
+#  endif /* !COPY_IDAT */
 
-   if (size == 0U || fread(data, size, 1U, dp->fp) == 1U)
+   if (size == 0U || fread(data, size, 1U, fp) == 1U)
       dp->read_size += size;
 
    else
    {
-      if (feof(dp->fp))
+      if (feof(fp))
          display_log(dp, LIBPNG_ERROR, "PNG file truncated");
       else
          display_log(dp, LIBPNG_ERROR, "PNG file read failed (%s)",
@@ -1791,6 +1859,15 @@ read_png(struct display *dp, const char *filename)
 
    /* Now read the PNG. */
    start_timer(dp, PNGCP_TIME_READ);
+#  ifdef COPY_IDAT
+      /* When copying the IDAT chunks only the chunks before the image data are
+       * read here; write_png copies the rest.
+       */
+      if ((dp->options & COPY_IDAT) != 0)
+         png_read_info(dp->read_pp, dp->ip);
+
+      else
+#  endif /* COPY_IDAT */
    png_read_png(dp->read_pp, dp->ip, 0U/*transforms*/, NULL/*params*/);
    end_timer(dp, PNGCP_TIME_READ);
    dp->w = png_get_image_width(dp->read_pp, dp->ip);
@@ -1816,7 +1893,11 @@ read_png(struct display *dp, const char *filename)
    }
 
 #ifdef FIX_INDEX
-   if (dp->ct == PNG_COLOR_TYPE_PALETTE && (dp->options & FIX_INDEX) != 0)
+   if (dp->ct == PNG_COLOR_TYPE_PALETTE && (dp->options & FIX_INDEX) != 0
+#     ifdef COPY_IDAT
+         && (dp->options & COPY_IDAT) == 0 /* palette_max is not known */
+#     endif /* COPY_IDAT */
+      )
    {
       int max = png_get_palette_max(dp->read_pp, dp->ip);
       png_colorp palette = NULL;
@@ -1848,6 +1929,19 @@ read_png(struct display *dp, const char *filename)
    }
 #endif /* FIX_INDEX */
 
+#  ifdef COPY_IDAT
+      if ((dp->options & COPY_IDAT) != 0)
+      {
+         /* Keep the read struct for write_png, moving the input file out of
+          * the way of the output file.
+          */
+         dp->read_fp = dp->fp;
+         dp->fp = NULL;
+         dp->operation = "none";
+         return;
+      }
+#  endif /* COPY_IDAT */
+
    display_clean_read(dp);
    dp->operation = "none";
 }
@@ -1972,6 +2066,50 @@ set_text_compression(struct display *dp)
 #  define set_text_compression(dp) ((void)0)
 #endif /* WRITE_CUSTOMIZE_ZTXT_COMPRESSION */
 
+#ifdef COPY_IDAT
+static void
+copy_IDAT(struct display *dp)
+{
+   /* The IDAT chunks are copied as png_read_end reads them, so the read struct
+    * is used up by the first write.
+    */
+   if (dp->read_pp == NULL)
+      display_log(dp, USER_ERROR, "copy-IDAT: only one write is possible");
+
+   dp->end_ip = png_create_info_struct(dp->read_pp);
+   if (dp->end_ip == NULL)
+      png_error(dp->read_pp, "failed to create end info struct");
+
+#  ifdef PNG_TEXT_SUPPORTED
+      /* Text from before the IDAT is either discarded or moved to the end info
+       * so that it is written after the image data.
+       */
+      if ((dp->options & (STRIP_TEXT+TEXT_AFTER)) != 0)
+      {
+         png_textp text = NULL;
+         int num_text = png_get_text(dp->read_pp, dp->ip, &text, NULL);
+
+         if (num_text > 0 && (dp->options & STRIP_TEXT) == 0)
+            png_set_text(dp->read_pp, dp->end_ip, text, num_text);
+
+         png_free_data(dp->read_pp, dp->ip, PNG_FREE_TEXT, -1);
+      }
+#  endif /* TEXT */
+
+   png_write_info(dp->write_pp, dp->ip);
+   png_set_copy_IDAT(dp->read_pp, dp->write_pp);
+   png_read_end(dp->read_pp, dp->end_ip);
+
+#  ifdef PNG_TEXT_SUPPORTED
+      if ((dp->options & STRIP_TEXT) != 0)
+         png_free_data(dp->read_pp, dp->end_ip, PNG_FREE_TEXT, -1);
+#  endif /* TEXT */
+
+   png_write_end(dp->write_pp, dp->end_ip);
+   display_clean_read(dp);
+}
+#endif /* COPY_IDAT */
+
 static void
 write_png(struct display *dp, const char *destname)
 {
@@ -2032,6 +2170,17 @@ write_png(struct display *dp, const char *destname)
             png_set_text_compression(dp->write_pp, val);
       }
 #  endif /* png_level support */
+#  ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+      {
+         int val;
+
+         /* The preset sets the IDAT compression; the options below then change
+          * parts of it.
+          */
+         if (get_option(dp, "preset", &val))
+            png_set_encode_preset(dp->write_pp, val);
+      }
+#  endif /* WRITE_ENCODE_PRESET */
    if (dp->options & SEARCH)
       search_compression(dp);
    else
@@ -2047,6 +2196,16 @@ write_png(struct display *dp, const char *destname)
          png_set_IDAT_size(dp->write_pp, val);
    }
 
+#  ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+      {
+         int val;
+
+         /* These also run the trials of PNG_COMPRESSION_LEVEL_OPTIMAL. */
+         if (get_option(dp, "threads", &val))
+            png_set_compression_threads(dp->write_pp, val, 0);
+      }
+#  endif /* WRITE_COMPRESSION_THREADS */
+
    /* filter handling */
 #  ifdef PNG_WRITE_FILTER_SUPPORTED
       {
@@ -2060,6 +2219,12 @@ write_png(struct display *dp, const char *destname)
    /* This just uses the 'read' info_struct directly, it contains the image. */
    dp->write_size = 0U;
    start_timer(dp, PNGCP_TIME_WRITE);
+#  ifdef COPY_IDAT
+      if ((dp->options & COPY_IDAT) != 0)
+         copy_IDAT(dp);
+
+      else
+#  endif /* COPY_IDAT */
    png_write_png(dp->write_pp, dp->ip, 0U/*transforms*/, NULL/*params*/);
    end_timer(dp, PNGCP_TIME_WRITE);
 
@@ -2172,6 +2337,12 @@ cp_one_file(struct display *dp, const char *filename, const char *destname)
    dp->operation = "read";
    dp->no_warnings = 0;
 
+#  ifdef COPY_IDAT
+      if ((dp->options & (STRIP_TEXT+TEXT_AFTER)) != 0 &&
+          (dp->options & COPY_IDAT) == 0)
+         display_log(dp, USER_ERROR, "text options require --copy-IDAT");
+#  endif /* COPY_IDAT */
+
    /* Read it then write it: */
    if (filename != NULL && access(filename, R_OK) != 0)
       display_log(dp, USER_ERROR, "%s: invalid file name (%s)",
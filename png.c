@@ -13,6 +13,14 @@
 
 #include "pngpriv.h"
 
+#if defined(PNG_TASK_SUPPORTED) && PNG_THREADS_OPT > 0
+#  if defined(_WIN32) && !defined(__CYGWIN__)
+#     define PNG_WIN32_THREADS /* windows.h is included by pngpriv.h */
+#  else
+#     include <pthread.h>
+#  endif
+#endif
+
 /* Generate a compiler error if there is an old png.h in the search path. */
 typedef png_libpng_version_1_6_38_git Your_png_h_is_not_version_1_6_38_git;
 
@@ -243,6 +251,13 @@ png_user_version_check(png_structrp png_ptr, png_const_charp user_png_ver)
    return 1;
 }
 
+#ifdef PNG_EXECUTOR_SUPPORTED
+/* The executor given to png_structs when they are created. */
+static png_submit_ptr png_default_submit_fn = NULL;
+static png_wait_ptr png_default_wait_fn = NULL;
+static png_voidp png_default_executor_ptr = NULL;
+#endif
+
 /* Generic function to create a png_struct for either read or write - this
  * contains the common initialization.
  */
@@ -298,6 +313,12 @@ png_create_png_struct,(png_const_charp user_png_ver, png_voidp error_ptr,
     */
    png_set_error_fn(&create_struct, error_ptr, error_fn, warn_fn);
 
+#  ifdef PNG_EXECUTOR_SUPPORTED
+      create_struct.submit_fn = png_default_submit_fn;
+      create_struct.wait_fn = png_default_wait_fn;
+      create_struct.executor_ptr = png_default_executor_ptr;
+#  endif
+
 #  ifdef PNG_SETJMP_SUPPORTED
       if (!setjmp(create_jmp_buf))
 #  endif
@@ -321,12 +342,13 @@ png_create_png_struct,(png_const_charp user_png_ver, png_voidp error_ptr,
 
             if (png_ptr != NULL)
             {
-               /* png_ptr->zstream holds a back-pointer to the png_struct, so
+               /* The zstreams hold a back-pointer to the png_struct, so
                 * this can only be done now:
                 */
-               create_struct.zstream.zalloc = png_zalloc;
-               create_struct.zstream.zfree = png_zfree;
-               create_struct.zstream.opaque = png_ptr;
+               create_struct.zstream_idat.zalloc = png_zalloc;
+               create_struct.zstream_idat.zfree = png_zfree;
+               create_struct.zstream_idat.opaque = png_ptr;
+               create_struct.zstream_chunk = create_struct.zstream_idat;
 
 #              ifdef PNG_SETJMP_SUPPORTED
                /* Eliminate the local error handling: */
@@ -336,6 +358,7 @@ png_create_png_struct,(png_const_charp user_png_ver, png_voidp error_ptr,
 #              endif
 
                *png_ptr = create_struct;
+               png_ptr->zstream = &png_ptr->zstream_idat;
 
                /* This is the successful return point */
                return png_ptr;
@@ -447,7 +470,136 @@ png_info_init_3,(png_infopp ptr_ptr, size_t png_info_struct_size),
    memset(info_ptr, 0, (sizeof *info_ptr));
 }
 
+#ifdef PNG_TEXT_SUPPORTED
+/* Return true if the string was allocated from the text pool of info_ptr. */
+static int
+png_text_pooled(png_const_inforp info_ptr, png_const_charp string)
+{
+   png_const_bytep p = (png_const_bytep)string;
+   png_text_blockp block;
+
+   for (block = info_ptr->text_pool; block != NULL; block = block->next)
+      if (p >= block->data && p < block->data + block->size)
+         return 1;
+
+   return 0;
+}
+
+static void
+png_free_text_pool(png_const_structrp png_ptr, png_inforp info_ptr)
+{
+   png_text_blockp block = info_ptr->text_pool;
+
+   info_ptr->text_pool = NULL;
+
+   while (block != NULL)
+   {
+      png_text_blockp next = block->next;
+
+      png_free(png_ptr, block);
+      block = next;
+   }
+}
+
+/* When the application takes over the text it must be able to png_free each
+ * key, so the strings are copied out of the pool to separate allocations, as
+ * png_set_text made before the pool existed.
+ */
+static void
+png_text_unpool(png_const_structrp png_ptr, png_inforp info_ptr)
+{
+   int i;
+
+   for (i = 0; i < info_ptr->num_text; i++)
+   {
+      png_textp textp = info_ptr->text + i;
+
+      if (textp->key != NULL && png_text_pooled(info_ptr, textp->key) != 0)
+      {
+         size_t key_len = strlen(textp->key) + 1;
+         size_t lang_len = textp->lang != NULL ? strlen(textp->lang) + 1 : 0;
+         size_t lang_key_len =
+             textp->lang_key != NULL ? strlen(textp->lang_key) + 1 : 0;
+         size_t text_len = textp->text != NULL ? strlen(textp->text) + 1 : 0;
+         png_charp copy = png_voidcast(png_charp, png_malloc(png_ptr,
+             key_len + lang_len + lang_key_len + text_len));
+
+         memcpy(copy, textp->key, key_len);
+         textp->key = copy;
+         copy += key_len;
+
+         if (textp->lang != NULL)
+         {
+            memcpy(copy, textp->lang, lang_len);
+            textp->lang = copy;
+            copy += lang_len;
+         }
+
+         if (textp->lang_key != NULL)
+         {
+            memcpy(copy, textp->lang_key, lang_key_len);
+            textp->lang_key = copy;
+            copy += lang_key_len;
+         }
+
+         if (textp->text != NULL)
+         {
+            memcpy(copy, textp->text, text_len);
+            textp->text = copy;
+         }
+      }
+   }
+
+   png_free_text_pool(png_ptr, info_ptr);
+}
+#endif /* TEXT */
+
 /* The following API is not called internally */
+#ifdef PNG_READ_CONTIGUOUS_SUPPORTED
+/* Likewise the rows of a PNG_TRANSFORM_CONTIGUOUS image are copied out of their
+ * block, so that the application can png_free each row.  The rows are left as
+ * they were if there is not enough memory.
+ */
+static void
+png_rows_unblock(png_const_structrp png_ptr, png_inforp info_ptr)
+{
+   png_bytepp rows = png_voidcast(png_bytepp, png_malloc_warn(png_ptr,
+       info_ptr->height * (sizeof (png_bytep))));
+   png_uint_32 row = 0;
+
+   if (rows != NULL)
+   {
+      for (; row < info_ptr->height; row++)
+      {
+         rows[row] = png_voidcast(png_bytep, png_malloc_warn(png_ptr,
+             info_ptr->rowbytes));
+
+         if (rows[row] == NULL)
+            break;
+
+         memcpy(rows[row], info_ptr->row_pointers[row], info_ptr->rowbytes);
+      }
+
+      if (row < info_ptr->height)
+      {
+         while (row > 0)
+            png_free(png_ptr, rows[--row]);
+
+         png_free(png_ptr, rows);
+         rows = NULL;
+      }
+   }
+
+   if (rows == NULL)
+      png_error(png_ptr, "png_data_freer: out of memory for the rows");
+
+   png_free(png_ptr, info_ptr->row_pointers);
+   png_free(png_ptr, info_ptr->row_block);
+   info_ptr->row_pointers = rows;
+   info_ptr->row_block = NULL;
+}
+#endif /* READ_CONTIGUOUS */
+
 void PNGAPI
 png_data_freer(png_const_structrp png_ptr, png_inforp info_ptr,
     int freer, png_uint_32 mask)
@@ -461,7 +613,19 @@ png_data_freer(png_const_structrp png_ptr, png_inforp info_ptr,
       info_ptr->free_me |= mask;
 
    else if (freer == PNG_USER_WILL_FREE_DATA)
+   {
+#ifdef PNG_TEXT_SUPPORTED
+      if ((mask & PNG_FREE_TEXT) != 0 && info_ptr->text_pool != NULL)
+         png_text_unpool(png_ptr, info_ptr);
+#endif
+
+#ifdef PNG_READ_CONTIGUOUS_SUPPORTED
+      if ((mask & PNG_FREE_ROWS) != 0 && info_ptr->row_block != NULL)
+         png_rows_unblock(png_ptr, info_ptr);
+#endif
+
       info_ptr->free_me &= ~mask;
+   }
 
    else
       png_error(png_ptr, "Unknown freer parameter in png_data_freer");
@@ -481,9 +645,12 @@ png_free_data(png_const_structrp png_ptr, png_inforp info_ptr, png_uint_32 mask,
    if (info_ptr->text != NULL &&
        ((mask & PNG_FREE_TEXT) & info_ptr->free_me) != 0)
    {
+      /* Strings in the text pool are only released with the whole pool. */
       if (num != -1)
       {
-         png_free(png_ptr, info_ptr->text[num].key);
+         if (png_text_pooled(info_ptr, info_ptr->text[num].key) == 0)
+            png_free(png_ptr, info_ptr->text[num].key);
+
          info_ptr->text[num].key = NULL;
       }
 
@@ -492,9 +659,11 @@ png_free_data(png_const_structrp png_ptr, png_inforp info_ptr, png_uint_32 mask,
          int i;
 
          for (i = 0; i < info_ptr->num_text; i++)
-            png_free(png_ptr, info_ptr->text[i].key);
+            if (png_text_pooled(info_ptr, info_ptr->text[i].key) == 0)
+               png_free(png_ptr, info_ptr->text[i].key);
 
          png_free(png_ptr, info_ptr->text);
+         png_free_text_pool(png_ptr, info_ptr);
          info_ptr->text = NULL;
          info_ptr->num_text = 0;
          info_ptr->max_text = 0;
@@ -586,6 +755,7 @@ png_free_data(png_const_structrp png_ptr, png_inforp info_ptr, png_uint_32 mask,
          png_free(png_ptr, info_ptr->splt_palettes);
          info_ptr->splt_palettes = NULL;
          info_ptr->splt_palettes_num = 0;
+         info_ptr->splt_palettes_max = 0;
          info_ptr->valid &= ~PNG_INFO_sPLT;
       }
    }
@@ -611,6 +781,7 @@ png_free_data(png_const_structrp png_ptr, png_inforp info_ptr, png_uint_32 mask,
          png_free(png_ptr, info_ptr->unknown_chunks);
          info_ptr->unknown_chunks = NULL;
          info_ptr->unknown_chunks_num = 0;
+         info_ptr->unknown_chunks_max = 0;
       }
    }
 #endif
@@ -660,9 +831,21 @@ png_free_data(png_const_structrp png_ptr, png_inforp info_ptr, png_uint_32 mask,
    {
       if (info_ptr->row_pointers != NULL)
       {
-         png_uint_32 row;
-         for (row = 0; row < info_ptr->height; row++)
-            png_free(png_ptr, info_ptr->row_pointers[row]);
+#ifdef PNG_READ_CONTIGUOUS_SUPPORTED
+         /* The rows are in one block from PNG_TRANSFORM_CONTIGUOUS: */
+         if (info_ptr->row_block != NULL)
+         {
+            png_free(png_ptr, info_ptr->row_block);
+            info_ptr->row_block = NULL;
+         }
+
+         else
+#endif
+         {
+            png_uint_32 row;
+            for (row = 0; row < info_ptr->height; row++)
+               png_free(png_ptr, info_ptr->row_pointers[row]);
+         }
 
          png_free(png_ptr, info_ptr->row_pointers);
          info_ptr->row_pointers = NULL;
@@ -977,7 +1160,7 @@ png_reset_zstream(png_structrp png_ptr)
       return Z_STREAM_ERROR;
 
    /* WARNING: this resets the window bits to the maximum! */
-   return (inflateReset(&png_ptr->zstream));
+   return (inflateReset(png_ptr->zstream));
 }
 #endif /* READ */
 
@@ -990,7 +1173,7 @@ png_access_version_number(void)
 }
 
 #if defined(PNG_READ_SUPPORTED) || defined(PNG_WRITE_SUPPORTED)
-/* Ensure that png_ptr->zstream.msg holds some appropriate error message string.
+/* Ensure that png_ptr->zstream->msg holds some appropriate error message string.
  * If it doesn't 'ret' is used to set it to something appropriate, even in cases
  * like Z_OK or Z_STREAM_END where the error code is apparently a success code.
  */
@@ -1001,52 +1184,52 @@ png_zstream_error(png_structrp png_ptr, int ret)
     * one in zstream if set.  This always returns a string, even in cases like
     * Z_OK or Z_STREAM_END where the error code is a success code.
     */
-   if (png_ptr->zstream.msg == NULL) switch (ret)
+   if (png_ptr->zstream->msg == NULL) switch (ret)
    {
       default:
       case Z_OK:
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("unexpected zlib return code");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("unexpected zlib return code");
          break;
 
       case Z_STREAM_END:
          /* Normal exit */
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("unexpected end of LZ stream");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("unexpected end of LZ stream");
          break;
 
       case Z_NEED_DICT:
          /* This means the deflate stream did not have a dictionary; this
           * indicates a bogus PNG.
           */
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("missing LZ dictionary");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("missing LZ dictionary");
          break;
 
       case Z_ERRNO:
          /* gz APIs only: should not happen */
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("zlib IO error");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("zlib IO error");
          break;
 
       case Z_STREAM_ERROR:
          /* internal libpng error */
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("bad parameters to zlib");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("bad parameters to zlib");
          break;
 
       case Z_DATA_ERROR:
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("damaged LZ stream");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("damaged LZ stream");
          break;
 
       case Z_MEM_ERROR:
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("insufficient memory");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("insufficient memory");
          break;
 
       case Z_BUF_ERROR:
          /* End of input or output; not a problem if the caller is doing
           * incremental read or write.
           */
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("truncated");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("truncated");
          break;
 
       case Z_VERSION_ERROR:
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("unsupported zlib version");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("unsupported zlib version");
          break;
 
       case PNG_UNEXPECTED_ZLIB_RETURN:
@@ -1055,7 +1238,7 @@ png_zstream_error(png_structrp png_ptr, int ret)
           * and change pngpriv.h.  Note that this message is "... return",
           * whereas the default/Z_OK one is "... return code".
           */
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("unexpected zlib return");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("unexpected zlib return");
          break;
    }
 }
@@ -4347,6 +4530,355 @@ png_set_option(png_structrp png_ptr, int option, int onoff)
 }
 #endif
 
+#ifdef PNG_TASK_SUPPORTED
+#if PNG_THREADS_OPT > 0
+/* A system thread that runs tasks.  It is created the first time a task needs
+ * it and then kept, idle, on the png_struct's list until the png_struct is
+ * destroyed, so that a thread is not created for every task.  The list is only
+ * used by the thread that calls libpng and so needs no lock.
+ */
+typedef struct png_worker
+{
+   struct png_worker *next; /* The next idle worker */
+   png_taskp task;          /* The task to run */
+   int quit;                /* Set to make the thread return */
+#  ifdef PNG_WIN32_THREADS
+   HANDLE thread;
+   HANDLE start;            /* Set when there is a task or quit is set */
+   HANDLE done;             /* Set when the task has returned */
+#  else
+   int busy;                /* Set from when task is set until it returns */
+   pthread_t thread;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;     /* Signalled when busy or quit changes */
+#  endif
+} png_worker, *png_workerp;
+
+#ifdef PNG_WIN32_THREADS
+static DWORD WINAPI
+png_worker_thread(LPVOID argument)
+{
+   png_workerp worker = png_voidcast(png_workerp, argument);
+
+   for (;;)
+   {
+      WaitForSingleObject(worker->start, INFINITE);
+
+      if (worker->quit != 0)
+         break;
+
+      worker->task->fn(worker->task->arg);
+      SetEvent(worker->done);
+   }
+
+   return 0;
+}
+#else
+static void *
+png_worker_thread(void *argument)
+{
+   png_workerp worker = png_voidcast(png_workerp, argument);
+
+   pthread_mutex_lock(&worker->mutex);
+
+   for (;;)
+   {
+      while (worker->busy == 0 && worker->quit == 0)
+         pthread_cond_wait(&worker->cond, &worker->mutex);
+
+      if (worker->busy == 0)
+         break;
+
+      pthread_mutex_unlock(&worker->mutex);
+      worker->task->fn(worker->task->arg);
+      pthread_mutex_lock(&worker->mutex);
+
+      worker->busy = 0;
+      pthread_cond_broadcast(&worker->cond);
+   }
+
+   pthread_mutex_unlock(&worker->mutex);
+   return NULL;
+}
+#endif
+
+/* Returns an idle worker, creating one if there is none, or NULL if a thread
+ * cannot be created.
+ */
+static png_workerp
+png_worker_get(png_structrp png_ptr)
+{
+   png_workerp worker = png_voidcast(png_workerp, png_ptr->task_workers);
+
+   if (worker != NULL)
+   {
+      png_ptr->task_workers = worker->next;
+      return worker;
+   }
+
+   worker = png_voidcast(png_workerp, png_malloc_warn(png_ptr, sizeof *worker));
+
+   if (worker == NULL)
+      return NULL;
+
+   memset(worker, 0, sizeof *worker);
+
+#  ifdef PNG_WIN32_THREADS
+   worker->start = CreateEvent(NULL, FALSE, FALSE, NULL);
+   worker->done = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+   if (worker->start != NULL && worker->done != NULL)
+   {
+      worker->thread = CreateThread(NULL, 0, png_worker_thread, worker, 0,
+          NULL);
+
+      if (worker->thread != NULL)
+         return worker;
+   }
+
+   if (worker->start != NULL)
+      CloseHandle(worker->start);
+
+   if (worker->done != NULL)
+      CloseHandle(worker->done);
+#  else
+   if (pthread_mutex_init(&worker->mutex, NULL) == 0)
+   {
+      if (pthread_cond_init(&worker->cond, NULL) == 0)
+      {
+         if (pthread_create(&worker->thread, NULL, png_worker_thread,
+             worker) == 0)
+            return worker;
+
+         pthread_cond_destroy(&worker->cond);
+      }
+
+      pthread_mutex_destroy(&worker->mutex);
+   }
+#  endif
+
+   png_free(png_ptr, worker);
+   return NULL;
+}
+
+void /* PRIVATE */
+png_free_task_workers(png_structrp png_ptr)
+{
+   while (png_ptr->task_workers != NULL)
+   {
+      png_workerp worker = png_voidcast(png_workerp, png_ptr->task_workers);
+
+      png_ptr->task_workers = worker->next;
+
+#  ifdef PNG_WIN32_THREADS
+      worker->quit = 1;
+      SetEvent(worker->start);
+      WaitForSingleObject(worker->thread, INFINITE);
+      CloseHandle(worker->thread);
+      CloseHandle(worker->start);
+      CloseHandle(worker->done);
+#  else
+      pthread_mutex_lock(&worker->mutex);
+      worker->quit = 1;
+      pthread_cond_broadcast(&worker->cond);
+      pthread_mutex_unlock(&worker->mutex);
+
+      pthread_join(worker->thread, NULL);
+      pthread_cond_destroy(&worker->cond);
+      pthread_mutex_destroy(&worker->mutex);
+#  endif
+
+      png_free(png_ptr, worker);
+   }
+}
+#endif /* THREADS_OPT */
+
+void /* PRIVATE */
+png_task_start(png_structrp png_ptr, png_taskp task, png_task_fn fn,
+    png_voidp arg)
+{
+   task->fn = fn;
+   task->arg = arg;
+   task->thread = NULL;
+
+#ifdef PNG_EXECUTOR_SUPPORTED
+   task->handle = NULL;
+
+   if (png_ptr->submit_fn != NULL)
+   {
+      /* The application's executor replaces libpng's own threads; if it does
+       * not take the task the task is run here.
+       */
+      task->handle = (*png_ptr->submit_fn)(png_ptr->executor_ptr, fn, arg);
+
+      if (task->handle == NULL)
+         fn(arg);
+
+      return;
+   }
+#endif
+
+#if PNG_THREADS_OPT > 0
+   {
+      png_workerp worker = png_worker_get(png_ptr);
+
+      if (worker != NULL)
+      {
+         worker->task = task;
+         task->thread = worker;
+
+#  ifdef PNG_WIN32_THREADS
+         SetEvent(worker->start);
+#  else
+         pthread_mutex_lock(&worker->mutex);
+         worker->busy = 1;
+         pthread_cond_broadcast(&worker->cond);
+         pthread_mutex_unlock(&worker->mutex);
+#  endif
+         return;
+      }
+   }
+#endif /* THREADS_OPT */
+
+   /* There is no thread to run the task on, so run it now; the result is the
+    * same, it just takes longer.
+    */
+   PNG_UNUSED(png_ptr)
+   fn(arg);
+}
+
+void /* PRIVATE */
+png_task_finish(png_structrp png_ptr, png_taskp task)
+{
+#ifdef PNG_EXECUTOR_SUPPORTED
+   if (task->handle != NULL)
+   {
+      (*png_ptr->wait_fn)(png_ptr->executor_ptr, task->handle);
+      task->handle = NULL;
+   }
+#endif
+
+#if PNG_THREADS_OPT > 0
+   if (task->thread != NULL)
+   {
+      png_workerp worker = png_voidcast(png_workerp, task->thread);
+
+#  ifdef PNG_WIN32_THREADS
+      WaitForSingleObject(worker->done, INFINITE);
+#  else
+      pthread_mutex_lock(&worker->mutex);
+
+      while (worker->busy != 0)
+         pthread_cond_wait(&worker->cond, &worker->mutex);
+
+      pthread_mutex_unlock(&worker->mutex);
+#  endif
+
+      /* The worker is idle again. */
+      worker->task = NULL;
+      worker->next = png_voidcast(png_workerp, png_ptr->task_workers);
+      png_ptr->task_workers = worker;
+      task->thread = NULL;
+   }
+#endif /* THREADS_OPT */
+
+   PNG_UNUSED(png_ptr)
+   PNG_UNUSED(task)
+}
+
+#if PNG_THREADS_OPT > 0
+png_voidp /* PRIVATE */
+png_mutex_create(png_structrp png_ptr)
+{
+#  ifdef PNG_WIN32_THREADS
+   CRITICAL_SECTION *mutex = png_voidcast(CRITICAL_SECTION *,
+       png_malloc_warn(png_ptr, sizeof *mutex));
+
+   if (mutex != NULL)
+      InitializeCriticalSection(mutex);
+#  else
+   pthread_mutex_t *mutex = png_voidcast(pthread_mutex_t *,
+       png_malloc_warn(png_ptr, sizeof *mutex));
+
+   if (mutex != NULL && pthread_mutex_init(mutex, NULL) != 0)
+   {
+      png_free(png_ptr, mutex);
+      mutex = NULL;
+   }
+#  endif
+
+   return mutex;
+}
+
+void /* PRIVATE */
+png_mutex_lock(png_voidp mutex)
+{
+#  ifdef PNG_WIN32_THREADS
+   EnterCriticalSection(png_voidcast(CRITICAL_SECTION *, mutex));
+#  else
+   pthread_mutex_lock(png_voidcast(pthread_mutex_t *, mutex));
+#  endif
+}
+
+void /* PRIVATE */
+png_mutex_unlock(png_voidp mutex)
+{
+#  ifdef PNG_WIN32_THREADS
+   LeaveCriticalSection(png_voidcast(CRITICAL_SECTION *, mutex));
+#  else
+   pthread_mutex_unlock(png_voidcast(pthread_mutex_t *, mutex));
+#  endif
+}
+
+void /* PRIVATE */
+png_mutex_destroy(png_structrp png_ptr, png_voidp mutex)
+{
+#  ifdef PNG_WIN32_THREADS
+   DeleteCriticalSection(png_voidcast(CRITICAL_SECTION *, mutex));
+#  else
+   pthread_mutex_destroy(png_voidcast(pthread_mutex_t *, mutex));
+#  endif
+
+   png_free(png_ptr, mutex);
+}
+#endif /* THREADS_OPT */
+#endif /* TASK */
+
+#ifdef PNG_EXECUTOR_SUPPORTED
+void PNGAPI
+png_set_executor(png_structrp png_ptr, png_submit_ptr submit_fn,
+    png_wait_ptr wait_fn, png_voidp executor_ptr)
+{
+   png_debug(1, "in png_set_executor");
+
+   if ((submit_fn == NULL) != (wait_fn == NULL))
+   {
+      if (png_ptr != NULL)
+         png_app_error(png_ptr,
+             "png_set_executor: submit and wait functions must both be set");
+
+      return;
+   }
+
+   if (submit_fn == NULL)
+      executor_ptr = NULL;
+
+   if (png_ptr == NULL)
+   {
+      png_default_submit_fn = submit_fn;
+      png_default_wait_fn = wait_fn;
+      png_default_executor_ptr = executor_ptr;
+   }
+
+   else
+   {
+      png_ptr->submit_fn = submit_fn;
+      png_ptr->wait_fn = wait_fn;
+      png_ptr->executor_ptr = executor_ptr;
+   }
+}
+#endif /* EXECUTOR */
+
 /* sRGB support */
 #if defined(PNG_SIMPLIFIED_READ_SUPPORTED) ||\
    defined(PNG_SIMPLIFIED_WRITE_SUPPORTED)
@@ -775,6 +775,13 @@ typedef png_row_info * * png_row_infopp;
 typedef PNG_CALLBACK(void, *png_error_ptr, (png_structp, png_const_charp));
 typedef PNG_CALLBACK(void, *png_rw_ptr, (png_structp, png_bytep, size_t));
 typedef PNG_CALLBACK(void, *png_flush_ptr, (png_structp));
+#ifdef PNG_READ_SKIP_IDAT_SUPPORTED
+/* The 'seek' function advances the input by the given number of bytes without
+ * returning them.  It returns non-zero on success; if it returns zero the
+ * input position must be unchanged and libpng will read the data instead.
+ */
+typedef PNG_CALLBACK(int, *png_seek_ptr, (png_structp, png_uint_32));
+#endif
 typedef PNG_CALLBACK(void, *png_read_status_ptr, (png_structp, png_uint_32,
     int));
 typedef PNG_CALLBACK(void, *png_write_status_ptr, (png_structp, png_uint_32,
@@ -852,6 +859,9 @@ PNG_FUNCTION(void, (PNGCAPI *png_longjmp_ptr), PNGARG((jmp_buf, int)), typedef);
 #if INT_MAX >= 0x8000 /* else this might break */
 #define PNG_TRANSFORM_SCALE_16      0x8000      /* read only */
 #endif
+#if INT_MAX >= 0x10000
+#define PNG_TRANSFORM_CONTIGUOUS   0x10000      /* read only */
+#endif
 
 /* Flags for MNG supported features */
 #define PNG_FLAG_MNG_EMPTY_PLTE     0x01
@@ -868,6 +878,20 @@ typedef PNG_CALLBACK(png_voidp, *png_malloc_ptr, (png_structp,
     png_alloc_size_t));
 typedef PNG_CALLBACK(void, *png_free_ptr, (png_structp, png_voidp));
 
+#ifdef PNG_EXECUTOR_SUPPORTED
+/* An executor runs work for libpng.  The submit function must arrange for
+ * work(arg) to be called and return a non-NULL handle for it, or return NULL
+ * to have libpng call work(arg) itself.  The wait function is called exactly
+ * once with each non-NULL handle and must not return until the work has
+ * finished.  The first argument of both is the executor_ptr given to
+ * png_set_executor.
+ */
+typedef PNG_CALLBACK(void, *png_work_ptr, (png_voidp));
+typedef PNG_CALLBACK(png_voidp, *png_submit_ptr, (png_voidp, png_work_ptr,
+    png_voidp));
+typedef PNG_CALLBACK(void, *png_wait_ptr, (png_voidp, png_voidp));
+#endif
+
 /* Section 4: exported functions
  * Here are the function definitions most commonly used.  This is not
  * the place to find out how to use libpng.  See libpng-manual.txt for the
@@ -1367,6 +1391,30 @@ PNG_EXPORT(53, void, png_start_read_image, (png_structrp png_ptr));
 PNG_EXPORT(54, void, png_read_update_info, (png_structrp png_ptr,
     png_inforp info_ptr));
 
+#ifdef PNG_READ_DECODE_COST_SUPPORTED
+/* Estimate the resources needed to decode the image with the transforms that
+ * have been set, without starting the decode.  Call this after png_read_info
+ * (or from the progressive reader's info callback) and before
+ * png_read_update_info or png_start_read_image; the png_struct is not
+ * changed.  The memory sizes are upper bounds and saturate at the largest
+ * png_alloc_size_t.  Returns 1 on success, 0 if called at the wrong time.
+ */
+typedef struct png_decode_cost
+{
+   size_t           rowbytes;        /* Bytes in each transformed row */
+   png_alloc_size_t image_bytes;     /* The output image: rowbytes * height */
+   png_alloc_size_t row_buffers;     /* The row buffers libpng allocates */
+   png_alloc_size_t gamma_tables;    /* Gamma tables, if any are built */
+   png_alloc_size_t zlib_memory;     /* IDAT read buffer and inflate state */
+   png_alloc_size_t peak_memory;     /* The total of the above */
+   png_alloc_size_t inflate_bytes;   /* Uncompressed IDAT data */
+   png_alloc_size_t transform_bytes; /* Row bytes passed to the transforms */
+} png_decode_cost, *png_decode_costp;
+
+PNG_EXPORT(254, int, png_get_decode_cost, (png_structrp png_ptr,
+    png_const_inforp info_ptr, png_decode_costp cost));
+#endif
+
 #ifdef PNG_SEQUENTIAL_READ_SUPPORTED
 /* Read one or more rows of image data. */
 PNG_EXPORT(55, void, png_read_rows, (png_structrp png_ptr, png_bytepp row,
@@ -1384,6 +1432,25 @@ PNG_EXPORT(56, void, png_read_row, (png_structrp png_ptr, png_bytep row,
 PNG_EXPORT(57, void, png_read_image, (png_structrp png_ptr, png_bytepp image));
 #endif
 
+#ifdef PNG_READ_PIPELINE_SUPPORTED
+/* Make png_read_rows and png_read_image decompress image data ahead of the
+ * rows being unfiltered and transformed, so that the two can be done at the
+ * same time on different threads.  'rows' is the number of decompressed rows
+ * held between the two; 0, the default, turns this off.
+ */
+PNG_EXPORT(256, void, png_set_read_pipeline, (png_structrp png_ptr,
+    png_uint_32 rows));
+#endif
+
+#ifdef PNG_READ_TRANSFORM_THREADS_SUPPORTED
+/* Unfilter the rows of the pipeline as they are decompressed and divide the
+ * transformation of each batch between 'threads' tasks (at most 16).  0, the
+ * default, transforms each batch in the same task as it is unfiltered.
+ */
+PNG_EXPORT(257, void, png_set_read_transform_threads, (png_structrp png_ptr,
+    int threads));
+#endif
+
 /* Write a row of image data */
 PNG_EXPORT(58, void, png_write_row, (png_structrp png_ptr,
     png_const_bytep row));
@@ -1408,6 +1475,44 @@ PNG_EXPORT(61, void, png_write_end, (png_structrp png_ptr,
 PNG_EXPORT(62, void, png_read_end, (png_structrp png_ptr, png_inforp info_ptr));
 #endif
 
+#ifdef PNG_READ_VERIFY_SUPPORTED
+/* Check a complete PNG data stream without decoding the image: the chunk CRCs,
+ * the zlib stream (including the Adler-32 checksum), the row filter bytes, the
+ * amount of image data and, for palette images, the palette indexes.  Pixels
+ * are only unfiltered when the palette indexes must be checked; transforms are
+ * never applied.  png_read_info() is called if it has not been called already
+ * and png_read_end() is called to read the chunks after the image data.
+ *
+ * Errors do not longjmp to the application; they stop the check and are
+ * recorded in the report.  The png_struct cannot be used to read the image
+ * afterward.  The return value is 1 if nothing other than a warning was
+ * found, otherwise 0.
+ */
+#define PNG_VERIFY_MESSAGE_SIZE 64
+typedef struct png_verify_report
+{
+   png_uint_32      status;           /* PNG_VERIFY_ flags, below */
+   png_uint_32      rows;             /* Rows checked, including all passes */
+   png_alloc_size_t compressed_bytes; /* IDAT bytes read by inflate */
+   png_alloc_size_t image_bytes;      /* Bytes produced, with filter bytes */
+   int              palette_max;      /* Largest palette index, else -1 */
+   char             message[PNG_VERIFY_MESSAGE_SIZE];
+      /* The error that stopped the check, else the first warning */
+} png_verify_report, *png_verify_reportp;
+
+#define PNG_VERIFY_ERROR     0x01U /* The check stopped on an error */
+#define PNG_VERIFY_WARNING   0x02U /* Warnings or benign errors were issued */
+#define PNG_VERIFY_CRC       0x04U /* At least one chunk has a bad CRC */
+#define PNG_VERIFY_ZLIB      0x08U /* Invalid zlib stream or Adler-32 */
+#define PNG_VERIFY_FILTER    0x10U /* Invalid row filter byte */
+#define PNG_VERIFY_TOO_SHORT 0x20U /* Not enough image data */
+#define PNG_VERIFY_TOO_LONG  0x40U /* Extra image data or IDAT chunks */
+#define PNG_VERIFY_PALETTE   0x80U /* Palette index out of range */
+
+PNG_EXPORT(253, int, png_verify, (png_structrp png_ptr, png_inforp info_ptr,
+    png_verify_reportp report));
+#endif
+
 /* Free any memory associated with the png_info_struct */
 PNG_EXPORT(63, void, png_destroy_info_struct, (png_const_structrp png_ptr,
     png_infopp info_ptr_ptr));
@@ -1481,7 +1586,17 @@ PNG_EXPORT(67, void, png_set_filter, (png_structrp png_ptr, int method,
 #define PNG_FILTER_VALUE_LAST  5
 
 #ifdef PNG_WRITE_SUPPORTED
-#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED /* DEPRECATED */
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+/* Choose how png_write_row compares the filters allowed by png_set_filter.
+ * The UNWEIGHTED (default) method picks the filter with the smallest sum of
+ * absolute differences.  WEIGHTED multiplies each sum by the cost of the
+ * filter and, for each of the last 'num_weights' rows that used the same
+ * filter, by the weight for that row; weights below 1.0 favor keeping the
+ * same filter.  ENTROPY picks the filter that leaves the filtered bytes with
+ * the lowest entropy.  ZLIB deflates the best few candidates after the data
+ * written before them and picks the shortest; this is much slower.  The
+ * weights and costs are only used by WEIGHTED; negative values mean 1.0.
+ */
 PNG_FP_EXPORT(68, void, png_set_filter_heuristics, (png_structrp png_ptr,
     int heuristic_method, int num_weights, png_const_doublep filter_weights,
     png_const_doublep filter_costs))
@@ -1491,11 +1606,13 @@ PNG_FIXED_EXPORT(209, void, png_set_filter_heuristics_fixed,
     png_const_fixed_point_p filter_costs))
 #endif /* WRITE_WEIGHTED_FILTER */
 
-/* The following are no longer used and will be removed from libpng-1.7: */
+/* Heuristic used for row filter selection: */
 #define PNG_FILTER_HEURISTIC_DEFAULT    0  /* Currently "UNWEIGHTED" */
-#define PNG_FILTER_HEURISTIC_UNWEIGHTED 1  /* Used by libpng < 0.95 */
-#define PNG_FILTER_HEURISTIC_WEIGHTED   2  /* Experimental feature */
-#define PNG_FILTER_HEURISTIC_LAST       3  /* Not a valid value */
+#define PNG_FILTER_HEURISTIC_UNWEIGHTED 1  /* Sum of absolute differences */
+#define PNG_FILTER_HEURISTIC_WEIGHTED   2  /* Weighted by filter history */
+#define PNG_FILTER_HEURISTIC_ENTROPY    3  /* Entropy of the filtered bytes */
+#define PNG_FILTER_HEURISTIC_ZLIB       4  /* Trial compression */
+#define PNG_FILTER_HEURISTIC_LAST       5  /* Not a valid value */
 
 /* Set the library compression level.  Currently, valid values range from
  * 0 - 9, corresponding directly to the zlib compression levels 0 - 9
@@ -1504,6 +1621,30 @@ PNG_FIXED_EXPORT(209, void, png_set_filter_heuristics_fixed,
  * for PNG images, and do considerably fewer caclulations.  In the future,
  * these values may not correspond directly to the zlib compression levels.
  */
+#ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+/* This level does not use zlib for the image data.  Runs of the same byte are
+ * the only matches and each block gets Huffman codes of its own, which is about
+ * three times as fast as zlib level 1 and usually compresses filtered images
+ * within 10%.  Unless png_set_filter is called the SUB filter is used for
+ * every row.  The other zlib settings are ignored for the image data.
+ */
+#  define PNG_COMPRESSION_LEVEL_FASTEST (-2)
+#endif
+
+#ifdef PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED
+/* This level does not use zlib for the image data either.  The data is kept
+ * until the end of the image, then the cheapest sequence of literals and
+ * matches is searched for again and again and the blocks are split where new
+ * Huffman codes pay for themselves.  That is usually about 10% smaller than
+ * level 9 with the same filters but several times slower.  Each filter
+ * png_set_filter allows is also tried alone on every row and the smallest
+ * result is kept; png_set_compression_threads runs that many trials at once.
+ * This is for files written once and read many times.  png_write_flush has no
+ * effect on the image data.
+ */
+#  define PNG_COMPRESSION_LEVEL_OPTIMAL (-3)
+#endif
+
 #ifdef PNG_WRITE_CUSTOMIZE_COMPRESSION_SUPPORTED
 PNG_EXPORT(69, void, png_set_compression_level, (png_structrp png_ptr,
     int level));
@@ -1544,6 +1685,85 @@ PNG_EXPORT(225, void, png_set_text_compression_window_bits,
 PNG_EXPORT(226, void, png_set_text_compression_method, (png_structrp png_ptr,
     int method));
 #endif /* WRITE_CUSTOMIZE_ZTXT_COMPRESSION */
+
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+/* Deflate the image data on up to 'threads' threads at once, in blocks of
+ * 'block_size' bytes (0 for the default).  Each block is compressed with the
+ * 32K of data before it as a dictionary, so the output is a single standard
+ * zlib stream only slightly bigger than it would be otherwise.  0 or 1 turns
+ * this off; images no bigger than one block are always compressed serially.
+ */
+PNG_EXPORT(268, void, png_set_compression_threads, (png_structrp png_ptr,
+    int threads, png_alloc_size_t block_size));
+#endif
+
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+/* Choose the filters for the rows of a non-interlaced image and filter them in
+ * batches of 'rows' rows on other threads while the rows before them are
+ * compressed.  'threads' divides each batch between that many tasks (0 for
+ * one).  0 rows turns this off.  The output is the same either way.
+ */
+PNG_EXPORT(269, void, png_set_write_pipeline, (png_structrp png_ptr,
+    png_uint_32 rows, int threads));
+#endif
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+/* A frame cache speeds up writing a sequence of images that are mostly the
+ * same, such as the frames of a screen.  Give it to the png_struct of each
+ * image with png_set_frame_cache before the image data is written.  It keeps
+ * the filtered image data and the zlib data of the last image with copies of
+ * the deflate stream made at row boundaries.  While the rows of the next image
+ * are the same nothing is deflated; at the first change the zlib data up to
+ * the last copy before it is written from the cache and deflate carries on
+ * from the copy, so only the rest of the image is compressed again.  The rows
+ * are still filtered.  The file is the same as it would be without the cache.
+ *
+ * The cache is only used where zlib deflates the image data, so not with
+ * PNG_COMPRESSION_LEVEL_FASTEST or PNG_COMPRESSION_LEVEL_OPTIMAL or
+ * png_set_compression_threads, and the last image is only reused if it was
+ * written with the same zlib settings.  It holds up to 16 copies of the deflate
+ * state (over 256K each with the default settings).  It is allocated with
+ * malloc, not the png_struct memory functions, because it outlives the
+ * png_struct, and must not be used by two png_structs at once.
+ * png_create_frame_cache returns NULL if there is not enough memory.
+ */
+typedef struct png_frame_cache png_frame_cache;
+typedef png_frame_cache * png_frame_cachep;
+
+PNG_EXPORTA(271, png_frame_cachep, png_create_frame_cache, (void),
+    PNG_ALLOCATED);
+PNG_EXPORT(272, void, png_destroy_frame_cache, (png_frame_cachep *cache_ptr));
+PNG_EXPORT(273, void, png_set_frame_cache, (png_structrp png_ptr,
+    png_frame_cachep cache));
+#endif
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+/* Set the compression level, zlib window and memory level and filter heuristic
+ * for the image data at once, for a given balance of speed against size.  The
+ * filters and zlib strategy depend on the pixel format and are chosen when the
+ * IHDR is written unless png_set_filter or png_set_compression_strategy has
+ * been called.  Any of the other settings can be changed afterwards.
+ *
+ * PNG_ENCODE_PRESET_AUTO holds back the image data of the first rows (at most
+ * 256K) and measures how much of the image is flat, how many colors it has and
+ * how much it varies, then chooses no filtering for synthetic images such as
+ * screenshots and diagrams, or the filters and a strategy that suit the noise
+ * in photographic ones.  Rows are not pipelined while it chooses the filters.
+ */
+PNG_EXPORT(270, void, png_set_encode_preset, (png_structrp png_ptr,
+    int preset));
+#endif
+
+#define PNG_ENCODE_PRESET_DEFAULT          0 /* png_create_write_struct's */
+#define PNG_ENCODE_PRESET_FASTEST          1 /* PNG_COMPRESSION_LEVEL_FASTEST */
+#define PNG_ENCODE_PRESET_HIGH_SPEED       2 /* zlib's fastest levels */
+#define PNG_ENCODE_PRESET_BALANCED         3 /* one filter, level 6 */
+#define PNG_ENCODE_PRESET_HIGH_COMPRESSION 4 /* trial compression, level 9 */
+#define PNG_ENCODE_PRESET_HIGH_READ_SPEED  5 /* quick to decode */
+#define PNG_ENCODE_PRESET_LOW_MEMORY       6 /* a 4K window */
+#define PNG_ENCODE_PRESET_OPTIMAL          7 /* PNG_COMPRESSION_LEVEL_OPTIMAL */
+#define PNG_ENCODE_PRESET_AUTO             8 /* chosen from the first rows */
+#define PNG_ENCODE_PRESET_LAST             9 /* Not a valid value */
 #endif /* WRITE */
 
 /* These next functions are called for input/output, memory, and error
@@ -1591,6 +1811,36 @@ PNG_EXPORT(77, void, png_set_write_fn, (png_structrp png_ptr, png_voidp io_ptr,
 PNG_EXPORT(78, void, png_set_read_fn, (png_structrp png_ptr, png_voidp io_ptr,
     png_rw_ptr read_data_fn));
 
+#ifdef PNG_READ_SKIP_IDAT_SUPPORTED
+/* Replace the function used to skip forward over unwanted input.  The default
+ * uses fseek() when the default (stdio) read function is in use, otherwise
+ * there is no seek function and skipped data is read and discarded.  Call this
+ * after png_set_read_fn(), which resets the seek function.
+ */
+PNG_EXPORT(250, void, png_set_read_seek_fn, (png_structrp png_ptr,
+    png_seek_ptr seek_fn));
+
+/* Make png_read_end() skip any image data that has not been read instead of
+ * decompressing it.  This is for applications that call png_read_end()
+ * directly after png_read_info() to obtain the chunks after the image data.
+ */
+#define PNG_SKIP_IDAT_OFF        0 /* Default: decompress remaining IDAT data */
+#define PNG_SKIP_IDAT_CHECK_CRC  1 /* Read, but do not decompress, IDAT data */
+#define PNG_SKIP_IDAT_IGNORE_CRC 2 /* Seek over IDAT data; the CRC is ignored */
+PNG_EXPORT(251, void, png_set_skip_IDAT, (png_structrp png_ptr, int mode));
+#endif
+
+#ifdef PNG_READ_COPY_IDAT_SUPPORTED
+/* Make png_read_end() copy the IDAT chunks it skips to 'write_ptr', which must
+ * be writing a PNG with the same IHDR and must have completed png_write_info()
+ * but not written any rows.  The compressed data is not changed.  After
+ * png_read_end() call png_write_end() on 'write_ptr' to complete the new PNG.
+ * Pass NULL to cancel the copy.
+ */
+PNG_EXPORT(252, void, png_set_copy_IDAT, (png_structrp png_ptr,
+    png_structrp write_ptr));
+#endif
+
 /* Return the user pointer associated with the I/O functions */
 PNG_EXPORT(79, png_voidp, png_get_io_ptr, (png_const_structrp png_ptr));
 
@@ -1608,6 +1858,17 @@ PNG_EXPORT(82, void, png_set_mem_fn, (png_structrp png_ptr, png_voidp mem_ptr,
 PNG_EXPORT(83, png_voidp, png_get_mem_ptr, (png_const_structrp png_ptr));
 #endif
 
+#ifdef PNG_EXECUTOR_SUPPORTED
+/* Run the work libpng does in parallel with the given functions instead of on
+ * threads libpng creates.  NULL functions restore the default.  With a NULL
+ * png_ptr this sets the executor given to every png_struct created afterward,
+ * including those used internally by png_image_read_batch; this must not be
+ * done while any other thread is using libpng.
+ */
+PNG_EXPORT(259, void, png_set_executor, (png_structrp png_ptr,
+    png_submit_ptr submit_fn, png_wait_ptr wait_fn, png_voidp executor_ptr));
+#endif
+
 #ifdef PNG_READ_USER_TRANSFORM_SUPPORTED
 PNG_EXPORT(84, void, png_set_read_user_transform_fn, (png_structrp png_ptr,
     png_user_transform_ptr read_user_transform_fn));
@@ -2321,6 +2582,18 @@ PNG_EXPORT(177, void, png_set_invalid, (png_const_structrp png_ptr,
 PNG_EXPORT(178, void, png_read_png, (png_structrp png_ptr, png_inforp info_ptr,
     int transforms, png_voidp params));
 #endif
+#ifdef PNG_READ_CONTIGUOUS_SUPPORTED
+/* With PNG_TRANSFORM_CONTIGUOUS png_read_png allocates the image as a single
+ * block; row_stride is the number of bytes from one row to the next, or 0 for
+ * the row bytes rounded up to a multiple of 'alignment'.  The block is
+ * aligned to 'alignment' bytes, a power of 2, or PNG_IMAGE_ROW_ALIGNMENT if it
+ * is 0.  The rows from png_get_rows index into the block, which png_free_data
+ * frees along with the rows.  png_data_freer(PNG_USER_WILL_FREE_DATA) with
+ * PNG_FREE_ROWS copies the rows out of the block to separate allocations.
+ */
+PNG_EXPORT(267, void, png_set_image_layout, (png_structrp png_ptr,
+    size_t row_stride, unsigned int alignment));
+#endif
 #ifdef PNG_WRITE_SUPPORTED
 PNG_EXPORT(179, void, png_write_png, (png_structrp png_ptr, png_inforp info_ptr,
     int transforms, png_voidp params));
@@ -2376,6 +2649,21 @@ PNG_EXPORT(192, png_alloc_size_t, png_get_chunk_malloc_max,
     (png_const_structrp png_ptr));
 #endif
 
+#ifdef PNG_INFLATE_LIMITS_SUPPORTED
+/* Limit the decompression done while reading, to stop "decompression bombs"
+ * early.  ratio_max limits the ratio of decompressed to compressed bytes in
+ * each zlib stream once the stream has produced 64KB, inflate_max limits the
+ * total bytes decompressed and work_max the total bytes consumed plus bytes
+ * produced by inflate, a measure of the time spent in it.  The totals cover
+ * all of the zlib streams (IDAT, iCCP, zTXt and iTXt) read by the png_struct.
+ * 0 means no limit, the default.  A stream that exceeds a limit is treated as
+ * damaged: this is an error in IDAT, otherwise the chunk is discarded.
+ */
+PNG_EXPORT(255, void, png_set_inflate_limits, (png_structrp png_ptr,
+    png_uint_32 ratio_max, png_alloc_size_t inflate_max,
+    png_alloc_size_t work_max));
+#endif
+
 #if defined(PNG_INCH_CONVERSIONS_SUPPORTED)
 PNG_EXPORT(193, png_uint_32, png_get_pixels_per_inch,
     (png_const_structrp png_ptr, png_const_inforp info_ptr));
@@ -2922,6 +3210,19 @@ typedef struct
     * the row stride is the minimum stride required for the image.
     */
 
+#define PNG_IMAGE_ROW_STRIDE_LARGE(image)\
+   ((png_ptrdiff_t)PNG_IMAGE_PIXEL_CHANNELS((image).format) *\
+   (png_ptrdiff_t)(image).width)
+#define PNG_IMAGE_BUFFER_SIZE_LARGE(image, row_stride)\
+   ((png_alloc_size_t)PNG_IMAGE_PIXEL_COMPONENT_SIZE((image).format) *\
+   (image).height * (png_alloc_size_t)(row_stride))
+#define PNG_IMAGE_SIZE_LARGE(image)\
+   PNG_IMAGE_BUFFER_SIZE_LARGE(image, PNG_IMAGE_ROW_STRIDE_LARGE(image))
+   /* Versions of the above three macros for use with the _large APIs below;
+    * they do the arithmetic in png_ptrdiff_t and png_alloc_size_t so they do
+    * not overflow for images that fit in the address space.
+    */
+
 #define PNG_IMAGE_COLORMAP_SIZE(image)\
    (PNG_IMAGE_SAMPLE_SIZE((image).format) * (image).colormap_entries)
    /* Return the size, in bytes, of the color-map of this image.  If the image
@@ -2969,6 +3270,49 @@ typedef struct
     * because that call initializes the 'flags' field.
     */
 
+#define PNG_IMAGE_FLAG_THREADS 0x08
+   /* On read use the pipelined reader with the transformations divided between
+    * several threads (see png_set_read_transform_threads) where libpng does the
+    * whole conversion; this can be faster for large images on machines with
+    * more than one core.  As with the previous flag this must be set after the
+    * png_image_begin_read_ call.  It is ignored for interlaced images and
+    * where libpng has not been built with PNG_READ_TRANSFORM_THREADS_SUPPORTED;
+    * the result is the same either way.  It has no effect on write.
+    */
+
+#define PNG_IMAGE_FLAG_FASTEST 0x10
+   /* On write use PNG_COMPRESSION_LEVEL_FASTEST (see png_set_compression_level)
+    * where libpng has been built with PNG_WRITE_FAST_ENCODER_SUPPORTED,
+    * otherwise this is the same as PNG_IMAGE_FLAG_FAST.  The file is bigger
+    * than with PNG_IMAGE_FLAG_FAST but it is written much faster.  It has no
+    * effect on read.
+    */
+
+#define PNG_IMAGE_FLAG_ENCODE_PRESET(preset) ((png_uint_32)(preset) << 8)
+#define PNG_IMAGE_FLAG_ENCODE_PRESET_MASK 0xf00
+   /* On write use png_set_encode_preset with one of the PNG_ENCODE_PRESET_
+    * values, where libpng has been built with
+    * PNG_WRITE_ENCODE_PRESET_SUPPORTED.  This is applied after
+    * PNG_IMAGE_FLAG_FAST or PNG_IMAGE_FLAG_FASTEST, so it overrides them.  It
+    * has no effect on read.
+    */
+
+#define PNG_IMAGE_FLAG_REDUCE 0x20
+   /* On write examine the image first and write it in the smallest PNG color
+    * type and bit depth that holds it without loss: the alpha channel is
+    * dropped if every pixel is opaque, the color channels if every pixel is
+    * gray, 16-bit samples become 8-bit if both bytes of every sample are equal
+    * and images with 256 or fewer colors are written with a palette (and tRNS
+    * for the transparent entries) or as 1, 2 or 4-bit gray.  The data read
+    * back with the same format is the same.  This costs one extra pass over
+    * the image and only applies to a buffer given to png_image_write_to_memory,
+    * png_image_write_to_file or png_image_write_to_stdio (or their _large
+    * forms) where convert_to_8bit is 0 and the format is not color-mapped;
+    * 16-bit images with alpha are only reduced if they are opaque.  It is
+    * ignored where libpng has not been built with
+    * PNG_SIMPLIFIED_WRITE_REDUCE_SUPPORTED and has no effect on read.
+    */
+
 #ifdef PNG_SIMPLIFIED_READ_SUPPORTED
 /* READ APIs
  * ---------
@@ -3027,10 +3371,97 @@ PNG_EXPORT(237, int, png_image_finish_read, (png_imagep image,
     * written to the colormap; this may be less than the original value.
     */
 
+PNG_EXPORT(263, int, png_image_finish_read_large, (png_imagep image,
+   png_const_colorp background, void *buffer, png_ptrdiff_t row_stride,
+   void *colormap));
+   /* As png_image_finish_read but row_stride is a png_ptrdiff_t.
+    * png_image_finish_read limits the stride to 31 bits and the size of the
+    * buffer to 32 bits, for compatibility with PNG_IMAGE_BUFFER_SIZE; this
+    * function only requires the buffer, PNG_IMAGE_BUFFER_SIZE_LARGE bytes, to
+    * fit in the address space, so images bigger than 4GByte can be read on
+    * 64-bit systems.
+    */
+
+#ifdef PNG_SIMPLIFIED_READ_ROWS_SUPPORTED
+typedef int (*png_image_rows_ptr)(png_imagep image, void *user_ptr,
+   png_uint_32 y, png_uint_32 count, const void *rows);
+   /* Called by png_image_finish_read_rows with 'count' rows of the image
+    * starting at row 'y' (from the top.)  The rows are in the format
+    * png_image_finish_read would produce and are PNG_IMAGE_ROW_STRIDE(*image)
+    * components apart; they must be copied before returning.  Return 0 to stop
+    * reading, which is then reported as an error.
+    */
+
+PNG_EXPORT(260, int, png_image_finish_read_rows, (png_imagep image,
+   png_const_colorp background, png_image_rows_ptr row_fn, void *user_ptr,
+   png_uint_32 rows_per_batch, void *colormap));
+   /* As png_image_finish_read but the image is passed to row_fn, from the top
+    * down, in batches of rows_per_batch rows (the last may be shorter) so that
+    * the whole image need not be in memory.  An interlaced image is only
+    * complete when all of it has been read, so libpng holds the whole image
+    * and passes it to row_fn at the end.  Where png_image_finish_read would
+    * compose onto the buffer the rows are composed onto black.
+    */
+#endif /* SIMPLIFIED_READ_ROWS */
+
 PNG_EXPORT(238, void, png_image_free, (png_imagep image));
    /* Free any data allocated by libpng in image->opaque, setting the pointer to
     * NULL.  May be called at any time after the structure is initialized.
     */
+
+#ifdef PNG_SIMPLIFIED_READ_BATCH_SUPPORTED
+/* Reading many images at once.  Each job describes one PNG, either a file or
+ * a PNG in memory, and what to convert it to.  png_image_read_batch reads the
+ * jobs on several threads, a job at a time; a thread that runs out of jobs
+ * takes half of the remaining jobs of the busiest thread.  Each thread keeps
+ * the memory freed by one image for the next, so after the first few images
+ * most of the allocations are avoided.
+ */
+typedef struct png_batch_job
+{
+   /* Set by the application: */
+   const char     *file_name;  /* The file to read if memory is NULL */
+   png_const_voidp memory;     /* The PNG in memory */
+   size_t          size;       /* Bytes at memory */
+   png_uint_32     format;     /* The PNG_FORMAT_ to read the image in */
+   png_uint_32     flags;      /* PNG_IMAGE_FLAG_ values to add */
+   png_const_colorp background;  /* As png_image_finish_read */
+   void           *buffer;     /* Where to read the image, see below */
+   png_int_32      row_stride; /* As png_image_finish_read */
+   void           *colormap;   /* As png_image_finish_read */
+   void           *user_ptr;   /* For the application's use */
+
+   /* Set by png_image_read_batch: */
+   png_image       image;      /* Describes the image, or the error */
+   int             result;     /* Result of png_image_finish_read */
+} png_batch_job;
+
+typedef struct png_batch_options
+{
+   int threads;                /* Threads to use, 0 for the default */
+
+   /* If not NULL this is called, on any of the threads, once the header of the
+    * image has been read and job->image describes the PNG, as it would after
+    * png_image_begin_read_from_file.  The function may change job->format and
+    * job->flags and must set job->buffer (and job->colormap and
+    * job->row_stride as required.)  Return 0 to skip the image, which is then
+    * reported as an error.  If it is NULL job->buffer must already be large
+    * enough for the image.
+    */
+   int (*allocate)(png_batch_job *job);
+} png_batch_options;
+
+PNG_EXPORT(258, int, png_image_read_batch, (png_batch_job *jobs, size_t n,
+   const png_batch_options *options));
+   /* Read the 'n' jobs, returning non-zero if all were read successfully.  The
+    * result of each is in job->result and job->image as if it had been read
+    * with png_image_begin_read_from_file or png_image_begin_read_from_memory
+    * and png_image_finish_read.  options may be NULL.  Without thread support
+    * (PNG_THREADS_OPT) the jobs are read one after another on the calling
+    * thread unless png_set_executor(NULL, ...) has given an executor to run
+    * the workers, which then do not share their jobs.
+    */
+#endif /* SIMPLIFIED_READ_BATCH */
 #endif /* SIMPLIFIED_READ */
 
 #ifdef PNG_SIMPLIFIED_WRITE_SUPPORTED
@@ -3122,6 +3553,90 @@ PNG_EXPORT(245, int, png_image_write_to_memory, (png_imagep image, void *memory,
     * set to zero and the write failed and probably will fail if tried again.
     */
 
+PNG_EXPORT(264, int, png_image_write_to_memory_large, (png_imagep image,
+   void *memory, png_alloc_size_t * PNG_RESTRICT memory_bytes,
+   int convert_to_8_bit, const void *buffer, png_ptrdiff_t row_stride,
+   const void *colormap));
+#ifdef PNG_SIMPLIFIED_WRITE_STDIO_SUPPORTED
+PNG_EXPORT(265, int, png_image_write_to_file_large, (png_imagep image,
+   const char *file, int convert_to_8bit, const void *buffer,
+   png_ptrdiff_t row_stride, const void *colormap));
+PNG_EXPORT(266, int, png_image_write_to_stdio_large, (png_imagep image,
+   FILE *file, int convert_to_8_bit, const void *buffer,
+   png_ptrdiff_t row_stride, const void *colormap));
+#endif /* SIMPLIFIED_WRITE_STDIO */
+   /* As the functions without _large but with a png_ptrdiff_t row_stride; as
+    * with png_image_finish_read_large the buffer need only fit in the address
+    * space.
+    */
+
+typedef void *(*png_image_realloc_ptr)(void *user_ptr, void *memory,
+   png_alloc_size_t size);
+   /* Called by png_image_write_to_memory_realloc to resize 'memory' (NULL for
+    * the first allocation) to 'size' bytes, as realloc.  Return NULL if there
+    * is not enough memory; 'memory' must then be left unchanged.
+    */
+
+PNG_EXPORT(274, int, png_image_write_to_memory_realloc, (png_imagep image,
+   void **memory, png_alloc_size_t * PNG_RESTRICT memory_bytes,
+   png_image_realloc_ptr realloc_fn, void *user_ptr, int convert_to_8_bit,
+   const void *buffer, png_ptrdiff_t row_stride, const void *colormap));
+   /* As png_image_write_to_memory_large but the image is written in one pass
+    * into *memory, which is grown with realloc_fn as the PNG data is written,
+    * rather than written twice to find the size first.  On entry *memory is
+    * NULL or points to *memory_bytes bytes that realloc_fn can resize; a
+    * buffer allocated up front from an estimate of the size (such as a
+    * fraction of PNG_IMAGE_PNG_SIZE_MAX) is only resized if the estimate is
+    * too small.  The buffer is grown by doubling, up to PNG_IMAGE_PNG_SIZE_MAX.
+    * If realloc_fn is NULL the C library realloc is used.
+    *
+    * On success *memory points to the PNG data and *memory_bytes is its length;
+    * the buffer may be bigger, as last resized by realloc_fn.  On failure
+    * *memory_bytes is 0.  In either case *memory is the buffer (or NULL) which
+    * the caller must free with the allocator that matches realloc_fn.
+    *
+    * When realloc_fn is NULL that is the realloc of the C library libpng was
+    * built with, which need not be the caller's (for example when libpng is a
+    * Windows DLL), so any buffer passed in must come from
+    * png_image_realloc_memory and the result must be freed with
+    * png_image_free_memory.  Pass a realloc_fn to use another allocator.
+    */
+
+PNG_EXPORT(275, void *, png_image_realloc_memory, (void *memory,
+   png_alloc_size_t size));
+PNG_EXPORT(276, void, png_image_free_memory, (void *memory));
+   /* realloc and free from the C library used by libpng, for the buffers of
+    * png_image_write_to_memory_realloc when realloc_fn is NULL.
+    */
+
+#ifdef PNG_SIMPLIFIED_WRITE_ROWS_SUPPORTED
+typedef const void *(*png_image_row_source_ptr)(png_imagep image,
+   void *user_ptr, png_uint_32 y);
+   /* Called by png_image_write_rows_to_* for each row of the image, in order
+    * from the top, to get row 'y' in the format given by image->format.  The
+    * row must remain valid until the next call.  Return NULL to stop writing,
+    * which is then reported as an error.
+    */
+
+PNG_EXPORT(261, int, png_image_write_rows_to_memory, (png_imagep image,
+   void *memory, png_alloc_size_t * PNG_RESTRICT memory_bytes,
+   int convert_to_8_bit, png_image_row_source_ptr row_fn, void *user_ptr,
+   const void *colormap));
+   /* As png_image_write_to_memory but the rows are obtained one at a time from
+    * row_fn, so the image need never be in memory all at once; only a row of
+    * the image is held by libpng.  row_fn is called again for each row if the
+    * function is called again, for example after finding the size with a NULL
+    * 'memory'.
+    */
+
+#ifdef PNG_SIMPLIFIED_WRITE_STDIO_SUPPORTED
+PNG_EXPORT(262, int, png_image_write_rows_to_stdio, (png_imagep image,
+   FILE *file, int convert_to_8_bit, png_image_row_source_ptr row_fn,
+   void *user_ptr, const void *colormap));
+   /* As png_image_write_to_stdio with the rows from row_fn. */
+#endif /* SIMPLIFIED_WRITE_STDIO */
+#endif /* SIMPLIFIED_WRITE_ROWS */
+
 /* You can pre-allocate the buffer by making sure it is of sufficient size
  * regardless of the amount of compression achieved.  The buffer size will
  * always be bigger than the original image and it will never be filled.  The
@@ -3235,7 +3750,7 @@ PNG_EXPORT(244, int, png_set_option, (png_structrp png_ptr, int option,
  * one to use is one more than this.)
  */
 #ifdef PNG_EXPORT_LAST_ORDINAL
-  PNG_EXPORT_LAST_ORDINAL(249);
+  PNG_EXPORT_LAST_ORDINAL(276);
 #endif
 
 #ifdef __cplusplus
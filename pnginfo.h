@@ -52,6 +52,23 @@
 #ifndef PNGINFO_H
 #define PNGINFO_H
 
+#ifdef PNG_TEXT_SUPPORTED
+/* The strings of the text chunks are carved out of a list of blocks so that a
+ * file with many text chunks does not need an allocation for each.  Each new
+ * block is at least as big as all the blocks before it together, so the list
+ * stays short; 'next' is the previous block and 'total' the size of this block
+ * plus all those before it.
+ */
+typedef struct png_text_block
+{
+   struct png_text_block *next;
+   size_t                 total;
+   size_t                 size;    /* bytes in data */
+   size_t                 used;    /* bytes of data handed out */
+   png_byte               data[1]; /* actually size */
+} png_text_block, *png_text_blockp;
+#endif
+
 struct png_info_def
 {
    /* The following are necessary for every PNG file */
@@ -120,6 +137,7 @@ struct png_info_def
    int num_text; /* number of comments read or comments to write */
    int max_text; /* current size of text array */
    png_textp text; /* array of comments read or comments to write */
+   png_text_blockp text_pool; /* storage for the strings of text */
 #endif /* TEXT */
 
 #ifdef PNG_tIME_SUPPORTED
@@ -235,12 +253,14 @@ defined(PNG_READ_BACKGROUND_SUPPORTED)
     * png_struct::user_chunk_cache_max, else overflow can occur.
     */
    int                unknown_chunks_num;
+   int                unknown_chunks_max; /* allocated size of the array */
 #endif
 
 #ifdef PNG_sPLT_SUPPORTED
    /* Data on sPLT chunks (there may be more than one). */
    png_sPLT_tp splt_palettes;
    int         splt_palettes_num; /* Match type returned by png_get API */
+   int         splt_palettes_max; /* allocated size of the array */
 #endif
 
 #ifdef PNG_sCAL_SUPPORTED
@@ -261,6 +281,9 @@ defined(PNG_READ_BACKGROUND_SUPPORTED)
       non-zero */
    /* Data valid if (valid & PNG_INFO_IDAT) non-zero */
    png_bytepp row_pointers;        /* the image bits */
+#ifdef PNG_READ_CONTIGUOUS_SUPPORTED
+   png_voidp row_block;            /* all the rows, if allocated together */
+#endif
 #endif
 
 };
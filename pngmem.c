@@ -26,6 +26,10 @@ png_destroy_png_struct(png_structrp png_ptr)
 {
    if (png_ptr != NULL)
    {
+#     if defined(PNG_TASK_SUPPORTED) && PNG_THREADS_OPT > 0
+         png_free_task_workers(png_ptr);
+#     endif
+
       /* png_free might call png_error and may certainly call
        * png_get_mem_ptr, so fake a temporary png_struct to support this.
        */
@@ -162,6 +166,58 @@ png_realloc_array,(png_const_structrp png_ptr, png_const_voidp old_array,
 
    return NULL; /* error */
 }
+
+png_voidp /* PRIVATE */
+png_grow_array(png_const_structrp png_ptr, png_voidp array, int num_elements,
+    int *max_elements, int add_elements, size_t element_size)
+{
+   int max = *max_elements;
+
+   if (add_elements <= 0 || num_elements < 0 ||
+      (array != NULL && num_elements > max) ||
+      (array == NULL && num_elements > 0))
+      png_error(png_ptr, "internal error: array grow");
+
+   if (array != NULL && add_elements <= max - num_elements)
+      return array;
+
+   if (add_elements <= INT_MAX - num_elements)
+   {
+      int need = num_elements + add_elements;
+      png_voidp new_array;
+
+      /* Double the array, so that adding elements one at a time takes time
+       * linear in the total, but fall back to what is needed if the larger
+       * allocation fails.
+       */
+      max = num_elements <= INT_MAX/2 ? 2*num_elements : INT_MAX;
+
+      if (max < 8)
+         max = 8;
+
+      if (max < need)
+         max = need;
+
+      new_array = png_realloc_array(png_ptr, array, num_elements,
+          max - num_elements, element_size);
+
+      if (new_array == NULL && max > need)
+      {
+         max = need;
+         new_array = png_realloc_array(png_ptr, array, num_elements,
+             max - num_elements, element_size);
+      }
+
+      if (new_array != NULL)
+      {
+         png_free(png_ptr, array);
+         *max_elements = max;
+         return new_array;
+      }
+   }
+
+   return NULL; /* error */
+}
 #endif /* TEXT || sPLT || STORE_UNKNOWN_CHUNKS */
 
 /* Various functions that have different error handling are derived from this.
@@ -264,10 +264,10 @@ png_push_read_chunk(png_structrp png_ptr, png_inforp info_ptr)
       png_ptr->idat_size = png_ptr->push_length;
       png_ptr->process_mode = PNG_READ_IDAT_MODE;
       png_push_have_info(png_ptr, info_ptr);
-      png_ptr->zstream.avail_out =
+      png_ptr->zstream->avail_out =
           (uInt) PNG_ROWBYTES(png_ptr->pixel_depth,
           png_ptr->iwidth) + 1;
-      png_ptr->zstream.next_out = png_ptr->row_buf;
+      png_ptr->zstream->next_out = png_ptr->row_buf;
       return;
    }
 
@@ -635,14 +635,14 @@ png_process_IDAT_data(png_structrp png_ptr, png_bytep buffer,
     * before returning, calling the row callback as required to
     * handle the uncompressed results.
     */
-   png_ptr->zstream.next_in = buffer;
+   png_ptr->zstream->next_in = buffer;
    /* TODO: WARNING: TRUNCATION ERROR: DANGER WILL ROBINSON: */
-   png_ptr->zstream.avail_in = (uInt)buffer_length;
+   png_ptr->zstream->avail_in = (uInt)buffer_length;
 
    /* Keep going until the decompressed data is all processed
     * or the stream marked as finished.
     */
-   while (png_ptr->zstream.avail_in > 0 &&
+   while (png_ptr->zstream->avail_in > 0 &&
       (png_ptr->flags & PNG_FLAG_ZSTREAM_ENDED) == 0)
    {
       int ret;
@@ -652,13 +652,13 @@ png_process_IDAT_data(png_structrp png_ptr, png_bytep buffer,
        * if we don't expect any results -- it may be the input
        * data is just the LZ end code.
        */
-      if (!(png_ptr->zstream.avail_out > 0))
+      if (!(png_ptr->zstream->avail_out > 0))
       {
          /* TODO: WARNING: TRUNCATION ERROR: DANGER WILL ROBINSON: */
-         png_ptr->zstream.avail_out = (uInt)(PNG_ROWBYTES(png_ptr->pixel_depth,
+         png_ptr->zstream->avail_out = (uInt)(PNG_ROWBYTES(png_ptr->pixel_depth,
              png_ptr->iwidth) + 1);
 
-         png_ptr->zstream.next_out = png_ptr->row_buf;
+         png_ptr->zstream->next_out = png_ptr->row_buf;
       }
 
       /* Using Z_SYNC_FLUSH here means that an unterminated
@@ -697,7 +697,7 @@ png_process_IDAT_data(png_structrp png_ptr, png_bytep buffer,
       }
 
       /* Did inflate output any data? */
-      if (png_ptr->zstream.next_out != png_ptr->row_buf)
+      if (png_ptr->zstream->next_out != png_ptr->row_buf)
       {
          /* Is this unexpected data after the last row?
           * If it is, artificially terminate the LZ output
@@ -718,7 +718,7 @@ png_process_IDAT_data(png_structrp png_ptr, png_bytep buffer,
          }
 
          /* Do we have a complete row? */
-         if (png_ptr->zstream.avail_out == 0)
+         if (png_ptr->zstream->avail_out == 0)
             png_push_process_row(png_ptr);
       }
 
@@ -731,7 +731,7 @@ png_process_IDAT_data(png_structrp png_ptr, png_bytep buffer,
     * is left at this point we have bytes of IDAT data
     * after the zlib end code.
     */
-   if (png_ptr->zstream.avail_in > 0)
+   if (png_ptr->zstream->avail_in > 0)
       png_warning(png_ptr, "Extra compression data in IDAT");
 }
 
@@ -766,7 +766,7 @@ png_push_process_row(png_structrp png_ptr)
 
 #ifdef PNG_READ_TRANSFORMS_SUPPORTED
    if (png_ptr->transformations != 0)
-      png_do_read_transformations(png_ptr, &row_info);
+      png_do_read_transformations(png_ptr, &row_info, png_ptr->row_buf + 1);
 #endif
 
    /* The transformed pixel depth should match the depth now in row_info. */
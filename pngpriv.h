@@ -270,6 +270,18 @@
 #  define PNG_POWERPC_VSX_IMPLEMENTATION 1
 #endif
 
+#ifndef PNG_THREADS_OPT
+   /* Work that libpng can do concurrently, such as the pipelined reader set up
+    * by png_set_read_pipeline, runs on system threads only if this is set to
+    * a value greater than 0; the CMake build does this when it finds a thread
+    * library.  Otherwise the work is done, in the same order, on the thread
+    * that called libpng.  Use -DPNG_THREADS_OPT=1 in CPPFLAGS to use POSIX
+    * threads (or Win32 threads on Windows) in other builds; the application
+    * must then link with the thread library.
+    */
+#  define PNG_THREADS_OPT 0
+#endif
+
 
 /* Is this a build of a DLL where compilation of the object modules requires
  * different preprocessor settings to those required for a simple library?  If
@@ -635,7 +647,7 @@
 #define PNG_BACKGROUND_IS_GRAY     0x800U
 #define PNG_HAVE_PNG_SIGNATURE    0x1000U
 #define PNG_HAVE_CHUNK_AFTER_IDAT 0x2000U /* Have another chunk after IDAT */
-                   /*             0x4000U (unused) */
+#define PNG_WROTE_eXIf            0x4000U
 #define PNG_IS_READ_STRUCT        0x8000U /* Else is a write struct */
 
 /* Flags for the transformations the PNG library does on the image data */
@@ -677,8 +689,8 @@
 
 /* Flags for the png_ptr->flags rather than declaring a byte for each one */
 #define PNG_FLAG_ZLIB_CUSTOM_STRATEGY     0x0001U
-#define PNG_FLAG_ZSTREAM_INITIALIZED      0x0002U /* Added to libpng-1.6.0 */
-                                  /*      0x0004U    unused */
+#define PNG_FLAG_ZSTREAM_INITIALIZED      0x0002U /* zstream_idat, 1.6.0 */
+#define PNG_FLAG_ZCHUNK_INITIALIZED       0x0004U /* zstream_chunk */
 #define PNG_FLAG_ZSTREAM_ENDED            0x0008U /* Added to libpng-1.6.0 */
                                   /*      0x0010U    unused */
                                   /*      0x0020U    unused */
@@ -734,12 +746,25 @@
 #define PNG_DIV65535(v24) (((v24) + 32895) >> 16)
 #define PNG_DIV257(v16) PNG_DIV65535((png_uint_32)(v16) * 255)
 
+/* The largest png_ptrdiff_t; this assumes that it is the same size as size_t,
+ * which is true on all the systems libpng supports.
+ */
+#define PNG_PTRDIFF_MAX ((png_alloc_size_t)(PNG_SIZE_MAX >> 1))
+
 /* Added to libpng-1.2.6 JB */
 #define PNG_ROWBYTES(pixel_bits, width) \
     ((pixel_bits) >= 8 ? \
     ((size_t)(width) * (((size_t)(pixel_bits)) >> 3)) : \
     (( ((size_t)(width) * ((size_t)(pixel_bits))) + 7) >> 3) )
 
+/* The size of each of the row buffers allocated by png_read_start_row, less
+ * the 48 bytes of alignment padding: the width is rounded up to a multiple of
+ * 8 pixels for interlacing and a byte and a pixel are added for safety.
+ */
+#define PNG_ROW_BUFFER_SIZE(pixel_bits, width) \
+    (PNG_ROWBYTES((pixel_bits), ((width) + 7) & ~(png_uint_32)7) + 1 + \
+    (((size_t)(pixel_bits) + 7) >> 3))
+
 /* This returns the number of trailing bits in the last byte of a row, 0 if the
  * last byte is completely full of pixels.  It is, in principle, (pixel_bits x
  * width) % 8, but that would overflow for large 'width'.  The second macro is
@@ -905,6 +930,15 @@
 #define PNG_GAMMA_MAC_INVERSE 65909
 #define PNG_GAMMA_sRGB_INVERSE 45455
 
+/* These run tasks, see png_task_start below; pngstruct.h checks this. */
+#if defined(PNG_READ_PIPELINE_SUPPORTED) ||\
+    defined(PNG_SIMPLIFIED_READ_BATCH_SUPPORTED) ||\
+    defined(PNG_WRITE_COMPRESSION_THREADS_SUPPORTED) ||\
+    defined(PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED) ||\
+    defined(PNG_WRITE_PIPELINE_SUPPORTED)
+#  define PNG_TASK_SUPPORTED
+#endif
+
 /* Almost everything below is C specific; the #defines above can be used in
  * non-C code (so long as it is C-preprocessed) the rest of this stuff cannot.
  */
@@ -983,6 +1017,37 @@ PNG_INTERNAL_FUNCTION(void,png_free_buffer_list,(png_structrp png_ptr,
    /* Free the buffer list used by the compressed write code. */
 #endif
 
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+PNG_INTERNAL_FUNCTION(void,png_free_compression_threads,(png_structrp png_ptr),
+   PNG_EMPTY);
+   /* Wait for the png_set_compression_threads tasks, if any, and free their
+    * memory.
+    */
+#endif
+
+#ifdef PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED
+PNG_INTERNAL_FUNCTION(void,png_free_optimal_encoder,(png_structrp png_ptr),
+   PNG_EMPTY);
+   /* Free the image data PNG_COMPRESSION_LEVEL_OPTIMAL has kept, if any. */
+#endif
+
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+PNG_INTERNAL_FUNCTION(void,png_write_pipeline_flush,(png_structrp png_ptr),
+   PNG_EMPTY);
+   /* Filter and compress the rows png_set_write_pipeline is holding. */
+
+PNG_INTERNAL_FUNCTION(void,png_free_write_pipeline,(png_structrp png_ptr),
+   PNG_EMPTY);
+   /* Wait for the png_set_write_pipeline tasks, if any, and free the memory. */
+#endif
+
+#if defined(PNG_WRITE_WEIGHTED_FILTER_SUPPORTED) &&\
+    defined(PNG_WRITE_FILTER_SUPPORTED)
+PNG_INTERNAL_FUNCTION(void,png_free_filter_trials,(png_structrp png_ptr),
+   PNG_EMPTY);
+   /* Free the state of the PNG_FILTER_HEURISTIC_ZLIB filter selection. */
+#endif
+
 #if defined(PNG_FLOATING_POINT_SUPPORTED) && \
    !defined(PNG_FIXED_POINT_MACRO_SUPPORTED) && \
    (defined(PNG_gAMA_SUPPORTED) || defined(PNG_cHRM_SUPPORTED) || \
@@ -1022,6 +1087,17 @@ PNG_INTERNAL_FUNCTION(png_voidp,png_malloc_array,(png_const_structrp png_ptr,
 PNG_INTERNAL_FUNCTION(png_voidp,png_realloc_array,(png_const_structrp png_ptr,
    png_const_voidp array, int old_elements, int add_elements,
    size_t element_size),PNG_ALLOCATED);
+
+/* Make room in an array for add_elements more elements after the first
+ * num_elements, given that *max_elements are allocated.  The array is returned
+ * unchanged if there is room, otherwise the array is replaced by one at least
+ * twice the size, with the new elements set to 0, the old array is freed and
+ * *max_elements updated.  Returns NULL, leaving the array alone, on overflow or
+ * out of memory.
+ */
+PNG_INTERNAL_FUNCTION(png_voidp,png_grow_array,(png_const_structrp png_ptr,
+   png_voidp array, int num_elements, int *max_elements, int add_elements,
+   size_t element_size),PNG_EMPTY);
 #endif /* text, sPLT or unknown chunks */
 
 /* Magic to create a struct when there is no struct to call the user supplied
@@ -1057,6 +1133,11 @@ PNG_INTERNAL_FUNCTION(void,png_zfree,(voidpf png_ptr, voidpf ptr),PNG_EMPTY);
 PNG_INTERNAL_FUNCTION(void PNGCBAPI,png_default_read_data,(png_structp png_ptr,
     png_bytep data, size_t length),PNG_EMPTY);
 
+#if defined(PNG_READ_SKIP_IDAT_SUPPORTED) && defined(PNG_STDIO_SUPPORTED)
+PNG_INTERNAL_FUNCTION(int PNGCBAPI,png_default_seek_data,(png_structp png_ptr,
+    png_uint_32 length),PNG_EMPTY);
+#endif
+
 #ifdef PNG_PROGRESSIVE_READ_SUPPORTED
 PNG_INTERNAL_FUNCTION(void PNGCBAPI,png_push_fill_buffer,(png_structp png_ptr,
     png_bytep buffer, size_t length),PNG_EMPTY);
@@ -1091,6 +1172,12 @@ PNG_INTERNAL_FUNCTION(png_uint_32,png_read_chunk_header,(png_structrp png_ptr),
 PNG_INTERNAL_FUNCTION(void,png_read_data,(png_structrp png_ptr, png_bytep data,
     size_t length),PNG_EMPTY);
 
+#ifdef PNG_READ_SKIP_IDAT_SUPPORTED
+/* Skip "length" bytes of input, using the seek function if there is one */
+PNG_INTERNAL_FUNCTION(void,png_read_skip_data,(png_structrp png_ptr,
+    png_uint_32 length),PNG_EMPTY);
+#endif
+
 /* Read bytes into buf, and update png_ptr->crc */
 PNG_INTERNAL_FUNCTION(void,png_crc_read,(png_structrp png_ptr, png_bytep buf,
     png_uint_32 length),PNG_EMPTY);
@@ -1256,8 +1343,9 @@ PNG_INTERNAL_FUNCTION(void,png_write_start_row,(png_structrp png_ptr),
  *
  * 'display' must be 0 or 1, otherwise the memcpy will be done regardless.
  *
- * The API always reads from the png_struct row buffer and always assumes that
- * it is full width (png_do_read_interlace has already been called.)
+ * png_combine_row reads from the png_struct row buffer, png_combine_row_data
+ * from 'sp', and both assume that the row is full width (png_do_read_interlace
+ * has already been called.)
  *
  * This function is only ever used to write to row buffers provided by the
  * caller of the relevant libpng API and the row must have already been
@@ -1270,8 +1358,10 @@ PNG_INTERNAL_FUNCTION(void,png_write_start_row,(png_structrp png_ptr),
 #ifndef PNG_USE_COMPILE_TIME_MASKS
 #  define PNG_USE_COMPILE_TIME_MASKS 1
 #endif
-PNG_INTERNAL_FUNCTION(void,png_combine_row,(png_const_structrp png_ptr,
-    png_bytep row, int display),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_combine_row_data,(png_const_structrp png_ptr,
+    png_bytep row, png_const_bytep sp, int display),PNG_EMPTY);
+#define png_combine_row(png_ptr, row, display)\
+   png_combine_row_data(png_ptr, row, (png_ptr)->row_buf + 1, display)
 
 #ifdef PNG_READ_INTERLACING_SUPPORTED
 /* Expand an interlaced row: the 'row_info' describes the pass data that has
@@ -1368,6 +1458,13 @@ PNG_INTERNAL_FUNCTION(void,png_read_filter_row_paeth4_sse2,(png_row_infop
 PNG_INTERNAL_FUNCTION(void,png_write_find_filter,(png_structrp png_ptr,
     png_row_infop row_info),PNG_EMPTY);
 
+#ifdef PNG_READ_VERIFY_SUPPORTED
+   /* Record a problem found while reading for png_verify to report. */
+#  define png_verify_flag(png_ptr, flags) ((png_ptr)->verify_status |= (flags))
+#else
+#  define png_verify_flag(png_ptr, flags) ((void)0)
+#endif
+
 #ifdef PNG_SEQUENTIAL_READ_SUPPORTED
 PNG_INTERNAL_FUNCTION(void,png_read_IDAT_data,(png_structrp png_ptr,
    png_bytep output, png_alloc_size_t avail_out),PNG_EMPTY);
@@ -1382,6 +1479,16 @@ PNG_INTERNAL_FUNCTION(void,png_read_finish_IDAT,(png_structrp png_ptr),
     * byte is read; there is still some pending input.
     */
 
+#ifdef PNG_READ_SKIP_IDAT_SUPPORTED
+PNG_INTERNAL_FUNCTION(void,png_read_skip_IDAT,(png_structrp png_ptr,
+   png_uint_32 length),PNG_EMPTY);
+   /* The alternative to png_read_finish_IDAT used when png_set_skip_IDAT or
+    * png_set_copy_IDAT is in effect: abandons the LZ stream and skips (or
+    * copies) the remaining 'length' bytes of the current IDAT chunk together
+    * with its CRC.
+    */
+#endif
+
 PNG_INTERNAL_FUNCTION(void,png_read_finish_row,(png_structrp png_ptr),
    PNG_EMPTY);
    /* Finish a row while reading, dealing with interlacing passes, etc. */
@@ -1390,14 +1497,145 @@ PNG_INTERNAL_FUNCTION(void,png_read_finish_row,(png_structrp png_ptr),
 /* Initialize the row buffers, etc. */
 PNG_INTERNAL_FUNCTION(void,png_read_start_row,(png_structrp png_ptr),PNG_EMPTY);
 
-#if ZLIB_VERNUM >= 0x1240
+PNG_INTERNAL_FUNCTION(unsigned int,png_read_max_pixel_depth,
+   (png_const_structrp png_ptr),PNG_EMPTY);
+   /* The largest pixel depth the row transformations can produce; this sizes
+    * the row buffers allocated by png_read_start_row.
+    */
+
+#if ZLIB_VERNUM >= 0x1240 || defined(PNG_INFLATE_LIMITS_SUPPORTED)
 PNG_INTERNAL_FUNCTION(int,png_zlib_inflate,(png_structrp png_ptr, int flush),
       PNG_EMPTY);
 #  define PNG_INFLATE(pp, flush) png_zlib_inflate(pp, flush)
 #else /* Zlib < 1.2.4 */
-#  define PNG_INFLATE(pp, flush) inflate(&(pp)->zstream, flush)
+#  define PNG_INFLATE(pp, flush) inflate((pp)->zstream, flush)
 #endif /* Zlib < 1.2.4 */
 
+#ifdef PNG_INFLATE_LIMITS_SUPPORTED
+/* The compression ratio limit is only applied once a zlib stream has produced
+ * this many bytes.
+ */
+#  define PNG_INFLATE_RATIO_MIN 65536
+#endif
+
+#ifdef PNG_READ_TRANSFORM_THREADS_SUPPORTED
+/* The most tasks png_set_read_transform_threads will divide a batch between */
+#  define PNG_TRANSFORM_THREADS_MAX 16
+#endif
+
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+/* The most blocks png_set_compression_threads will deflate at once and the
+ * limits on the size of a block.
+ */
+#  define PNG_COMPRESSION_THREADS_MAX 16
+#  define PNG_COMPRESSION_BLOCK_MIN 1024
+#  define PNG_COMPRESSION_BLOCK_MAX 0x1000000
+#endif
+
+#ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+/* The bytes of image data PNG_COMPRESSION_LEVEL_FASTEST encodes as a block */
+#  define PNG_FAST_ENCODER_BLOCK 65536
+#endif
+
+#ifdef PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED
+/* PNG_COMPRESSION_LEVEL_OPTIMAL parses this many bytes of image data at once,
+ * splits each into at most PNG_OPTIMAL_BLOCKS deflate blocks and parses each
+ * block at most PNG_OPTIMAL_ITERATIONS times.
+ */
+#  define PNG_OPTIMAL_CHUNK 262144
+#  define PNG_OPTIMAL_BLOCKS 16
+#  define PNG_OPTIMAL_ITERATIONS 15
+#endif
+
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+/* The window of the PNG_FILTER_HEURISTIC_ZLIB trial stream holds at least this
+ * many rows, up to PNG_FILTER_TRIAL_WINDOW bytes.
+ */
+#  ifndef PNG_FILTER_TRIAL_ROWS
+#     define PNG_FILTER_TRIAL_ROWS 32
+#  endif
+#endif
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+/* PNG_ENCODE_PRESET_AUTO samples rows until PNG_AUTO_SAMPLE_CHANGES pixels
+ * differ from the pixel to their left, or until it holds PNG_AUTO_SAMPLE_BYTES
+ * of image data, but at least PNG_AUTO_SAMPLE_ROWS rows.
+ */
+#  define PNG_AUTO_SAMPLE_BYTES 262144
+#  define PNG_AUTO_SAMPLE_CHANGES 4096
+#  define PNG_AUTO_SAMPLE_ROWS 8
+#endif
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+/* png_set_frame_cache copies the deflate stream at most PNG_FRAME_CACHE_COPIES
+ * times in an image, at least PNG_FRAME_CACHE_INTERVAL bytes of image data
+ * apart.
+ */
+#  define PNG_FRAME_CACHE_COPIES 16
+#  define PNG_FRAME_CACHE_INTERVAL 65536
+#endif
+
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+/* The most tasks png_set_write_pipeline will divide a batch between */
+#  define PNG_WRITE_PIPELINE_TASKS 16
+#endif
+
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+/* png_set_filter_heuristics weights and costs are fixed point numbers with
+ * these many fractional bits.
+ */
+#  define PNG_WEIGHT_SHIFT 8
+#  define PNG_WEIGHT_FACTOR (1<<PNG_WEIGHT_SHIFT)
+#  define PNG_COST_SHIFT 3
+#  define PNG_COST_FACTOR (1<<PNG_COST_SHIFT)
+#endif
+
+#ifdef PNG_TASK_SUPPORTED
+/* A task is a function that libpng runs, possibly on another thread, while the
+ * caller gets on with something else.  png_task_start hands the function to
+ * the application's executor if png_set_executor has given one, otherwise it
+ * runs the function on one of the png_struct's threads if PNG_THREADS_OPT
+ * allows it; a thread is created when none is idle and is kept until
+ * png_free_task_workers.  If neither accepts the function it is run before
+ * png_task_start returns.  png_task_finish waits for the function to return;
+ * it must be called exactly once for each task and from the thread that
+ * started it.  A task function must not call png_error or png_warning or
+ * allocate memory.
+ */
+typedef PNG_CALLBACK(void, *png_task_fn, (png_voidp));
+
+typedef struct png_task
+{
+   png_task_fn fn;   /* The function to run */
+   png_voidp arg;    /* The argument to pass to it */
+   png_voidp thread; /* The system thread, NULL if it has finished */
+#ifdef PNG_EXECUTOR_SUPPORTED
+   png_voidp handle; /* From the executor's submit function, else NULL */
+#endif
+} png_task, *png_taskp;
+
+PNG_INTERNAL_FUNCTION(void,png_task_start,(png_structrp png_ptr,
+   png_taskp task, png_task_fn fn, png_voidp arg),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_task_finish,(png_structrp png_ptr,
+   png_taskp task),PNG_EMPTY);
+
+#if PNG_THREADS_OPT > 0
+/* A mutex for tasks that share data.  These exist only where tasks can run on
+ * other threads; png_mutex_create returns NULL if it runs out of memory.
+ */
+PNG_INTERNAL_FUNCTION(png_voidp,png_mutex_create,(png_structrp png_ptr),
+   PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_mutex_lock,(png_voidp mutex),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_mutex_unlock,(png_voidp mutex),PNG_EMPTY);
+PNG_INTERNAL_FUNCTION(void,png_mutex_destroy,(png_structrp png_ptr,
+   png_voidp mutex),PNG_EMPTY);
+
+/* Ends the idle threads; called when the png_struct is destroyed. */
+PNG_INTERNAL_FUNCTION(void,png_free_task_workers,(png_structrp png_ptr),
+   PNG_EMPTY);
+#endif
+#endif /* TASK */
+
 #ifdef PNG_READ_TRANSFORMS_SUPPORTED
 /* Optional call to update the users info structure */
 PNG_INTERNAL_FUNCTION(void,png_read_transform_info,(png_structrp png_ptr,
@@ -1562,7 +1800,7 @@ PNG_INTERNAL_FUNCTION(int,png_chunk_unknown_handling,
 /* Handle the transformations for reading and writing */
 #ifdef PNG_READ_TRANSFORMS_SUPPORTED
 PNG_INTERNAL_FUNCTION(void,png_do_read_transformations,(png_structrp png_ptr,
-   png_row_infop row_info),PNG_EMPTY);
+   png_row_infop row_info, png_bytep row),PNG_EMPTY);
 #endif
 #ifdef PNG_WRITE_TRANSFORMS_SUPPORTED
 PNG_INTERNAL_FUNCTION(void,png_do_write_transformations,(png_structrp png_ptr,
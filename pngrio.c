@@ -62,6 +62,21 @@ png_default_read_data(png_structp png_ptr, png_bytep data, size_t length)
    if (check != length)
       png_error(png_ptr, "Read Error");
 }
+
+#ifdef PNG_READ_SKIP_IDAT_SUPPORTED
+/* The default seek function used with png_default_read_data.  fseek takes a
+ * long offset, so lengths that may not fit are read instead.
+ */
+int PNGCBAPI
+png_default_seek_data(png_structp png_ptr, png_uint_32 length)
+{
+   if (png_ptr == NULL || length > 0x7fffffffU)
+      return 0;
+
+   return fseek(png_voidcast(png_FILE_p, png_ptr->io_ptr), (long)length,
+       SEEK_CUR) == 0;
+}
+#endif /* READ_SKIP_IDAT */
 #endif
 
 /* This function allows the application to supply a new input function
@@ -102,6 +117,17 @@ png_set_read_fn(png_structrp png_ptr, png_voidp io_ptr,
    png_ptr->read_data_fn = read_data_fn;
 #endif
 
+#ifdef PNG_READ_SKIP_IDAT_SUPPORTED
+   /* The default seek function only works with the default read function. */
+#  ifdef PNG_STDIO_SUPPORTED
+   if (read_data_fn == NULL)
+      png_ptr->read_seek_fn = png_default_seek_data;
+
+   else
+#  endif
+      png_ptr->read_seek_fn = NULL;
+#endif
+
 #ifdef PNG_WRITE_SUPPORTED
    /* It is an error to write to a read device */
    if (png_ptr->write_data_fn != NULL)
@@ -117,4 +143,48 @@ png_set_read_fn(png_structrp png_ptr, png_voidp io_ptr,
    png_ptr->output_flush_fn = NULL;
 #endif
 }
+
+#ifdef PNG_READ_SKIP_IDAT_SUPPORTED
+/* Skip over input data.  The seek function, if any, is tried first; if there
+ * is none or it fails the data is read and discarded.  No CRC is calculated.
+ */
+void /* PRIVATE */
+png_read_skip_data(png_structrp png_ptr, png_uint_32 length)
+{
+   png_debug1(4, "skipping %lu bytes", (unsigned long)length);
+
+   if (length == 0)
+      return;
+
+   if (png_ptr->read_seek_fn != NULL &&
+       (*(png_ptr->read_seek_fn))(png_ptr, length) != 0)
+      return;
+
+   while (length > 0)
+   {
+      png_uint_32 len;
+      png_byte tmpbuf[PNG_INFLATE_BUF_SIZE];
+
+      len = (sizeof tmpbuf);
+      if (len > length)
+         len = length;
+      length -= len;
+
+      png_read_data(png_ptr, tmpbuf, len);
+   }
+}
+
+/* This function allows the application to supply a function to skip forward
+ * in the input; it is used by png_read_end to skip IDAT chunks when requested
+ * with png_set_skip_IDAT.  NULL removes any seek function.
+ */
+void PNGAPI
+png_set_read_seek_fn(png_structrp png_ptr, png_seek_ptr seek_fn)
+{
+   if (png_ptr == NULL)
+      return;
+
+   png_ptr->read_seek_fn = seek_fn;
+}
+#endif /* READ_SKIP_IDAT */
 #endif /* READ */
@@ -277,7 +277,14 @@ png_crc_error(png_structrp png_ptr)
    if (need_crc != 0)
    {
       crc = png_get_uint_32(crc_bytes);
-      return ((int)(crc != png_ptr->crc));
+
+      if (crc != png_ptr->crc)
+      {
+         png_verify_flag(png_ptr, PNG_VERIFY_CRC);
+         return 1;
+      }
+
+      return 0;
    }
 
    else
@@ -373,6 +380,7 @@ png_inflate_claim(png_structrp png_ptr, png_uint_32 owner)
     */
    {
       int ret; /* zlib return code */
+      png_uint_32 initialized; /* flag for the stream */
 #if ZLIB_VERNUM >= 0x1240
       int window_bits = 0;
 
@@ -392,40 +400,65 @@ png_inflate_claim(png_structrp png_ptr, png_uint_32 owner)
 
 #endif /* ZLIB_VERNUM >= 0x1240 */
 
+      /* IDAT has a stream of its own so that the stream and window of the
+       * image data are not thrown away and allocated again for compressed
+       * chunks that come before or after it, and vice versa.
+       */
+      if (owner == png_IDAT)
+      {
+         png_ptr->zstream = &png_ptr->zstream_idat;
+         initialized = PNG_FLAG_ZSTREAM_INITIALIZED;
+      }
+
+      else
+      {
+         png_ptr->zstream = &png_ptr->zstream_chunk;
+         initialized = PNG_FLAG_ZCHUNK_INITIALIZED;
+      }
+
       /* Set this for safety, just in case the previous owner left pointers to
        * memory allocations.
        */
-      png_ptr->zstream.next_in = NULL;
-      png_ptr->zstream.avail_in = 0;
-      png_ptr->zstream.next_out = NULL;
-      png_ptr->zstream.avail_out = 0;
+      png_ptr->zstream->next_in = NULL;
+      png_ptr->zstream->avail_in = 0;
+      png_ptr->zstream->next_out = NULL;
+      png_ptr->zstream->avail_out = 0;
 
-      if ((png_ptr->flags & PNG_FLAG_ZSTREAM_INITIALIZED) != 0)
+      if ((png_ptr->flags & initialized) != 0)
       {
 #if ZLIB_VERNUM >= 0x1240
-         ret = inflateReset2(&png_ptr->zstream, window_bits);
+         /* When the window size comes from the stream header inflateReset2
+          * would free the window of the previous stream; instead inflateReset
+          * keeps it and png_zlib_inflate sets the size from the header, which
+          * only reallocates the window if the size has changed.
+          */
+         if (png_ptr->zstream_start != 0)
+            ret = inflateReset(png_ptr->zstream);
+
+         else
+            ret = inflateReset2(png_ptr->zstream, window_bits);
 #else
-         ret = inflateReset(&png_ptr->zstream);
+         ret = inflateReset(png_ptr->zstream);
 #endif
       }
 
       else
       {
 #if ZLIB_VERNUM >= 0x1240
-         ret = inflateInit2(&png_ptr->zstream, window_bits);
+         ret = inflateInit2(png_ptr->zstream, window_bits);
 #else
-         ret = inflateInit(&png_ptr->zstream);
+         ret = inflateInit(png_ptr->zstream);
 #endif
 
          if (ret == Z_OK)
-            png_ptr->flags |= PNG_FLAG_ZSTREAM_INITIALIZED;
+            png_ptr->flags |= initialized;
       }
 
 #if ZLIB_VERNUM >= 0x1290 && \
    defined(PNG_SET_OPTION_SUPPORTED) && defined(PNG_IGNORE_ADLER32)
       if (((png_ptr->options >> PNG_IGNORE_ADLER32) & 3) == PNG_OPTION_ON)
          /* Turn off validation of the ADLER32 checksum in IDAT chunks */
-         ret = inflateValidate(&png_ptr->zstream, 0);
+         ret = inflateValidate(png_ptr->zstream, 0);
 #endif
 
       if (ret == Z_OK)
@@ -442,30 +475,101 @@ png_inflate_claim(png_structrp png_ptr, png_uint_32 owner)
 #endif
 }
 
-#if ZLIB_VERNUM >= 0x1240
+#if ZLIB_VERNUM >= 0x1240 || defined(PNG_INFLATE_LIMITS_SUPPORTED)
 /* Handle the start of the inflate stream if we called inflateInit2(strm,0);
  * in this case some zlib versions skip validation of the CINFO field and, in
  * certain circumstances, libpng may end up displaying an invalid image, in
  * contrast to implementations that call zlib in the normal way (e.g. libpng
  * 1.5).
+ *
+ * This is also where the limits set by png_set_inflate_limits are applied;
+ * they are checked after every call to inflate so a stream that exceeds them
+ * is stopped at once.  Exceeding a limit is reported as a zlib data error.
  */
 int /* PRIVATE */
 png_zlib_inflate(png_structrp png_ptr, int flush)
 {
-   if (png_ptr->zstream_start && png_ptr->zstream.avail_in > 0)
+#ifdef PNG_INFLATE_LIMITS_SUPPORTED
+   uInt avail_in = png_ptr->zstream->avail_in;
+   uInt avail_out = png_ptr->zstream->avail_out;
+   int ret;
+#endif
+
+#if ZLIB_VERNUM >= 0x1240
+   if (png_ptr->zstream_start && png_ptr->zstream->avail_in > 0)
    {
-      if ((*png_ptr->zstream.next_in >> 4) > 7)
+      int window_bits = (*png_ptr->zstream->next_in >> 4) + 8;
+      int reset;
+
+      if (window_bits > 15)
       {
-         png_ptr->zstream.msg = "invalid window size (libpng)";
+         png_ptr->zstream->msg = "invalid window size (libpng)";
          return Z_DATA_ERROR;
       }
 
       png_ptr->zstream_start = 0;
+
+      /* This is the size inflate would take from the header; setting it here
+       * lets zlib keep the window of the previous stream if it is the same.
+       */
+      reset = inflateReset2(png_ptr->zstream, window_bits);
+
+#  if ZLIB_VERNUM >= 0x1290 && \
+      defined(PNG_SET_OPTION_SUPPORTED) && defined(PNG_IGNORE_ADLER32)
+      if (reset == Z_OK &&
+          ((png_ptr->options >> PNG_IGNORE_ADLER32) & 3) == PNG_OPTION_ON)
+         reset = inflateValidate(png_ptr->zstream, 0);
+#  endif
+
+      if (reset != Z_OK)
+         return reset;
+   }
+#endif /* Zlib >= 1.2.4 */
+
+#ifdef PNG_INFLATE_LIMITS_SUPPORTED
+   ret = inflate(png_ptr->zstream, flush);
+
+   /* inflate only ever reduces avail_in and avail_out: */
+   avail_in -= png_ptr->zstream->avail_in;
+   avail_out -= png_ptr->zstream->avail_out;
+   png_ptr->inflate_total += avail_out;
+   png_ptr->inflate_work += avail_in;
+   png_ptr->inflate_work += avail_out;
+
+   if (ret == Z_OK || ret == Z_STREAM_END)
+   {
+      if (png_ptr->inflate_max > 0 &&
+          png_ptr->inflate_total > png_ptr->inflate_max)
+      {
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("inflate limit exceeded");
+         ret = Z_DATA_ERROR;
+      }
+
+      else if (png_ptr->inflate_work_max > 0 &&
+          png_ptr->inflate_work > png_ptr->inflate_work_max)
+      {
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("inflate work limit exceeded");
+         ret = Z_DATA_ERROR;
+      }
+
+      /* Short streams can legitimately have very high ratios: */
+      else if (png_ptr->inflate_ratio_max > 0 &&
+          png_ptr->zstream->total_out >= PNG_INFLATE_RATIO_MIN &&
+          png_ptr->zstream->total_out / png_ptr->inflate_ratio_max >
+          png_ptr->zstream->total_in)
+      {
+         png_ptr->zstream->msg =
+             PNGZ_MSG_CAST("compression ratio limit exceeded");
+         ret = Z_DATA_ERROR;
+      }
    }
 
-   return inflate(&png_ptr->zstream, flush);
+   return ret;
+#else
+   return inflate(png_ptr->zstream, flush);
+#endif /* INFLATE_LIMITS */
 }
-#endif /* Zlib >= 1.2.4 */
+#endif /* Zlib >= 1.2.4 || INFLATE_LIMITS */
 
 #ifdef PNG_READ_COMPRESSED_TEXT_SUPPORTED
 #if defined(PNG_READ_zTXt_SUPPORTED) || defined (PNG_READ_iTXt_SUPPORTED)
@@ -500,16 +604,16 @@ png_inflate(png_structrp png_ptr, png_uint_32 owner, int finish,
        * a performance advantage, because it reduces the amount of data accessed
        * at each step and that may give the OS more time to page it in.
        */
-      png_ptr->zstream.next_in = PNGZ_INPUT_CAST(input);
+      png_ptr->zstream->next_in = PNGZ_INPUT_CAST(input);
       /* avail_in and avail_out are set below from 'size' */
-      png_ptr->zstream.avail_in = 0;
-      png_ptr->zstream.avail_out = 0;
+      png_ptr->zstream->avail_in = 0;
+      png_ptr->zstream->avail_out = 0;
 
       /* Read directly into the output if it is available (this is set to
        * a local buffer below if output is NULL).
        */
       if (output != NULL)
-         png_ptr->zstream.next_out = output;
+         png_ptr->zstream->next_out = output;
 
       do
       {
@@ -524,7 +628,7 @@ png_inflate(png_structrp png_ptr, png_uint_32 owner, int finish,
           * requiring a window save (memcpy of up to 32768 output bytes)
           * every ZLIB_IO_MAX input bytes.
           */
-         avail_in += png_ptr->zstream.avail_in; /* not consumed last time */
+         avail_in += png_ptr->zstream->avail_in; /* not consumed last time */
 
          avail = ZLIB_IO_MAX;
 
@@ -532,10 +636,10 @@ png_inflate(png_structrp png_ptr, png_uint_32 owner, int finish,
             avail = (uInt)avail_in; /* safe: < than ZLIB_IO_MAX */
 
          avail_in -= avail;
-         png_ptr->zstream.avail_in = avail;
+         png_ptr->zstream->avail_in = avail;
 
          /* zlib OUTPUT BUFFER */
-         avail_out += png_ptr->zstream.avail_out; /* not written last time */
+         avail_out += png_ptr->zstream->avail_out; /* not written last time */
 
          avail = ZLIB_IO_MAX; /* maximum zlib can process */
 
@@ -544,7 +648,7 @@ png_inflate(png_structrp png_ptr, png_uint_32 owner, int finish,
             /* Reset the output buffer each time round if output is NULL and
              * make available the full buffer, up to 'remaining_space'
              */
-            png_ptr->zstream.next_out = local_buffer;
+            png_ptr->zstream->next_out = local_buffer;
             if ((sizeof local_buffer) < avail)
                avail = (sizeof local_buffer);
          }
@@ -552,7 +656,7 @@ png_inflate(png_structrp png_ptr, png_uint_32 owner, int finish,
          if (avail_out < avail)
             avail = (uInt)avail_out; /* safe: < ZLIB_IO_MAX */
 
-         png_ptr->zstream.avail_out = avail;
+         png_ptr->zstream->avail_out = avail;
          avail_out -= avail;
 
          /* zlib inflate call */
@@ -567,11 +671,11 @@ png_inflate(png_structrp png_ptr, png_uint_32 owner, int finish,
 
       /* For safety kill the local buffer pointer now */
       if (output == NULL)
-         png_ptr->zstream.next_out = NULL;
+         png_ptr->zstream->next_out = NULL;
 
       /* Claw back the 'size' and 'remaining_space' byte counts. */
-      avail_in += png_ptr->zstream.avail_in;
-      avail_out += png_ptr->zstream.avail_out;
+      avail_in += png_ptr->zstream->avail_in;
+      avail_out += png_ptr->zstream->avail_out;
 
       /* Update the input and output sizes; the updated values are the amount
        * consumed or written, effectively the inverse of what zlib uses.
@@ -582,7 +686,7 @@ png_inflate(png_structrp png_ptr, png_uint_32 owner, int finish,
       if (avail_in > 0)
          *input_size_ptr -= avail_in;
 
-      /* Ensure png_ptr->zstream.msg is set (even in the success case!) */
+      /* Ensure png_ptr->zstream->msg is set (even in the success case!) */
       png_zstream_error(png_ptr, ret);
       return ret;
    }
@@ -593,7 +697,7 @@ png_inflate(png_structrp png_ptr, png_uint_32 owner, int finish,
        * pointer, which is not owned by the caller, but this is safe; it's only
        * used on errors!
        */
-      png_ptr->zstream.msg = PNGZ_MSG_CAST("zstream unclaimed");
+      png_ptr->zstream->msg = PNGZ_MSG_CAST("zstream unclaimed");
       return Z_STREAM_ERROR;
    }
 }
@@ -658,7 +762,7 @@ png_decompress_chunk(png_structrp png_ptr,
              * with Z_FINISH in almost all cases, so the window will not be
              * maintained.
              */
-            if (inflateReset(&png_ptr->zstream) == Z_OK)
+            if (inflateReset(png_ptr->zstream) == Z_OK)
             {
                /* Because of the limit checks above we know that the new,
                 * expanded, size will fit in a size_t (let alone an
@@ -779,12 +883,12 @@ png_inflate_read(png_structrp png_ptr, png_bytep read_buffer, uInt read_size,
       int ret;
 
       /* next_in and avail_in must have been initialized by the caller. */
-      png_ptr->zstream.next_out = next_out;
-      png_ptr->zstream.avail_out = 0; /* set in the loop */
+      png_ptr->zstream->next_out = next_out;
+      png_ptr->zstream->avail_out = 0; /* set in the loop */
 
       do
       {
-         if (png_ptr->zstream.avail_in == 0)
+         if (png_ptr->zstream->avail_in == 0)
          {
             if (read_size > *chunk_bytes)
                read_size = (uInt)*chunk_bytes;
@@ -793,18 +897,18 @@ png_inflate_read(png_structrp png_ptr, png_bytep read_buffer, uInt read_size,
             if (read_size > 0)
                png_crc_read(png_ptr, read_buffer, read_size);
 
-            png_ptr->zstream.next_in = read_buffer;
-            png_ptr->zstream.avail_in = read_size;
+            png_ptr->zstream->next_in = read_buffer;
+            png_ptr->zstream->avail_in = read_size;
          }
 
-         if (png_ptr->zstream.avail_out == 0)
+         if (png_ptr->zstream->avail_out == 0)
          {
             uInt avail = ZLIB_IO_MAX;
             if (avail > *out_size)
                avail = (uInt)*out_size;
             *out_size -= avail;
 
-            png_ptr->zstream.avail_out = avail;
+            png_ptr->zstream->avail_out = avail;
          }
 
          /* Use Z_SYNC_FLUSH when there is no more chunk data to ensure that all
@@ -814,10 +918,10 @@ png_inflate_read(png_structrp png_ptr, png_bytep read_buffer, uInt read_size,
          ret = PNG_INFLATE(png_ptr, *chunk_bytes > 0 ?
              Z_NO_FLUSH : (finish ? Z_FINISH : Z_SYNC_FLUSH));
       }
-      while (ret == Z_OK && (*out_size > 0 || png_ptr->zstream.avail_out > 0));
+      while (ret == Z_OK && (*out_size > 0 || png_ptr->zstream->avail_out > 0));
 
-      *out_size += png_ptr->zstream.avail_out;
-      png_ptr->zstream.avail_out = 0; /* Should not be required, but is safe */
+      *out_size += png_ptr->zstream->avail_out;
+      png_ptr->zstream->avail_out = 0; /* Should not be required, but is safe */
 
       /* Ensure the error message pointer is always set: */
       png_zstream_error(png_ptr, ret);
@@ -826,7 +930,7 @@ png_inflate_read(png_structrp png_ptr, png_bytep read_buffer, uInt read_size,
 
    else
    {
-      png_ptr->zstream.msg = PNGZ_MSG_CAST("zstream unclaimed");
+      png_ptr->zstream->msg = PNGZ_MSG_CAST("zstream unclaimed");
       return Z_STREAM_ERROR;
    }
 }
@@ -1450,8 +1554,8 @@ png_handle_iCCP(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
                Byte local_buffer[PNG_INFLATE_BUF_SIZE];
                png_alloc_size_t size = (sizeof profile_header);
 
-               png_ptr->zstream.next_in = (Bytef*)keyword + (keyword_length+2);
-               png_ptr->zstream.avail_in = read_length;
+               png_ptr->zstream->next_in = (Bytef*)keyword + (keyword_length+2);
+               png_ptr->zstream->avail_in = read_length;
                (void)png_inflate_read(png_ptr, local_buffer,
                    (sizeof local_buffer), &length, profile_header, &size,
                    0/*finish: don't, because the output is too small*/);
@@ -1536,7 +1640,7 @@ png_handle_iCCP(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
                                     /* Check for a match against sRGB */
                                     png_icc_set_sRGB(png_ptr,
                                         &png_ptr->colorspace, profile,
-                                        png_ptr->zstream.adler);
+                                        png_ptr->zstream->adler);
 # endif
 
                                     /* Steal the profile for info_ptr. */
@@ -1583,12 +1687,12 @@ png_handle_iCCP(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
                                     }
                                  }
                                  if (errmsg == NULL)
-                                    errmsg = png_ptr->zstream.msg;
+                                    errmsg = png_ptr->zstream->msg;
                               }
                               /* else png_icc_check_tag_table output an error */
                            }
                            else /* profile truncated */
-                              errmsg = png_ptr->zstream.msg;
+                              errmsg = png_ptr->zstream->msg;
                         }
 
                         else
@@ -1602,14 +1706,14 @@ png_handle_iCCP(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
                }
 
                else /* profile truncated */
-                  errmsg = png_ptr->zstream.msg;
+                  errmsg = png_ptr->zstream->msg;
 
                /* Release the stream */
                png_ptr->zowner = 0;
             }
 
             else /* png_inflate_claim failed */
-               errmsg = png_ptr->zstream.msg;
+               errmsg = png_ptr->zstream->msg;
          }
 
          else
@@ -2696,7 +2800,7 @@ png_handle_zTXt(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
       }
 
       else
-         errmsg = png_ptr->zstream.msg;
+         errmsg = png_ptr->zstream->msg;
    }
 
    if (errmsg != NULL)
@@ -2816,7 +2920,7 @@ png_handle_iTXt(png_structrp png_ptr, png_inforp info_ptr, png_uint_32 length)
             buffer = png_ptr->read_buffer;
 
          else
-            errmsg = png_ptr->zstream.msg;
+            errmsg = png_ptr->zstream->msg;
       }
 
       else
@@ -3194,17 +3298,17 @@ png_check_chunk_length(png_const_structrp png_ptr, png_uint_32 length)
  * 'display' is false only those pixels present in the pass are filled in.
  */
 void /* PRIVATE */
-png_combine_row(png_const_structrp png_ptr, png_bytep dp, int display)
+png_combine_row_data(png_const_structrp png_ptr, png_bytep dp,
+    png_const_bytep sp, int display)
 {
    unsigned int pixel_depth = png_ptr->transformed_pixel_depth;
-   png_const_bytep sp = png_ptr->row_buf + 1;
    png_alloc_size_t row_width = png_ptr->width;
    unsigned int pass = png_ptr->pass;
    png_bytep end_ptr = 0;
    png_byte end_byte = 0;
    unsigned int end_mask;
 
-   png_debug(1, "in png_combine_row");
+   png_debug(1, "in png_combine_row_data");
 
    /* Added in 1.5.6: it should not be possible to enter this routine until at
     * least one row has been read from the PNG data and transformed.
@@ -4147,8 +4251,8 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
     png_alloc_size_t avail_out)
 {
    /* Loop reading IDATs and decompressing the result into output[avail_out] */
-   png_ptr->zstream.next_out = output;
-   png_ptr->zstream.avail_out = 0; /* safety: set below */
+   png_ptr->zstream->next_out = output;
+   png_ptr->zstream->avail_out = 0; /* safety: set below */
 
    if (output == NULL)
       avail_out = 0;
@@ -4158,7 +4262,7 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
       int ret;
       png_byte tmpbuf[PNG_INFLATE_BUF_SIZE];
 
-      if (png_ptr->zstream.avail_in == 0)
+      if (png_ptr->zstream->avail_in == 0)
       {
          uInt avail_in;
          png_bytep buffer;
@@ -4172,7 +4276,10 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
              * consumed a non-IDAT header.
              */
             if (png_ptr->chunk_name != png_IDAT)
+            {
+               png_verify_flag(png_ptr, PNG_VERIFY_TOO_SHORT);
                png_error(png_ptr, "Not enough image data");
+            }
          }
 
          avail_in = png_ptr->IDAT_read_size;
@@ -4190,8 +4297,8 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
          png_crc_read(png_ptr, buffer, avail_in);
          png_ptr->idat_size -= avail_in;
 
-         png_ptr->zstream.next_in = buffer;
-         png_ptr->zstream.avail_in = avail_in;
+         png_ptr->zstream->next_in = buffer;
+         png_ptr->zstream->avail_in = avail_in;
       }
 
       /* And set up the output side. */
@@ -4203,13 +4310,13 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
             out = (uInt)avail_out;
 
          avail_out -= out;
-         png_ptr->zstream.avail_out = out;
+         png_ptr->zstream->avail_out = out;
       }
 
       else /* after last row, checking for end */
       {
-         png_ptr->zstream.next_out = tmpbuf;
-         png_ptr->zstream.avail_out = (sizeof tmpbuf);
+         png_ptr->zstream->next_out = tmpbuf;
+         png_ptr->zstream->avail_out = (sizeof tmpbuf);
       }
 
       /* Use NO_FLUSH; this gives zlib the maximum opportunity to optimize the
@@ -4223,36 +4330,40 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
 
       /* Take the unconsumed output back. */
       if (output != NULL)
-         avail_out += png_ptr->zstream.avail_out;
+         avail_out += png_ptr->zstream->avail_out;
 
       else /* avail_out counts the extra bytes */
-         avail_out += (sizeof tmpbuf) - png_ptr->zstream.avail_out;
+         avail_out += (sizeof tmpbuf) - png_ptr->zstream->avail_out;
 
-      png_ptr->zstream.avail_out = 0;
+      png_ptr->zstream->avail_out = 0;
 
       if (ret == Z_STREAM_END)
       {
          /* Do this for safety; we won't read any more into this row. */
-         png_ptr->zstream.next_out = NULL;
+         png_ptr->zstream->next_out = NULL;
 
          png_ptr->mode |= PNG_AFTER_IDAT;
          png_ptr->flags |= PNG_FLAG_ZSTREAM_ENDED;
 
-         if (png_ptr->zstream.avail_in > 0 || png_ptr->idat_size > 0)
+         if (png_ptr->zstream->avail_in > 0 || png_ptr->idat_size > 0)
+         {
+            png_verify_flag(png_ptr, PNG_VERIFY_TOO_LONG);
             png_chunk_benign_error(png_ptr, "Extra compressed data");
+         }
          break;
       }
 
       if (ret != Z_OK)
       {
+         png_verify_flag(png_ptr, PNG_VERIFY_ZLIB);
          png_zstream_error(png_ptr, ret);
 
          if (output != NULL)
-            png_chunk_error(png_ptr, png_ptr->zstream.msg);
+            png_chunk_error(png_ptr, png_ptr->zstream->msg);
 
          else /* checking */
          {
-            png_chunk_benign_error(png_ptr, png_ptr->zstream.msg);
+            png_chunk_benign_error(png_ptr, png_ptr->zstream->msg);
             return;
          }
       }
@@ -4264,10 +4375,16 @@ png_read_IDAT_data(png_structrp png_ptr, png_bytep output,
        * should be handled the same way.
        */
       if (output != NULL)
+      {
+         png_verify_flag(png_ptr, PNG_VERIFY_TOO_SHORT);
          png_error(png_ptr, "Not enough image data");
+      }
 
       else /* the deflate stream contained extra data */
+      {
+         png_verify_flag(png_ptr, PNG_VERIFY_TOO_LONG);
          png_chunk_benign_error(png_ptr, "Too much image data");
+      }
    }
 }
 
@@ -4286,7 +4403,7 @@ png_read_finish_IDAT(png_structrp png_ptr)
        * this call we may need to terminate the zstream ownership.
        */
       png_read_IDAT_data(png_ptr, NULL, 0);
-      png_ptr->zstream.next_out = NULL; /* safety */
+      png_ptr->zstream->next_out = NULL; /* safety */
 
       /* Now clear everything out for safety; the following may not have been
        * done.
@@ -4304,8 +4421,8 @@ png_read_finish_IDAT(png_structrp png_ptr)
    if (png_ptr->zowner == png_IDAT)
    {
       /* Always do this; the pointers otherwise point into the read buffer. */
-      png_ptr->zstream.next_in = NULL;
-      png_ptr->zstream.avail_in = 0;
+      png_ptr->zstream->next_in = NULL;
+      png_ptr->zstream->avail_in = 0;
 
       /* Now we no longer own the zstream. */
       png_ptr->zowner = 0;
@@ -4319,6 +4436,116 @@ png_read_finish_IDAT(png_structrp png_ptr)
    }
 }
 
+#ifdef PNG_READ_SKIP_IDAT_SUPPORTED
+#ifdef PNG_READ_COPY_IDAT_SUPPORTED
+/* Check that the write struct set by png_set_copy_IDAT can accept the IDAT
+ * chunks of this image unchanged.
+ */
+static void
+png_check_copy_IDAT(png_structrp png_ptr)
+{
+   png_const_structrp write_ptr = png_ptr->copy_IDAT_ptr;
+
+   /* The compressed data must be copied from the start. */
+   if (png_ptr->zowner == png_IDAT && png_ptr->zstream->next_in != NULL)
+      png_error(png_ptr, "IDAT copy: image data has already been read");
+
+   if ((write_ptr->mode & PNG_WROTE_INFO_BEFORE_PLTE) == 0 ||
+       (write_ptr->mode & PNG_HAVE_IDAT) != 0 || write_ptr->row_buf != NULL)
+      png_error(png_ptr, "IDAT copy: write struct not ready for image data");
+
+   if (write_ptr->width != png_ptr->width ||
+       write_ptr->height != png_ptr->height ||
+       write_ptr->bit_depth != png_ptr->bit_depth ||
+       write_ptr->color_type != png_ptr->color_type ||
+       write_ptr->interlaced != png_ptr->interlaced ||
+       write_ptr->filter_type != png_ptr->filter_type)
+      png_error(png_ptr, "IDAT copy: IHDR does not match");
+}
+
+/* Copy the remaining 'length' bytes of the current IDAT chunk to the write
+ * struct as a complete chunk.  The data is read through the CRC code unless the
+ * CRC is to be ignored; the writer calculates its own CRC, which matches the
+ * original when the data is intact.
+ */
+static void
+png_copy_IDAT_chunk(png_structrp png_ptr, png_uint_32 length)
+{
+   png_structrp write_ptr = png_ptr->copy_IDAT_ptr;
+   int check_crc = png_ptr->skip_IDAT != PNG_SKIP_IDAT_IGNORE_CRC;
+   png_byte chunk_string[4];
+
+   PNG_STRING_FROM_CHUNK(chunk_string, png_IDAT);
+   png_write_chunk_start(write_ptr, chunk_string, length);
+
+   while (length > 0)
+   {
+      png_uint_32 len;
+      png_byte tmpbuf[PNG_INFLATE_BUF_SIZE];
+
+      len = (sizeof tmpbuf);
+      if (len > length)
+         len = length;
+      length -= len;
+
+      if (check_crc != 0)
+         png_crc_read(png_ptr, tmpbuf, len);
+
+      else
+         png_read_data(png_ptr, tmpbuf, len);
+
+      png_write_chunk_data(write_ptr, tmpbuf, len);
+   }
+
+   /* Check the input CRC before completing the output chunk. */
+   if (check_crc != 0)
+      (void)png_crc_finish(png_ptr, 0);
+
+   else
+      png_read_skip_data(png_ptr, 4);
+
+   png_write_chunk_end(write_ptr);
+   write_ptr->mode |= PNG_HAVE_IDAT;
+}
+#endif /* READ_COPY_IDAT */
+
+void /* PRIVATE */
+png_read_skip_IDAT(png_structrp png_ptr, png_uint_32 length)
+{
+#ifdef PNG_READ_COPY_IDAT_SUPPORTED
+   if (png_ptr->copy_IDAT_ptr != NULL &&
+       (png_ptr->flags & PNG_FLAG_ZSTREAM_ENDED) == 0)
+      png_check_copy_IDAT(png_ptr);
+#endif
+
+   /* Any remaining compressed data is abandoned, so the zstream is released
+    * without reading to the end of the LZ stream.
+    */
+   if (png_ptr->zowner == png_IDAT)
+   {
+      png_ptr->zstream->next_in = NULL;
+      png_ptr->zstream->avail_in = 0;
+      png_ptr->zowner = 0;
+   }
+
+   png_ptr->mode |= PNG_AFTER_IDAT;
+   png_ptr->flags |= PNG_FLAG_ZSTREAM_ENDED;
+   png_ptr->idat_size = 0;
+
+#ifdef PNG_READ_COPY_IDAT_SUPPORTED
+   if (png_ptr->copy_IDAT_ptr != NULL)
+      png_copy_IDAT_chunk(png_ptr, length);
+
+   else
+#endif
+   if (png_ptr->skip_IDAT == PNG_SKIP_IDAT_CHECK_CRC)
+      (void)png_crc_finish(png_ptr, length);
+
+   else /* The data and the CRC are skipped; chunk lengths are < 2^31 */
+      png_read_skip_data(png_ptr, length + 4);
+}
+#endif /* READ_SKIP_IDAT */
+
 void /* PRIVATE */
 png_read_finish_row(png_structrp png_ptr)
 {
@@ -4384,51 +4611,10 @@ png_read_finish_row(png_structrp png_ptr)
 }
 #endif /* SEQUENTIAL_READ */
 
-void /* PRIVATE */
-png_read_start_row(png_structrp png_ptr)
+unsigned int /* PRIVATE */
+png_read_max_pixel_depth(png_const_structrp png_ptr)
 {
-   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
-
-   /* Start of interlace block */
-   static const png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
-
-   /* Offset to next interlace block */
-   static const png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
-
-   /* Start of interlace block in the y direction */
-   static const png_byte png_pass_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
-
-   /* Offset to next interlace block in the y direction */
-   static const png_byte png_pass_yinc[7] = {8, 8, 8, 4, 4, 2, 2};
-
    unsigned int max_pixel_depth;
-   size_t row_bytes;
-
-   png_debug(1, "in png_read_start_row");
-
-#ifdef PNG_READ_TRANSFORMS_SUPPORTED
-   png_init_read_transformations(png_ptr);
-#endif
-   if (png_ptr->interlaced != 0)
-   {
-      if ((png_ptr->transformations & PNG_INTERLACE) == 0)
-         png_ptr->num_rows = (png_ptr->height + png_pass_yinc[0] - 1 -
-             png_pass_ystart[0]) / png_pass_yinc[0];
-
-      else
-         png_ptr->num_rows = png_ptr->height;
-
-      png_ptr->iwidth = (png_ptr->width +
-          png_pass_inc[png_ptr->pass] - 1 -
-          png_pass_start[png_ptr->pass]) /
-          png_pass_inc[png_ptr->pass];
-   }
-
-   else
-   {
-      png_ptr->num_rows = png_ptr->height;
-      png_ptr->iwidth = png_ptr->width;
-   }
 
    max_pixel_depth = (unsigned int)png_ptr->pixel_depth;
 
@@ -4479,21 +4665,13 @@ png_read_start_row(png_structrp png_ptr)
    }
 #endif
 
-#ifdef PNG_READ_EXPAND_16_SUPPORTED
-   if ((png_ptr->transformations & PNG_EXPAND_16) != 0)
+#if defined(PNG_READ_EXPAND_16_SUPPORTED) && defined(PNG_READ_EXPAND_SUPPORTED)
+   /* png_read_start_row cancels PNG_EXPAND_16 without PNG_EXPAND */
+   if ((png_ptr->transformations & (PNG_EXPAND_16 | PNG_EXPAND)) ==
+       (PNG_EXPAND_16 | PNG_EXPAND))
    {
-#  ifdef PNG_READ_EXPAND_SUPPORTED
-      /* In fact it is an error if it isn't supported, but checking is
-       * the safe way.
-       */
-      if ((png_ptr->transformations & PNG_EXPAND) != 0)
-      {
-         if (png_ptr->bit_depth < 16)
-            max_pixel_depth *= 2;
-      }
-      else
-#  endif
-      png_ptr->transformations &= ~PNG_EXPAND_16;
+      if (png_ptr->bit_depth < 16)
+         max_pixel_depth *= 2;
    }
 #endif
 
@@ -4573,21 +4751,87 @@ defined(PNG_USER_TRANSFORM_PTR_SUPPORTED)
    }
 #endif
 
+   return max_pixel_depth;
+}
+
+void /* PRIVATE */
+png_read_start_row(png_structrp png_ptr)
+{
+   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
+
+   /* Start of interlace block */
+   static const png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+
+   /* Offset to next interlace block */
+   static const png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+
+   /* Start of interlace block in the y direction */
+   static const png_byte png_pass_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+
+   /* Offset to next interlace block in the y direction */
+   static const png_byte png_pass_yinc[7] = {8, 8, 8, 4, 4, 2, 2};
+
+   unsigned int max_pixel_depth;
+   size_t row_bytes;
+
+   png_debug(1, "in png_read_start_row");
+
+#ifdef PNG_READ_TRANSFORMS_SUPPORTED
+   png_init_read_transformations(png_ptr);
+#endif
+   if (png_ptr->interlaced != 0)
+   {
+      if ((png_ptr->transformations & PNG_INTERLACE) == 0)
+         png_ptr->num_rows = (png_ptr->height + png_pass_yinc[0] - 1 -
+             png_pass_ystart[0]) / png_pass_yinc[0];
+
+      else
+         png_ptr->num_rows = png_ptr->height;
+
+      png_ptr->iwidth = (png_ptr->width +
+          png_pass_inc[png_ptr->pass] - 1 -
+          png_pass_start[png_ptr->pass]) /
+          png_pass_inc[png_ptr->pass];
+   }
+
+   else
+   {
+      png_ptr->num_rows = png_ptr->height;
+      png_ptr->iwidth = png_ptr->width;
+   }
+
+#ifdef PNG_READ_EXPAND_16_SUPPORTED
+   if ((png_ptr->transformations & PNG_EXPAND_16) != 0)
+   {
+#  ifdef PNG_READ_EXPAND_SUPPORTED
+      /* In fact it is an error if it isn't supported, but checking is
+       * the safe way.
+       */
+      if ((png_ptr->transformations & PNG_EXPAND) == 0)
+#  endif
+      png_ptr->transformations &= ~PNG_EXPAND_16;
+   }
+#endif
+
+   max_pixel_depth = png_read_max_pixel_depth(png_ptr);
+
    /* This value is stored in png_struct and double checked in the row read
     * code.
     */
    png_ptr->maximum_pixel_depth = (png_byte)max_pixel_depth;
    png_ptr->transformed_pixel_depth = 0; /* calculated on demand */
 
-   /* Align the width on the next larger 8 pixels.  Mainly used
-    * for interlacing
-    */
-   row_bytes = ((png_ptr->width + 7) & ~((png_uint_32)7));
-   /* Calculate the maximum bytes needed, adding a byte and a pixel
-    * for safety's sake
+   /* png_check_IHDR limits the width so that a row of 8-byte pixels fits in a
+    * size_t with the padding below, however a user transform can ask for more,
+    * so check the calculation here.
     */
-   row_bytes = PNG_ROWBYTES(max_pixel_depth, row_bytes) +
-       1 + ((max_pixel_depth + 7) >> 3U);
+   if (max_pixel_depth > 64 && ((png_ptr->width + 7) & ~(png_uint_32)7) >
+       (PNG_SIZE_MAX - 48 - 1 - (max_pixel_depth >> 3)) /
+       (max_pixel_depth >> 3))
+      png_error(png_ptr, "Image width is too large for this architecture");
+
+   /* Calculate the maximum bytes needed, see PNG_ROW_BUFFER_SIZE */
+   row_bytes = PNG_ROW_BUFFER_SIZE(max_pixel_depth, png_ptr->width);
 
 #ifdef PNG_MAX_MALLOC_64K
    if (row_bytes > (png_uint_32)65536L)
@@ -4671,7 +4915,7 @@ defined(PNG_USER_TRANSFORM_PTR_SUPPORTED)
     * not be happening any longer!)
     */
    if (png_inflate_claim(png_ptr, png_IDAT) != Z_OK)
-      png_error(png_ptr, png_ptr->zstream.msg);
+      png_error(png_ptr, png_ptr->zstream->msg);
 
    png_ptr->flags |= PNG_FLAG_ROW_INIT;
 }
@@ -769,6 +769,55 @@ png_set_text(png_const_structrp png_ptr, png_inforp info_ptr,
       png_error(png_ptr, "Insufficient memory to store text");
 }
 
+/* Return size bytes from the text pool of info_ptr, adding a block if
+ * necessary, or NULL if out of memory.
+ */
+static png_charp
+png_text_pool_alloc(png_const_structrp png_ptr, png_inforp info_ptr,
+    size_t size)
+{
+   png_text_blockp block = info_ptr->text_pool;
+
+   if (block == NULL || size > block->size - block->used)
+   {
+      size_t block_size = 1024 - offsetof(png_text_block, data);
+
+      if (block != NULL && block_size < block->total)
+         block_size = block->total;
+
+      if (block_size < size)
+         block_size = size;
+
+      if (block_size > PNG_SIZE_MAX - offsetof(png_text_block, data))
+         return NULL;
+
+      block = png_voidcast(png_text_blockp, png_malloc_base(png_ptr,
+          offsetof(png_text_block, data) + block_size));
+
+      /* If the big block is not available try for just enough. */
+      if (block == NULL && block_size > size)
+      {
+         block_size = size;
+         block = png_voidcast(png_text_blockp, png_malloc_base(png_ptr,
+             offsetof(png_text_block, data) + block_size));
+      }
+
+      if (block == NULL)
+         return NULL;
+
+      block->next = info_ptr->text_pool;
+      block->total = block_size;
+      if (block->next != NULL)
+         block->total += block->next->total;
+      block->size = block_size;
+      block->used = 0;
+      info_ptr->text_pool = block;
+   }
+
+   block->used += size;
+   return (png_charp)(block->data + (block->used - size));
+}
+
 int /* PRIVATE */
 png_set_text_2(png_const_structrp png_ptr, png_inforp info_ptr,
     png_const_textp text_ptr, int num_text)
@@ -782,36 +831,14 @@ png_set_text_2(png_const_structrp png_ptr, png_inforp info_ptr,
       return(0);
 
    /* Make sure we have enough space in the "text" array in info_struct
-    * to hold all of the incoming text_ptr objects.  This compare can't overflow
-    * because max_text >= num_text (anyway, subtract of two positive integers
-    * can't overflow in any case.)
+    * to hold all of the incoming text_ptr objects.  The array grows
+    * geometrically so that a file with a great many text chunks, each of which
+    * is added by a separate call, does not copy the array each time.
     */
-   if (num_text > info_ptr->max_text - info_ptr->num_text)
    {
-      int old_num_text = info_ptr->num_text;
-      int max_text;
-      png_textp new_text = NULL;
-
-      /* Calculate an appropriate max_text, checking for overflow. */
-      max_text = old_num_text;
-      if (num_text <= INT_MAX - max_text)
-      {
-         max_text += num_text;
-
-         /* Round up to a multiple of 8 */
-         if (max_text < INT_MAX-8)
-            max_text = (max_text + 8) & ~0x7;
-
-         else
-            max_text = INT_MAX;
-
-         /* Now allocate a new array and copy the old members in; this does all
-          * the overflow checks.
-          */
-         new_text = png_voidcast(png_textp,png_realloc_array(png_ptr,
-             info_ptr->text, old_num_text, max_text-old_num_text,
-             sizeof *new_text));
-      }
+      png_textp new_text = png_voidcast(png_textp, png_grow_array(png_ptr,
+          info_ptr->text, info_ptr->num_text, &info_ptr->max_text, num_text,
+          sizeof *new_text));
 
       if (new_text == NULL)
       {
@@ -821,14 +848,15 @@ png_set_text_2(png_const_structrp png_ptr, png_inforp info_ptr,
          return 1;
       }
 
-      png_free(png_ptr, info_ptr->text);
-
-      info_ptr->text = new_text;
-      info_ptr->free_me |= PNG_FREE_TEXT;
-      info_ptr->max_text = max_text;
-      /* num_text is adjusted below as the entries are copied in */
+      if (new_text != info_ptr->text)
+      {
+         info_ptr->text = new_text;
+         info_ptr->free_me |= PNG_FREE_TEXT;
+         /* num_text is adjusted below as the entries are copied in */
 
-      png_debug1(3, "allocated %d entries for info_ptr->text", max_text);
+         png_debug1(3, "allocated %d entries for info_ptr->text",
+             info_ptr->max_text);
+      }
    }
 
    for (i = 0; i < num_text; i++)
@@ -899,8 +927,17 @@ png_set_text_2(png_const_structrp png_ptr, png_inforp info_ptr,
          textp->compression = text_ptr[i].compression;
       }
 
-      textp->key = png_voidcast(png_charp,png_malloc_base(png_ptr,
-          key_len + text_length + lang_len + lang_key_len + 4));
+      /* The strings come from the pool when libpng will free them; if the
+       * application has taken over the text it must be able to png_free each
+       * key.
+       */
+      if ((info_ptr->free_me & PNG_FREE_TEXT) != 0)
+         textp->key = png_text_pool_alloc(png_ptr, info_ptr,
+             key_len + text_length + lang_len + lang_key_len + 4);
+
+      else
+         textp->key = png_voidcast(png_charp,png_malloc_base(png_ptr,
+             key_len + text_length + lang_len + lang_key_len + 4));
 
       if (textp->key == NULL)
       {
@@ -1075,12 +1112,13 @@ png_set_sPLT(png_const_structrp png_ptr,
    if (png_ptr == NULL || info_ptr == NULL || nentries <= 0 || entries == NULL)
       return;
 
-   /* Use the internal realloc function, which checks for all the possible
-    * overflows.  Notice that the parameters are (int) and (size_t)
+   /* Use the internal grow function, which checks for all the possible
+    * overflows and leaves room for more palettes.  Notice that the parameters
+    * are (int) and (size_t)
     */
-   np = png_voidcast(png_sPLT_tp,png_realloc_array(png_ptr,
-       info_ptr->splt_palettes, info_ptr->splt_palettes_num, nentries,
-       sizeof *np));
+   np = png_voidcast(png_sPLT_tp,png_grow_array(png_ptr,
+       info_ptr->splt_palettes, info_ptr->splt_palettes_num,
+       &info_ptr->splt_palettes_max, nentries, sizeof *np));
 
    if (np == NULL)
    {
@@ -1090,9 +1128,11 @@ png_set_sPLT(png_const_structrp png_ptr,
       return;
    }
 
-   png_free(png_ptr, info_ptr->splt_palettes);
-   info_ptr->splt_palettes = np;
-   info_ptr->free_me |= PNG_FREE_SPLT;
+   if (np != info_ptr->splt_palettes)
+   {
+      info_ptr->splt_palettes = np;
+      info_ptr->free_me |= PNG_FREE_SPLT;
+   }
 
    np += info_ptr->splt_palettes_num;
 
@@ -1236,9 +1276,9 @@ png_set_unknown_chunks(png_const_structrp png_ptr,
     * undefined behavior.  Now png_chunk_report is used to provide behavior
     * appropriate to read or write.
     */
-   np = png_voidcast(png_unknown_chunkp, png_realloc_array(png_ptr,
-       info_ptr->unknown_chunks, info_ptr->unknown_chunks_num, num_unknowns,
-       sizeof *np));
+   np = png_voidcast(png_unknown_chunkp, png_grow_array(png_ptr,
+       info_ptr->unknown_chunks, info_ptr->unknown_chunks_num,
+       &info_ptr->unknown_chunks_max, num_unknowns, sizeof *np));
 
    if (np == NULL)
    {
@@ -1248,9 +1288,11 @@ png_set_unknown_chunks(png_const_structrp png_ptr,
       return;
    }
 
-   png_free(png_ptr, info_ptr->unknown_chunks);
-   info_ptr->unknown_chunks = np; /* safe because it is initialized */
-   info_ptr->free_me |= PNG_FREE_UNKN;
+   if (np != info_ptr->unknown_chunks)
+   {
+      info_ptr->unknown_chunks = np; /* safe because it is initialized */
+      info_ptr->free_me |= PNG_FREE_UNKN;
+   }
 
    np += info_ptr->unknown_chunks_num;
 
@@ -1665,6 +1707,22 @@ png_set_chunk_malloc_max(png_structrp png_ptr,
 }
 #endif /* ?SET_USER_LIMITS */
 
+#ifdef PNG_INFLATE_LIMITS_SUPPORTED
+void PNGAPI
+png_set_inflate_limits(png_structrp png_ptr, png_uint_32 ratio_max,
+    png_alloc_size_t inflate_max, png_alloc_size_t work_max)
+{
+   png_debug(1, "in png_set_inflate_limits");
+
+   if (png_ptr == NULL)
+      return;
+
+   png_ptr->inflate_ratio_max = ratio_max;
+   png_ptr->inflate_max = inflate_max;
+   png_ptr->inflate_work_max = work_max;
+}
+#endif /* INFLATE_LIMITS */
+
 
 #ifdef PNG_BENIGN_ERRORS_SUPPORTED
 void PNGAPI
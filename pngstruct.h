@@ -66,6 +66,18 @@ typedef struct png_compression_buffer
 
 #define PNG_COMPRESSION_BUFFER_SIZE(pp)\
    (offsetof(png_compression_buffer, output) + (pp)->zbuffer_size)
+
+/* The parameters a deflate stream was initialized with; while they do not
+ * change the stream need only be reset for the next chunk.
+ */
+typedef struct png_zlib_settings
+{
+   int level;
+   int method;
+   int window_bits;
+   int mem_level;
+   int strategy;
+} png_zlib_settings;
 #endif
 
 /* Colorspace support; structures used in png_struct, png_info and in internal
@@ -157,6 +169,17 @@ struct png_struct_def
    png_rw_ptr read_data_fn;   /* function for reading input data */
    png_voidp io_ptr;          /* ptr to application struct for I/O functions */
 
+#ifdef PNG_READ_SKIP_IDAT_SUPPORTED
+   png_seek_ptr read_seek_fn; /* function for skipping input data */
+   png_byte skip_IDAT;        /* PNG_SKIP_IDAT_ setting for png_read_end */
+#endif
+#ifdef PNG_READ_COPY_IDAT_SUPPORTED
+   png_structp copy_IDAT_ptr; /* write struct to receive skipped IDAT chunks */
+#endif
+#ifdef PNG_READ_VERIFY_SUPPORTED
+   png_uint_32 verify_status; /* PNG_VERIFY_ flags for problems detected */
+#endif
+
 #ifdef PNG_READ_USER_TRANSFORM_SUPPORTED
    png_user_transform_ptr read_user_transform_fn; /* user read transform */
 #endif
@@ -180,7 +203,9 @@ struct png_struct_def
    png_uint_32 transformations; /* which transformations to perform */
 
    png_uint_32 zowner;        /* ID (chunk type) of zstream owner, 0 if none */
-   z_stream    zstream;       /* decompression structure */
+   z_streamp   zstream;       /* the stream last claimed, one of: */
+   z_stream    zstream_idat;  /* the IDAT stream */
+   z_stream    zstream_chunk; /* the stream of the other compressed chunks */
 
 #ifdef PNG_WRITE_SUPPORTED
    png_compression_bufferp zbuffer_list; /* Created on demand during write */
@@ -203,11 +228,8 @@ struct png_struct_def
 /* End of material added at libpng 1.5.4 */
 /* Added at libpng 1.6.0 */
 #ifdef PNG_WRITE_SUPPORTED
-   int zlib_set_level;        /* Actual values set into the zstream on write */
-   int zlib_set_method;
-   int zlib_set_window_bits;
-   int zlib_set_mem_level;
-   int zlib_set_strategy;
+   png_zlib_settings zlib_set_idat;  /* Actual values set into the zstreams */
+   png_zlib_settings zlib_set_chunk; /* on write */
 #endif
 
    png_uint_32 width;         /* width of image in pixels */
@@ -448,6 +470,17 @@ struct png_struct_def
    png_alloc_size_t user_chunk_malloc_max;
 #endif
 
+#ifdef PNG_INFLATE_LIMITS_SUPPORTED
+   /* The limits set by png_set_inflate_limits (0 means unlimited) and the
+    * running totals, over every zlib stream read, that they apply to.
+    */
+   png_uint_32      inflate_ratio_max;
+   png_alloc_size_t inflate_max;
+   png_alloc_size_t inflate_work_max;
+   png_alloc_size_t inflate_total;    /* bytes produced by inflate */
+   png_alloc_size_t inflate_work;     /* bytes consumed and produced */
+#endif
+
 /* New member added in libpng-1.0.25 and 1.2.17 */
 #ifdef PNG_READ_UNKNOWN_CHUNKS_SUPPORTED
    /* Temporary storage for unknown chunk that the library doesn't recognize,
@@ -468,6 +501,70 @@ struct png_struct_def
   uInt             IDAT_read_size;   /* limit on read buffer size for IDAT */
 #endif
 
+#ifdef PNG_EXECUTOR_SUPPORTED
+   png_submit_ptr submit_fn;    /* runs a task for libpng, NULL for default */
+   png_wait_ptr   wait_fn;      /* waits for a task submit_fn accepted */
+   png_voidp      executor_ptr; /* passed to both */
+#endif
+
+#if defined(PNG_TASK_SUPPORTED) && PNG_THREADS_OPT > 0
+   png_voidp      task_workers; /* idle threads kept for png_task_start */
+#endif
+
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+   int              compression_threads; /* 0 or 1 for serial compression */
+   png_alloc_size_t compression_block;   /* bytes deflated by each task */
+   png_voidp        compression_state;   /* while IDAT is being written */
+#endif
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+   png_byte         encode_preset;       /* PNG_ENCODE_PRESET_, 0 for none */
+   png_byte         auto_strategy;       /* the strategy AUTO chose */
+   png_voidp        auto_sample;         /* AUTO's statistics and held data */
+#endif
+
+#ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+   png_voidp        fast_encoder;        /* PNG_COMPRESSION_LEVEL_FASTEST */
+#endif
+
+#ifdef PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED
+   png_voidp        optimal_encoder;     /* PNG_COMPRESSION_LEVEL_OPTIMAL */
+#endif
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+   png_frame_cachep frame_cache;         /* png_set_frame_cache, not owned */
+#endif
+
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+   png_uint_32 write_pipeline_rows;    /* rows filtered per batch, 0 if off */
+   int         write_pipeline_threads; /* filter tasks per batch */
+   png_voidp   write_pipeline;         /* the state while rows are written */
+#endif
+
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+   png_byte     heuristic_method;  /* PNG_FILTER_HEURISTIC_, 0 is UNWEIGHTED */
+   png_byte     num_prev_filters;  /* rows png_set_filter_heuristics weights */
+   png_bytep    prev_filters;      /* filters of those rows, latest first */
+   png_uint_16p filter_weights;    /* PNG_WEIGHT_FACTOR is 1.0 */
+   png_uint_16  filter_costs[PNG_FILTER_VALUE_LAST]; /* PNG_COST_FACTOR is 1.0 */
+   png_voidp    filter_trials;     /* the PNG_FILTER_HEURISTIC_ZLIB state */
+#endif
+
+#ifdef PNG_READ_PIPELINE_SUPPORTED
+   png_uint_32 pipeline_rows; /* size of the ring of inflated rows, 0 if off */
+   png_bytep   pipeline_buf;  /* the ring, allocated on first use */
+   size_t      pipeline_size; /* allocated size of pipeline_buf */
+   png_voidp   pipeline;      /* the pipeline state while a task is running */
+#ifdef PNG_READ_TRANSFORM_THREADS_SUPPORTED
+   int         transform_threads; /* transform tasks per batch, 0 if off */
+#endif
+#endif
+
+#ifdef PNG_READ_CONTIGUOUS_SUPPORTED
+   size_t       image_row_stride;    /* png_set_image_layout, 0 for default */
+   unsigned int image_row_alignment; /* 0 for PNG_IMAGE_ROW_ALIGNMENT */
+#endif
+
 #ifdef PNG_IO_STATE_SUPPORTED
 /* New member added in libpng-1.4.0 */
    png_uint_32 io_state;
@@ -848,6 +848,265 @@ pngtest_check_text_support(png_structp png_ptr, png_textp text_ptr,
 #endif
 /* END of code to check that libpng has the required text support */
 
+#ifdef PNG_READ_VERIFY_SUPPORTED
+/* Check the file with png_verify before the full read; the report is only
+ * printed in verbose mode or when the check fails.
+ */
+static int
+verify_one_file(const char *inname)
+{
+   png_FILE_p fp;
+   png_structp png_ptr;
+   png_infop info_ptr;
+   png_verify_report report;
+   int ok;
+
+   if ((fp = fopen(inname, "rb")) == NULL)
+   {
+      fprintf(STDERR, "Could not find input file %s\n", inname);
+      return (1);
+   }
+
+   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   info_ptr = png_create_info_struct(png_ptr);
+
+   if (info_ptr == NULL)
+   {
+      png_destroy_read_struct(&png_ptr, NULL, NULL);
+      FCLOSE(fp);
+      return (1);
+   }
+
+   png_init_io(png_ptr, fp);
+   ok = png_verify(png_ptr, info_ptr, &report);
+
+   if (verbose != 0 || ok == 0)
+   {
+      fprintf(STDERR, "\n  %s: verify %s (status 0x%lx, %lu rows,"
+          " %lu compressed bytes, %lu image bytes, palette max %d)",
+          inname, ok ? "passed" : "FAILED", (unsigned long)report.status,
+          (unsigned long)report.rows, (unsigned long)report.compressed_bytes,
+          (unsigned long)report.image_bytes, report.palette_max);
+
+      if (report.message[0] != 0)
+         fprintf(STDERR, "\n  %s: %s", inname, report.message);
+   }
+
+   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+   FCLOSE(fp);
+
+   return ok == 0;
+}
+#endif /* READ_VERIFY */
+
+#if defined(PNG_TEXT_SUPPORTED) && defined(PNG_USER_MEM_SUPPORTED) &&\
+    defined(PNG_SETJMP_SUPPORTED)
+/* The strings stored by png_set_text come from a pool owned by the info
+ * struct.  Check that freeing one item, handing the text to the application
+ * with png_data_freer and adding text afterwards neither leaks nor frees a
+ * pooled string on its own.  The allocations are counted here because the
+ * memory checks above need PNG_DEBUG.
+ */
+static int text_pool_allocations = 0;
+
+static png_voidp PNGCBAPI
+text_pool_malloc(png_structp png_ptr, png_alloc_size_t size)
+{
+   png_voidp ptr = malloc((size_t)size);
+
+   PNG_UNUSED(png_ptr)
+
+   if (ptr != NULL)
+      ++text_pool_allocations;
+
+   return ptr;
+}
+
+static void PNGCBAPI
+text_pool_free(png_structp png_ptr, png_voidp ptr)
+{
+   PNG_UNUSED(png_ptr)
+
+   if (ptr != NULL)
+   {
+      --text_pool_allocations;
+      free(ptr);
+   }
+}
+
+#define TEXT_POOL_ITEMS 40
+
+static int
+text_pool_check(png_const_structp png_ptr, png_infop info_ptr,
+    int missing)
+{
+   png_textp text;
+   int i, num_text = png_get_text(png_ptr, info_ptr, &text, NULL);
+   char value[32];
+
+   if (num_text != TEXT_POOL_ITEMS)
+      return 0;
+
+   for (i = 0; i < num_text; i++)
+   {
+      if (i == missing)
+      {
+         if (text[i].key != NULL)
+            return 0;
+
+         continue;
+      }
+
+      sprintf(value, "value %d", i);
+
+      if (text[i].key == NULL || strcmp(text[i].key, "Comment") != 0 ||
+          strcmp(text[i].text, value) != 0)
+         return 0;
+
+#ifdef PNG_iTXt_SUPPORTED
+      if (text[i].compression == PNG_ITXT_COMPRESSION_NONE &&
+          (strcmp(text[i].lang, "en") != 0 ||
+           strcmp(text[i].lang_key, "Remark") != 0))
+         return 0;
+#endif
+   }
+
+   return 1;
+}
+
+static void
+text_pool_set(png_structp png_ptr, png_infop info_ptr, int first, int count)
+{
+   int i;
+
+   for (i = first; i < first + count; i++)
+   {
+      png_text text;
+      char key[] = "Comment", lang[] = "en", lang_key[] = "Remark";
+      char value[32];
+
+      sprintf(value, "value %d", i);
+      memset(&text, 0, sizeof text);
+      text.compression = PNG_TEXT_COMPRESSION_NONE;
+      text.key = key;
+      text.text = value;
+
+#ifdef PNG_iTXt_SUPPORTED
+      if (i & 1)
+      {
+         text.compression = PNG_ITXT_COMPRESSION_NONE;
+         text.lang = lang;
+         text.lang_key = lang_key;
+      }
+#else
+      PNG_UNUSED(lang)
+      PNG_UNUSED(lang_key)
+#endif
+
+      png_set_text(png_ptr, info_ptr, &text, 1);
+   }
+}
+
+static int
+test_text_pool(void)
+{
+   png_structp png_ptr;
+   png_infop info_ptr;
+   const char *volatile failed = NULL; /* set after setjmp */
+   int i;
+
+   png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+       NULL, text_pool_malloc, text_pool_free);
+   info_ptr = png_create_info_struct(png_ptr);
+
+   if (info_ptr == NULL)
+   {
+      fprintf(STDERR, "text pool: out of memory\n");
+      png_destroy_read_struct(&png_ptr, NULL, NULL);
+      return 1;
+   }
+
+   if (setjmp(png_jmpbuf(png_ptr)))
+   {
+      fprintf(STDERR, "text pool: libpng error\n");
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      return 1;
+   }
+
+   /* Free one pooled item, then add the rest after it. */
+   text_pool_set(png_ptr, info_ptr, 0, TEXT_POOL_ITEMS/2);
+   png_free_data(png_ptr, info_ptr, PNG_FREE_TEXT, 3);
+   text_pool_set(png_ptr, info_ptr, TEXT_POOL_ITEMS/2, TEXT_POOL_ITEMS/2);
+
+   if (text_pool_check(png_ptr, info_ptr, 3) == 0)
+      failed = "single item png_free_data";
+
+   /* Take the text over; each key must then be separately png_free'able. */
+   if (failed == NULL)
+   {
+      png_textp text;
+      int num_text;
+
+      png_data_freer(png_ptr, info_ptr, PNG_USER_WILL_FREE_DATA,
+          PNG_FREE_TEXT);
+
+      if (text_pool_check(png_ptr, info_ptr, 3) == 0)
+         failed = "png_data_freer";
+
+      num_text = png_get_text(png_ptr, info_ptr, &text, NULL);
+
+      for (i = 0; i < num_text; i++)
+         png_free(png_ptr, text[i].key);
+
+      png_free(png_ptr, text);
+   }
+
+   png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+   /* A single item freed from a pool that is then freed as a whole: */
+   if (failed == NULL)
+   {
+      png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL,
+          NULL, NULL, text_pool_malloc, text_pool_free);
+      info_ptr = png_create_info_struct(png_ptr);
+
+      if (info_ptr == NULL || setjmp(png_jmpbuf(png_ptr)))
+      {
+         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+         failed = "second pool";
+      }
+
+      else
+      {
+         text_pool_set(png_ptr, info_ptr, 0, TEXT_POOL_ITEMS);
+
+         for (i = 0; i < TEXT_POOL_ITEMS; i += 2)
+            png_free_data(png_ptr, info_ptr, PNG_FREE_TEXT, i);
+
+         png_free_data(png_ptr, info_ptr, PNG_FREE_TEXT, -1);
+         text_pool_set(png_ptr, info_ptr, 0, TEXT_POOL_ITEMS);
+
+         if (text_pool_check(png_ptr, info_ptr, -1) == 0)
+            failed = "text after png_free_data";
+
+         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      }
+   }
+
+   if (failed == NULL && text_pool_allocations != 0)
+      failed = "memory leak";
+
+   if (failed != NULL)
+   {
+      fprintf(STDERR, "text pool: %s (%d allocations left)\n", failed,
+          text_pool_allocations);
+      return 1;
+   }
+
+   return 0;
+}
+#endif /* TEXT && USER_MEM && SETJMP */
+
 /* Test one file */
 static int
 test_one_file(const char *inname, const char *outname)
@@ -879,6 +1138,12 @@ test_one_file(const char *inname, const char *outname)
    row_buf = NULL;
    error_parameters.file_name = inname;
 
+#ifdef PNG_READ_VERIFY_SUPPORTED
+   /* Files that are expected to be damaged are tested with --relaxed: */
+   if (verify_one_file(inname) != 0 && relaxed == 0)
+      return (1);
+#endif
+
    if ((fpin = fopen(inname, "rb")) == NULL)
    {
       fprintf(STDERR, "Could not find input file %s\n", inname);
@@ -2117,6 +2382,11 @@ main(int argc, char *argv[])
        t_misc/(float)CLOCKS_PER_SEC);
 #endif
 
+#if defined(PNG_TEXT_SUPPORTED) && defined(PNG_USER_MEM_SUPPORTED) &&\
+    defined(PNG_SETJMP_SUPPORTED)
+   ierror += test_text_pool();
+#endif
+
    if (ierror == 0)
       fprintf(STDERR, " libpng passes test\n");
 
@@ -239,7 +239,10 @@ png_write_info(png_structrp png_ptr, png_const_inforp info_ptr)
 
 #ifdef PNG_WRITE_eXIf_SUPPORTED
    if ((info_ptr->valid & PNG_INFO_eXIf) != 0)
+   {
       png_write_eXIf(png_ptr, info_ptr->exif, info_ptr->num_exif);
+      png_ptr->mode |= PNG_WROTE_eXIf;
+   }
 #endif
 
 #ifdef PNG_WRITE_hIST_SUPPORTED
@@ -366,7 +369,11 @@ png_write_end(png_structrp png_ptr, png_inforp info_ptr)
       png_error(png_ptr, "No IDATs written into file");
 
 #ifdef PNG_WRITE_CHECK_FOR_INVALID_INDEX_SUPPORTED
-   if (png_ptr->num_palette_max > png_ptr->num_palette)
+   /* num_palette_max is the largest index written, so an index equal to
+    * num_palette is already out of range.
+    */
+   if (png_ptr->color_type == PNG_COLOR_TYPE_PALETTE &&
+       png_ptr->num_palette_max >= png_ptr->num_palette)
       png_benign_error(png_ptr, "Wrote palette index exceeding num_palette");
 #endif
 
@@ -382,6 +389,13 @@ png_write_end(png_structrp png_ptr, png_inforp info_ptr)
           (png_ptr->mode & PNG_WROTE_tIME) == 0)
          png_write_tIME(png_ptr, &(info_ptr->mod_time));
 
+#endif
+#ifdef PNG_WRITE_eXIf_SUPPORTED
+      /* Write eXIf after IDAT if it was not written by png_write_info */
+      if ((info_ptr->valid & PNG_INFO_eXIf) != 0 &&
+          (png_ptr->mode & PNG_WROTE_eXIf) == 0)
+         png_write_eXIf(png_ptr, info_ptr->exif, info_ptr->num_exif);
+
 #endif
 #ifdef PNG_WRITE_TEXT_SUPPORTED
       /* Loop through comment chunks */
@@ -923,6 +937,10 @@ png_write_flush(png_structrp png_ptr)
    if (png_ptr->row_number >= png_ptr->num_rows)
       return;
 
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+   png_write_pipeline_flush(png_ptr);
+#endif
+
    png_compress_IDAT(png_ptr, NULL, 0, Z_SYNC_FLUSH);
    png_ptr->flush_rows = 0;
    png_flush(png_ptr);
@@ -935,9 +953,31 @@ png_write_destroy(png_structrp png_ptr)
 {
    png_debug(1, "in png_write_destroy");
 
+   /* These must be first: the tasks may still be using the memory. */
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+   png_free_write_pipeline(png_ptr);
+#endif
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+   png_free_compression_threads(png_ptr);
+#endif
+#ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+   png_free(png_ptr, png_ptr->fast_encoder);
+   png_ptr->fast_encoder = NULL;
+#endif
+#ifdef PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED
+   png_free_optimal_encoder(png_ptr);
+#endif
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+   png_free(png_ptr, png_ptr->auto_sample);
+   png_ptr->auto_sample = NULL;
+#endif
+
    /* Free any memory zlib uses */
    if ((png_ptr->flags & PNG_FLAG_ZSTREAM_INITIALIZED) != 0)
-      deflateEnd(&png_ptr->zstream);
+      deflateEnd(&png_ptr->zstream_idat);
+
+   if ((png_ptr->flags & PNG_FLAG_ZCHUNK_INITIALIZED) != 0)
+      deflateEnd(&png_ptr->zstream_chunk);
 
    /* Free our memory.  png_free checks NULL for us. */
    png_free_buffer_list(png_ptr, &png_ptr->zbuffer_list);
@@ -952,6 +992,16 @@ png_write_destroy(png_structrp png_ptr)
    png_ptr->tst_row = NULL;
 #endif
 
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+   png_free_filter_trials(png_ptr);
+#endif
+   png_free(png_ptr, png_ptr->prev_filters);
+   png_free(png_ptr, png_ptr->filter_weights);
+   png_ptr->prev_filters = NULL;
+   png_ptr->filter_weights = NULL;
+#endif
+
 #ifdef PNG_SET_UNKNOWN_CHUNKS_SUPPORTED
    png_free(png_ptr, png_ptr->chunk_list);
    png_ptr->chunk_list = NULL;
@@ -1117,33 +1167,158 @@ png_set_filter(png_structrp png_ptr, int method, int filters)
       png_error(png_ptr, "Unknown custom filter method");
 }
 
-#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED /* DEPRECATED */
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+/* Check the method and set up the weights and costs for the callers to fill
+ * in.  Returns 0 if the method is not valid.
+ */
+static int
+png_init_filter_heuristics(png_structrp png_ptr, int heuristic_method,
+    int num_weights)
+{
+   int i;
+
+   if (png_ptr == NULL)
+      return 0;
+
+   if (heuristic_method < 0 || heuristic_method >= PNG_FILTER_HEURISTIC_LAST)
+   {
+      png_warning(png_ptr, "Unknown filter heuristic method");
+      return 0;
+   }
+
+   if (heuristic_method == PNG_FILTER_HEURISTIC_DEFAULT)
+      heuristic_method = PNG_FILTER_HEURISTIC_UNWEIGHTED;
+
+   /* Only the WEIGHTED method remembers the filters of earlier rows. */
+   if (heuristic_method != PNG_FILTER_HEURISTIC_WEIGHTED || num_weights < 0)
+      num_weights = 0;
+
+   else if (num_weights > 255)
+      num_weights = 255;
+
+   png_free(png_ptr, png_ptr->prev_filters);
+   png_free(png_ptr, png_ptr->filter_weights);
+   png_ptr->prev_filters = NULL;
+   png_ptr->filter_weights = NULL;
+   png_ptr->num_prev_filters = 0;
+   png_ptr->heuristic_method = (png_byte)heuristic_method;
+
+   if (num_weights > 0)
+   {
+      png_ptr->prev_filters = png_voidcast(png_bytep,
+          png_malloc(png_ptr, (png_alloc_size_t)num_weights));
+
+      /* No row has been filtered yet. */
+      memset(png_ptr->prev_filters, PNG_FILTER_VALUE_LAST,
+          (size_t)num_weights);
+
+      png_ptr->filter_weights = png_voidcast(png_uint_16p, png_malloc(png_ptr,
+          (png_alloc_size_t)num_weights * (sizeof *png_ptr->filter_weights)));
+
+      for (i = 0; i < num_weights; ++i)
+         png_ptr->filter_weights[i] = PNG_WEIGHT_FACTOR;
+
+      png_ptr->num_prev_filters = (png_byte)num_weights;
+   }
+
+   for (i = 0; i < PNG_FILTER_VALUE_LAST; ++i)
+      png_ptr->filter_costs[i] = PNG_COST_FACTOR;
+
+   return 1;
+}
+
+/* Weights and costs are stored as 16-bit fixed point numbers; zero would make
+ * a filter free, so the smallest value is one.
+ */
+static png_uint_16
+png_filter_factor(png_uint_32 value)
+{
+   if (value < 1)
+      return 1;
+
+   if (value > 65535)
+      return 65535;
+
+   return (png_uint_16)value;
+}
+
 /* Provide floating and fixed point APIs */
 #ifdef PNG_FLOATING_POINT_SUPPORTED
+static png_uint_16
+png_filter_factor_fp(double value, int shift)
+{
+   value = value * (1 << shift) + .5;
+
+   return png_filter_factor(value >= 65535 ? 65535 : (png_uint_32)value);
+}
+
 void PNGAPI
 png_set_filter_heuristics(png_structrp png_ptr, int heuristic_method,
     int num_weights, png_const_doublep filter_weights,
     png_const_doublep filter_costs)
 {
-   PNG_UNUSED(png_ptr)
-   PNG_UNUSED(heuristic_method)
-   PNG_UNUSED(num_weights)
-   PNG_UNUSED(filter_weights)
-   PNG_UNUSED(filter_costs)
+   int i;
+
+   png_debug(1, "in png_set_filter_heuristics");
+
+   if (png_init_filter_heuristics(png_ptr, heuristic_method,
+       filter_weights != NULL ? num_weights : 0) == 0)
+      return;
+
+   /* Negative weights and costs mean 1.0, the default. */
+   for (i = 0; i < png_ptr->num_prev_filters; ++i)
+      if (filter_weights[i] >= 0)
+         png_ptr->filter_weights[i] =
+             png_filter_factor_fp(filter_weights[i], PNG_WEIGHT_SHIFT);
+
+   if (filter_costs != NULL &&
+       png_ptr->heuristic_method == PNG_FILTER_HEURISTIC_WEIGHTED)
+      for (i = 0; i < PNG_FILTER_VALUE_LAST; ++i)
+         if (filter_costs[i] >= 0)
+            png_ptr->filter_costs[i] =
+                png_filter_factor_fp(filter_costs[i], PNG_COST_SHIFT);
 }
 #endif /* FLOATING_POINT */
 
 #ifdef PNG_FIXED_POINT_SUPPORTED
+static png_uint_16
+png_filter_factor_fixed(png_fixed_point value, int shift)
+{
+   png_uint_32 whole = (png_uint_32)value / PNG_FP_1;
+   png_uint_32 part = (png_uint_32)value % PNG_FP_1;
+
+   if (whole >= 65535)
+      return 65535;
+
+   return png_filter_factor((whole << shift) +
+       ((part << shift) + PNG_FP_1/2) / PNG_FP_1);
+}
+
 void PNGAPI
 png_set_filter_heuristics_fixed(png_structrp png_ptr, int heuristic_method,
     int num_weights, png_const_fixed_point_p filter_weights,
     png_const_fixed_point_p filter_costs)
 {
-   PNG_UNUSED(png_ptr)
-   PNG_UNUSED(heuristic_method)
-   PNG_UNUSED(num_weights)
-   PNG_UNUSED(filter_weights)
-   PNG_UNUSED(filter_costs)
+   int i;
+
+   png_debug(1, "in png_set_filter_heuristics_fixed");
+
+   if (png_init_filter_heuristics(png_ptr, heuristic_method,
+       filter_weights != NULL ? num_weights : 0) == 0)
+      return;
+
+   /* Negative weights and costs mean 1.0, the default. */
+   for (i = 0; i < png_ptr->num_prev_filters; ++i)
+      if (filter_weights[i] >= 0)
+         png_ptr->filter_weights[i] =
+             png_filter_factor_fixed(filter_weights[i], PNG_WEIGHT_SHIFT);
+
+   if (filter_costs != NULL &&
+       png_ptr->heuristic_method == PNG_FILTER_HEURISTIC_WEIGHTED)
+      for (i = 0; i < PNG_FILTER_VALUE_LAST; ++i)
+         if (filter_costs[i] >= 0)
+            png_ptr->filter_costs[i] =
+                png_filter_factor_fixed(filter_costs[i], PNG_COST_SHIFT);
 }
 #endif /* FIXED_POINT */
 #endif /* WRITE_WEIGHTED_FILTER */
@@ -1233,6 +1408,148 @@ png_set_compression_method(png_structrp png_ptr, int method)
 }
 #endif /* WRITE_CUSTOMIZE_COMPRESSION */
 
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+void PNGAPI
+png_set_compression_threads(png_structrp png_ptr, int threads,
+    png_alloc_size_t block_size)
+{
+   png_debug(1, "in png_set_compression_threads");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (threads < 0)
+      threads = 0;
+
+   else if (threads > PNG_COMPRESSION_THREADS_MAX)
+      threads = PNG_COMPRESSION_THREADS_MAX;
+
+   if (block_size == 0)
+      block_size = PNG_COMPRESSION_THREAD_BLOCK;
+
+   if (block_size < PNG_COMPRESSION_BLOCK_MIN)
+      block_size = PNG_COMPRESSION_BLOCK_MIN;
+
+   else if (block_size > PNG_COMPRESSION_BLOCK_MAX)
+      block_size = PNG_COMPRESSION_BLOCK_MAX;
+
+   png_ptr->compression_threads = threads;
+   png_ptr->compression_block = block_size;
+}
+#endif /* WRITE_COMPRESSION_THREADS */
+
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+void PNGAPI
+png_set_write_pipeline(png_structrp png_ptr, png_uint_32 rows, int threads)
+{
+   png_debug(1, "in png_set_write_pipeline");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (threads < 0)
+      threads = 0;
+
+   else if (threads > PNG_WRITE_PIPELINE_TASKS)
+      threads = PNG_WRITE_PIPELINE_TASKS;
+
+   png_ptr->write_pipeline_rows = rows;
+   png_ptr->write_pipeline_threads = threads;
+}
+#endif /* WRITE_PIPELINE */
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+void PNGAPI
+png_set_frame_cache(png_structrp png_ptr, png_frame_cachep cache)
+{
+   png_debug(1, "in png_set_frame_cache");
+
+   if (png_ptr == NULL)
+      return;
+
+   png_ptr->frame_cache = cache;
+}
+#endif /* WRITE_FRAME_CACHE */
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+/* The zlib settings of each png_set_encode_preset preset, as measured by
+ * contrib/libtests/pngfilterbench --presets; png_write_IHDR chooses the
+ * filters and the strategy once the pixel format is known.
+ */
+static const struct
+{
+   png_int_16 level;
+   png_byte   window_bits;
+   png_byte   mem_level;
+   png_byte   heuristic;    /* PNG_FILTER_HEURISTIC_ */
+   png_uint_16 buffer_size; /* 0 leaves png_set_compression_buffer_size */
+}
+png_encode_presets[PNG_ENCODE_PRESET_LAST] =
+{
+   /* DEFAULT: what png_create_write_struct sets */
+   { PNG_Z_DEFAULT_COMPRESSION, 15, 8, PNG_FILTER_HEURISTIC_DEFAULT, 0 },
+   /* FASTEST: the same as HIGH_SPEED without the fast encoder */
+   {
+#  ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+      PNG_COMPRESSION_LEVEL_FASTEST,
+#  else
+      2,
+#  endif
+      15, 8, PNG_FILTER_HEURISTIC_DEFAULT, 0
+   },
+   /* HIGH_SPEED: zlib's fast matcher, level 2 is as fast as 1 */
+   { 2, 15, 8, PNG_FILTER_HEURISTIC_DEFAULT, 0 },
+   /* BALANCED */
+   { 6, 15, 8, PNG_FILTER_HEURISTIC_DEFAULT, 0 },
+   /* HIGH_COMPRESSION: each row is filtered by trial compression */
+   { 9, 15, 9, PNG_FILTER_HEURISTIC_ZLIB, 0 },
+   /* HIGH_READ_SPEED: cheap filters, longer matches */
+   { 9, 15, 8, PNG_FILTER_HEURISTIC_DEFAULT, 0 },
+   /* LOW_MEMORY: 32K of deflate state rather than 256K */
+   { 6, 12, 5, PNG_FILTER_HEURISTIC_DEFAULT, 4096 },
+   /* OPTIMAL: as HIGH_COMPRESSION without the optimal encoder */
+   {
+#  ifdef PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED
+      PNG_COMPRESSION_LEVEL_OPTIMAL,
+#  else
+      9,
+#  endif
+      15, 9, PNG_FILTER_HEURISTIC_ZLIB, 0
+   },
+   /* AUTO: the filters and strategy are chosen from the first rows */
+   { 6, 15, 8, PNG_FILTER_HEURISTIC_DEFAULT, 0 }
+};
+
+void PNGAPI
+png_set_encode_preset(png_structrp png_ptr, int preset)
+{
+   png_debug(1, "in png_set_encode_preset");
+
+   if (png_ptr == NULL)
+      return;
+
+   if (preset < 0 || preset >= PNG_ENCODE_PRESET_LAST)
+   {
+      png_warning(png_ptr, "Unknown encode preset");
+      return;
+   }
+
+   png_ptr->encode_preset = (png_byte)preset;
+   png_ptr->zlib_level = png_encode_presets[preset].level;
+   png_ptr->zlib_window_bits = png_encode_presets[preset].window_bits;
+   png_ptr->zlib_mem_level = png_encode_presets[preset].mem_level;
+
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+   png_init_filter_heuristics(png_ptr, png_encode_presets[preset].heuristic,
+       0);
+#endif
+
+   if (png_encode_presets[preset].buffer_size > 0)
+      png_set_compression_buffer_size(png_ptr,
+          png_encode_presets[preset].buffer_size);
+}
+#endif /* WRITE_ENCODE_PRESET */
+
 /* The following were added to libpng-1.5.4 */
 #ifdef PNG_WRITE_CUSTOMIZE_ZTXT_COMPRESSION_SUPPORTED
 void PNGAPI
@@ -1502,19 +1819,58 @@ typedef struct
    /* Arguments: */
    png_imagep      image;
    png_const_voidp buffer;
-   png_int_32      row_stride;
+   png_ptrdiff_t   row_stride;
    png_const_voidp colormap;
    int             convert_to_8bit;
+   int             large;          /* row_stride is from a _large API */
    /* Local variables: */
    png_const_voidp first_row;
    ptrdiff_t       row_bytes;
    png_voidp       local_row;
+#ifdef PNG_SIMPLIFIED_WRITE_ROWS_SUPPORTED
+   /* png_image_write_rows_to_*; buffer is NULL and the rows come from: */
+   png_image_row_source_ptr source_fn;
+   png_voidp                source_ptr;
+#endif
+#ifdef PNG_SIMPLIFIED_WRITE_REDUCE_SUPPORTED
+   /* PNG_IMAGE_FLAG_REDUCE; NULL if the image is written as it is */
+   png_voidp       reduce;
+#endif
    /* Byte count for memory writing */
    png_bytep        memory;
    png_alloc_size_t memory_bytes; /* not used for STDIO */
    png_alloc_size_t output_bytes; /* running total */
+   /* png_image_write_to_memory_realloc; NULL if 'memory' cannot grow */
+   png_image_realloc_ptr realloc_fn;
+   png_voidp             realloc_ptr;
+   png_alloc_size_t      memory_max; /* PNG_IMAGE_PNG_SIZE_MAX */
 } png_image_write_control;
 
+/* Return image row 'y' of the application data; the rows are asked for in order
+ * from the top.
+ */
+static png_const_voidp
+png_image_write_row(png_image_write_control *display, png_uint_32 y)
+{
+   png_const_bytep row = png_voidcast(png_const_bytep, display->first_row);
+
+#ifdef PNG_SIMPLIFIED_WRITE_ROWS_SUPPORTED
+   if (display->source_fn != NULL)
+   {
+      png_const_voidp source_row = (*display->source_fn)(display->image,
+          display->source_ptr, y);
+
+      if (source_row == NULL)
+         png_error(display->image->opaque->png_ptr,
+             "png_image_write_rows: stopped by the application");
+
+      return source_row;
+   }
+#endif
+
+   return row + y * display->row_bytes;
+}
+
 /* Write png_uint_16 input to a 16-bit PNG; the png_ptr has already been set to
  * do any necessary byte swapping.  The component order is defined by the
  * png_image format value.
@@ -1527,14 +1883,13 @@ png_write_image_16bit(png_voidp argument)
    png_imagep image = display->image;
    png_structrp png_ptr = image->opaque->png_ptr;
 
-   png_const_uint_16p input_row = png_voidcast(png_const_uint_16p,
-       display->first_row);
    png_uint_16p output_row = png_voidcast(png_uint_16p, display->local_row);
    png_uint_16p row_end;
    unsigned int channels = (image->format & PNG_FORMAT_FLAG_COLOR) != 0 ?
        3 : 1;
    int aindex = 0;
-   png_uint_32 y = image->height;
+   unsigned int afirst = 0; /* 1 to skip an alpha channel before the color */
+   png_uint_32 y;
 
    if ((image->format & PNG_FORMAT_FLAG_ALPHA) != 0)
    {
@@ -1542,7 +1897,7 @@ png_write_image_16bit(png_voidp argument)
       if ((image->format & PNG_FORMAT_FLAG_AFIRST) != 0)
       {
          aindex = -1;
-         ++input_row; /* To point to the first component */
+         afirst = 1; /* To point to the first component */
          ++output_row;
       }
          else
@@ -1559,13 +1914,16 @@ png_write_image_16bit(png_voidp argument)
     * above to 'row' means that row_end can actually be beyond the end of the
     * row; this is correct.
     */
-   row_end = output_row + image->width * (channels+1);
+   row_end = output_row + (size_t)image->width * (channels+1);
 
-   for (; y > 0; --y)
+   for (y = 0; y < image->height; ++y)
    {
-      png_const_uint_16p in_ptr = input_row;
+      png_const_uint_16p in_ptr = png_voidcast(png_const_uint_16p,
+          png_image_write_row(display, y));
       png_uint_16p out_ptr = output_row;
 
+      in_ptr += afirst;
+
       while (out_ptr < row_end)
       {
          png_uint_16 alpha = in_ptr[aindex];
@@ -1617,7 +1975,6 @@ png_write_image_16bit(png_voidp argument)
       }
 
       png_write_row(png_ptr, png_voidcast(png_const_bytep, display->local_row));
-      input_row += (png_uint_16)display->row_bytes/(sizeof (png_uint_16));
    }
 
    return 1;
@@ -1686,10 +2043,8 @@ png_write_image_8bit(png_voidp argument)
    png_imagep image = display->image;
    png_structrp png_ptr = image->opaque->png_ptr;
 
-   png_const_uint_16p input_row = png_voidcast(png_const_uint_16p,
-       display->first_row);
    png_bytep output_row = png_voidcast(png_bytep, display->local_row);
-   png_uint_32 y = image->height;
+   png_uint_32 y;
    unsigned int channels = (image->format & PNG_FORMAT_FLAG_COLOR) != 0 ?
        3 : 1;
 
@@ -1697,12 +2052,13 @@ png_write_image_8bit(png_voidp argument)
    {
       png_bytep row_end;
       int aindex;
+      unsigned int afirst = 0; /* As in png_write_image_16bit */
 
 #   ifdef PNG_SIMPLIFIED_WRITE_AFIRST_SUPPORTED
       if ((image->format & PNG_FORMAT_FLAG_AFIRST) != 0)
       {
          aindex = -1;
-         ++input_row; /* To point to the first component */
+         afirst = 1; /* To point to the first component */
          ++output_row;
       }
 
@@ -1711,13 +2067,16 @@ png_write_image_8bit(png_voidp argument)
       aindex = (int)channels;
 
       /* Use row_end in place of a loop counter: */
-      row_end = output_row + image->width * (channels+1);
+      row_end = output_row + (size_t)image->width * (channels+1);
 
-      for (; y > 0; --y)
+      for (y = 0; y < image->height; ++y)
       {
-         png_const_uint_16p in_ptr = input_row;
+         png_const_uint_16p in_ptr = png_voidcast(png_const_uint_16p,
+             png_image_write_row(display, y));
          png_bytep out_ptr = output_row;
 
+         in_ptr += afirst;
+
          while (out_ptr < row_end)
          {
             png_uint_16 alpha = in_ptr[aindex];
@@ -1743,7 +2102,6 @@ png_write_image_8bit(png_voidp argument)
 
          png_write_row(png_ptr, png_voidcast(png_const_bytep,
              display->local_row));
-         input_row += (png_uint_16)display->row_bytes/(sizeof (png_uint_16));
       } /* while y */
    }
 
@@ -1752,11 +2110,12 @@ png_write_image_8bit(png_voidp argument)
       /* No alpha channel, so the row_end really is the end of the row and it
        * is sufficient to loop over the components one by one.
        */
-      png_bytep row_end = output_row + image->width * channels;
+      png_bytep row_end = output_row + (size_t)image->width * channels;
 
-      for (; y > 0; --y)
+      for (y = 0; y < image->height; ++y)
       {
-         png_const_uint_16p in_ptr = input_row;
+         png_const_uint_16p in_ptr = png_voidcast(png_const_uint_16p,
+             png_image_write_row(display, y));
          png_bytep out_ptr = output_row;
 
          while (out_ptr < row_end)
@@ -1768,7 +2127,6 @@ png_write_image_8bit(png_voidp argument)
          }
 
          png_write_row(png_ptr, output_row);
-         input_row += (png_uint_16)display->row_bytes/(sizeof (png_uint_16));
       }
    }
 
@@ -1921,109 +2279,506 @@ png_image_set_PLTE(png_image_write_control *display)
    image->colormap_entries = (png_uint_32)entries;
 }
 
+#ifdef PNG_SIMPLIFIED_WRITE_REDUCE_SUPPORTED
+/* PNG_IMAGE_FLAG_REDUCE: one pass over the image finds whether the alpha
+ * channel is all opaque, whether the color channels are all equal, whether the
+ * bytes of each 16-bit sample are equal, which lower bit depths hold the gray
+ * values exactly and up to 256 distinct colors.  The image is then written in
+ * the smallest of the formats that holds it without loss.  Only images that
+ * png_write_row would be given unchanged are reduced, so that the values
+ * examined are those that would be written.
+ */
+typedef struct
+{
+   int           color_type;   /* The PNG color type chosen */
+   int           bit_depth;
+   int           linear;       /* The input has 16-bit samples */
+   unsigned int  channels;     /* Samples in an input pixel */
+   int           red, green, blue, alpha; /* Their offsets, alpha -1 if none */
+   unsigned int  colors;       /* Distinct colors, 257 for too many */
+   png_uint_32   color[512];   /* Open hash of the colors as 0xRRGGBBAA */
+   png_byte      used[512];
+   png_byte      index[512];   /* Their palette indices */
+} png_image_reduce;
+
+static unsigned int
+png_image_reduce_find(const png_image_reduce *reduce, png_uint_32 color)
+{
+   unsigned int h =
+       (unsigned int)(((color * 0x9e3779b1U) & 0xffffffffU) >> 23) & 511;
+
+   /* There are never more than 257 colors in the table. */
+   while (reduce->used[h] != 0 && reduce->color[h] != color)
+      h = (h + 1) & 511;
+
+   return h;
+}
+
+/* Return the samples of pixel 'x' of 'row' as 0xRRGGBBAA, with the top byte of
+ * 16-bit samples.
+ */
+static png_uint_32
+png_image_reduce_color(const png_image_reduce *reduce, png_const_voidp row,
+    png_uint_32 x, png_uint_32p sample)
+{
+   size_t i = (size_t)x * reduce->channels;
+   png_uint_32 key;
+   int c;
+
+   if (reduce->linear != 0)
+   {
+      png_const_uint_16p p = png_voidcast(png_const_uint_16p, row);
+
+      p += i;
+
+      sample[0] = p[reduce->red];
+      sample[1] = p[reduce->green];
+      sample[2] = p[reduce->blue];
+      sample[3] = reduce->alpha >= 0 ? p[reduce->alpha] : 65535;
+   }
+
+   else
+   {
+      png_const_bytep p = png_voidcast(png_const_bytep, row);
+
+      p += i;
+
+      sample[0] = p[reduce->red];
+      sample[1] = p[reduce->green];
+      sample[2] = p[reduce->blue];
+      sample[3] = reduce->alpha >= 0 ? p[reduce->alpha] : 255;
+   }
+
+   for (key = 0, c = 0; c < 4; ++c)
+      key = (key << 8) + (reduce->linear != 0 ? sample[c] >> 8 : sample[c]);
+
+   return key;
+}
+
+/* Examine the image and set reduce->color_type and bit_depth; returns 0 if the
+ * image is best written as it is.
+ */
 static int
-png_image_write_main(png_voidp argument)
+png_image_reduce_analyse(png_image_write_control *display,
+    png_image_reduce *reduce)
 {
-   png_image_write_control *display = png_voidcast(png_image_write_control*,
-       argument);
    png_imagep image = display->image;
-   png_structrp png_ptr = image->opaque->png_ptr;
-   png_inforp info_ptr = image->opaque->info_ptr;
    png_uint_32 format = image->format;
+   png_uint_32 max = (format & PNG_FORMAT_FLAG_LINEAR) != 0 ? 65535 : 255;
+   int color = (format & PNG_FORMAT_FLAG_COLOR) != 0;
+   int opaque, gray, replicated;
+   unsigned int depths = 1|2|4; /* The lower gray bit depths still possible */
+   png_uint_32 y;
+
+   memset(reduce, 0, (sizeof *reduce));
+   reduce->linear = max == 65535;
+   reduce->channels = PNG_IMAGE_PIXEL_CHANNELS(format);
+   reduce->alpha = -1;
+
+   if ((format & PNG_FORMAT_FLAG_ALPHA) != 0)
+   {
+#  ifdef PNG_FORMAT_AFIRST_SUPPORTED
+      if ((format & PNG_FORMAT_FLAG_AFIRST) != 0)
+      {
+         reduce->alpha = 0;
+         reduce->red = 1;
+      }
 
-   /* The following four ints are actually booleans */
-   int colormap = (format & PNG_FORMAT_FLAG_COLORMAP);
-   int linear = !colormap && (format & PNG_FORMAT_FLAG_LINEAR); /* input */
-   int alpha = !colormap && (format & PNG_FORMAT_FLAG_ALPHA);
-   int write_16bit = linear && (display->convert_to_8bit == 0);
+      else
+#  endif
+      reduce->alpha = (int)reduce->channels - 1;
+   }
 
-#   ifdef PNG_BENIGN_ERRORS_SUPPORTED
-      /* Make sure we error out on any bad situation */
-      png_set_benign_errors(png_ptr, 0/*error*/);
-#   endif
+   reduce->green = reduce->blue = reduce->red;
 
-   /* Default the 'row_stride' parameter if required, also check the row stride
-    * and total image size to ensure that they are within the system limits.
-    */
+   if (color != 0)
    {
-      unsigned int channels = PNG_IMAGE_PIXEL_CHANNELS(image->format);
+      reduce->green += 1;
+      reduce->blue += 2;
 
-      if (image->width <= 0x7fffffffU/channels) /* no overflow */
+#  ifdef PNG_FORMAT_BGR_SUPPORTED
+      if ((format & PNG_FORMAT_FLAG_BGR) != 0)
       {
-         png_uint_32 check;
-         png_uint_32 png_row_stride = image->width * channels;
+         reduce->blue -= 2;
+         reduce->red += 2;
+      }
+#  endif
+   }
 
-         if (display->row_stride == 0)
-            display->row_stride = (png_int_32)/*SAFE*/png_row_stride;
+   opaque = reduce->alpha >= 0;
+   gray = color;
+   replicated = reduce->linear;
 
-         if (display->row_stride < 0)
-            check = (png_uint_32)(-display->row_stride);
+   for (y = 0; y < image->height; ++y)
+   {
+      png_const_voidp row = png_image_write_row(display, y);
+      png_uint_32 x;
 
-         else
-            check = (png_uint_32)display->row_stride;
+      for (x = 0; x < image->width; ++x)
+      {
+         png_uint_32 sample[4];
+         png_uint_32 key = png_image_reduce_color(reduce, row, x, sample);
+         png_uint_32 v;
 
-         if (check >= png_row_stride)
+         if (sample[3] != max)
          {
-            /* Now check for overflow of the image buffer calculation; this
-             * limits the whole image size to 32 bits for API compatibility with
-             * the current, 32-bit, PNG_IMAGE_BUFFER_SIZE macro.
-             */
-            if (image->height > 0xffffffffU/png_row_stride)
-               png_error(image->opaque->png_ptr, "memory image too large");
+            opaque = 0;
+
+            /* 16-bit alpha is premultiplied and written unpremultiplied. */
+            if (reduce->linear != 0)
+               return 0;
          }
 
-         else
-            png_error(image->opaque->png_ptr, "supplied row stride too small");
-      }
+         if (sample[0] != sample[1] || sample[1] != sample[2])
+            gray = 0, depths = 0;
 
-      else
-         png_error(image->opaque->png_ptr, "image row stride too large");
-   }
+         if (replicated != 0 && (((sample[0] ^ (sample[0] >> 8)) |
+             (sample[1] ^ (sample[1] >> 8)) | (sample[2] ^ (sample[2] >> 8)) |
+             (sample[3] ^ (sample[3] >> 8))) & 0xff) != 0)
+            replicated = 0, depths = 0, reduce->colors = 257;
 
-   /* Set the required transforms then write the rows in the correct order. */
-   if ((format & PNG_FORMAT_FLAG_COLORMAP) != 0)
-   {
-      if (display->colormap != NULL && image->colormap_entries > 0)
-      {
-         png_uint_32 entries = image->colormap_entries;
+         v = key >> 24;
 
-         png_set_IHDR(png_ptr, info_ptr, image->width, image->height,
-             entries > 16 ? 8 : (entries > 4 ? 4 : (entries > 2 ? 2 : 1)),
-             PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
-             PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+         if ((depths & 1) != 0 && v != 0 && v != 255)
+            depths &= ~1U;
 
-         png_image_set_PLTE(display);
+         if ((depths & 2) != 0 && v % 85 != 0)
+            depths &= ~2U;
+
+         if ((depths & 4) != 0 && v % 17 != 0)
+            depths &= ~4U;
+
+         if (reduce->colors <= 256)
+         {
+            unsigned int h = png_image_reduce_find(reduce, key);
+
+            if (reduce->used[h] == 0)
+            {
+               reduce->used[h] = 1;
+               reduce->color[h] = key;
+               reduce->colors++;
+            }
+         }
       }
 
-      else
-         png_error(image->opaque->png_ptr,
-             "no color-map for color-mapped image");
+      /* Stop when there is nothing left to reduce. */
+      if (opaque == 0 && gray == 0 && replicated == 0 && depths == 0 &&
+          reduce->colors > 256)
+         return 0;
    }
 
+   if (reduce->linear != 0 && replicated == 0)
+      reduce->bit_depth = 16;
+
    else
-      png_set_IHDR(png_ptr, info_ptr, image->width, image->height,
-          write_16bit ? 16 : 8,
-          ((format & PNG_FORMAT_FLAG_COLOR) ? PNG_COLOR_MASK_COLOR : 0) +
-          ((format & PNG_FORMAT_FLAG_ALPHA) ? PNG_COLOR_MASK_ALPHA : 0),
-          PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+      reduce->bit_depth = 8;
 
-   /* Counter-intuitively the data transformations must be called *after*
-    * png_write_info, not before as in the read code, but the 'set' functions
-    * must still be called before.  Just set the color space information, never
-    * write an interlaced image.
-    */
+   reduce->color_type = (color != 0 && gray == 0 ? PNG_COLOR_MASK_COLOR : 0) +
+       (reduce->alpha >= 0 && opaque == 0 ? PNG_COLOR_MASK_ALPHA : 0);
 
-   if (write_16bit != 0)
+   if (reduce->bit_depth == 8)
    {
-      /* The gamma here is 1.0 (linear) and the cHRM chunk matches sRGB. */
-      png_set_gAMA_fixed(png_ptr, info_ptr, PNG_GAMMA_LINEAR);
+      unsigned int colors = reduce->colors;
+      int palette_depth = colors <= 2 ? 1 : colors <= 4 ? 2 :
+          colors <= 16 ? 4 : 8;
 
-      if ((image->flags & PNG_IMAGE_FLAG_COLORSPACE_NOT_sRGB) == 0)
-         png_set_cHRM_fixed(png_ptr, info_ptr,
-             /* color      x       y */
-             /* white */ 31270, 32900,
-             /* red   */ 64000, 33000,
-             /* green */ 30000, 60000,
+      if (reduce->color_type == PNG_COLOR_TYPE_GRAY)
+         reduce->bit_depth = (depths & 1) != 0 ? 1 : (depths & 2) != 0 ? 2 :
+             (depths & 4) != 0 ? 4 : 8;
+
+      /* A palette is only used where the smaller rows at least pay for PLTE and
+       * tRNS, which also keeps the file within PNG_IMAGE_PNG_SIZE_MAX.
+       */
+      if (colors <= 256)
+      {
+         unsigned int channels =
+             ((reduce->color_type & PNG_COLOR_MASK_COLOR) != 0 ? 3U : 1U) +
+             ((reduce->color_type & PNG_COLOR_MASK_ALPHA) != 0 ? 1U : 0U);
+         png_alloc_size_t width = image->width;
+         png_alloc_size_t row = (width * channels *
+             (unsigned int)reduce->bit_depth + 7) >> 3;
+         png_alloc_size_t palette_row =
+             (width * (unsigned int)palette_depth + 7) >> 3;
+         png_uint_32 overhead = 24 + 4 * colors;
+
+         if (row > palette_row && row - palette_row >=
+             (overhead + image->height - 1) / image->height)
+         {
+            reduce->color_type = PNG_COLOR_TYPE_PALETTE;
+            reduce->bit_depth = palette_depth;
+         }
+      }
+   }
+
+   /* Is this any different from the format as given? */
+   return reduce->bit_depth != (max == 65535 ? 16 : 8) ||
+       reduce->color_type != (color != 0 ? PNG_COLOR_MASK_COLOR : 0) +
+          ((format & PNG_FORMAT_FLAG_ALPHA) != 0 ? PNG_COLOR_MASK_ALPHA : 0);
+}
+
+/* Number the colors, the transparent ones first so that tRNS is short, and set
+ * PLTE and tRNS.
+ */
+static void
+png_image_reduce_PLTE(png_image_write_control *display,
+    png_image_reduce *reduce)
+{
+   png_color palette[256];
+   png_byte tRNS[256];
+   int entries = 0, num_trans = 0, pass;
+
+   for (pass = 0; pass < 2; ++pass)
+   {
+      unsigned int h;
+
+      for (h = 0; h < 512; ++h)
+      {
+         png_uint_32 color = reduce->color[h];
+
+         if (reduce->used[h] != 0 && ((color & 0xff) < 255) == (pass == 0))
+         {
+            palette[entries].red = (png_byte)(color >> 24);
+            palette[entries].green = (png_byte)((color >> 16) & 0xff);
+            palette[entries].blue = (png_byte)((color >> 8) & 0xff);
+            tRNS[entries] = (png_byte)(color & 0xff);
+            reduce->index[h] = (png_byte)entries++;
+         }
+      }
+
+      if (pass == 0)
+         num_trans = entries;
+   }
+
+   png_set_PLTE(display->image->opaque->png_ptr,
+       display->image->opaque->info_ptr, palette, entries);
+
+   if (num_trans > 0)
+      png_set_tRNS(display->image->opaque->png_ptr,
+          display->image->opaque->info_ptr, tRNS, num_trans, NULL);
+}
+
+/* Write the rows in the format png_image_reduce_analyse chose.  Bit depths
+ * below 8 are packed by png_set_packing.
+ */
+static int
+png_write_image_reduced(png_voidp argument)
+{
+   png_image_write_control *display = png_voidcast(png_image_write_control*,
+       argument);
+   png_imagep image = display->image;
+   png_structrp png_ptr = image->opaque->png_ptr;
+   const png_image_reduce *reduce =
+       png_voidcast(const png_image_reduce*, display->reduce);
+   int color_type = reduce->color_type;
+   unsigned int scale = 1;
+   png_uint_32 y;
+
+   if (color_type == PNG_COLOR_TYPE_GRAY && reduce->bit_depth < 8)
+      scale = 255U / ((1U << reduce->bit_depth) - 1U);
+
+   for (y = 0; y < image->height; ++y)
+   {
+      png_const_voidp row = png_image_write_row(display, y);
+      png_bytep out = png_voidcast(png_bytep, display->local_row);
+      png_uint_16p out16 = png_voidcast(png_uint_16p, display->local_row);
+      png_uint_32 x;
+
+      for (x = 0; x < image->width; ++x)
+      {
+         png_uint_32 sample[4];
+         png_uint_32 key = png_image_reduce_color(reduce, row, x, sample);
+
+         if (color_type == PNG_COLOR_TYPE_PALETTE)
+            *out++ = reduce->index[png_image_reduce_find(reduce, key)];
+
+         else if (reduce->bit_depth == 16)
+         {
+            *out16++ = (png_uint_16)sample[0];
+
+            if ((color_type & PNG_COLOR_MASK_COLOR) != 0)
+            {
+               *out16++ = (png_uint_16)sample[1];
+               *out16++ = (png_uint_16)sample[2];
+            }
+
+            if ((color_type & PNG_COLOR_MASK_ALPHA) != 0)
+               *out16++ = (png_uint_16)sample[3];
+         }
+
+         else
+         {
+            *out++ = (png_byte)((key >> 24) / scale);
+
+            if ((color_type & PNG_COLOR_MASK_COLOR) != 0)
+            {
+               *out++ = (png_byte)(key >> 16);
+               *out++ = (png_byte)(key >> 8);
+            }
+
+            if ((color_type & PNG_COLOR_MASK_ALPHA) != 0)
+               *out++ = (png_byte)key;
+         }
+      }
+
+      png_write_row(png_ptr, png_voidcast(png_const_bytep,
+          display->local_row));
+   }
+
+   return 1;
+}
+#endif /* SIMPLIFIED_WRITE_REDUCE */
+
+static int
+png_image_write_main(png_voidp argument)
+{
+   png_image_write_control *display = png_voidcast(png_image_write_control*,
+       argument);
+   png_imagep image = display->image;
+   png_structrp png_ptr = image->opaque->png_ptr;
+   png_inforp info_ptr = image->opaque->info_ptr;
+   png_uint_32 format = image->format;
+
+   /* The following four ints are actually booleans */
+   int colormap = (format & PNG_FORMAT_FLAG_COLORMAP);
+   int linear = !colormap && (format & PNG_FORMAT_FLAG_LINEAR); /* input */
+   int alpha = !colormap && (format & PNG_FORMAT_FLAG_ALPHA);
+   int write_16bit = linear && (display->convert_to_8bit == 0);
+   int reduced = 0;
+#   ifdef PNG_SIMPLIFIED_WRITE_REDUCE_SUPPORTED
+   png_image_reduce reduce;
+#   endif
+
+#   ifdef PNG_BENIGN_ERRORS_SUPPORTED
+      /* Make sure we error out on any bad situation */
+      png_set_benign_errors(png_ptr, 0/*error*/);
+#   endif
+
+   /* Default the 'row_stride' parameter if required, also check the row stride
+    * and total image size to ensure that they are within the system limits.
+    * The _large APIs and rows from a callback are only limited by what a
+    * png_ptrdiff_t can address, the other APIs by the 32-bit limits of
+    * PNG_IMAGE_BUFFER_SIZE.
+    */
+   {
+      unsigned int channels = PNG_IMAGE_PIXEL_CHANNELS(image->format);
+      int large = display->large != 0 || display->buffer == NULL;
+
+      if (image->width <= (large ? PNG_PTRDIFF_MAX : 0x7fffffffU)/channels)
+      {
+         png_alloc_size_t check;
+         png_alloc_size_t png_row_stride =
+             (png_alloc_size_t)image->width * channels;
+
+         if (display->row_stride == 0)
+            display->row_stride = (png_ptrdiff_t)/*SAFE*/png_row_stride;
+
+         /* The negation is unsigned so that it does not overflow: */
+         if (display->row_stride < 0)
+            check = 0 - (png_alloc_size_t)display->row_stride;
+
+         else
+            check = (png_alloc_size_t)display->row_stride;
+
+         if (check >= png_row_stride)
+         {
+            /* Now check for overflow of the image buffer calculation; without
+             * _large this limits the whole image size to 32 bits for API
+             * compatibility with the current, 32-bit, PNG_IMAGE_BUFFER_SIZE
+             * macro.  Rows from a callback are never held together, so no
+             * limit applies.
+             */
+            if (display->buffer != NULL && (large ?
+                image->height > PNG_PTRDIFF_MAX/
+                   PNG_IMAGE_PIXEL_COMPONENT_SIZE(image->format)/check :
+                image->height > 0xffffffffU/png_row_stride))
+               png_error(image->opaque->png_ptr, "memory image too large");
+         }
+
+         else
+            png_error(image->opaque->png_ptr, "supplied row stride too small");
+      }
+
+      else
+         png_error(image->opaque->png_ptr, "image row stride too large");
+   }
+
+   {
+      png_const_bytep row = png_voidcast(png_const_bytep, display->buffer);
+      ptrdiff_t row_bytes = display->row_stride;
+
+      if (linear != 0)
+         row_bytes *= (sizeof (png_uint_16));
+
+      if (row_bytes < 0)
+         row += (image->height-1) * (-row_bytes);
+
+      display->first_row = row;
+      display->row_bytes = row_bytes;
+   }
+
+#ifdef PNG_SIMPLIFIED_WRITE_REDUCE_SUPPORTED
+   /* The rows are examined twice, so this needs the whole image in memory. */
+   if ((image->flags & PNG_IMAGE_FLAG_REDUCE) != 0 && colormap == 0 &&
+       display->buffer != NULL && display->convert_to_8bit == 0 &&
+       png_image_reduce_analyse(display, &reduce) != 0)
+   {
+      reduced = 1;
+      display->reduce = &reduce;
+
+      png_set_IHDR(png_ptr, info_ptr, image->width, image->height,
+          reduce.bit_depth, reduce.color_type, PNG_INTERLACE_NONE,
+          PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+      if (reduce.color_type == PNG_COLOR_TYPE_PALETTE)
+         png_image_reduce_PLTE(display, &reduce);
+   }
+
+   else
+#endif
+   /* Set the required transforms then write the rows in the correct order. */
+   if ((format & PNG_FORMAT_FLAG_COLORMAP) != 0)
+   {
+      if (display->colormap != NULL && image->colormap_entries > 0)
+      {
+         png_uint_32 entries = image->colormap_entries;
+
+         png_set_IHDR(png_ptr, info_ptr, image->width, image->height,
+             entries > 16 ? 8 : (entries > 4 ? 4 : (entries > 2 ? 2 : 1)),
+             PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+             PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+         png_image_set_PLTE(display);
+      }
+
+      else
+         png_error(image->opaque->png_ptr,
+             "no color-map for color-mapped image");
+   }
+
+   else
+      png_set_IHDR(png_ptr, info_ptr, image->width, image->height,
+          write_16bit ? 16 : 8,
+          ((format & PNG_FORMAT_FLAG_COLOR) ? PNG_COLOR_MASK_COLOR : 0) +
+          ((format & PNG_FORMAT_FLAG_ALPHA) ? PNG_COLOR_MASK_ALPHA : 0),
+          PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+   /* Counter-intuitively the data transformations must be called *after*
+    * png_write_info, not before as in the read code, but the 'set' functions
+    * must still be called before.  Just set the color space information, never
+    * write an interlaced image.
+    */
+
+   if (write_16bit != 0)
+   {
+      /* The gamma here is 1.0 (linear) and the cHRM chunk matches sRGB. */
+      png_set_gAMA_fixed(png_ptr, info_ptr, PNG_GAMMA_LINEAR);
+
+      if ((image->flags & PNG_IMAGE_FLAG_COLORSPACE_NOT_sRGB) == 0)
+         png_set_cHRM_fixed(png_ptr, info_ptr,
+             /* color      x       y */
+             /* white */ 31270, 32900,
+             /* red   */ 64000, 33000,
+             /* green */ 30000, 60000,
              /* blue  */ 15000,  6000
          );
    }
@@ -2045,7 +2800,7 @@ png_image_write_main(png_voidp argument)
     *
     * First check for a little endian system if writing 16-bit files.
     */
-   if (write_16bit != 0)
+   if (write_16bit != 0 && png_get_bit_depth(png_ptr, info_ptr) == 16)
    {
       png_uint_16 le = 0x0001;
 
@@ -2053,10 +2808,12 @@ png_image_write_main(png_voidp argument)
          png_set_swap(png_ptr);
    }
 
+   /* Rows written by png_write_image_reduced are already in PNG order. */
 #   ifdef PNG_SIMPLIFIED_WRITE_BGR_SUPPORTED
       if ((format & PNG_FORMAT_FLAG_BGR) != 0)
       {
-         if (colormap == 0 && (format & PNG_FORMAT_FLAG_COLOR) != 0)
+         if (colormap == 0 && reduced == 0 &&
+             (format & PNG_FORMAT_FLAG_COLOR) != 0)
             png_set_bgr(png_ptr);
          format &= ~PNG_FORMAT_FLAG_BGR;
       }
@@ -2065,16 +2822,18 @@ png_image_write_main(png_voidp argument)
 #   ifdef PNG_SIMPLIFIED_WRITE_AFIRST_SUPPORTED
       if ((format & PNG_FORMAT_FLAG_AFIRST) != 0)
       {
-         if (colormap == 0 && (format & PNG_FORMAT_FLAG_ALPHA) != 0)
+         if (colormap == 0 && reduced == 0 &&
+             (format & PNG_FORMAT_FLAG_ALPHA) != 0)
             png_set_swap_alpha(png_ptr);
          format &= ~PNG_FORMAT_FLAG_AFIRST;
       }
 #   endif
 
-   /* If there are 16 or fewer color-map entries we wrote a lower bit depth
-    * above, but the application data is still byte packed.
+   /* If there are 16 or fewer color-map entries, or the image was reduced to
+    * fewer than 8 bits, a lower bit depth was written above but the rows
+    * passed to png_write_row are still byte packed.
     */
-   if (colormap != 0 && image->colormap_entries <= 16)
+   if (png_get_bit_depth(png_ptr, info_ptr) < 8)
       png_set_packing(png_ptr);
 
    /* That should have handled all (both) the transforms. */
@@ -2082,22 +2841,8 @@ png_image_write_main(png_voidp argument)
          PNG_FORMAT_FLAG_ALPHA | PNG_FORMAT_FLAG_COLORMAP)) != 0)
       png_error(png_ptr, "png_write_image: unsupported transformation");
 
-   {
-      png_const_bytep row = png_voidcast(png_const_bytep, display->buffer);
-      ptrdiff_t row_bytes = display->row_stride;
-
-      if (linear != 0)
-         row_bytes *= (sizeof (png_uint_16));
-
-      if (row_bytes < 0)
-         row += (image->height-1) * (-row_bytes);
-
-      display->first_row = row;
-      display->row_bytes = row_bytes;
-   }
-
    /* Apply 'fast' options if the flag is set. */
-   if ((image->flags & PNG_IMAGE_FLAG_FAST) != 0)
+   if ((image->flags & (PNG_IMAGE_FLAG_FAST|PNG_IMAGE_FLAG_FASTEST)) != 0)
    {
       png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_NO_FILTERS);
       /* NOTE: determined by experiment using pngstest, this reflects some
@@ -2110,18 +2855,40 @@ png_image_write_main(png_voidp argument)
 #   endif
    }
 
+#ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+   if ((image->flags & PNG_IMAGE_FLAG_FASTEST) != 0)
+      png_ptr->zlib_level = PNG_COMPRESSION_LEVEL_FASTEST;
+#endif
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+   if ((image->flags & PNG_IMAGE_FLAG_ENCODE_PRESET_MASK) != 0)
+      png_set_encode_preset(png_ptr, (int)((image->flags &
+          PNG_IMAGE_FLAG_ENCODE_PRESET_MASK) >> 8));
+#endif
+
    /* Check for the cases that currently require a pre-transform on the row
     * before it is written.  This only applies when the input is 16-bit and
     * either there is an alpha channel or it is converted to 8-bit.
     */
-   if ((linear != 0 && alpha != 0 ) ||
+   if (reduced != 0 || (linear != 0 && alpha != 0 ) ||
        (colormap == 0 && display->convert_to_8bit != 0))
    {
-      png_bytep row = png_voidcast(png_bytep, png_malloc(png_ptr,
-          png_get_rowbytes(png_ptr, info_ptr)));
+      png_alloc_size_t row_size = png_get_rowbytes(png_ptr, info_ptr);
+      png_bytep row;
       int result;
 
+      /* The rows are byte packed before png_set_packing. */
+      if (row_size < image->width)
+         row_size = image->width;
+
+      row = png_voidcast(png_bytep, png_malloc(png_ptr, row_size));
+
       display->local_row = row;
+#   ifdef PNG_SIMPLIFIED_WRITE_REDUCE_SUPPORTED
+      if (reduced != 0)
+         result = png_safe_execute(image, png_write_image_reduced, display);
+      else
+#   endif
       if (write_16bit != 0)
          result = png_safe_execute(image, png_write_image_16bit, display);
       else
@@ -2140,15 +2907,11 @@ png_image_write_main(png_voidp argument)
     */
    else
    {
-      png_const_bytep row = png_voidcast(png_const_bytep, display->first_row);
-      ptrdiff_t row_bytes = display->row_bytes;
-      png_uint_32 y = image->height;
+      png_uint_32 y;
 
-      for (; y > 0; --y)
-      {
-         png_write_row(png_ptr, row);
-         row += row_bytes;
-      }
+      for (y = 0; y < image->height; ++y)
+         png_write_row(png_ptr, png_voidcast(png_const_bytep,
+             png_image_write_row(display, y)));
    }
 
    png_write_end(png_ptr, info_ptr);
@@ -2156,6 +2919,35 @@ png_image_write_main(png_voidp argument)
 }
 
 
+/* Make the buffer of png_image_write_to_memory_realloc big enough for 'needed'
+ * bytes.  It is doubled so that the data is only copied a few times, but not
+ * beyond the size the PNG cannot exceed.
+ */
+static void
+image_memory_grow(png_structrp png_ptr, png_image_write_control *display,
+    png_alloc_size_t needed)
+{
+   png_alloc_size_t size = display->memory_bytes;
+   png_voidp memory;
+
+   if (size < PNG_ZBUF_SIZE)
+      size = PNG_ZBUF_SIZE;
+
+   while (size < needed)
+      size = size <= PNG_SIZE_MAX/2 ? size * 2 : needed;
+
+   if (size > display->memory_max && display->memory_max >= needed)
+      size = display->memory_max;
+
+   memory = display->realloc_fn(display->realloc_ptr, display->memory, size);
+
+   if (memory == NULL)
+      png_error(png_ptr, "png_image_write_to_memory_realloc: out of memory");
+
+   display->memory = png_voidcast(png_bytep, memory);
+   display->memory_bytes = size;
+}
+
 static void (PNGCBAPI
 image_memory_write)(png_structp png_ptr, png_bytep/*const*/ data, size_t size)
 {
@@ -2169,6 +2961,9 @@ image_memory_write)(png_structp png_ptr, png_bytep/*const*/ data, size_t size)
       /* I don't think libpng ever does this, but just in case: */
       if (size > 0)
       {
+         if (display->realloc_fn != NULL && display->memory_bytes < ob+size)
+            image_memory_grow(png_ptr, display, ob+size);
+
          if (display->memory_bytes >= ob+size) /* writing */
             memcpy(display->memory+ob, data, size);
 
@@ -2203,6 +2998,51 @@ png_image_write_memory(png_voidp argument)
    return png_image_write_main(display);
 }
 
+/* The common part of the png_image_write_to_memory APIs; 'display' has the
+ * arguments for png_image_write_main.
+ */
+static int
+png_image_write_memory_control(png_image_write_control *display, void *memory,
+    png_alloc_size_t * PNG_RESTRICT memory_bytes)
+{
+   png_imagep image = display->image;
+
+   /* This is to give the caller an easier error detection in the NULL
+    * case and guard against uninitialized variable problems:
+    */
+   if (memory == NULL)
+      *memory_bytes = 0;
+
+   if (png_image_write_init(image) != 0)
+   {
+      int result;
+
+      display->memory = png_voidcast(png_bytep, memory);
+      display->memory_bytes = *memory_bytes;
+      display->output_bytes = 0;
+
+      result = png_safe_execute(image, png_image_write_memory, display);
+      png_image_free(image);
+
+      /* write_memory returns true even if we ran out of buffer. */
+      if (result)
+      {
+         /* On out-of-buffer this function returns '0' but still updates
+          * memory_bytes:
+          */
+         if (memory != NULL && display->output_bytes > *memory_bytes)
+            result = 0;
+
+         *memory_bytes = display->output_bytes;
+      }
+
+      return result;
+   }
+
+   else
+      return 0;
+}
+
 int PNGAPI
 png_image_write_to_memory(png_imagep image, void *memory,
     png_alloc_size_t * PNG_RESTRICT memory_bytes, int convert_to_8bit,
@@ -2213,63 +3053,170 @@ png_image_write_to_memory(png_imagep image, void *memory,
    {
       if (memory_bytes != NULL && buffer != NULL)
       {
-         /* This is to give the caller an easier error detection in the NULL
-          * case and guard against uninitialized variable problems:
-          */
-         if (memory == NULL)
-            *memory_bytes = 0;
+         png_image_write_control display;
 
-         if (png_image_write_init(image) != 0)
-         {
-            png_image_write_control display;
-            int result;
-
-            memset(&display, 0, (sizeof display));
-            display.image = image;
-            display.buffer = buffer;
-            display.row_stride = row_stride;
-            display.colormap = colormap;
-            display.convert_to_8bit = convert_to_8bit;
-            display.memory = png_voidcast(png_bytep, memory);
-            display.memory_bytes = *memory_bytes;
-            display.output_bytes = 0;
+         memset(&display, 0, (sizeof display));
+         display.image = image;
+         display.buffer = buffer;
+         display.row_stride = row_stride;
+         display.colormap = colormap;
+         display.convert_to_8bit = convert_to_8bit;
 
-            result = png_safe_execute(image, png_image_write_memory, &display);
-            png_image_free(image);
+         return png_image_write_memory_control(&display, memory, memory_bytes);
+      }
 
-            /* write_memory returns true even if we ran out of buffer. */
-            if (result)
-            {
-               /* On out-of-buffer this function returns '0' but still updates
-                * memory_bytes:
-                */
-               if (memory != NULL && display.output_bytes > *memory_bytes)
-                  result = 0;
+      else
+         return png_image_error(image,
+             "png_image_write_to_memory: invalid argument");
+   }
 
-               *memory_bytes = display.output_bytes;
-            }
+   else if (image != NULL)
+      return png_image_error(image,
+          "png_image_write_to_memory: incorrect PNG_IMAGE_VERSION");
+
+   else
+      return 0;
+}
+
+int PNGAPI
+png_image_write_to_memory_large(png_imagep image, void *memory,
+    png_alloc_size_t * PNG_RESTRICT memory_bytes, int convert_to_8bit,
+    const void *buffer, png_ptrdiff_t row_stride, const void *colormap)
+{
+   if (image != NULL && image->version == PNG_IMAGE_VERSION)
+   {
+      if (memory_bytes != NULL && buffer != NULL)
+      {
+         png_image_write_control display;
+
+         memset(&display, 0, (sizeof display));
+         display.image = image;
+         display.buffer = buffer;
+         display.row_stride = row_stride;
+         display.colormap = colormap;
+         display.convert_to_8bit = convert_to_8bit;
+         display.large = 1;
+
+         return png_image_write_memory_control(&display, memory, memory_bytes);
+      }
+
+      else
+         return png_image_error(image,
+             "png_image_write_to_memory_large: invalid argument");
+   }
+
+   else if (image != NULL)
+      return png_image_error(image,
+          "png_image_write_to_memory_large: incorrect PNG_IMAGE_VERSION");
+
+   else
+      return 0;
+}
+
+/* These use the C library of libpng, which may not be the application's. */
+void * PNGAPI
+png_image_realloc_memory(void *memory, png_alloc_size_t size)
+{
+   if (size > PNG_SIZE_MAX)
+      return NULL;
+
+   return realloc(memory, (size_t)size);
+}
 
-            return result;
+void PNGAPI
+png_image_free_memory(void *memory)
+{
+   free(memory);
+}
+
+static void *
+png_image_realloc(void *user_ptr, void *memory, png_alloc_size_t size)
+{
+   PNG_UNUSED(user_ptr)
+
+   return png_image_realloc_memory(memory, size);
+}
+
+int PNGAPI
+png_image_write_to_memory_realloc(png_imagep image, void **memory,
+    png_alloc_size_t * PNG_RESTRICT memory_bytes,
+    png_image_realloc_ptr realloc_fn, void *user_ptr, int convert_to_8bit,
+    const void *buffer, png_ptrdiff_t row_stride, const void *colormap)
+{
+   if (image != NULL && image->version == PNG_IMAGE_VERSION)
+   {
+      if (memory != NULL && memory_bytes != NULL && buffer != NULL)
+      {
+         png_image_write_control display;
+         int result = 0;
+
+         memset(&display, 0, (sizeof display));
+         display.image = image;
+         display.buffer = buffer;
+         display.row_stride = row_stride;
+         display.colormap = colormap;
+         display.convert_to_8bit = convert_to_8bit;
+         display.large = 1;
+         display.memory = png_voidcast(png_bytep, *memory);
+         display.memory_bytes = *memory != NULL ? *memory_bytes : 0;
+         display.realloc_fn = realloc_fn != NULL ? realloc_fn :
+             png_image_realloc;
+         display.realloc_ptr = user_ptr;
+         /* This may overflow, in which case it is not used: */
+         display.memory_max = PNG_IMAGE_PNG_SIZE_MAX(*image);
+
+         if (png_image_write_init(image) != 0)
+         {
+            result = png_safe_execute(image, png_image_write_memory, &display);
+            png_image_free(image);
          }
 
-         else
-            return 0;
+         /* The buffer may have moved even if the write failed. */
+         *memory = display.memory;
+         *memory_bytes = result ? display.output_bytes : 0;
+
+         return result;
       }
 
       else
          return png_image_error(image,
-             "png_image_write_to_memory: invalid argument");
+             "png_image_write_to_memory_realloc: invalid argument");
    }
 
    else if (image != NULL)
       return png_image_error(image,
-          "png_image_write_to_memory: incorrect PNG_IMAGE_VERSION");
+          "png_image_write_to_memory_realloc: incorrect PNG_IMAGE_VERSION");
 
    else
       return 0;
 }
 
 #ifdef PNG_SIMPLIFIED_WRITE_STDIO_SUPPORTED
+/* The common part of the png_image_write_to_stdio APIs. */
+static int
+png_image_write_stdio_control(png_image_write_control *display, FILE *file)
+{
+   png_imagep image = display->image;
+
+   if (png_image_write_init(image) != 0)
+   {
+      int result;
+
+      /* This is slightly evil, but png_init_io doesn't do anything other
+       * than this and we haven't changed the standard IO functions so
+       * this saves a 'safe' function.
+       */
+      image->opaque->png_ptr->io_ptr = file;
+
+      result = png_safe_execute(image, png_image_write_main, display);
+      png_image_free(image);
+      return result;
+   }
+
+   else
+      return 0;
+}
+
 int PNGAPI
 png_image_write_to_stdio(png_imagep image, FILE *file, int convert_to_8bit,
     const void *buffer, png_int_32 row_stride, const void *colormap)
@@ -2279,31 +3226,16 @@ png_image_write_to_stdio(png_imagep image, FILE *file, int convert_to_8bit,
    {
       if (file != NULL && buffer != NULL)
       {
-         if (png_image_write_init(image) != 0)
-         {
-            png_image_write_control display;
-            int result;
+         png_image_write_control display;
 
-            /* This is slightly evil, but png_init_io doesn't do anything other
-             * than this and we haven't changed the standard IO functions so
-             * this saves a 'safe' function.
-             */
-            image->opaque->png_ptr->io_ptr = file;
-
-            memset(&display, 0, (sizeof display));
-            display.image = image;
-            display.buffer = buffer;
-            display.row_stride = row_stride;
-            display.colormap = colormap;
-            display.convert_to_8bit = convert_to_8bit;
-
-            result = png_safe_execute(image, png_image_write_main, &display);
-            png_image_free(image);
-            return result;
-         }
+         memset(&display, 0, (sizeof display));
+         display.image = image;
+         display.buffer = buffer;
+         display.row_stride = row_stride;
+         display.colormap = colormap;
+         display.convert_to_8bit = convert_to_8bit;
 
-         else
-            return 0;
+         return png_image_write_stdio_control(&display, file);
       }
 
       else
@@ -2320,57 +3252,111 @@ png_image_write_to_stdio(png_imagep image, FILE *file, int convert_to_8bit,
 }
 
 int PNGAPI
-png_image_write_to_file(png_imagep image, const char *file_name,
-    int convert_to_8bit, const void *buffer, png_int_32 row_stride,
+png_image_write_to_stdio_large(png_imagep image, FILE *file,
+    int convert_to_8bit, const void *buffer, png_ptrdiff_t row_stride,
     const void *colormap)
 {
-   /* Write the image to the named file. */
    if (image != NULL && image->version == PNG_IMAGE_VERSION)
    {
-      if (file_name != NULL && buffer != NULL)
+      if (file != NULL && buffer != NULL)
       {
-         FILE *fp = fopen(file_name, "wb");
+         png_image_write_control display;
+
+         memset(&display, 0, (sizeof display));
+         display.image = image;
+         display.buffer = buffer;
+         display.row_stride = row_stride;
+         display.colormap = colormap;
+         display.convert_to_8bit = convert_to_8bit;
+         display.large = 1;
+
+         return png_image_write_stdio_control(&display, file);
+      }
+
+      else
+         return png_image_error(image,
+             "png_image_write_to_stdio_large: invalid argument");
+   }
 
-         if (fp != NULL)
+   else if (image != NULL)
+      return png_image_error(image,
+          "png_image_write_to_stdio_large: incorrect PNG_IMAGE_VERSION");
+
+   else
+      return 0;
+}
+
+/* The common part of the png_image_write_to_file APIs; the image is written
+ * to the named file, which is removed if the write fails.
+ */
+static int
+png_image_write_file_control(png_image_write_control *display,
+    const char *file_name)
+{
+   png_imagep image = display->image;
+   FILE *fp = fopen(file_name, "wb");
+
+   if (fp != NULL)
+   {
+      if (png_image_write_stdio_control(display, fp) != 0)
+      {
+         int error; /* from fflush/fclose */
+
+         /* Make sure the file is flushed correctly. */
+         if (fflush(fp) == 0 && ferror(fp) == 0)
          {
-            if (png_image_write_to_stdio(image, fp, convert_to_8bit, buffer,
-                row_stride, colormap) != 0)
-            {
-               int error; /* from fflush/fclose */
-
-               /* Make sure the file is flushed correctly. */
-               if (fflush(fp) == 0 && ferror(fp) == 0)
-               {
-                  if (fclose(fp) == 0)
-                     return 1;
-
-                  error = errno; /* from fclose */
-               }
-
-               else
-               {
-                  error = errno; /* from fflush or ferror */
-                  (void)fclose(fp);
-               }
-
-               (void)remove(file_name);
-               /* The image has already been cleaned up; this is just used to
-                * set the error (because the original write succeeded).
-                */
-               return png_image_error(image, strerror(error));
-            }
+            if (fclose(fp) == 0)
+               return 1;
 
-            else
-            {
-               /* Clean up: just the opened file. */
-               (void)fclose(fp);
-               (void)remove(file_name);
-               return 0;
-            }
+            error = errno; /* from fclose */
          }
 
          else
-            return png_image_error(image, strerror(errno));
+         {
+            error = errno; /* from fflush or ferror */
+            (void)fclose(fp);
+         }
+
+         (void)remove(file_name);
+         /* The image has already been cleaned up; this is just used to
+          * set the error (because the original write succeeded).
+          */
+         return png_image_error(image, strerror(error));
+      }
+
+      else
+      {
+         /* Clean up: just the opened file. */
+         (void)fclose(fp);
+         (void)remove(file_name);
+         return 0;
+      }
+   }
+
+   else
+      return png_image_error(image, strerror(errno));
+}
+
+int PNGAPI
+png_image_write_to_file(png_imagep image, const char *file_name,
+    int convert_to_8bit, const void *buffer, png_int_32 row_stride,
+    const void *colormap)
+{
+   /* Write the image to the named file. */
+   if (image != NULL && image->version == PNG_IMAGE_VERSION)
+   {
+      if (file_name != NULL && buffer != NULL)
+      {
+         png_image_write_control display;
+
+         memset(&display, 0, (sizeof display));
+         display.image = image;
+         display.buffer = buffer;
+         display.row_stride = row_stride;
+         display.colormap = colormap;
+         display.convert_to_8bit = convert_to_8bit;
+
+         return png_image_write_file_control(&display, file_name);
       }
 
       else
@@ -2385,6 +3371,113 @@ png_image_write_to_file(png_imagep image, const char *file_name,
    else
       return 0;
 }
+
+int PNGAPI
+png_image_write_to_file_large(png_imagep image, const char *file_name,
+    int convert_to_8bit, const void *buffer, png_ptrdiff_t row_stride,
+    const void *colormap)
+{
+   if (image != NULL && image->version == PNG_IMAGE_VERSION)
+   {
+      if (file_name != NULL && buffer != NULL)
+      {
+         png_image_write_control display;
+
+         memset(&display, 0, (sizeof display));
+         display.image = image;
+         display.buffer = buffer;
+         display.row_stride = row_stride;
+         display.colormap = colormap;
+         display.convert_to_8bit = convert_to_8bit;
+         display.large = 1;
+
+         return png_image_write_file_control(&display, file_name);
+      }
+
+      else
+         return png_image_error(image,
+             "png_image_write_to_file_large: invalid argument");
+   }
+
+   else if (image != NULL)
+      return png_image_error(image,
+          "png_image_write_to_file_large: incorrect PNG_IMAGE_VERSION");
+
+   else
+      return 0;
+}
+#endif /* SIMPLIFIED_WRITE_STDIO */
+
+#ifdef PNG_SIMPLIFIED_WRITE_ROWS_SUPPORTED
+int PNGAPI
+png_image_write_rows_to_memory(png_imagep image, void *memory,
+    png_alloc_size_t * PNG_RESTRICT memory_bytes, int convert_to_8bit,
+    png_image_row_source_ptr row_fn, void *user_ptr, const void *colormap)
+{
+   if (image != NULL && image->version == PNG_IMAGE_VERSION)
+   {
+      if (memory_bytes != NULL && row_fn != NULL)
+      {
+         png_image_write_control display;
+
+         memset(&display, 0, (sizeof display));
+         display.image = image;
+         display.colormap = colormap;
+         display.convert_to_8bit = convert_to_8bit;
+         display.source_fn = row_fn;
+         display.source_ptr = user_ptr;
+
+         return png_image_write_memory_control(&display, memory, memory_bytes);
+      }
+
+      else
+         return png_image_error(image,
+             "png_image_write_rows_to_memory: invalid argument");
+   }
+
+   else if (image != NULL)
+      return png_image_error(image,
+          "png_image_write_rows_to_memory: incorrect PNG_IMAGE_VERSION");
+
+   else
+      return 0;
+}
+
+#ifdef PNG_SIMPLIFIED_WRITE_STDIO_SUPPORTED
+int PNGAPI
+png_image_write_rows_to_stdio(png_imagep image, FILE *file,
+    int convert_to_8bit, png_image_row_source_ptr row_fn, void *user_ptr,
+    const void *colormap)
+{
+   if (image != NULL && image->version == PNG_IMAGE_VERSION)
+   {
+      if (file != NULL && row_fn != NULL)
+      {
+         png_image_write_control display;
+
+         memset(&display, 0, (sizeof display));
+         display.image = image;
+         display.colormap = colormap;
+         display.convert_to_8bit = convert_to_8bit;
+         display.source_fn = row_fn;
+         display.source_ptr = user_ptr;
+
+         return png_image_write_stdio_control(&display, file);
+      }
+
+      else
+         return png_image_error(image,
+             "png_image_write_rows_to_stdio: invalid argument");
+   }
+
+   else if (image != NULL)
+      return png_image_error(image,
+          "png_image_write_rows_to_stdio: incorrect PNG_IMAGE_VERSION");
+
+   else
+      return 0;
+}
 #endif /* SIMPLIFIED_WRITE_STDIO */
+#endif /* SIMPLIFIED_WRITE_ROWS */
 #endif /* SIMPLIFIED_WRITE */
 #endif /* WRITE */
@@ -287,6 +287,403 @@ optimize_cmf(png_bytep data, png_alloc_size_t data_size)
 }
 #endif /* WRITE_OPTIMIZE_CMF */
 
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+/* The filters and zlib strategy of each png_set_encode_preset preset for four
+ * classes of pixel format: palette or less than 8 bits, 8-bit gray, 8-bit
+ * color and 16-bit, as measured by contrib/libtests/pngfilterbench --presets.
+ * 16-bit data does better without Z_FILTERED, which drops the short matches
+ * between the two bytes of a sample.  Palette indices are only filtered by
+ * trial compression, which will not choose a filter that does not help.
+ */
+static const struct
+{
+   png_byte filters[4];
+   png_byte strategy[4];
+}
+png_encode_preset_choices[PNG_ENCODE_PRESET_LAST] =
+{
+   /* DEFAULT: libpng's own choices are used */
+   {
+      { 0, 0, 0, 0 },
+      { 0, 0, 0, 0 }
+   },
+   /* FASTEST */
+   {
+      { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_SUB, PNG_FILTER_SUB },
+      { Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY,
+        Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY }
+   },
+   /* HIGH_SPEED */
+   {
+      { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_SUB, PNG_FILTER_SUB },
+      { Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY,
+        Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY }
+   },
+   /* BALANCED */
+   {
+      { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_SUB, PNG_FILTER_SUB },
+      { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY }
+   },
+   /* HIGH_COMPRESSION */
+   {
+      { PNG_ALL_FILTERS, PNG_ALL_FILTERS, PNG_ALL_FILTERS, PNG_ALL_FILTERS },
+      { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY }
+   },
+   /* HIGH_READ_SPEED: the filters that were quickest to read back */
+   {
+      { PNG_FILTER_NONE, PNG_FILTER_UP, PNG_FILTER_SUB, PNG_FILTER_UP },
+      { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY }
+   },
+   /* LOW_MEMORY */
+   {
+      { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_SUB, PNG_FILTER_SUB },
+      { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY }
+   },
+   /* OPTIMAL: the optimal encoder also tries each filter alone */
+   {
+      { PNG_ALL_FILTERS, PNG_ALL_FILTERS, PNG_ALL_FILTERS, PNG_ALL_FILTERS },
+      { Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY,
+        Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY }
+   },
+   /* AUTO: the choices for photographic images, see png_auto_choose */
+   {
+      { PNG_FILTER_NONE, PNG_ALL_FILTERS, PNG_ALL_FILTERS, PNG_ALL_FILTERS },
+      { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_FILTERED, Z_DEFAULT_STRATEGY }
+   }
+};
+
+static int
+png_encode_preset_class(png_const_structrp png_ptr)
+{
+   if (png_ptr->color_type == PNG_COLOR_TYPE_PALETTE || png_ptr->bit_depth < 8)
+      return 0;
+
+   else if (png_ptr->bit_depth == 16)
+      return 3;
+
+   else if ((png_ptr->color_type & PNG_COLOR_MASK_COLOR) == 0)
+      return 1;
+
+   else
+      return 2;
+}
+
+/* PNG_ENCODE_PRESET_AUTO: png_write_find_filter passes the first rows to
+ * png_auto_sample_row and png_compress_IDAT holds their image data until
+ * png_auto_choose has chosen the filters and strategy from them.  The rows are
+ * held unfiltered and filtered once the filters are chosen.  The statistics
+ * only look along each row, so they are the same for interlaced images and
+ * pipelined rows.
+ */
+typedef struct
+{
+   png_uint_32   rows;      /* Rows sampled */
+   png_uint_32   pixels;    /* Pixels sampled */
+   png_uint_32   changes;   /* Pixels different from the pixel to the left */
+   png_uint_32   residual;  /* Sum of the sizes of the SUB filter residuals */
+   png_uint_32   bytes;     /* Bytes in 'residual' */
+   unsigned int  colors;    /* Distinct 8-bit colors, more than 256 is many */
+   int           filters;   /* Choose the filters as well as the strategy */
+   int           chosen;    /* png_auto_choose has been called */
+   size_t        size;      /* Bytes of image data held */
+   size_t        max;       /* Space for them after this structure */
+   png_uint_32   color[512];
+   png_byte      used[512];
+} png_auto_sample, *png_auto_samplep;
+
+/* Called from png_write_IHDR; 'filters' says whether png_set_filter was
+ * called.  Palette images and images of less than 8 bits are left unfiltered
+ * with the default strategy.
+ */
+static void
+png_auto_start(png_structrp png_ptr, int filters)
+{
+   int image_class = png_encode_preset_class(png_ptr);
+   png_alloc_size_t max = png_image_size(png_ptr);
+   png_auto_samplep sample;
+
+   png_ptr->auto_strategy = png_encode_preset_choices[
+       PNG_ENCODE_PRESET_AUTO].strategy[image_class];
+
+   if (image_class == 0 || (filters == 0 &&
+       (png_ptr->flags & PNG_FLAG_ZLIB_CUSTOM_STRATEGY) != 0))
+      return;
+
+   if (max > PNG_AUTO_SAMPLE_BYTES)
+      max = PNG_AUTO_SAMPLE_BYTES;
+
+   png_free(png_ptr, png_ptr->auto_sample);
+   png_ptr->auto_sample = NULL;
+
+   sample = png_voidcast(png_auto_samplep, png_malloc(png_ptr,
+       (sizeof *sample) + max));
+   memset(sample, 0, (sizeof *sample));
+   sample->filters = filters;
+   sample->max = (size_t)max;
+
+   /* Only 8-bit color pixels are counted. */
+   if (png_ptr->bit_depth != 8 ||
+       (png_ptr->color_type & PNG_COLOR_MASK_COLOR) == 0)
+      sample->colors = 257;
+
+   png_ptr->auto_sample = sample;
+}
+
+static void
+png_auto_sample_row(png_auto_samplep sample, png_const_bytep row,
+    size_t row_bytes, unsigned int bpp)
+{
+   size_t i;
+
+   sample->rows++;
+   sample->pixels += (png_uint_32)(row_bytes / bpp);
+
+   for (i = bpp; i < row_bytes; ++i)
+   {
+      int d = (png_byte)(row[i] - row[i-bpp]);
+
+      sample->residual += (png_uint_32)(d < 128 ? d : 256 - d);
+   }
+
+   sample->bytes += (png_uint_32)(row_bytes - bpp);
+
+   for (i = 0; i < row_bytes; i += bpp)
+   {
+      if (i == 0 || memcmp(row + i, row + i - bpp, bpp) != 0)
+      {
+         sample->changes++;
+
+         if (sample->colors <= 256)
+         {
+            png_uint_32 c = ((png_uint_32)row[i] << 16) +
+                ((png_uint_32)row[i+1] << 8) + row[i+2];
+            unsigned int h;
+
+            if (bpp > 3)
+               c = (c << 8) + row[i+3];
+
+            h = (unsigned int)((c * 0x9e3779b1U) >> 23) & 511;
+
+            while (sample->used[h] != 0 && sample->color[h] != c)
+               h = (h + 1) & 511;
+
+            if (sample->used[h] == 0)
+            {
+               sample->used[h] = 1;
+               sample->color[h] = c;
+               sample->colors++;
+            }
+         }
+      }
+   }
+}
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+static png_const_bytep
+png_write_select_row(png_structrp png_ptr, unsigned int filter_to_do,
+    png_const_bytep row_buf, png_const_bytep prev_row, png_uint_32 bpp,
+    size_t row_bytes);
+
+/* Filter the rows held by PNG_ENCODE_PRESET_AUTO, followed by 'input' if it is
+ * not NULL, and compress them.  They are the first rows of the image, each
+ * with a filter byte of 0, so the passes of an interlaced image are found from
+ * the IHDR; the first row of each pass is filtered against a row of zeros.
+ */
+static void
+png_auto_filter_rows(png_structrp png_ptr, png_bytep data, size_t size,
+    png_const_bytep input, size_t input_len)
+{
+   png_uint_32 bpp = (png_uint_32)(png_ptr->pixel_depth + 7) >> 3;
+   png_bytep zero = png_voidcast(png_bytep, png_calloc(png_ptr,
+       png_ptr->rowbytes + 1));
+   png_const_bytep prev_row = zero;
+   png_uint_32 rows = 0;
+   size_t row_bytes = 0;
+   int pass = -1;
+
+   for (;;)
+   {
+      png_const_bytep row;
+
+      /* Find the next pass with pixels: */
+      while (rows == 0 && pass < 6)
+      {
+         png_uint_32 width = png_ptr->width;
+
+         if (png_ptr->interlaced == 0)
+         {
+            rows = png_ptr->height;
+            pass = 6;
+         }
+
+         else
+         {
+            ++pass;
+            width = PNG_PASS_COLS(png_ptr->width, pass);
+            rows = width > 0 ? PNG_PASS_ROWS(png_ptr->height, pass) : 0;
+         }
+
+         row_bytes = PNG_ROWBYTES(png_ptr->pixel_depth, width);
+         prev_row = zero;
+      }
+
+      if (size >= row_bytes + 1)
+      {
+         row = data;
+         data += row_bytes + 1;
+         size -= row_bytes + 1;
+      }
+
+      else if (size == 0 && input != NULL && input_len == row_bytes + 1)
+      {
+         row = input;
+         input = NULL;
+      }
+
+      else
+         break;
+
+      png_compress_IDAT(png_ptr, png_write_select_row(png_ptr,
+          png_ptr->do_filter, row, prev_row, bpp, row_bytes), row_bytes + 1,
+          Z_NO_FLUSH);
+
+      prev_row = row;
+
+      if (rows > 0)
+         --rows;
+   }
+
+   png_free(png_ptr, zero);
+
+   /* Anything that is not a row, which should not happen, as it is: */
+   if (size > 0)
+      png_compress_IDAT(png_ptr, data, size, Z_NO_FLUSH);
+
+   if (input != NULL)
+      png_compress_IDAT(png_ptr, input, input_len, Z_NO_FLUSH);
+}
+#endif /* WRITE_FILTER */
+
+/* Choose the filters and strategy for the rest of the image, then compress the
+ * image data held so far, followed by 'input' if it is not NULL.  The thresholds were measured with
+ * contrib/libtests/pngfilterbench --presets on a corpus of screenshots,
+ * diagrams and photographs: synthetic images, with long runs of the same pixel
+ * or few colors, compress best unfiltered, photographic ones filtered, and
+ * Z_RLE is best when the rows are noisy enough that deflate finds few longer
+ * matches.  Z_RLE only needs a 512 byte window.
+ */
+static void
+png_auto_choose(png_structrp png_ptr, png_const_bytep input, size_t input_len)
+{
+   png_auto_samplep sample =
+       png_voidcast(png_auto_samplep, png_ptr->auto_sample);
+
+   sample->chosen = 1;
+
+   if (sample->changes / 2 < sample->pixels / 5 || sample->colors <= 256)
+   {
+      if (sample->filters != 0)
+         png_ptr->do_filter = PNG_FILTER_NONE;
+
+      png_ptr->auto_strategy = Z_DEFAULT_STRATEGY;
+   }
+
+   else if (sample->residual / 4 >= sample->bytes)
+   {
+      png_ptr->auto_strategy = Z_RLE;
+
+      if (png_ptr->zlib_window_bits > 9)
+         png_ptr->zlib_window_bits = 9;
+   }
+
+   /* The data is compressed as the image is written from here on. */
+   png_ptr->auto_sample = NULL;
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+   if (sample->filters != 0 && png_ptr->do_filter != PNG_FILTER_NONE)
+      png_auto_filter_rows(png_ptr, (png_bytep)(sample + 1), sample->size,
+          input, input_len);
+
+   else
+#endif
+   {
+      if (sample->size > 0)
+         png_compress_IDAT(png_ptr, (png_const_bytep)(sample + 1),
+             sample->size, Z_NO_FLUSH);
+
+      if (input != NULL)
+         png_compress_IDAT(png_ptr, input, input_len, Z_NO_FLUSH);
+   }
+
+   png_free(png_ptr, sample);
+}
+
+/* Returns 1 while the rows are sampled to choose the filters. */
+static int
+png_auto_filters(png_const_structrp png_ptr)
+{
+   const png_auto_sample *sample =
+       png_voidcast(const png_auto_sample *, png_ptr->auto_sample);
+
+   return sample != NULL && sample->filters != 0;
+}
+
+/* Called from png_compress_IDAT: returns 1 if the data is held. */
+static int
+png_auto_hold(png_structrp png_ptr, png_const_bytep input,
+    png_alloc_size_t input_len, int flush)
+{
+   png_auto_samplep sample =
+       png_voidcast(png_auto_samplep, png_ptr->auto_sample);
+
+   if (sample->chosen != 0)
+      return 0;
+
+   if (flush == Z_NO_FLUSH && input_len <= sample->max - sample->size)
+   {
+      memcpy((png_bytep)(sample + 1) + sample->size, input,
+          (size_t)input_len);
+      sample->size += (size_t)input_len;
+      return 1;
+   }
+
+   /* A row that does not fit is filtered after the rows held. */
+   if (flush == Z_NO_FLUSH)
+   {
+      png_auto_choose(png_ptr, input, (size_t)input_len);
+      return 1;
+   }
+
+   png_auto_choose(png_ptr, NULL, 0);
+   return 0;
+}
+#endif /* WRITE_ENCODE_PRESET */
+
+/* The zlib strategy for IDAT: the application's choice if it made one, else
+ * the preset's or the one that suits the filtering.
+ */
+static int
+png_IDAT_strategy(png_const_structrp png_ptr)
+{
+   if ((png_ptr->flags & PNG_FLAG_ZLIB_CUSTOM_STRATEGY) != 0)
+      return png_ptr->zlib_strategy;
+
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+   else if (png_ptr->encode_preset == PNG_ENCODE_PRESET_AUTO)
+      return png_ptr->auto_strategy;
+
+   else if (png_ptr->encode_preset != PNG_ENCODE_PRESET_DEFAULT)
+      return png_encode_preset_choices[png_ptr->encode_preset].strategy[
+          png_encode_preset_class(png_ptr)];
+#endif
+
+   else if (png_ptr->do_filter != PNG_FILTER_NONE)
+      return PNG_Z_DEFAULT_STRATEGY;
+
+   else
+      return PNG_Z_DEFAULT_NOFILTER_STRATEGY;
+}
+
 /* Initialize the compressor for the appropriate type of compression. */
 static int
 png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
@@ -313,7 +710,7 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
          /* Attempt sane error recovery */
          if (png_ptr->zowner == png_IDAT) /* don't steal from IDAT */
          {
-            png_ptr->zstream.msg = PNGZ_MSG_CAST("in use by IDAT");
+            png_ptr->zstream->msg = PNGZ_MSG_CAST("in use by IDAT");
             return Z_STREAM_ERROR;
          }
 
@@ -330,18 +727,11 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
       int memLevel = png_ptr->zlib_mem_level;
       int strategy; /* set below */
       int ret; /* zlib return code */
+      png_zlib_settings *set; /* the values in the stream */
+      png_uint_32 initialized; /* flag for the stream */
 
       if (owner == png_IDAT)
-      {
-         if ((png_ptr->flags & PNG_FLAG_ZLIB_CUSTOM_STRATEGY) != 0)
-            strategy = png_ptr->zlib_strategy;
-
-         else if (png_ptr->do_filter != PNG_FILTER_NONE)
-            strategy = PNG_Z_DEFAULT_STRATEGY;
-
-         else
-            strategy = PNG_Z_DEFAULT_NOFILTER_STRATEGY;
-      }
+         strategy = png_IDAT_strategy(png_ptr);
 
       else
       {
@@ -359,6 +749,12 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
              */
             strategy = Z_DEFAULT_STRATEGY;
 #endif
+
+         /* PNG_COMPRESSION_LEVEL_FASTEST and _OPTIMAL are not zlib levels;
+          * they only apply to the image data.
+          */
+         if (level < Z_DEFAULT_COMPRESSION)
+            level = Z_DEFAULT_COMPRESSION;
       }
 
       /* Adjust 'windowBits' down if larger than 'data_size'; to stop this
@@ -384,41 +780,80 @@ png_deflate_claim(png_structrp png_ptr, png_uint_32 owner,
          }
       }
 
+      /* IDAT has a stream of its own so that writing the compressed chunks
+       * before and after it does not make the streams be initialized again
+       * with different parameters each time the owner changes.
+       */
+      if (owner == png_IDAT)
+      {
+         png_ptr->zstream = &png_ptr->zstream_idat;
+         set = &png_ptr->zlib_set_idat;
+         initialized = PNG_FLAG_ZSTREAM_INITIALIZED;
+      }
+
+      else
+      {
+         png_ptr->zstream = &png_ptr->zstream_chunk;
+         set = &png_ptr->zlib_set_chunk;
+         initialized = PNG_FLAG_ZCHUNK_INITIALIZED;
+
+#ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
+         /* A chunk stream with a bigger window than this data needs compresses
+          * it to the same bytes (the window is bigger than the data, so no
+          * match is out of reach either way) except that the header gives the
+          * bigger window, which optimize_cmf corrects.  So reuse the stream
+          * rather than make a new one for each different size of chunk.  This
+          * does not hold for stored (level 0) data, where zlib divides the
+          * blocks by the window size.
+          */
+         if ((png_ptr->flags & initialized) != 0 && level != 0 &&
+            set->window_bits > windowBits)
+            windowBits = set->window_bits;
+#endif
+      }
+
       /* Check against the previous initialized values, if any. */
-      if ((png_ptr->flags & PNG_FLAG_ZSTREAM_INITIALIZED) != 0 &&
-         (png_ptr->zlib_set_level != level ||
-         png_ptr->zlib_set_method != method ||
-         png_ptr->zlib_set_window_bits != windowBits ||
-         png_ptr->zlib_set_mem_level != memLevel ||
-         png_ptr->zlib_set_strategy != strategy))
-      {
-         if (deflateEnd(&png_ptr->zstream) != Z_OK)
+      if ((png_ptr->flags & initialized) != 0 &&
+         (set->level != level ||
+         set->method != method ||
+         set->window_bits != windowBits ||
+         set->mem_level != memLevel ||
+         set->strategy != strategy))
+      {
+         if (deflateEnd(png_ptr->zstream) != Z_OK)
             png_warning(png_ptr, "deflateEnd failed (ignored)");
 
-         png_ptr->flags &= ~PNG_FLAG_ZSTREAM_INITIALIZED;
+         png_ptr->flags &= ~initialized;
       }
 
       /* For safety clear out the input and output pointers (currently zlib
        * doesn't use them on Init, but it might in the future).
        */
-      png_ptr->zstream.next_in = NULL;
-      png_ptr->zstream.avail_in = 0;
-      png_ptr->zstream.next_out = NULL;
-      png_ptr->zstream.avail_out = 0;
+      png_ptr->zstream->next_in = NULL;
+      png_ptr->zstream->avail_in = 0;
+      png_ptr->zstream->next_out = NULL;
+      png_ptr->zstream->avail_out = 0;
 
       /* Now initialize if required, setting the new parameters, otherwise just
        * do a simple reset to the previous parameters.
        */
-      if ((png_ptr->flags & PNG_FLAG_ZSTREAM_INITIALIZED) != 0)
-         ret = deflateReset(&png_ptr->zstream);
+      if ((png_ptr->flags & initialized) != 0)
+         ret = deflateReset(png_ptr->zstream);
 
       else
       {
-         ret = deflateInit2(&png_ptr->zstream, level, method, windowBits,
+         ret = deflateInit2(png_ptr->zstream, level, method, windowBits,
              memLevel, strategy);
 
          if (ret == Z_OK)
-            png_ptr->flags |= PNG_FLAG_ZSTREAM_INITIALIZED;
+         {
+            png_ptr->flags |= initialized;
+            set->level = level;
+            set->method = method;
+            set->window_bits = windowBits;
+            set->mem_level = memLevel;
+            set->strategy = strategy;
+         }
       }
 
       /* The return code is from either deflateReset or deflateInit2; they have
@@ -517,12 +952,12 @@ png_text_compress(png_structrp png_ptr, png_uint_32 chunk_name,
       png_uint_32 output_len;
 
       /* zlib updates these for us: */
-      png_ptr->zstream.next_in = PNGZ_INPUT_CAST(comp->input);
-      png_ptr->zstream.avail_in = 0; /* Set below */
-      png_ptr->zstream.next_out = comp->output;
-      png_ptr->zstream.avail_out = (sizeof comp->output);
+      png_ptr->zstream->next_in = PNGZ_INPUT_CAST(comp->input);
+      png_ptr->zstream->avail_in = 0; /* Set below */
+      png_ptr->zstream->next_out = comp->output;
+      png_ptr->zstream->avail_out = (sizeof comp->output);
 
-      output_len = png_ptr->zstream.avail_out;
+      output_len = png_ptr->zstream->avail_out;
 
       do
       {
@@ -533,9 +968,9 @@ png_text_compress(png_structrp png_ptr, png_uint_32 chunk_name,
 
          input_len -= avail_in;
 
-         png_ptr->zstream.avail_in = avail_in;
+         png_ptr->zstream->avail_in = avail_in;
 
-         if (png_ptr->zstream.avail_out == 0)
+         if (png_ptr->zstream->avail_out == 0)
          {
             png_compression_buffer *next;
 
@@ -568,31 +1003,31 @@ png_text_compress(png_structrp png_ptr, png_uint_32 chunk_name,
                *end = next;
             }
 
-            png_ptr->zstream.next_out = next->output;
-            png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
-            output_len += png_ptr->zstream.avail_out;
+            png_ptr->zstream->next_out = next->output;
+            png_ptr->zstream->avail_out = png_ptr->zbuffer_size;
+            output_len += png_ptr->zstream->avail_out;
 
             /* Move 'end' to the next buffer pointer. */
             end = &next->next;
          }
 
          /* Compress the data */
-         ret = deflate(&png_ptr->zstream,
+         ret = deflate(png_ptr->zstream,
              input_len > 0 ? Z_NO_FLUSH : Z_FINISH);
 
          /* Claw back input data that was not consumed (because avail_in is
           * reset above every time round the loop).
           */
-         input_len += png_ptr->zstream.avail_in;
-         png_ptr->zstream.avail_in = 0; /* safety */
+         input_len += png_ptr->zstream->avail_in;
+         png_ptr->zstream->avail_in = 0; /* safety */
       }
       while (ret == Z_OK);
 
       /* There may be some space left in the last output buffer. This needs to
        * be subtracted from output_len.
        */
-      output_len -= png_ptr->zstream.avail_out;
-      png_ptr->zstream.avail_out = 0; /* safety */
+      output_len -= png_ptr->zstream->avail_out;
+      png_ptr->zstream->avail_out = 0; /* safety */
       comp->output_len = output_len;
 
       /* Now double check the output length, put in a custom message if it is
@@ -601,7 +1036,7 @@ png_text_compress(png_structrp png_ptr, png_uint_32 chunk_name,
        */
       if (output_len + prefix_len >= PNG_UINT_31_MAX)
       {
-         png_ptr->zstream.msg = PNGZ_MSG_CAST("compressed data too long");
+         png_ptr->zstream->msg = PNGZ_MSG_CAST("compressed data too long");
          ret = Z_MEM_ERROR;
       }
 
@@ -821,12 +1256,40 @@ png_write_IHDR(png_structrp png_ptr, png_uint_32 width, png_uint_32 height,
    /* Write the chunk */
    png_write_complete_chunk(png_ptr, png_IHDR, buf, 13);
 
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+   if (png_ptr->encode_preset == PNG_ENCODE_PRESET_AUTO)
+      png_auto_start(png_ptr, png_ptr->do_filter == PNG_NO_FILTERS);
+
+   if (png_ptr->do_filter == PNG_NO_FILTERS &&
+       png_ptr->encode_preset != PNG_ENCODE_PRESET_DEFAULT)
+   {
+      int preset = png_ptr->encode_preset;
+
+#  ifndef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+      /* Without trial compression all the filters are chosen by their sums,
+       * which does worse than the BALANCED single filter.
+       */
+      if (preset == PNG_ENCODE_PRESET_HIGH_COMPRESSION)
+         preset = PNG_ENCODE_PRESET_BALANCED;
+#  endif
+
+      png_ptr->do_filter = png_encode_preset_choices[preset].filters[
+          png_encode_preset_class(png_ptr)];
+   }
+#endif
+
    if ((png_ptr->do_filter) == PNG_NO_FILTERS)
    {
       if (png_ptr->color_type == PNG_COLOR_TYPE_PALETTE ||
           png_ptr->bit_depth < 8)
          png_ptr->do_filter = PNG_FILTER_NONE;
 
+#ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+      /* The fast encoder does not spend time choosing filters. */
+      else if (png_ptr->zlib_level == PNG_COMPRESSION_LEVEL_FASTEST)
+         png_ptr->do_filter = PNG_FILTER_SUB;
+#endif
+
       else
          png_ptr->do_filter = PNG_ALL_FILTERS;
    }
@@ -910,1841 +1373,5523 @@ png_write_PLTE(png_structrp png_ptr, png_const_colorp palette,
    png_ptr->mode |= PNG_HAVE_PLTE;
 }
 
-/* This is similar to png_text_compress, above, except that it does not require
- * all of the data at once and, instead of buffering the compressed result,
- * writes it as IDAT chunks.  Unlike png_text_compress it *can* png_error out
- * because it calls the write interface.  As a result it does its own error
- * reporting and does not return an error code.  In the event of error it will
- * just call png_error.  The input data length may exceed 32-bits.  The 'flush'
- * parameter is exactly the same as that to deflate, with the following
- * meanings:
- *
- * Z_NO_FLUSH: normal incremental output of compressed data
- * Z_SYNC_FLUSH: do a SYNC_FLUSH, used by png_write_flush
- * Z_FINISH: this is the end of the input, do a Z_FINISH and clean up
- *
- * The routine manages the acquire and release of the png_ptr->zstream by
- * checking and (at the end) clearing png_ptr->zowner; it does some sanity
- * checks on the 'mode' flags while doing this.
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+/* Parallel compression of IDAT, for png_set_compression_threads.  The filtered
+ * rows are collected in batches of 'threads' blocks.  When a batch is full a
+ * task deflates each block with a raw deflate stream of its own, using the
+ * data before the block (up to the size of the window) as a dictionary, and
+ * ends it with a sync flush so that the compressed blocks are whole bytes and
+ * can simply be concatenated.  The caller adds the zlib header and combines
+ * the Adler-32 checksums of the blocks for the trailer, so the result is one
+ * standard zlib stream.  It is a little bigger than the serial result because
+ * each block starts new deflate blocks and ends with an empty stored block.
+ * The next batch is filled while the tasks compress the last one.
  */
-void /* PRIVATE */
-png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
-    png_alloc_size_t input_len, int flush)
+typedef struct
 {
-   if (png_ptr->zowner != png_IDAT)
-   {
-      /* First time.   Ensure we have a temporary buffer for compression and
-       * trim the buffer list if it has more than one entry to free memory.
-       * If 'WRITE_COMPRESSED_TEXT' is not set the list will never have been
-       * created at this point, but the check here is quick and safe.
-       */
-      if (png_ptr->zbuffer_list == NULL)
-      {
-         png_ptr->zbuffer_list = png_voidcast(png_compression_bufferp,
-             png_malloc(png_ptr, PNG_COMPRESSION_BUFFER_SIZE(png_ptr)));
-         png_ptr->zbuffer_list->next = NULL;
-      }
+   png_task    task;
+   z_stream    zstream;     /* Raw deflate stream of this worker */
+   int         initialized; /* Set once deflateInit2 has succeeded */
+   png_bytep   input;       /* The block, preceded by the dictionary */
+   uInt        dictionary;  /* Number of bytes of dictionary */
+   uInt        size;        /* Number of bytes in the block */
+   int         flush;       /* Z_SYNC_FLUSH, Z_FINISH for the last block */
+   png_bytep   output;      /* The compressed block */
+   uInt        output_size; /* Allocated size of output */
+   uInt        out;         /* Number of bytes of output */
+   uLong       adler;       /* Adler-32 of the block */
+   int         ret;         /* zlib return code, Z_OK if the block is done */
+} png_deflate_worker, *png_deflate_workerp;
 
-      else
-         png_free_buffer_list(png_ptr, &png_ptr->zbuffer_list->next);
+typedef struct
+{
+   int              threads;    /* Number of blocks in a batch */
+   uInt             block;      /* Number of bytes in a whole block */
+   uInt             window;     /* Number of bytes in the deflate window */
+   png_alloc_size_t batch_size; /* threads * block */
+   png_bytep        buf[2];     /* The batches, each after 'window' bytes */
+   int              current;    /* The batch being filled */
+   png_alloc_size_t have;       /* Number of bytes in the current batch */
+   uInt             history;    /* Number of bytes before the current batch */
+   int              running[2]; /* Number of tasks running on each batch */
+   uLong            adler;      /* Adler-32 of the output blocks */
+   uInt             out;        /* Number of bytes in the zbuffer */
+   png_deflate_worker worker[2][PNG_COMPRESSION_THREADS_MAX];
+} png_deflate_threads, *png_deflate_threadsp;
+
+/* The task: compress one block. */
+static void PNGCBAPI
+png_deflate_block(png_voidp argument)
+{
+   png_deflate_workerp worker = png_voidcast(png_deflate_workerp, argument);
+   z_streamp zstream = &worker->zstream;
+   int ret = deflateReset(zstream);
+
+   if (ret == Z_OK && worker->dictionary > 0)
+      ret = deflateSetDictionary(zstream,
+          PNGZ_INPUT_CAST(worker->input - worker->dictionary),
+          worker->dictionary);
+
+   if (ret == Z_OK)
+   {
+      zstream->next_in = PNGZ_INPUT_CAST(worker->input);
+      zstream->avail_in = worker->size;
+      zstream->next_out = worker->output;
+      zstream->avail_out = worker->output_size;
 
-      /* It is a terminal error if we can't claim the zstream. */
-      if (png_deflate_claim(png_ptr, png_IDAT, png_image_size(png_ptr)) != Z_OK)
-         png_error(png_ptr, png_ptr->zstream.msg);
+      ret = deflate(zstream, worker->flush);
 
-      /* The output state is maintained in png_ptr->zstream, so it must be
-       * initialized here after the claim.
+      /* The output buffer is big enough for all of it; if deflate stopped
+       * short anyway report an error rather than loop.
        */
-      png_ptr->zstream.next_out = png_ptr->zbuffer_list->output;
-      png_ptr->zstream.avail_out = png_ptr->zbuffer_size;
+      if (worker->flush == Z_FINISH ? ret == Z_STREAM_END :
+          ret == Z_OK && zstream->avail_out > 0)
+         ret = Z_OK;
+
+      else if (ret == Z_OK || ret == Z_STREAM_END)
+         ret = Z_BUF_ERROR;
    }
 
-   /* Now loop reading and writing until all the input is consumed or an error
-    * terminates the operation.  The _out values are maintained across calls to
-    * this function, but the input must be reset each time.
-    */
-   png_ptr->zstream.next_in = PNGZ_INPUT_CAST(input);
-   png_ptr->zstream.avail_in = 0; /* set below */
-   for (;;)
+   worker->out = worker->output_size - zstream->avail_out;
+   worker->adler = adler32(1, worker->input, worker->size);
+   worker->ret = ret;
+}
+
+static PNG_FUNCTION(void,
+png_deflate_worker_error,(png_structrp png_ptr, png_deflate_workerp worker,
+    int ret),PNG_NORETURN)
+{
+   png_ptr->zstream = &png_ptr->zstream_idat;
+   png_ptr->zstream->msg = worker->zstream.msg;
+   png_zstream_error(png_ptr, ret);
+   png_error(png_ptr, png_ptr->zstream->msg);
+}
+
+/* Set up parallel compression if the application asked for it and the image
+ * is big enough to be divided.  Returns NULL to compress serially.
+ */
+static png_deflate_threadsp
+png_deflate_threads_init(png_structrp png_ptr)
+{
+   png_deflate_threadsp control;
+   int windowBits = png_ptr->zlib_window_bits;
+   int b;
+
+   if (png_ptr->compression_threads < 2 || windowBits < 9 ||
+       png_image_size(png_ptr) <= png_ptr->compression_block)
+      return NULL;
+
+   control = png_voidcast(png_deflate_threadsp,
+       png_malloc(png_ptr, (sizeof *control)));
+   memset(control, 0, (sizeof *control));
+
+   /* From here png_free_compression_threads cleans up after an error. */
+   png_ptr->compression_state = control;
+   control->threads = png_ptr->compression_threads;
+   control->block = (uInt)png_ptr->compression_block;
+   control->window = 1U << windowBits;
+   control->batch_size = (png_alloc_size_t)control->threads * control->block;
+   control->adler = adler32(0, NULL, 0);
+
+   for (b = 0; b < 2; ++b)
    {
-      int ret;
+      int i;
 
-      /* INPUT: from the row data */
-      uInt avail = ZLIB_IO_MAX;
+      control->buf[b] = png_voidcast(png_bytep, png_malloc(png_ptr,
+          control->window + control->batch_size));
 
-      if (avail > input_len)
-         avail = (uInt)input_len; /* safe because of the check */
+      for (i = 0; i < control->threads; ++i)
+      {
+         png_deflate_workerp worker = &control->worker[b][i];
+         int ret;
 
-      png_ptr->zstream.avail_in = avail;
-      input_len -= avail;
+         worker->zstream.zalloc = png_zalloc;
+         worker->zstream.zfree = png_zfree;
+         worker->zstream.opaque = png_ptr;
 
-      ret = deflate(&png_ptr->zstream, input_len > 0 ? Z_NO_FLUSH : flush);
+         ret = deflateInit2(&worker->zstream, png_ptr->zlib_level,
+             png_ptr->zlib_method, -windowBits, png_ptr->zlib_mem_level,
+             png_IDAT_strategy(png_ptr));
 
-      /* Include as-yet unconsumed input */
-      input_len += png_ptr->zstream.avail_in;
-      png_ptr->zstream.avail_in = 0;
+         if (ret != Z_OK)
+            png_deflate_worker_error(png_ptr, worker, ret);
 
-      /* OUTPUT: write complete IDAT chunks when avail_out drops to zero. Note
-       * that these two zstream fields are preserved across the calls, therefore
-       * there is no need to set these up on entry to the loop.
-       */
-      if (png_ptr->zstream.avail_out == 0)
-      {
-         png_bytep data = png_ptr->zbuffer_list->output;
-         uInt size = png_ptr->zbuffer_size;
-
-         /* Write an IDAT containing the data then reset the buffer.  The
-          * first IDAT may need deflate header optimization.
-          */
-#ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
-            if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
-                png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
-               optimize_cmf(data, png_image_size(png_ptr));
-#endif
+         worker->initialized = 1;
 
-         if (size > 0)
-            png_write_complete_chunk(png_ptr, png_IDAT, data, size);
-         png_ptr->mode |= PNG_HAVE_IDAT;
+         /* A sync flush adds at most a few bytes to the deflateBound. */
+         worker->output_size =
+             (uInt)deflateBound(&worker->zstream, control->block) + 16;
+         worker->output = png_voidcast(png_bytep,
+             png_malloc(png_ptr, worker->output_size));
+      }
+   }
 
-         png_ptr->zstream.next_out = data;
-         png_ptr->zstream.avail_out = size;
+   return control;
+}
 
-         /* For SYNC_FLUSH or FINISH it is essential to keep calling zlib with
-          * the same flush parameter until it has finished output, for NO_FLUSH
-          * it doesn't matter.
-          */
-         if (ret == Z_OK && flush != Z_NO_FLUSH)
-            continue;
-      }
+/* Append compressed data to the zbuffer, writing it as an IDAT chunk each time
+ * it is full, as png_compress_IDAT does.
+ */
+static void
+png_deflate_threads_output(png_structrp png_ptr, png_deflate_threadsp control,
+    png_const_bytep data, png_alloc_size_t size)
+{
+   while (size > 0)
+   {
+      png_bytep buffer = png_ptr->zbuffer_list->output;
+      uInt avail = png_ptr->zbuffer_size - control->out;
 
-      /* The order of these checks doesn't matter much; it just affects which
-       * possible error might be detected if multiple things go wrong at once.
-       */
-      if (ret == Z_OK) /* most likely return code! */
-      {
-         /* If all the input has been consumed then just return.  If Z_FINISH
-          * was used as the flush parameter something has gone wrong if we get
-          * here.
-          */
-         if (input_len == 0)
-         {
-            if (flush == Z_FINISH)
-               png_error(png_ptr, "Z_OK on Z_FINISH with output space");
+      if (avail > size)
+         avail = (uInt)size;
 
-            return;
-         }
-      }
+      memcpy(buffer + control->out, data, avail);
+      control->out += avail;
+      data += avail;
+      size -= avail;
 
-      else if (ret == Z_STREAM_END && flush == Z_FINISH)
+      if (control->out == png_ptr->zbuffer_size)
       {
-         /* This is the end of the IDAT data; any pending output must be
-          * flushed.  For small PNG files we may still be at the beginning.
-          */
-         png_bytep data = png_ptr->zbuffer_list->output;
-         uInt size = png_ptr->zbuffer_size - png_ptr->zstream.avail_out;
-
 #ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
          if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
              png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
-            optimize_cmf(data, png_image_size(png_ptr));
+            optimize_cmf(buffer, png_image_size(png_ptr));
 #endif
 
-         if (size > 0)
-            png_write_complete_chunk(png_ptr, png_IDAT, data, size);
-         png_ptr->zstream.avail_out = 0;
-         png_ptr->zstream.next_out = NULL;
-         png_ptr->mode |= PNG_HAVE_IDAT | PNG_AFTER_IDAT;
-
-         png_ptr->zowner = 0; /* Release the stream */
-         return;
-      }
-
-      else
-      {
-         /* This is an error condition. */
-         png_zstream_error(png_ptr, ret);
-         png_error(png_ptr, png_ptr->zstream.msg);
+         png_write_complete_chunk(png_ptr, png_IDAT, buffer, control->out);
+         png_ptr->mode |= PNG_HAVE_IDAT;
+         control->out = 0;
       }
    }
 }
 
-/* Write an IEND chunk */
-void /* PRIVATE */
-png_write_IEND(png_structrp png_ptr)
-{
-   png_debug(1, "in png_write_IEND");
-
-   png_write_complete_chunk(png_ptr, png_IEND, NULL, 0);
-   png_ptr->mode |= PNG_HAVE_IEND;
-}
-
-#ifdef PNG_WRITE_gAMA_SUPPORTED
-/* Write a gAMA chunk */
-void /* PRIVATE */
-png_write_gAMA_fixed(png_structrp png_ptr, png_fixed_point file_gamma)
+/* Output the zlib header that deflate would have written for these settings
+ * (RFC 1950).
+ */
+static void
+png_deflate_threads_header(png_structrp png_ptr, png_deflate_threadsp control)
 {
-   png_byte buf[4];
+   int level = png_ptr->zlib_level;
+   unsigned int header = 0x0800U | /* CM 8, deflate */
+       (((unsigned int)png_ptr->zlib_window_bits - 8U) << 12); /* CINFO */
+   png_byte buf[2];
 
-   png_debug(1, "in png_write_gAMA");
+   if (level == Z_DEFAULT_COMPRESSION)
+      level = 6;
 
-   /* file_gamma is saved in 1/100,000ths */
-   png_save_uint_32(buf, (png_uint_32)file_gamma);
-   png_write_complete_chunk(png_ptr, png_gAMA, buf, 4);
-}
-#endif
+   if (png_IDAT_strategy(png_ptr) >= Z_HUFFMAN_ONLY || level < 2)
+      header |= 0U << 6;
 
-#ifdef PNG_WRITE_sRGB_SUPPORTED
-/* Write a sRGB chunk */
-void /* PRIVATE */
-png_write_sRGB(png_structrp png_ptr, int srgb_intent)
-{
-   png_byte buf[1];
+   else if (level < 6)
+      header |= 1U << 6;
 
-   png_debug(1, "in png_write_sRGB");
+   else if (level == 6)
+      header |= 2U << 6;
 
-   if (srgb_intent >= PNG_sRGB_INTENT_LAST)
-      png_warning(png_ptr,
-          "Invalid sRGB rendering intent specified");
+   else
+      header |= 3U << 6;
 
-   buf[0]=(png_byte)srgb_intent;
-   png_write_complete_chunk(png_ptr, png_sRGB, buf, 1);
+   header += 31 - header % 31;
+   buf[0] = (png_byte)(header >> 8);
+   buf[1] = (png_byte)(header & 0xff);
+   png_deflate_threads_output(png_ptr, control, buf, 2);
 }
-#endif
 
-#ifdef PNG_WRITE_iCCP_SUPPORTED
-/* Write an iCCP chunk */
-void /* PRIVATE */
-png_write_iCCP(png_structrp png_ptr, png_const_charp name,
-    png_const_bytep profile)
+/* Start the tasks for the current batch.  A Z_FINISH batch always has at least
+ * one (possibly empty) block to end the stream.
+ */
+static void
+png_deflate_threads_start(png_structrp png_ptr, png_deflate_threadsp control,
+    int flush)
 {
-   png_uint_32 name_len;
-   png_uint_32 profile_len;
-   png_byte new_name[81]; /* 1 byte for the compression byte */
-   compression_state comp;
-   png_uint_32 temp;
-
-   png_debug(1, "in png_write_iCCP");
-
-   /* These are all internal problems: the profile should have been checked
-    * before when it was stored.
-    */
-   if (profile == NULL)
-      png_error(png_ptr, "No profile for iCCP chunk"); /* internal error */
-
-   profile_len = png_get_uint_32(profile);
-
-   if (profile_len < 132)
-      png_error(png_ptr, "ICC profile too short");
-
-   temp = (png_uint_32) (*(profile+8));
-   if (temp > 3 && (profile_len & 0x03))
-      png_error(png_ptr, "ICC profile length invalid (not a multiple of 4)");
+   int b = control->current;
+   png_bytep data = control->buf[b] + control->window;
+   png_alloc_size_t done = 0;
 
+   do
    {
-      png_uint_32 embedded_profile_len = png_get_uint_32(profile);
-
-      if (profile_len != embedded_profile_len)
-         png_error(png_ptr, "Profile length does not match profile");
+      png_deflate_workerp worker = &control->worker[b][control->running[b]];
+      png_alloc_size_t before = control->history + done;
+      png_alloc_size_t size = control->have - done;
+
+      if (size > control->block)
+         size = control->block;
+
+      worker->input = data + done;
+      worker->size = (uInt)size;
+      worker->dictionary = before > control->window ? control->window :
+          (uInt)before;
+      done += size;
+      worker->flush = (done == control->have && flush == Z_FINISH) ?
+          Z_FINISH : Z_SYNC_FLUSH;
+
+      png_task_start(png_ptr, &worker->task, png_deflate_block, worker);
+      ++control->running[b];
    }
+   while (done < control->have);
+}
 
-   name_len = png_check_keyword(png_ptr, name, new_name);
+/* Wait for the tasks on batch 'b' and output their blocks in order. */
+static void
+png_deflate_threads_finish(png_structrp png_ptr, png_deflate_threadsp control,
+    int b)
+{
+   int running = control->running[b];
+   int i;
 
-   if (name_len == 0)
-      png_error(png_ptr, "iCCP: invalid keyword");
+   /* All the tasks must finish before anything can call png_error. */
+   for (i = 0; i < running; ++i)
+      png_task_finish(png_ptr, &control->worker[b][i].task);
 
-   new_name[++name_len] = PNG_COMPRESSION_TYPE_BASE;
+   control->running[b] = 0;
 
-   /* Make sure we include the NULL after the name and the compression type */
-   ++name_len;
+   for (i = 0; i < running; ++i)
+   {
+      png_deflate_workerp worker = &control->worker[b][i];
 
-   png_text_compress_init(&comp, profile, profile_len);
+      if (worker->ret != Z_OK)
+         png_deflate_worker_error(png_ptr, worker, worker->ret);
 
-   /* Allow for keyword terminator and compression byte */
-   if (png_text_compress(png_ptr, png_iCCP, &comp, name_len) != Z_OK)
-      png_error(png_ptr, png_ptr->zstream.msg);
+      png_deflate_threads_output(png_ptr, control, worker->output,
+          worker->out);
+      control->adler = adler32_combine(control->adler, worker->adler,
+          (z_off_t)worker->size);
+   }
+}
 
-   png_write_chunk_header(png_ptr, png_iCCP, name_len + comp.output_len);
+/* Compress the current batch; the tasks are left running unless 'flush' is
+ * Z_SYNC_FLUSH or Z_FINISH.  The output of the previous batch comes first.
+ */
+static void
+png_deflate_threads_batch(png_structrp png_ptr, png_deflate_threadsp control,
+    int flush)
+{
+   int b = control->current;
+   png_alloc_size_t total = control->history + control->have;
+   uInt keep = total > control->window ? control->window : (uInt)total;
 
-   png_write_chunk_data(png_ptr, new_name, name_len);
+   png_deflate_threads_finish(png_ptr, control, 1-b);
 
-   png_write_compressed_data_out(png_ptr, &comp);
+   if (control->have > 0 || flush == Z_FINISH)
+      png_deflate_threads_start(png_ptr, control, flush);
 
-   png_write_chunk_end(png_ptr);
+   if (flush != Z_NO_FLUSH)
+      png_deflate_threads_finish(png_ptr, control, b);
+
+   /* The end of this batch is the dictionary of the next; the tasks on this
+    * batch only read it.
+    */
+   memcpy(control->buf[1-b] + control->window - keep,
+       control->buf[b] + control->window + control->have - keep, keep);
+   control->history = keep;
+   control->current = 1-b;
+   control->have = 0;
 }
-#endif
 
-#ifdef PNG_WRITE_sPLT_SUPPORTED
-/* Write a sPLT chunk */
-void /* PRIVATE */
-png_write_sPLT(png_structrp png_ptr, png_const_sPLT_tp spalette)
+/* png_compress_IDAT for parallel compression. */
+static void
+png_deflate_threads_IDAT(png_structrp png_ptr, png_deflate_threadsp control,
+    png_const_bytep input, png_alloc_size_t input_len, int flush)
 {
-   png_uint_32 name_len;
-   png_byte new_name[80];
-   png_byte entrybuf[10];
-   size_t entry_size = (spalette->depth == 8 ? 6 : 10);
-   size_t palette_size = entry_size * (size_t)spalette->nentries;
-   png_sPLT_entryp ep;
-#ifndef PNG_POINTER_INDEXING_SUPPORTED
-   int i;
-#endif
-
-   png_debug(1, "in png_write_sPLT");
-
-   name_len = png_check_keyword(png_ptr, spalette->name, new_name);
+   while (input_len > 0)
+   {
+      png_alloc_size_t avail = control->batch_size - control->have;
 
-   if (name_len == 0)
-      png_error(png_ptr, "sPLT: invalid keyword");
+      if (avail > input_len)
+         avail = input_len;
 
-   /* Make sure we include the NULL after the name */
-   png_write_chunk_header(png_ptr, png_sPLT,
-       (png_uint_32)(name_len + 2 + palette_size));
+      memcpy(control->buf[control->current] + control->window + control->have,
+          input, avail);
+      control->have += avail;
+      input += avail;
+      input_len -= avail;
 
-   png_write_chunk_data(png_ptr, (png_bytep)new_name, (size_t)(name_len + 1));
+      if (control->have == control->batch_size)
+         png_deflate_threads_batch(png_ptr, control, Z_NO_FLUSH);
+   }
 
-   png_write_chunk_data(png_ptr, &spalette->depth, 1);
+   /* As in the serial case a sync flush does not write a partial IDAT. */
+   if (flush != Z_NO_FLUSH)
+      png_deflate_threads_batch(png_ptr, control, flush);
 
-   /* Loop through each palette entry, writing appropriately */
-#ifdef PNG_POINTER_INDEXING_SUPPORTED
-   for (ep = spalette->entries; ep<spalette->entries + spalette->nentries; ep++)
+   if (flush == Z_FINISH)
    {
-      if (spalette->depth == 8)
-      {
-         entrybuf[0] = (png_byte)ep->red;
-         entrybuf[1] = (png_byte)ep->green;
-         entrybuf[2] = (png_byte)ep->blue;
-         entrybuf[3] = (png_byte)ep->alpha;
-         png_save_uint_16(entrybuf + 4, ep->frequency);
-      }
+      png_byte adler[4];
 
-      else
-      {
-         png_save_uint_16(entrybuf + 0, ep->red);
-         png_save_uint_16(entrybuf + 2, ep->green);
-         png_save_uint_16(entrybuf + 4, ep->blue);
-         png_save_uint_16(entrybuf + 6, ep->alpha);
-         png_save_uint_16(entrybuf + 8, ep->frequency);
-      }
+      png_save_uint_32(adler, (png_uint_32)control->adler);
+      png_deflate_threads_output(png_ptr, control, adler, 4);
 
-      png_write_chunk_data(png_ptr, entrybuf, entry_size);
-   }
-#else
-   ep=spalette->entries;
-   for (i = 0; i>spalette->nentries; i++)
-   {
-      if (spalette->depth == 8)
+      if (control->out > 0)
       {
-         entrybuf[0] = (png_byte)ep[i].red;
-         entrybuf[1] = (png_byte)ep[i].green;
-         entrybuf[2] = (png_byte)ep[i].blue;
-         entrybuf[3] = (png_byte)ep[i].alpha;
-         png_save_uint_16(entrybuf + 4, ep[i].frequency);
-      }
+#ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
+         if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
+             png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
+            optimize_cmf(png_ptr->zbuffer_list->output,
+                png_image_size(png_ptr));
+#endif
 
-      else
-      {
-         png_save_uint_16(entrybuf + 0, ep[i].red);
-         png_save_uint_16(entrybuf + 2, ep[i].green);
-         png_save_uint_16(entrybuf + 4, ep[i].blue);
-         png_save_uint_16(entrybuf + 6, ep[i].alpha);
-         png_save_uint_16(entrybuf + 8, ep[i].frequency);
+         png_write_complete_chunk(png_ptr, png_IDAT,
+             png_ptr->zbuffer_list->output, control->out);
       }
 
-      png_write_chunk_data(png_ptr, entrybuf, entry_size);
+      png_ptr->mode |= PNG_HAVE_IDAT | PNG_AFTER_IDAT;
+      png_free_compression_threads(png_ptr);
+      png_ptr->zowner = 0; /* Release the stream */
    }
-#endif
-
-   png_write_chunk_end(png_ptr);
 }
-#endif
 
-#ifdef PNG_WRITE_sBIT_SUPPORTED
-/* Write the sBIT chunk */
 void /* PRIVATE */
-png_write_sBIT(png_structrp png_ptr, png_const_color_8p sbit, int color_type)
+png_free_compression_threads(png_structrp png_ptr)
 {
-   png_byte buf[4];
-   size_t size;
+   png_deflate_threadsp control =
+       png_voidcast(png_deflate_threadsp, png_ptr->compression_state);
+   int b;
 
-   png_debug(1, "in png_write_sBIT");
+   if (control == NULL)
+      return;
 
-   /* Make sure we don't depend upon the order of PNG_COLOR_8 */
-   if ((color_type & PNG_COLOR_MASK_COLOR) != 0)
+   for (b = 0; b < 2; ++b)
    {
-      png_byte maxbits;
+      int i;
 
-      maxbits = (png_byte)(color_type==PNG_COLOR_TYPE_PALETTE ? 8 :
-          png_ptr->usr_bit_depth);
+      while (control->running[b] > 0)
+         png_task_finish(png_ptr,
+             &control->worker[b][--control->running[b]].task);
 
-      if (sbit->red == 0 || sbit->red > maxbits ||
-          sbit->green == 0 || sbit->green > maxbits ||
-          sbit->blue == 0 || sbit->blue > maxbits)
+      for (i = 0; i < control->threads; ++i)
       {
-         png_warning(png_ptr, "Invalid sBIT depth specified");
-         return;
-      }
+         png_deflate_workerp worker = &control->worker[b][i];
 
-      buf[0] = sbit->red;
-      buf[1] = sbit->green;
-      buf[2] = sbit->blue;
-      size = 3;
-   }
+         if (worker->initialized != 0)
+            deflateEnd(&worker->zstream);
 
-   else
-   {
-      if (sbit->gray == 0 || sbit->gray > png_ptr->usr_bit_depth)
-      {
-         png_warning(png_ptr, "Invalid sBIT depth specified");
-         return;
+         png_free(png_ptr, worker->output);
       }
 
-      buf[0] = sbit->gray;
-      size = 1;
+      png_free(png_ptr, control->buf[b]);
    }
 
-   if ((color_type & PNG_COLOR_MASK_ALPHA) != 0)
+   png_free(png_ptr, control);
+   png_ptr->compression_state = NULL;
+}
+#endif /* WRITE_COMPRESSION_THREADS */
+
+#ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+/* PNG_COMPRESSION_LEVEL_FASTEST: the image data is deflated without zlib.  The
+ * only matches are runs of the byte before (distance 1), so there is no
+ * search; each PNG_FAST_ENCODER_BLOCK bytes of filtered rows are counted then
+ * written as one deflate block with Huffman codes made for it, or stored if
+ * that would be smaller (RFC 1951).
+ */
+#define PNG_FAST_LITLEN 286 /* literal/length codes */
+
+/* The first run length of each length code and the extra bits after it */
+static const png_uint_16 png_fast_length_base[29] =
+{
+   3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+   67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const png_byte png_fast_length_extra[29] =
+{
+   0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5,
+   5, 5, 5, 0
+};
+
+/* The order of the code length code lengths in a block header */
+static const png_byte png_fast_clen_order[19] =
+{
+   16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+typedef struct
+{
+   png_bytep   input;    /* filtered rows waiting to be encoded */
+   png_bytep   output;   /* the deflate data waiting to be written */
+   png_uint_32 have;     /* bytes in input */
+   png_alloc_size_t out; /* bytes in output */
+   png_uint_32 bits;     /* bits not yet in output, the first in bit 0 */
+   unsigned int nbits;   /* number of them, less than 16 */
+   int         last;     /* the byte before input, -1 at the start */
+   uLong       adler;    /* Adler-32 of all the input */
+   png_uint_32 freq[PNG_FAST_LITLEN];
+   png_byte    len[PNG_FAST_LITLEN];  /* code lengths, 0 if unused */
+   png_uint_16 code[PNG_FAST_LITLEN]; /* bit reversed, as they are sent */
+   png_byte    length_code[259];      /* run length to length code - 257 */
+} png_fast_encoder;
+typedef png_fast_encoder *png_fast_encoderp;
+
+/* Fill in the length code of each match length. */
+static void
+png_fast_length_codes(png_bytep length_code)
+{
+   int c;
+
+   /* 258 has a code of its own. */
+   for (c = 0; c < 28; ++c)
    {
-      if (sbit->alpha == 0 || sbit->alpha > png_ptr->usr_bit_depth)
-      {
-         png_warning(png_ptr, "Invalid sBIT depth specified");
-         return;
-      }
+      unsigned int l = png_fast_length_base[c];
+      unsigned int end = l + (1U << png_fast_length_extra[c]);
 
-      buf[size++] = sbit->alpha;
+      for (; l < end && l < 258; ++l)
+         length_code[l] = (png_byte)c;
    }
 
-   png_write_complete_chunk(png_ptr, png_sBIT, buf, size);
+   length_code[258] = 28;
 }
-#endif
 
-#ifdef PNG_WRITE_cHRM_SUPPORTED
-/* Write the cHRM chunk */
-void /* PRIVATE */
-png_write_cHRM_fixed(png_structrp png_ptr, const png_xy *xy)
+/* Add the 'n' low bits of 'value' (n <= 16) to the output. */
+static void
+png_fast_bits(png_fast_encoderp enc, png_uint_32 value, unsigned int n)
 {
-   png_byte buf[32];
+   enc->bits |= value << enc->nbits;
+   enc->nbits += n;
 
-   png_debug(1, "in png_write_cHRM");
+   if (enc->nbits >= 16)
+   {
+      enc->output[enc->out++] = (png_byte)enc->bits;
+      enc->output[enc->out++] = (png_byte)(enc->bits >> 8);
+      enc->bits >>= 16;
+      enc->nbits -= 16;
+   }
+}
 
-   /* Each value is saved in 1/100,000ths */
-   png_save_int_32(buf,      xy->whitex);
-   png_save_int_32(buf +  4, xy->whitey);
+/* Pad the output to a byte boundary and move the remaining bits to it. */
+static void
+png_fast_align(png_fast_encoderp enc)
+{
+   if ((enc->nbits & 7) != 0)
+      png_fast_bits(enc, 0, 8 - (enc->nbits & 7));
 
-   png_save_int_32(buf +  8, xy->redx);
-   png_save_int_32(buf + 12, xy->redy);
+   while (enc->nbits > 0)
+   {
+      enc->output[enc->out++] = (png_byte)enc->bits;
+      enc->bits >>= 8;
+      enc->nbits -= 8;
+   }
+}
 
-   png_save_int_32(buf + 16, xy->greenx);
-   png_save_int_32(buf + 20, xy->greeny);
+/* The number of bytes at the start of 'data' that equal the first, up to the
+ * longest match deflate allows.
+ */
+static png_uint_32
+png_fast_run(png_const_bytep data, png_uint_32 size)
+{
+   png_uint_32 run = 1;
 
-   png_save_int_32(buf + 24, xy->bluex);
-   png_save_int_32(buf + 28, xy->bluey);
+   if (size > 258)
+      size = 258;
 
-   png_write_complete_chunk(png_ptr, png_cHRM, buf, 32);
+   while (run < size && data[run] == data[0])
+      ++run;
+
+   return run;
 }
-#endif
 
-#ifdef PNG_WRITE_tRNS_SUPPORTED
-/* Write the tRNS chunk */
-void /* PRIVATE */
-png_write_tRNS(png_structrp png_ptr, png_const_bytep trans_alpha,
-    png_const_color_16p tran, int num_trans, int color_type)
+/* Make the canonical codes (RFC 1951 3.2.2) for the 'n' code lengths 'len',
+ * reversed to be sent first bit first.
+ */
+static void
+png_fast_codes(png_const_bytep len, int n, png_uint_16p code)
 {
-   png_byte buf[6];
+   unsigned int count[16], next[16];
+   int i;
 
-   png_debug(1, "in png_write_tRNS");
+   memset(count, 0, sizeof count);
 
-   if (color_type == PNG_COLOR_TYPE_PALETTE)
-   {
-      if (num_trans <= 0 || num_trans > (int)png_ptr->num_palette)
-      {
-         png_app_warning(png_ptr,
-             "Invalid number of transparent colors specified");
-         return;
-      }
+   for (i = 0; i < n; ++i)
+      ++count[len[i]];
 
-      /* Write the chunk out as it is */
-      png_write_complete_chunk(png_ptr, png_tRNS, trans_alpha,
-          (size_t)num_trans);
-   }
+   count[0] = 0;
+   next[1] = 0;
 
-   else if (color_type == PNG_COLOR_TYPE_GRAY)
+   for (i = 2; i < 16; ++i)
+      next[i] = (next[i-1] + count[i-1]) << 1;
+
+   for (i = 0; i < n; ++i)
    {
-      /* One 16-bit value */
-      if (tran->gray >= (1 << png_ptr->bit_depth))
+      unsigned int l = len[i];
+
+      if (l > 0)
       {
-         png_app_warning(png_ptr,
-             "Ignoring attempt to write tRNS chunk out-of-range for bit_depth");
+         unsigned int c = next[l]++, r = 0;
 
-         return;
-      }
+         while (l-- > 0)
+         {
+            r = (r << 1) | (c & 1);
+            c >>= 1;
+         }
 
-      png_save_uint_16(buf, tran->gray);
-      png_write_complete_chunk(png_ptr, png_tRNS, buf, 2);
+         code[i] = (png_uint_16)r;
+      }
    }
+}
 
-   else if (color_type == PNG_COLOR_TYPE_RGB)
-   {
-      /* Three 16-bit values */
-      png_save_uint_16(buf, tran->red);
-      png_save_uint_16(buf + 2, tran->green);
-      png_save_uint_16(buf + 4, tran->blue);
-#ifdef PNG_WRITE_16BIT_SUPPORTED
-      if (png_ptr->bit_depth == 8 && (buf[0] | buf[2] | buf[4]) != 0)
-#else
-      if ((buf[0] | buf[2] | buf[4]) != 0)
-#endif
+/* Make Huffman code lengths of at most 'limit' bits for the 'n' symbols with
+ * the given frequencies, and the codes themselves.  The lengths are those of
+ * an optimal code, found in place as described by Moffat and Katajainen ("In-
+ * place calculation of minimum-redundancy codes", 1995); if the longest is too
+ * long the frequencies are halved until it is not.  At least two symbols are
+ * given codes, as a decoder may reject an incomplete code.
+ */
+static void
+png_fast_huffman(png_uint_32p freq, int n, unsigned int limit, png_bytep len,
+    png_uint_16p code)
+{
+   png_uint_16 sym[PNG_FAST_LITLEN];
+   png_uint_32 weight[PNG_FAST_LITLEN];
+   png_uint_32 scale = 0;
+   int used, i;
+
+   for (i = 0, used = 0; i < n; ++i)
+      if (freq[i] > 0)
+         ++used;
+
+   for (i = 0; used < 2; ++i)
+      if (freq[i] == 0)
       {
-         png_app_warning(png_ptr,
-             "Ignoring attempt to write 16-bit tRNS chunk when bit_depth is 8");
-         return;
+         freq[i] = 1;
+         ++used;
       }
 
-      png_write_complete_chunk(png_ptr, png_tRNS, buf, 6);
-   }
-
-   else
+   for (;;)
    {
-      png_app_warning(png_ptr, "Can't write tRNS with an alpha channel");
-   }
-}
-#endif
+      int root, leaf, node, gap;
+      unsigned int depth, avail;
 
-#ifdef PNG_WRITE_bKGD_SUPPORTED
-/* Write the background chunk */
-void /* PRIVATE */
-png_write_bKGD(png_structrp png_ptr, png_const_color_16p back, int color_type)
-{
-   png_byte buf[6];
+      for (i = 0, used = 0; i < n; ++i)
+         if (freq[i] > 0)
+            sym[used++] = (png_uint_16)i;
 
-   png_debug(1, "in png_write_bKGD");
+      /* Shell sort the symbols by frequency, then by symbol so the result does
+       * not depend on the sort.
+       */
+      for (gap = used/2; gap > 0; gap /= 2)
+         for (i = gap; i < used; ++i)
+         {
+            png_uint_16 s = sym[i];
+            int j = i;
 
-   if (color_type == PNG_COLOR_TYPE_PALETTE)
-   {
-      if (
-#ifdef PNG_MNG_FEATURES_SUPPORTED
-          (png_ptr->num_palette != 0 ||
-          (png_ptr->mng_features_permitted & PNG_FLAG_MNG_EMPTY_PLTE) == 0) &&
-#endif
-         back->index >= png_ptr->num_palette)
+            while (j >= gap && (freq[sym[j-gap]] > freq[s] ||
+                (freq[sym[j-gap]] == freq[s] && sym[j-gap] > s)))
+            {
+               sym[j] = sym[j-gap];
+               j -= gap;
+            }
+
+            sym[j] = s;
+         }
+
+      for (i = 0; i < used; ++i)
+         weight[i] = ((freq[sym[i]] - 1) >> scale) + 1;
+
+      /* The tree: each internal node replaces the weight of a leaf with the
+       * index of its parent.
+       */
+      weight[0] += weight[1];
+      root = 0;
+      leaf = 2;
+
+      for (node = 1; node < used-1; ++node)
       {
-         png_warning(png_ptr, "Invalid background palette index");
-         return;
+         if (leaf >= used || weight[root] < weight[leaf])
+         {
+            weight[node] = weight[root];
+            weight[root++] = (png_uint_32)node;
+         }
+
+         else
+            weight[node] = weight[leaf++];
+
+         if (leaf >= used || (root < node && weight[root] < weight[leaf]))
+         {
+            weight[node] += weight[root];
+            weight[root++] = (png_uint_32)node;
+         }
+
+         else
+            weight[node] += weight[leaf++];
       }
 
-      buf[0] = back->index;
-      png_write_complete_chunk(png_ptr, png_bKGD, buf, 1);
-   }
+      /* The depths of the internal nodes: */
+      weight[used-2] = 0;
 
-   else if ((color_type & PNG_COLOR_MASK_COLOR) != 0)
-   {
-      png_save_uint_16(buf, back->red);
-      png_save_uint_16(buf + 2, back->green);
-      png_save_uint_16(buf + 4, back->blue);
-#ifdef PNG_WRITE_16BIT_SUPPORTED
-      if (png_ptr->bit_depth == 8 && (buf[0] | buf[2] | buf[4]) != 0)
-#else
-      if ((buf[0] | buf[2] | buf[4]) != 0)
-#endif
+      for (node = used-3; node >= 0; --node)
+         weight[node] = weight[weight[node]] + 1;
+
+      /* The depths of the leaves, the deepest first: */
+      avail = 1;
+      depth = 0;
+      root = used-2;
+      node = used-1;
+
+      while (avail > 0)
       {
-         png_warning(png_ptr,
-             "Ignoring attempt to write 16-bit bKGD chunk "
-             "when bit_depth is 8");
+         unsigned int internal = 0;
 
-         return;
+         while (root >= 0 && weight[root] == depth)
+         {
+            ++internal;
+            --root;
+         }
+
+         while (avail > internal)
+         {
+            weight[node--] = depth;
+            --avail;
+         }
+
+         avail = 2 * internal;
+         ++depth;
       }
 
-      png_write_complete_chunk(png_ptr, png_bKGD, buf, 6);
+      if (weight[0] <= limit)
+         break;
+
+      ++scale;
    }
 
-   else
+   memset(len, 0, (size_t)n);
+
+   for (i = 0; i < used; ++i)
+      len[sym[i]] = (png_byte)weight[i];
+
+   png_fast_codes(len, n, code);
+}
+
+/* Count the literals and run lengths the encoding of 'data' will use. */
+static void
+png_fast_count(png_fast_encoderp enc, png_const_bytep data, png_uint_32 size)
+{
+   png_uint_32p freq = enc->freq;
+   int prev = enc->last;
+   png_uint_32 i = 0;
+
+   while (i < size)
    {
-      if (back->gray >= (1 << png_ptr->bit_depth))
+      unsigned int b = data[i];
+
+      if ((int)b == prev)
       {
-         png_warning(png_ptr,
-             "Ignoring attempt to write bKGD chunk out-of-range for bit_depth");
+         png_uint_32 run = png_fast_run(data+i, size-i);
 
-         return;
+         if (run >= 3)
+         {
+            ++freq[257 + enc->length_code[run]];
+            i += run;
+            continue;
+         }
       }
 
-      png_save_uint_16(buf, back->gray);
-      png_write_complete_chunk(png_ptr, png_bKGD, buf, 2);
+      ++freq[b];
+      prev = (int)b;
+      ++i;
    }
 }
-#endif
 
-#ifdef PNG_WRITE_eXIf_SUPPORTED
-/* Write the Exif data */
-void /* PRIVATE */
-png_write_eXIf(png_structrp png_ptr, png_bytep exif, int num_exif)
+/* Encode 'data' with the codes in 'enc'.  This is the inner loop, so the
+ * output state is kept in locals.
+ */
+static void
+png_fast_emit(png_fast_encoderp enc, png_const_bytep data, png_uint_32 size)
 {
-   int i;
-   png_byte buf[1];
+   png_bytep output = enc->output;
+   png_const_bytep len = enc->len;
+   png_const_uint_16p code = enc->code;
+   png_alloc_size_t out = enc->out;
+   png_uint_32 bits = enc->bits;
+   unsigned int nbits = enc->nbits;
+   int prev = enc->last;
+   png_uint_32 i = 0;
+
+#  define PNG_FAST_PUT(value, n) do\
+   {\
+      bits |= (png_uint_32)(value) << nbits;\
+      nbits += (n);\
+      if (nbits >= 16)\
+      {\
+         output[out++] = (png_byte)bits;\
+         output[out++] = (png_byte)(bits >> 8);\
+         bits >>= 16;\
+         nbits -= 16;\
+      }\
+   } while (0)
+
+   while (i < size)
+   {
+      unsigned int b = data[i];
 
-   png_debug(1, "in png_write_eXIf");
+      if ((int)b == prev)
+      {
+         png_uint_32 run = png_fast_run(data+i, size-i);
 
-   png_write_chunk_header(png_ptr, png_eXIf, (png_uint_32)(num_exif));
+         if (run >= 3)
+         {
+            unsigned int c = enc->length_code[run];
 
-   for (i = 0; i < num_exif; i++)
-   {
-      buf[0] = exif[i];
-      png_write_chunk_data(png_ptr, buf, 1);
+            PNG_FAST_PUT(code[257+c], len[257+c]);
+            /* The extra bits then distance code 0, which is a single 0 bit: */
+            PNG_FAST_PUT(run - png_fast_length_base[c],
+                png_fast_length_extra[c] + 1U);
+            i += run;
+            continue;
+         }
+      }
+
+      PNG_FAST_PUT(code[b], len[b]);
+      prev = (int)b;
+      ++i;
    }
 
-   png_write_chunk_end(png_ptr);
+#  undef PNG_FAST_PUT
+
+   enc->out = out;
+   enc->bits = bits;
+   enc->nbits = nbits;
 }
-#endif
 
-#ifdef PNG_WRITE_hIST_SUPPORTED
-/* Write the histogram */
-void /* PRIVATE */
-png_write_hIST(png_structrp png_ptr, png_const_uint_16p hist, int num_hist)
+/* The size in bits of the header of a block with dynamic Huffman codes of the
+ * given literal/length and distance code lengths, which is also sent if
+ * 'write' is set.  The code lengths are sent run length encoded, the distance
+ * code lengths straight after the literal/length ones.
+ */
+static png_alloc_size_t
+png_fast_header(png_fast_encoderp enc, png_const_bytep lit_len,
+    png_const_bytep dist_len, int ndist, int final, int write)
 {
-   int i;
-   png_byte buf[3];
-
-   png_debug(1, "in png_write_hIST");
-
-   if (num_hist > (int)png_ptr->num_palette)
+   png_byte lens[PNG_FAST_LITLEN+30];
+   png_byte rle[PNG_FAST_LITLEN+30], rle_extra[PNG_FAST_LITLEN+30];
+   png_uint_32 clen_freq[19];
+   png_byte clen_len[19];
+   png_uint_16 clen_code[19];
+   png_alloc_size_t cost;
+   int hlit, hdist, hclen, nrle, i;
+
+   for (hlit = PNG_FAST_LITLEN; lit_len[hlit-1] == 0; --hlit) ;
+   for (hdist = ndist; hdist > 1 && dist_len[hdist-1] == 0; --hdist) ;
+
+   memcpy(lens, lit_len, (size_t)hlit);
+   memcpy(lens + hlit, dist_len, (size_t)hdist);
+   memset(clen_freq, 0, sizeof clen_freq);
+
+   for (i = 0, nrle = 0; i < hlit+hdist;)
    {
-      png_debug2(3, "num_hist = %d, num_palette = %d", num_hist,
-          png_ptr->num_palette);
+      unsigned int l = lens[i];
+      int run = 1, r;
 
-      png_warning(png_ptr, "Invalid number of histogram entries specified");
-      return;
-   }
+      while (i+run < hlit+hdist && lens[i+run] == l)
+         ++run;
 
-   png_write_chunk_header(png_ptr, png_hIST, (png_uint_32)(num_hist * 2));
+      i += run;
 
-   for (i = 0; i < num_hist; i++)
-   {
-      png_save_uint_16(buf, hist[i]);
-      png_write_chunk_data(png_ptr, buf, 2);
-   }
+      if (l == 0)
+      {
+         for (; run >= 11; run -= r)
+         {
+            r = run < 138 ? run : 138;
+            rle[nrle] = 18;
+            rle_extra[nrle++] = (png_byte)(r - 11);
+         }
 
-   png_write_chunk_end(png_ptr);
-}
-#endif
+         if (run >= 3)
+         {
+            rle[nrle] = 17;
+            rle_extra[nrle++] = (png_byte)(run - 3);
+            run = 0;
+         }
+      }
 
-#ifdef PNG_WRITE_tEXt_SUPPORTED
-/* Write a tEXt chunk */
-void /* PRIVATE */
-png_write_tEXt(png_structrp png_ptr, png_const_charp key, png_const_charp text,
-    size_t text_len)
-{
-   png_uint_32 key_len;
-   png_byte new_key[80];
+      else
+      {
+         rle[nrle] = (png_byte)l;
+         rle_extra[nrle++] = 0;
 
-   png_debug(1, "in png_write_tEXt");
+         for (--run; run >= 3; run -= r)
+         {
+            r = run < 6 ? run : 6;
+            rle[nrle] = 16;
+            rle_extra[nrle++] = (png_byte)(r - 3);
+         }
+      }
 
-   key_len = png_check_keyword(png_ptr, key, new_key);
+      while (run-- > 0)
+      {
+         rle[nrle] = (png_byte)l;
+         rle_extra[nrle++] = 0;
+      }
+   }
 
-   if (key_len == 0)
-      png_error(png_ptr, "tEXt: invalid keyword");
+   for (i = 0; i < nrle; ++i)
+      ++clen_freq[rle[i]];
 
-   if (text == NULL || *text == '\0')
-      text_len = 0;
+   png_fast_huffman(clen_freq, 19, 7, clen_len, clen_code);
 
-   else
-      text_len = strlen(text);
+   for (hclen = 19; hclen > 4 && clen_len[png_fast_clen_order[hclen-1]] == 0;
+       --hclen) ;
 
-   if (text_len > PNG_UINT_31_MAX - (key_len+1))
-      png_error(png_ptr, "tEXt: text too long");
+   cost = 3 + 5 + 5 + 4 + 3 * (png_alloc_size_t)hclen;
 
-   /* Make sure we include the 0 after the key */
-   png_write_chunk_header(png_ptr, png_tEXt,
-       (png_uint_32)/*checked above*/(key_len + text_len + 1));
-   /*
-    * We leave it to the application to meet PNG-1.0 requirements on the
-    * contents of the text.  PNG-1.0 through PNG-1.2 discourage the use of
-    * any non-Latin-1 characters except for NEWLINE.  ISO PNG will forbid them.
-    * The NUL character is forbidden by PNG-1.0 through PNG-1.2 and ISO PNG.
-    */
-   png_write_chunk_data(png_ptr, new_key, key_len + 1);
+   for (i = 0; i < nrle; ++i)
+      cost += clen_len[rle[i]] + (rle[i] == 16 ? 2U : rle[i] == 17 ? 3U :
+          rle[i] == 18 ? 7U : 0U);
 
-   if (text_len != 0)
-      png_write_chunk_data(png_ptr, (png_const_bytep)text, text_len);
+   if (write != 0)
+   {
+      png_fast_bits(enc, final != 0, 1);
+      png_fast_bits(enc, 2, 2); /* dynamic Huffman codes */
+      png_fast_bits(enc, (png_uint_32)(hlit - 257), 5);
+      png_fast_bits(enc, (png_uint_32)(hdist - 1), 5);
+      png_fast_bits(enc, (png_uint_32)(hclen - 4), 4);
 
-   png_write_chunk_end(png_ptr);
+      for (i = 0; i < hclen; ++i)
+         png_fast_bits(enc, clen_len[png_fast_clen_order[i]], 3);
+
+      for (i = 0; i < nrle; ++i)
+      {
+         unsigned int s = rle[i];
+
+         png_fast_bits(enc, clen_code[s], clen_len[s]);
+
+         if (s >= 16)
+            png_fast_bits(enc, rle_extra[i], s == 16 ? 2 : s == 17 ? 3 : 7);
+      }
+   }
+
+   return cost;
 }
-#endif
 
-#ifdef PNG_WRITE_zTXt_SUPPORTED
-/* Write a compressed text chunk */
-void /* PRIVATE */
-png_write_zTXt(png_structrp png_ptr, png_const_charp key, png_const_charp text,
-    int compression)
-{
-   png_uint_32 key_len;
-   png_byte new_key[81];
-   compression_state comp;
+/* The size in bits of 'size' bytes sent as stored blocks, allowing for the
+ * padding to a byte boundary.
+ */
+#define PNG_FAST_STORED_BITS(size)\
+   ((((size) + 0xfffe) / 0xffff) * (3 + 7 + 32) + 8 * (png_alloc_size_t)(size))
 
-   png_debug(1, "in png_write_zTXt");
+/* Send 'size' bytes as stored blocks of at most 65535 bytes, the last of them
+ * the final block if 'final' is set.
+ */
+static void
+png_fast_stored(png_fast_encoderp enc, png_const_bytep data, png_uint_32 size,
+    int final)
+{
+   png_uint_32 done = 0;
 
-   if (compression == PNG_TEXT_COMPRESSION_NONE)
+   do
    {
-      png_write_tEXt(png_ptr, key, text, 0);
-      return;
+      png_uint_32 piece = size - done;
+
+      if (piece > 0xffff)
+         piece = 0xffff;
+
+      png_fast_bits(enc, final != 0 && done + piece == size, 1);
+      png_fast_bits(enc, 0, 2);
+      png_fast_align(enc);
+      enc->output[enc->out++] = (png_byte)piece;
+      enc->output[enc->out++] = (png_byte)(piece >> 8);
+      enc->output[enc->out++] = (png_byte)~piece;
+      enc->output[enc->out++] = (png_byte)(~piece >> 8);
+      memcpy(enc->output + enc->out, data + done, piece);
+      enc->out += piece;
+      done += piece;
    }
+   while (done < size);
+}
 
-   if (compression != PNG_TEXT_COMPRESSION_zTXt)
-      png_error(png_ptr, "zTXt: invalid compression type");
+/* Encode the waiting input as a block, the last if 'final' is set.  Only the
+ * first of the two distance codes is used.
+ */
+static void
+png_fast_block(png_fast_encoderp enc, int final)
+{
+   static const png_byte dist_len[2] = { 1, 1 };
+   png_const_bytep data = enc->input;
+   png_uint_32 size = enc->have;
+   png_alloc_size_t cost;
+   int i;
 
-   key_len = png_check_keyword(png_ptr, key, new_key);
+   memset(enc->freq, 0, sizeof enc->freq);
+   png_fast_count(enc, data, size);
+   enc->freq[256] = 1; /* end of block */
+   png_fast_huffman(enc->freq, PNG_FAST_LITLEN, 15, enc->len, enc->code);
 
-   if (key_len == 0)
-      png_error(png_ptr, "zTXt: invalid keyword");
+   /* The exact size of the block in bits, to choose between the two: */
+   cost = png_fast_header(enc, enc->len, dist_len, 2, final, 0);
 
-   /* Add the compression method and 1 for the keyword separator. */
-   new_key[++key_len] = PNG_COMPRESSION_TYPE_BASE;
-   ++key_len;
+   for (i = 0; i < PNG_FAST_LITLEN; ++i)
+   {
+      png_alloc_size_t n = enc->freq[i];
 
-   /* Compute the compressed data; do it now for the length */
-   png_text_compress_init(&comp, (png_const_bytep)text,
-       text == NULL ? 0 : strlen(text));
+      cost += n * enc->len[i];
 
-   if (png_text_compress(png_ptr, png_zTXt, &comp, key_len) != Z_OK)
-      png_error(png_ptr, png_ptr->zstream.msg);
+      if (i > 256)
+         cost += n * (png_fast_length_extra[i-257] + 1U);
+   }
 
-   /* Write start of chunk */
-   png_write_chunk_header(png_ptr, png_zTXt, key_len + comp.output_len);
+   if (cost < PNG_FAST_STORED_BITS(size))
+   {
+      png_fast_header(enc, enc->len, dist_len, 2, final, 1);
+      png_fast_emit(enc, data, size);
+      png_fast_bits(enc, enc->code[256], enc->len[256]);
+   }
 
-   /* Write key */
-   png_write_chunk_data(png_ptr, new_key, key_len);
+   else
+      png_fast_stored(enc, data, size, final);
 
-   /* Write the compressed data */
-   png_write_compressed_data_out(png_ptr, &comp);
+   if (size > 0)
+      enc->last = data[size-1];
 
-   /* Close the chunk */
-   png_write_chunk_end(png_ptr);
+   enc->have = 0;
 }
-#endif
 
-#ifdef PNG_WRITE_iTXt_SUPPORTED
-/* Write an iTXt chunk */
-void /* PRIVATE */
-png_write_iTXt(png_structrp png_ptr, int compression, png_const_charp key,
-    png_const_charp lang, png_const_charp lang_key, png_const_charp text)
+/* Write the complete bytes of output as an IDAT chunk. */
+static void
+png_fast_write(png_structrp png_ptr, png_fast_encoderp enc)
 {
-   png_uint_32 key_len, prefix_len;
-   size_t lang_len, lang_key_len;
-   png_byte new_key[82];
-   compression_state comp;
-
-   png_debug(1, "in png_write_iTXt");
+   if (enc->out > 0)
+   {
+      png_write_complete_chunk(png_ptr, png_IDAT, enc->output, enc->out);
+      png_ptr->mode |= PNG_HAVE_IDAT;
+      enc->out = 0;
+   }
+}
 
-   key_len = png_check_keyword(png_ptr, key, new_key);
+static png_fast_encoderp
+png_fast_init(png_structrp png_ptr)
+{
+   png_fast_encoderp enc = png_voidcast(png_fast_encoderp,
+       png_malloc(png_ptr, (sizeof *enc) + 2 * PNG_FAST_ENCODER_BLOCK + 1024));
+
+   memset(enc, 0, sizeof *enc);
+   png_ptr->fast_encoder = enc;
+   enc->input = (png_bytep)(enc + 1);
+   enc->output = enc->input + PNG_FAST_ENCODER_BLOCK;
+   enc->last = -1;
+   enc->adler = adler32(0, NULL, 0);
+   png_fast_length_codes(enc->length_code);
+
+   /* The zlib header (RFC 1950): deflate with a 32K window, the fastest
+    * level.
+    */
+   enc->output[0] = 0x78;
+   enc->output[1] = 0x01;
+   enc->out = 2;
 
-   if (key_len == 0)
-      png_error(png_ptr, "iTXt: invalid keyword");
+   return enc;
+}
 
-   /* Set the compression flag */
-   switch (compression)
+static void
+png_fast_IDAT(png_structrp png_ptr, png_fast_encoderp enc,
+    png_const_bytep input, png_alloc_size_t input_len, int flush)
+{
+   while (input_len > 0)
    {
-      case PNG_ITXT_COMPRESSION_NONE:
-      case PNG_TEXT_COMPRESSION_NONE:
-         compression = new_key[++key_len] = 0; /* no compression */
-         break;
+      png_uint_32 avail;
 
-      case PNG_TEXT_COMPRESSION_zTXt:
-      case PNG_ITXT_COMPRESSION_zTXt:
-         compression = new_key[++key_len] = 1; /* compressed */
-         break;
+      /* A full block is only encoded when there is more, so that the last one
+       * can be marked final.
+       */
+      if (enc->have == PNG_FAST_ENCODER_BLOCK)
+      {
+         png_fast_block(enc, 0);
+         png_fast_write(png_ptr, enc);
+      }
 
-      default:
-         png_error(png_ptr, "iTXt: invalid compression");
-   }
+      avail = PNG_FAST_ENCODER_BLOCK - enc->have;
 
-   new_key[++key_len] = PNG_COMPRESSION_TYPE_BASE;
-   ++key_len; /* for the keywod separator */
+      if (avail > input_len)
+         avail = (png_uint_32)input_len;
 
-   /* We leave it to the application to meet PNG-1.0 requirements on the
-    * contents of the text.  PNG-1.0 through PNG-1.2 discourage the use of
-    * any non-Latin-1 characters except for NEWLINE.  ISO PNG, however,
-    * specifies that the text is UTF-8 and this really doesn't require any
-    * checking.
-    *
-    * The NUL character is forbidden by PNG-1.0 through PNG-1.2 and ISO PNG.
-    *
-    * TODO: validate the language tag correctly (see the spec.)
-    */
-   if (lang == NULL) lang = ""; /* empty language is valid */
-   lang_len = strlen(lang)+1;
-   if (lang_key == NULL) lang_key = ""; /* may be empty */
-   lang_key_len = strlen(lang_key)+1;
-   if (text == NULL) text = ""; /* may be empty */
+      memcpy(enc->input + enc->have, input, avail);
+      enc->adler = adler32(enc->adler, input, avail);
+      enc->have += avail;
+      input += avail;
+      input_len -= avail;
+   }
 
-   prefix_len = key_len;
-   if (lang_len > PNG_UINT_31_MAX-prefix_len)
-      prefix_len = PNG_UINT_31_MAX;
-   else
-      prefix_len = (png_uint_32)(prefix_len + lang_len);
+   if (flush == Z_FINISH)
+   {
+      png_byte adler[4];
+      unsigned int i;
 
-   if (lang_key_len > PNG_UINT_31_MAX-prefix_len)
-      prefix_len = PNG_UINT_31_MAX;
-   else
-      prefix_len = (png_uint_32)(prefix_len + lang_key_len);
+      png_fast_block(enc, 1);
+      png_fast_align(enc);
+      png_save_uint_32(adler, (png_uint_32)enc->adler);
 
-   png_text_compress_init(&comp, (png_const_bytep)text, strlen(text));
+      for (i = 0; i < 4; ++i)
+         enc->output[enc->out++] = adler[i];
 
-   if (compression != 0)
-   {
-      if (png_text_compress(png_ptr, png_iTXt, &comp, prefix_len) != Z_OK)
-         png_error(png_ptr, png_ptr->zstream.msg);
+      png_fast_write(png_ptr, enc);
+      png_ptr->mode |= PNG_AFTER_IDAT;
+      png_free(png_ptr, enc);
+      png_ptr->fast_encoder = NULL;
+      png_ptr->zowner = 0; /* Release the stream */
    }
 
-   else
+   else if (flush != Z_NO_FLUSH)
    {
-      if (comp.input_len > PNG_UINT_31_MAX-prefix_len)
-         png_error(png_ptr, "iTXt: uncompressed text too long");
-
-      /* So the string will fit in a chunk: */
-      comp.output_len = (png_uint_32)/*SAFE*/comp.input_len;
+      /* As deflate does, end with an empty stored block: */
+      if (enc->have > 0)
+         png_fast_block(enc, 0);
+
+      png_fast_bits(enc, 0, 3);
+      png_fast_align(enc);
+      enc->output[enc->out++] = 0;
+      enc->output[enc->out++] = 0;
+      enc->output[enc->out++] = 0xff;
+      enc->output[enc->out++] = 0xff;
+      png_fast_write(png_ptr, enc);
    }
+}
+#endif /* WRITE_FAST_ENCODER */
+
+#ifdef PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED
+/* PNG_COMPRESSION_LEVEL_OPTIMAL: the image data is kept until the end then
+ * deflated without zlib by optimal parsing, as Zopfli does.  The matches at
+ * each position are found once, except inside long matches.  The data is
+ * divided into blocks where separate Huffman codes cost less than one set,
+ * then the cheapest sequence of literals and matches through each block is
+ * found for the code lengths of the previous sequence, again and again while
+ * the block gets smaller.
+ *
+ * The rows are also filtered again with each of the filters png_set_filter
+ * allows, one filter for every row.  Each of these trials, and the one with
+ * the rows as libpng filtered them, is a task and png_set_compression_threads
+ * of them run at once; the smallest result is written.
+ */
+#define PNG_OPTIMAL_WINDOW    32768
+#define PNG_OPTIMAL_HASH_BITS 15
+#define PNG_OPTIMAL_CHAIN     256  /* most earlier positions a search tries */
+#define PNG_OPTIMAL_MATCHES   8    /* most matches kept for a position */
+#define PNG_OPTIMAL_NICE      128  /* matches are not looked for inside a
+                                    * match this long */
+#define PNG_OPTIMAL_SPLIT     512  /* fewest symbols in a block to split */
+#define PNG_OPTIMAL_TRIALS    6    /* as filtered, then each filter alone */
+#define PNG_OPTIMAL_NONE      0xffffffffU
+
+#define PNG_OPTIMAL_HASH(p) ((((((png_uint_32)(p)[0] << 16) |\
+   ((png_uint_32)(p)[1] << 8) | (p)[2]) * 0x9e3779b1U) & 0xffffffffU) >>\
+   (32 - PNG_OPTIMAL_HASH_BITS))
+
+/* A match is kept as the distance in the low 16 bits, the length less 3 in
+ * the next 8 and the distance code above them.
+ */
 
-   png_write_chunk_header(png_ptr, png_iTXt, comp.output_len + prefix_len);
+/* The first distance of each distance code and the extra bits after it */
+static const png_uint_16 png_optimal_dist_base[30] =
+{
+   1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+   769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
 
-   png_write_chunk_data(png_ptr, new_key, key_len);
+static const png_byte png_optimal_dist_extra[30] =
+{
+   0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+   11, 11, 12, 12, 13, 13
+};
 
-   png_write_chunk_data(png_ptr, (png_const_bytep)lang, lang_len);
+/* 16 * log2(1 + i/16), rounded */
+static const png_byte png_optimal_log2_fraction[16] =
+{
+   0, 1, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 15
+};
 
-   png_write_chunk_data(png_ptr, (png_const_bytep)lang_key, lang_key_len);
+typedef struct png_optimal_encoder png_optimal_encoder, *png_optimal_encoderp;
 
-   if (compression != 0)
-      png_write_compressed_data_out(png_ptr, &comp);
+typedef struct
+{
+   png_uint_16p len;   /* 1 for a literal, else the match length */
+   png_uint_16p dist;  /* the literal, else the match distance */
+   png_uint_32  count; /* number of symbols */
+} png_optimal_symbols, *png_optimal_symbolsp;
+
+typedef struct
+{
+   png_task             task;
+   png_optimal_encoderp state;
+   int                  filter;   /* PNG_FILTER_VALUE_ of every row, or -1 */
+   png_const_bytep      data;     /* the filtered rows being deflated */
+   png_bytep            filtered; /* the rows filtered with 'filter' */
+   png_bytep            output;   /* the zlib stream, after the header */
+   uLong                adler;    /* Adler-32 of data */
+   png_fast_encoder     enc;      /* writes output; its len and code are the
+                                   * literal/length code of a block */
+   png_uint_32p         head;     /* the last position with each hash */
+   png_uint_32p         prev;     /* the position before with the same hash */
+   png_uint_32p         match;    /* PNG_OPTIMAL_MATCHES at each position */
+   png_bytep            nmatch;   /* how many of them there are */
+   png_uint_32p         cost;     /* of the cheapest parse to each position */
+   png_uint_16p         step;     /* the last symbol of that parse */
+   png_optimal_symbols  first;    /* the parse the blocks are split from */
+   png_optimal_symbols  now;      /* the latest parse of a block */
+   png_optimal_symbols  best;     /* the smallest parse of a block */
+   png_uint_32          split[PNG_OPTIMAL_BLOCKS]; /* first symbol of blocks */
+   int                  splits;   /* number of blocks less one */
+   png_uint_32          lit_freq[PNG_FAST_LITLEN];
+   png_uint_32          dist_freq[30];
+   png_byte             dist_len[30];
+   png_uint_16          dist_code[30];
+   png_uint_32          lit_cost[PNG_FAST_LITLEN]; /* 1/16 bits, as the rest */
+   png_uint_32          len_cost[259];
+   png_uint_32          dist_cost[30];
+} png_optimal_worker, *png_optimal_workerp;
+
+struct png_optimal_encoder
+{
+   png_bytep          data;        /* the rows as libpng filtered them */
+   png_alloc_size_t   size;        /* bytes of data */
+   png_alloc_size_t   allocated;   /* allocated size of data */
+   png_bytep          raw;         /* the rows before filtering, or NULL */
+   png_bytep          best;        /* the smallest result so far */
+   png_alloc_size_t   output_size; /* allocated size of each result */
+   png_uint_32        chunk;       /* bytes parsed at once */
+   unsigned int       bpp;         /* bytes per pixel, for the filters */
+   png_uint_32        rows[7];     /* rows in each pass, 0 if none */
+   size_t             rowbytes[7]; /* bytes in a row of each pass */
+   png_byte           length_code[259];
+   png_byte           dist_code[512]; /* see PNG_OPTIMAL_DIST_CODE */
+   png_byte           fixed_len[PNG_FAST_LITLEN];
+   png_uint_16        fixed_code[PNG_FAST_LITLEN];
+   png_byte           fixed_dist_len[30];
+   png_uint_16        fixed_dist_code[30];
+   int                workers;     /* number with memory allocated */
+   png_optimal_worker worker[PNG_OPTIMAL_TRIALS];
+};
+
+/* The distance code of a distance, as zlib finds it */
+#define PNG_OPTIMAL_DIST_CODE(state, dist) ((dist) <= 256 ?\
+   (state)->dist_code[(dist) - 1] : (state)->dist_code[256 + (((dist)-1) >> 7)])
+
+/* 16 * log2(x) for x > 0, to within a sixteenth */
+static png_uint_32
+png_optimal_log2(png_uint_32 x)
+{
+   unsigned int k = 0;
+
+   while ((x >> k) > 1)
+      ++k;
+
+   if (k >= 4)
+      x >>= k - 4;
 
    else
-      png_write_chunk_data(png_ptr, (png_const_bytep)text, comp.output_len);
+      x <<= 4 - k;
 
-   png_write_chunk_end(png_ptr);
+   return 16 * k + png_optimal_log2_fraction[x & 15];
 }
-#endif
 
-#ifdef PNG_WRITE_oFFs_SUPPORTED
-/* Write the oFFs chunk */
-void /* PRIVATE */
-png_write_oFFs(png_structrp png_ptr, png_int_32 x_offset, png_int_32 y_offset,
-    int unit_type)
+/* Set the costs of the symbols to the number of bits each would take with the
+ * frequencies in lit_freq and dist_freq, or the fixed codes.  Symbols not used
+ * cost as much as one that is used once.
+ */
+static void
+png_optimal_model(png_optimal_workerp w, int fixed)
 {
-   png_byte buf[9];
+   png_optimal_encoderp state = w->state;
+   int i;
 
-   png_debug(1, "in png_write_oFFs");
+   if (fixed != 0)
+   {
+      for (i = 0; i < PNG_FAST_LITLEN; ++i)
+         w->lit_cost[i] = 16U * state->fixed_len[i];
 
-   if (unit_type >= PNG_OFFSET_LAST)
-      png_warning(png_ptr, "Unrecognized unit type for oFFs chunk");
+      for (i = 0; i < 30; ++i)
+         w->dist_cost[i] = 16U * 5;
+   }
 
-   png_save_int_32(buf, x_offset);
-   png_save_int_32(buf + 4, y_offset);
-   buf[8] = (png_byte)unit_type;
+   else
+   {
+      png_uint_32 lit_total = 0, dist_total = 1, lit_log, dist_log;
 
-   png_write_complete_chunk(png_ptr, png_oFFs, buf, 9);
-}
-#endif
-#ifdef PNG_WRITE_pCAL_SUPPORTED
-/* Write the pCAL chunk (described in the PNG extensions document) */
-void /* PRIVATE */
-png_write_pCAL(png_structrp png_ptr, png_charp purpose, png_int_32 X0,
-    png_int_32 X1, int type, int nparams, png_const_charp units,
-    png_charpp params)
-{
-   png_uint_32 purpose_len;
-   size_t units_len, total_len;
-   png_size_tp params_len;
-   png_byte buf[10];
-   png_byte new_purpose[80];
-   int i;
+      for (i = 0; i < PNG_FAST_LITLEN; ++i)
+         lit_total += w->lit_freq[i];
 
-   png_debug1(1, "in png_write_pCAL (%d parameters)", nparams);
+      for (i = 0; i < 30; ++i)
+         dist_total += w->dist_freq[i];
 
-   if (type >= PNG_EQUATION_LAST)
-      png_error(png_ptr, "Unrecognized equation type for pCAL chunk");
+      lit_log = png_optimal_log2(lit_total);
+      dist_log = png_optimal_log2(dist_total);
 
-   purpose_len = png_check_keyword(png_ptr, purpose, new_purpose);
+      /* No code is shorter than one bit. */
+      for (i = 0; i < PNG_FAST_LITLEN; ++i)
+      {
+         png_uint_32 f = w->lit_freq[i];
+         png_uint_32 c = lit_log - png_optimal_log2(f > 0 ? f : 1);
 
-   if (purpose_len == 0)
-      png_error(png_ptr, "pCAL: invalid keyword");
+         w->lit_cost[i] = c > 16 ? c : 16;
+      }
 
-   ++purpose_len; /* terminator */
+      for (i = 0; i < 30; ++i)
+      {
+         png_uint_32 f = w->dist_freq[i];
+         png_uint_32 c = dist_log - png_optimal_log2(f > 0 ? f : 1);
 
-   png_debug1(3, "pCAL purpose length = %d", (int)purpose_len);
-   units_len = strlen(units) + (nparams == 0 ? 0 : 1);
-   png_debug1(3, "pCAL units length = %d", (int)units_len);
-   total_len = purpose_len + units_len + 10;
+         w->dist_cost[i] = c > 16 ? c : 16;
+      }
+   }
 
-   params_len = (png_size_tp)png_malloc(png_ptr,
-       (png_alloc_size_t)((png_alloc_size_t)nparams * (sizeof (size_t))));
+   for (i = 3; i <= 258; ++i)
+   {
+      unsigned int c = state->length_code[i];
 
-   /* Find the length of each parameter, making sure we don't count the
-    * null terminator for the last parameter.
-    */
-   for (i = 0; i < nparams; i++)
-   {
-      params_len[i] = strlen(params[i]) + (i == nparams - 1 ? 0 : 1);
-      png_debug2(3, "pCAL parameter %d length = %lu", i,
-          (unsigned long)params_len[i]);
-      total_len += params_len[i];
-   }
-
-   png_debug1(3, "pCAL total length = %d", (int)total_len);
-   png_write_chunk_header(png_ptr, png_pCAL, (png_uint_32)total_len);
-   png_write_chunk_data(png_ptr, new_purpose, purpose_len);
-   png_save_int_32(buf, X0);
-   png_save_int_32(buf + 4, X1);
-   buf[8] = (png_byte)type;
-   buf[9] = (png_byte)nparams;
-   png_write_chunk_data(png_ptr, buf, 10);
-   png_write_chunk_data(png_ptr, (png_const_bytep)units, (size_t)units_len);
-
-   for (i = 0; i < nparams; i++)
-   {
-      png_write_chunk_data(png_ptr, (png_const_bytep)params[i], params_len[i]);
+      w->len_cost[i] = w->lit_cost[257+c] + 16U * png_fast_length_extra[c];
    }
 
-   png_free(png_ptr, params_len);
-   png_write_chunk_end(png_ptr);
+   for (i = 0; i < 30; ++i)
+      w->dist_cost[i] += 16U * png_optimal_dist_extra[i];
 }
-#endif
 
-#ifdef PNG_WRITE_sCAL_SUPPORTED
-/* Write the sCAL chunk */
-void /* PRIVATE */
-png_write_sCAL_s(png_structrp png_ptr, int unit, png_const_charp width,
-    png_const_charp height)
+/* Find the matches at each of the 'size' bytes at 'data', which follows
+ * 'dictionary' bytes that are only matched against.  At most
+ * PNG_OPTIMAL_MATCHES are kept for each position, each longer than the one
+ * before and at the nearest distance for its length.  If there are more the
+ * last is replaced by the longer ones; the lengths in between then use a
+ * longer distance than they could.
+ */
+static void
+png_optimal_find(png_optimal_workerp w, png_const_bytep data,
+    png_uint_32 dictionary, png_uint_32 size)
 {
-   png_byte buf[64];
-   size_t wlen, hlen, total_len;
-
-   png_debug(1, "in png_write_sCAL_s");
+   png_const_bytep base = data - dictionary;
+   png_uint_32p head = w->head;
+   png_uint_32p prev = w->prev;
+   png_uint_32 end = dictionary + size, skip = 0, q;
 
-   wlen = strlen(width);
-   hlen = strlen(height);
-   total_len = wlen + hlen + 2;
+   memset(head, 0xff, (sizeof *head) << PNG_OPTIMAL_HASH_BITS);
+   memset(w->nmatch, 0, size);
 
-   if (total_len > 64)
+   for (q = 0; q + 2 < end; ++q)
    {
-      png_warning(png_ptr, "Can't write sCAL (buffer too small)");
-      return;
-   }
-
-   buf[0] = (png_byte)unit;
-   memcpy(buf + 1, width, wlen + 1);      /* Append the '\0' here */
-   memcpy(buf + wlen + 2, height, hlen);  /* Do NOT append the '\0' here */
+      png_uint_32 h = PNG_OPTIMAL_HASH(base + q);
 
-   png_debug1(3, "sCAL total length = %u", (unsigned int)total_len);
-   png_write_complete_chunk(png_ptr, png_sCAL, buf, total_len);
-}
-#endif
+      if (skip > 0)
+         --skip;
 
-#ifdef PNG_WRITE_pHYs_SUPPORTED
-/* Write the pHYs chunk */
-void /* PRIVATE */
-png_write_pHYs(png_structrp png_ptr, png_uint_32 x_pixels_per_unit,
-    png_uint_32 y_pixels_per_unit,
-    int unit_type)
-{
-   png_byte buf[9];
+      else if (q >= dictionary)
+      {
+         png_uint_32p m = w->match +
+             (png_alloc_size_t)(q - dictionary) * PNG_OPTIMAL_MATCHES;
+         png_uint_32 limit = end - q;
+         png_uint_32 candidate = head[h];
+         unsigned int count = 0, best = 2, chain = PNG_OPTIMAL_CHAIN;
 
-   png_debug(1, "in png_write_pHYs");
+         if (limit > 258)
+            limit = 258;
 
-   if (unit_type >= PNG_RESOLUTION_LAST)
-      png_warning(png_ptr, "Unrecognized unit type for pHYs chunk");
+         while (candidate != PNG_OPTIMAL_NONE &&
+             q - candidate <= PNG_OPTIMAL_WINDOW && chain-- > 0)
+         {
+            png_const_bytep a = base + candidate, b = base + q;
 
-   png_save_uint_32(buf, x_pixels_per_unit);
-   png_save_uint_32(buf + 4, y_pixels_per_unit);
-   buf[8] = (png_byte)unit_type;
+            if (a[best] == b[best] && a[0] == b[0] && a[1] == b[1])
+            {
+               unsigned int len = 2;
 
-   png_write_complete_chunk(png_ptr, png_pHYs, buf, 9);
-}
-#endif
+               while (len < limit && a[len] == b[len])
+                  ++len;
 
-#ifdef PNG_WRITE_tIME_SUPPORTED
-/* Write the tIME chunk.  Use either png_convert_from_struct_tm()
- * or png_convert_from_time_t(), or fill in the structure yourself.
- */
-void /* PRIVATE */
-png_write_tIME(png_structrp png_ptr, png_const_timep mod_time)
-{
-   png_byte buf[7];
+               if (len > best)
+               {
+                  png_uint_32 dist = q - candidate;
+                  png_uint_32 entry = dist | ((png_uint_32)(len - 3) << 16) |
+                      ((png_uint_32)PNG_OPTIMAL_DIST_CODE(w->state, dist) <<
+                      24);
 
-   png_debug(1, "in png_write_tIME");
+                  if (count < PNG_OPTIMAL_MATCHES)
+                     m[count++] = entry;
 
-   if (mod_time->month  > 12 || mod_time->month  < 1 ||
-       mod_time->day    > 31 || mod_time->day    < 1 ||
-       mod_time->hour   > 23 || mod_time->second > 60)
-   {
-      png_warning(png_ptr, "Invalid time specified for tIME chunk");
-      return;
-   }
+                  else
+                     m[PNG_OPTIMAL_MATCHES-1] = entry;
 
-   png_save_uint_16(buf, mod_time->year);
-   buf[2] = mod_time->month;
-   buf[3] = mod_time->day;
-   buf[4] = mod_time->hour;
-   buf[5] = mod_time->minute;
-   buf[6] = mod_time->second;
+                  best = len;
 
-   png_write_complete_chunk(png_ptr, png_tIME, buf, 7);
-}
-#endif
+                  if (len == limit || len >= PNG_OPTIMAL_NICE)
+                     break;
+               }
+            }
 
-/* Initializes the row writing capability of libpng */
-void /* PRIVATE */
-png_write_start_row(png_structrp png_ptr)
-{
-#ifdef PNG_WRITE_INTERLACING_SUPPORTED
-   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
+            {
+               png_uint_32 next = prev[candidate & (PNG_OPTIMAL_WINDOW-1)];
 
-   /* Start of interlace block */
-   static const png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+               if (next == PNG_OPTIMAL_NONE || next >= candidate)
+                  break;
 
-   /* Offset to next interlace block */
-   static const png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+               candidate = next;
+            }
+         }
 
-   /* Start of interlace block in the y direction */
-   static const png_byte png_pass_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+         w->nmatch[q - dictionary] = (png_byte)count;
 
-   /* Offset to next interlace block in the y direction */
-   static const png_byte png_pass_yinc[7] = {8, 8, 8, 4, 4, 2, 2};
-#endif
+         if (best >= PNG_OPTIMAL_NICE)
+            skip = best - 1;
+      }
 
-   png_alloc_size_t buf_size;
-   int usr_pixel_depth;
+      prev[q & (PNG_OPTIMAL_WINDOW-1)] = head[h];
+      head[h] = q;
+   }
+}
 
-#ifdef PNG_WRITE_FILTER_SUPPORTED
-   png_byte filters;
-#endif
+/* Find the cheapest parse of bytes 'start' to 'end' of the 'data' given to
+ * png_optimal_find, with the costs png_optimal_model set.  Matches do not go
+ * past 'end'.
+ */
+static void
+png_optimal_parse(png_optimal_workerp w, png_const_bytep data,
+    png_uint_32 start, png_uint_32 end, png_optimal_symbolsp syms)
+{
+   png_uint_32p cost = w->cost;
+   png_uint_16p step = w->step;
+   png_const_uint_32p len_cost = w->len_cost;
+   png_uint_32 n = end - start, i, count;
 
-   png_debug(1, "in png_write_start_row");
+   cost[0] = 0;
 
-   usr_pixel_depth = png_ptr->usr_channels * png_ptr->usr_bit_depth;
-   buf_size = PNG_ROWBYTES(usr_pixel_depth, png_ptr->width) + 1;
+   for (i = 1; i <= n; ++i)
+      cost[i] = PNG_OPTIMAL_NONE;
 
-   /* 1.5.6: added to allow checking in the row write code. */
-   png_ptr->transformed_pixel_depth = png_ptr->pixel_depth;
-   png_ptr->maximum_pixel_depth = (png_byte)usr_pixel_depth;
+   for (i = 0; i < n; ++i)
+   {
+      png_uint_32 here = cost[i], c;
+      unsigned int nmatch = w->nmatch[start+i];
+      png_const_uint_32p m = w->match +
+          (png_alloc_size_t)(start+i) * PNG_OPTIMAL_MATCHES;
 
-   /* Set up row buffer */
-   png_ptr->row_buf = png_voidcast(png_bytep, png_malloc(png_ptr, buf_size));
+      c = here + w->lit_cost[data[start+i]];
 
-   png_ptr->row_buf[0] = PNG_FILTER_VALUE_NONE;
+      if (c < cost[i+1])
+      {
+         cost[i+1] = c;
+         step[i+1] = 1;
+      }
 
-#ifdef PNG_WRITE_FILTER_SUPPORTED
-   filters = png_ptr->do_filter;
+      if (nmatch > 0)
+      {
+         png_uint_32 limit = n - i;
+         unsigned int len = 3, k;
 
-   if (png_ptr->height == 1)
-      filters &= 0xff & ~(PNG_FILTER_UP|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+         for (k = 0; k < nmatch && len <= limit; ++k)
+         {
+            png_uint_32 dist_cost = here + w->dist_cost[m[k] >> 24];
+            png_uint_32 longest = ((m[k] >> 16) & 0xff) + 3;
 
-   if (png_ptr->width == 1)
-      filters &= 0xff & ~(PNG_FILTER_SUB|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+            if (longest > limit)
+               longest = limit;
 
-   if (filters == 0)
-      filters = PNG_FILTER_NONE;
+            for (; len <= longest; ++len)
+            {
+               c = dist_cost + len_cost[len];
 
-   png_ptr->do_filter = filters;
+               if (c < cost[i+len])
+               {
+                  cost[i+len] = c;
+                  step[i+len] = (png_uint_16)len;
+               }
+            }
+         }
+      }
+   }
 
-   if (((filters & (PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_AVG |
-       PNG_FILTER_PAETH)) != 0) && png_ptr->try_row == NULL)
+   /* The symbols are found from the end back, then put in order. */
+   for (i = n, count = 0; i > 0; ++count)
    {
-      int num_filters = 0;
+      unsigned int len = step[i];
 
-      png_ptr->try_row = png_voidcast(png_bytep, png_malloc(png_ptr, buf_size));
+      i -= len;
+      syms->len[count] = (png_uint_16)len;
 
-      if (filters & PNG_FILTER_SUB)
-         num_filters++;
+      if (len == 1)
+         syms->dist[count] = data[start+i];
 
-      if (filters & PNG_FILTER_UP)
-         num_filters++;
+      else
+      {
+         png_const_uint_32p m = w->match +
+             (png_alloc_size_t)(start+i) * PNG_OPTIMAL_MATCHES;
 
-      if (filters & PNG_FILTER_AVG)
-         num_filters++;
+         while (((*m >> 16) & 0xff) + 3 < len)
+            ++m;
 
-      if (filters & PNG_FILTER_PAETH)
-         num_filters++;
+         syms->dist[count] = (png_uint_16)(*m & 0xffff);
+      }
+   }
 
-      if (num_filters > 1)
-         png_ptr->tst_row = png_voidcast(png_bytep, png_malloc(png_ptr,
-             buf_size));
+   syms->count = count;
+
+   for (i = 0; i < count/2; ++i)
+   {
+      png_uint_16 t = syms->len[i];
+
+      syms->len[i] = syms->len[count-1-i];
+      syms->len[count-1-i] = t;
+      t = syms->dist[i];
+      syms->dist[i] = syms->dist[count-1-i];
+      syms->dist[count-1-i] = t;
    }
+}
 
-   /* We only need to keep the previous row if we are using one of the following
-    * filters.
-    */
-   if ((filters & (PNG_FILTER_AVG | PNG_FILTER_UP | PNG_FILTER_PAETH)) != 0)
-      png_ptr->prev_row = png_voidcast(png_bytep,
-          png_calloc(png_ptr, buf_size));
-#endif /* WRITE_FILTER */
+/* Count the codes the 'count' symbols use, with the end of block, in lit_freq
+ * and dist_freq.  Returns the number of bytes they encode.
+ */
+static png_uint_32
+png_optimal_count(png_optimal_workerp w, png_const_uint_16p len,
+    png_const_uint_16p dist, png_uint_32 count)
+{
+   png_optimal_encoderp state = w->state;
+   png_uint_32 bytes = 0, k;
 
-#ifdef PNG_WRITE_INTERLACING_SUPPORTED
-   /* If interlaced, we need to set up width and height of pass */
-   if (png_ptr->interlaced != 0)
+   memset(w->lit_freq, 0, sizeof w->lit_freq);
+   memset(w->dist_freq, 0, sizeof w->dist_freq);
+
+   for (k = 0; k < count; ++k)
    {
-      if ((png_ptr->transformations & PNG_INTERLACE) == 0)
-      {
-         png_ptr->num_rows = (png_ptr->height + png_pass_yinc[0] - 1 -
-             png_pass_ystart[0]) / png_pass_yinc[0];
+      unsigned int l = len[k];
 
-         png_ptr->usr_width = (png_ptr->width + png_pass_inc[0] - 1 -
-             png_pass_start[0]) / png_pass_inc[0];
-      }
+      if (l == 1)
+         ++w->lit_freq[dist[k]];
 
       else
       {
-         png_ptr->num_rows = png_ptr->height;
-         png_ptr->usr_width = png_ptr->width;
+         ++w->lit_freq[257 + state->length_code[l]];
+         ++w->dist_freq[PNG_OPTIMAL_DIST_CODE(state, dist[k])];
       }
-   }
 
-   else
-#endif
-   {
-      png_ptr->num_rows = png_ptr->height;
-      png_ptr->usr_width = png_ptr->width;
+      bytes += l;
    }
+
+   w->lit_freq[256] = 1;
+   return bytes;
 }
 
-/* Internal use only.  Called when finished processing a row of data. */
-void /* PRIVATE */
-png_write_finish_row(png_structrp png_ptr)
+/* The size in bits of a block of 'bytes' bytes with the codes counted by
+ * png_optimal_count: the smallest of a stored block, the fixed codes or
+ * dynamic codes, which are left in enc.len, enc.code, dist_len and dist_code.
+ * The block type (RFC 1951 3.2.3) is returned in 'btype' if it is not NULL.
+ */
+static png_alloc_size_t
+png_optimal_cost(png_optimal_workerp w, png_uint_32 bytes, int *btype)
 {
-#ifdef PNG_WRITE_INTERLACING_SUPPORTED
-   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
-
-   /* Start of interlace block */
-   static const png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+   png_optimal_encoderp state = w->state;
+   png_uint_32 lit_freq[PNG_FAST_LITLEN], dist_freq[30];
+   png_alloc_size_t extra = 0, fixed, dynamic, cost;
+   int i, type;
 
-   /* Offset to next interlace block */
-   static const png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+   for (i = 0; i < 29; ++i)
+      extra += (png_alloc_size_t)w->lit_freq[257+i] * png_fast_length_extra[i];
 
-   /* Start of interlace block in the y direction */
-   static const png_byte png_pass_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+   for (i = 0; i < 30; ++i)
+      extra += (png_alloc_size_t)w->dist_freq[i] * png_optimal_dist_extra[i];
 
-   /* Offset to next interlace block in the y direction */
-   static const png_byte png_pass_yinc[7] = {8, 8, 8, 4, 4, 2, 2};
-#endif
+   /* png_fast_huffman changes the frequencies it is given. */
+   memcpy(lit_freq, w->lit_freq, sizeof lit_freq);
+   memcpy(dist_freq, w->dist_freq, sizeof dist_freq);
+   png_fast_huffman(lit_freq, PNG_FAST_LITLEN, 15, w->enc.len, w->enc.code);
+   png_fast_huffman(dist_freq, 30, 15, w->dist_len, w->dist_code);
 
-   png_debug(1, "in png_write_finish_row");
+   fixed = 3 + extra;
+   dynamic = png_fast_header(&w->enc, w->enc.len, w->dist_len, 30, 0, 0) +
+       extra;
 
-   /* Next row */
-   png_ptr->row_number++;
+   for (i = 0; i < PNG_FAST_LITLEN; ++i)
+   {
+      png_alloc_size_t f = w->lit_freq[i];
 
-   /* See if we are done */
-   if (png_ptr->row_number < png_ptr->num_rows)
-      return;
+      fixed += f * state->fixed_len[i];
+      dynamic += f * w->enc.len[i];
+   }
 
-#ifdef PNG_WRITE_INTERLACING_SUPPORTED
-   /* If interlaced, go to next pass */
-   if (png_ptr->interlaced != 0)
+   for (i = 0; i < 30; ++i)
    {
-      png_ptr->row_number = 0;
-      if ((png_ptr->transformations & PNG_INTERLACE) != 0)
-      {
-         png_ptr->pass++;
-      }
+      png_alloc_size_t f = w->dist_freq[i];
 
-      else
-      {
-         /* Loop until we find a non-zero width or height pass */
-         do
-         {
-            png_ptr->pass++;
+      fixed += f * state->fixed_dist_len[i];
+      dynamic += f * w->dist_len[i];
+   }
 
-            if (png_ptr->pass >= 7)
-               break;
+   type = 2;
+   cost = dynamic;
 
-            png_ptr->usr_width = (png_ptr->width +
-                png_pass_inc[png_ptr->pass] - 1 -
-                png_pass_start[png_ptr->pass]) /
-                png_pass_inc[png_ptr->pass];
+   if (fixed < cost)
+   {
+      type = 1;
+      cost = fixed;
+   }
+
+   if (PNG_FAST_STORED_BITS(bytes) < cost)
+   {
+      type = 0;
+      cost = PNG_FAST_STORED_BITS(bytes);
+   }
+
+   if (btype != NULL)
+      *btype = type;
+
+   return cost;
+}
+
+/* The size in bits of symbols 'a' to 'b' of 'syms' as one block */
+static png_alloc_size_t
+png_optimal_range_cost(png_optimal_workerp w, png_optimal_symbolsp syms,
+    png_uint_32 a, png_uint_32 b)
+{
+   return png_optimal_cost(w, png_optimal_count(w, syms->len + a,
+       syms->dist + a, b - a), NULL);
+}
+
+/* Split symbols 'a' to 'b' of 'syms' in two where that makes the two blocks
+ * smaller than one, then split the halves in turn.  The best place is looked
+ * for among evenly spaced points, then among points closer to the best of
+ * those.
+ */
+static void
+png_optimal_split(png_optimal_workerp w, png_optimal_symbolsp syms,
+    png_uint_32 a, png_uint_32 b)
+{
+   png_alloc_size_t whole, best = (png_alloc_size_t)-1;
+   png_uint_32 lo, hi, at = a;
+
+   if (w->splits + 1 >= PNG_OPTIMAL_BLOCKS || b - a < PNG_OPTIMAL_SPLIT)
+      return;
+
+   whole = png_optimal_range_cost(w, syms, a, b);
+   lo = a + PNG_OPTIMAL_SPLIT/2;
+   hi = b - PNG_OPTIMAL_SPLIT/2;
+
+   for (;;)
+   {
+      png_uint_32 step = (hi - lo) / 8 + 1, p;
+
+      for (p = lo; p <= hi; p += step)
+      {
+         png_alloc_size_t cost = png_optimal_range_cost(w, syms, a, p) +
+             png_optimal_range_cost(w, syms, p, b);
+
+         if (cost < best)
+         {
+            best = cost;
+            at = p;
+         }
+      }
+
+      if (step == 1)
+         break;
+
+      lo = at - lo > step ? at - step : lo;
+      hi = hi - at > step ? at + step : hi;
+   }
+
+   if (best < whole)
+   {
+      w->split[w->splits++] = at;
+      png_optimal_split(w, syms, a, at);
+      png_optimal_split(w, syms, at, b);
+   }
+}
+
+/* Send the 'count' symbols as a block of 'bytes' bytes at 'data', the last
+ * block if 'final' is set.
+ */
+static void
+png_optimal_block(png_optimal_workerp w, png_const_bytep data,
+    png_uint_32 bytes, png_optimal_symbolsp syms, int final)
+{
+   png_optimal_encoderp state = w->state;
+   png_fast_encoderp enc = &w->enc;
+   png_const_bytep len, dist_len;
+   png_const_uint_16p code, dist_code;
+   png_uint_32 k;
+   int btype;
+
+   png_optimal_count(w, syms->len, syms->dist, syms->count);
+   png_optimal_cost(w, bytes, &btype);
+
+   if (btype == 0)
+   {
+      png_fast_stored(enc, data, bytes, final);
+      return;
+   }
+
+   if (btype == 1)
+   {
+      png_fast_bits(enc, final != 0, 1);
+      png_fast_bits(enc, 1, 2);
+      len = state->fixed_len;
+      code = state->fixed_code;
+      dist_len = state->fixed_dist_len;
+      dist_code = state->fixed_dist_code;
+   }
+
+   else
+   {
+      png_fast_header(enc, enc->len, w->dist_len, 30, final, 1);
+      len = enc->len;
+      code = enc->code;
+      dist_len = w->dist_len;
+      dist_code = w->dist_code;
+   }
+
+   for (k = 0; k < syms->count; ++k)
+   {
+      unsigned int l = syms->len[k], d = syms->dist[k];
+
+      if (l == 1)
+         png_fast_bits(enc, code[d], len[d]);
+
+      else
+      {
+         unsigned int c = state->length_code[l];
+
+         png_fast_bits(enc, code[257+c], len[257+c]);
+         png_fast_bits(enc, l - png_fast_length_base[c],
+             png_fast_length_extra[c]);
+         c = PNG_OPTIMAL_DIST_CODE(state, d);
+         png_fast_bits(enc, dist_code[c], dist_len[c]);
+         png_fast_bits(enc, d - png_optimal_dist_base[c],
+             png_optimal_dist_extra[c]);
+      }
+   }
+
+   png_fast_bits(enc, code[256], len[256]);
+}
+
+/* Deflate the 'size' bytes of data at 'start', the end of the data if 'last'
+ * is set.
+ */
+static void
+png_optimal_chunk(png_optimal_workerp w, png_alloc_size_t start,
+    png_uint_32 size, int last)
+{
+   png_const_bytep data = w->data + start;
+   png_uint_32 from = 0;
+   int b;
+
+   png_optimal_find(w, data, start < PNG_OPTIMAL_WINDOW ? (png_uint_32)start :
+       PNG_OPTIMAL_WINDOW, size);
+
+   /* The blocks are split from a parse with the fixed codes. */
+   png_optimal_model(w, 1);
+   png_optimal_parse(w, data, 0, size, &w->first);
+   w->splits = 0;
+   png_optimal_split(w, &w->first, 0, w->first.count);
+
+   for (b = 1; b < w->splits; ++b)
+   {
+      png_uint_32 at = w->split[b];
+      int i = b;
+
+      for (; i > 0 && w->split[i-1] > at; --i)
+         w->split[i] = w->split[i-1];
+
+      w->split[i] = at;
+   }
+
+   for (b = 0; b <= w->splits; ++b)
+   {
+      png_uint_32 a = b > 0 ? w->split[b-1] : 0;
+      png_uint_32 z = b < w->splits ? w->split[b] : w->first.count;
+      png_uint_32 bytes = png_optimal_count(w, w->first.len + a,
+          w->first.dist + a, z - a);
+      png_alloc_size_t best = png_optimal_cost(w, bytes, NULL), previous;
+      int i, stalled = 0;
+
+      memcpy(w->best.len, w->first.len + a, (z - a) * (sizeof *w->best.len));
+      memcpy(w->best.dist, w->first.dist + a,
+          (z - a) * (sizeof *w->best.dist));
+      w->best.count = z - a;
+      previous = best;
+
+      /* Each parse uses the costs of the codes of the one before; stop when
+       * two in a row have not done better.
+       */
+      for (i = 0; i < PNG_OPTIMAL_ITERATIONS && stalled < 2; ++i)
+      {
+         png_alloc_size_t cost;
+
+         png_optimal_model(w, 0);
+         png_optimal_parse(w, data, from, from + bytes, &w->now);
+         png_optimal_count(w, w->now.len, w->now.dist, w->now.count);
+         cost = png_optimal_cost(w, bytes, NULL);
+
+         if (cost < best)
+         {
+            png_optimal_symbols t = w->best;
+
+            w->best = w->now;
+            w->now = t;
+            best = cost;
+         }
+
+         if (cost < previous)
+            stalled = 0;
+
+         else
+            ++stalled;
+
+         previous = cost;
+      }
+
+      png_optimal_block(w, data + from, bytes, &w->best,
+          last && b == w->splits);
+      from += bytes;
+   }
+}
+
+/* The value the filter predicts from the bytes before (a), above (b) and
+ * above and before (c).
+ */
+static unsigned int
+png_optimal_predict(int filter, unsigned int a, unsigned int b,
+    unsigned int c)
+{
+   switch (filter)
+   {
+      case PNG_FILTER_VALUE_SUB:
+         return a;
+
+      case PNG_FILTER_VALUE_UP:
+         return b;
+
+      case PNG_FILTER_VALUE_AVG:
+         return (a + b) >> 1;
+
+      case PNG_FILTER_VALUE_PAETH:
+      {
+         int pa = (int)b - (int)c, pb = (int)a - (int)c, pc = pa + pb;
+
+         if (pa < 0) pa = -pa;
+         if (pb < 0) pb = -pb;
+         if (pc < 0) pc = -pc;
+
+         return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+      }
+
+      default:
+         return 0;
+   }
+}
+
+/* Filter the raw rows with 'filter' or, if 'filter' is negative, undo the
+ * filters of 'in'; 'in' and 'out' have the rows of each pass in turn, each
+ * after its filter byte.  Returns 0 if a filter byte is not valid.
+ */
+static int
+png_optimal_filter(const png_optimal_encoder *state, png_const_bytep in,
+    png_bytep out, int filter)
+{
+   unsigned int bpp = state->bpp;
+   int pass;
+
+   for (pass = 0; pass < 7; ++pass)
+   {
+      size_t rowbytes = state->rowbytes[pass];
+      png_const_bytep raw_prev = NULL;
+      png_uint_32 y;
+
+      for (y = 0; y < state->rows[pass]; ++y)
+      {
+         png_const_bytep raw = filter < 0 ? out + 1 : in + 1;
+         int f = filter < 0 ? in[0] : filter;
+         size_t i;
+
+         if (f >= PNG_FILTER_VALUE_LAST)
+            return 0;
+
+         out[0] = (png_byte)(filter < 0 ? 0 : filter);
+
+         for (i = 0; i < rowbytes; ++i)
+         {
+            unsigned int a = i >= bpp ? raw[i-bpp] : 0;
+            unsigned int b = raw_prev != NULL ? raw_prev[i] : 0;
+            unsigned int c = raw_prev != NULL && i >= bpp ? raw_prev[i-bpp] : 0;
+            unsigned int p = png_optimal_predict(f, a, b, c);
+
+            out[i+1] = (png_byte)(filter < 0 ? in[i+1] + p : in[i+1] - p);
+         }
+
+         raw_prev = raw;
+         in += rowbytes + 1;
+         out += rowbytes + 1;
+      }
+   }
+
+   return 1;
+}
+
+/* A trial: filter the rows if need be then deflate them into 'output'. */
+static void PNGCBAPI
+png_optimal_trial(png_voidp argument)
+{
+   png_optimal_workerp w = png_voidcast(png_optimal_workerp, argument);
+   png_optimal_encoderp state = w->state;
+   png_alloc_size_t size = state->size, done = 0;
+
+   if (w->filter >= 0)
+   {
+      png_optimal_filter(state, state->raw, w->filtered, w->filter);
+      w->data = w->filtered;
+   }
+
+   else
+      w->data = state->data;
+
+   w->adler = adler32(0, NULL, 0);
+
+   while (done < size)
+   {
+      png_alloc_size_t piece = size - done;
+      uInt n = piece > 0x40000000U ? 0x40000000U : (uInt)piece;
+
+      w->adler = adler32(w->adler, w->data + done, n);
+      done += n;
+   }
+
+   w->enc.output = w->output;
+   w->enc.out = 0;
+   w->enc.bits = 0;
+   w->enc.nbits = 0;
+   done = 0;
+
+   do
+   {
+      png_uint_32 n = size - done > state->chunk ? state->chunk :
+          (png_uint_32)(size - done);
+
+      png_optimal_chunk(w, done, n, done + n == size);
+      done += n;
+   }
+   while (done < size);
+
+   png_fast_align(&w->enc);
+}
+
+/* The rows in each pass and the bytes of filtered data they make, or 0 if that
+ * cannot be allocated.
+ */
+static png_alloc_size_t
+png_optimal_geometry(png_const_structrp png_ptr, png_optimal_encoderp state)
+{
+   png_alloc_size_t size = 0;
+   int pass;
+
+   state->bpp = (png_ptr->pixel_depth + 7U) >> 3;
+
+   for (pass = 0; pass < 7; ++pass)
+   {
+      png_uint_32 cols = png_ptr->width, rows = png_ptr->height;
+      size_t bytes;
+
+      if (png_ptr->interlaced != 0)
+      {
+         cols = PNG_PASS_COLS(cols, pass);
+         rows = PNG_PASS_ROWS(rows, pass);
+      }
+
+      else if (pass > 0)
+         rows = 0;
+
+      if (cols == 0)
+         rows = 0;
+
+      bytes = PNG_ROWBYTES(png_ptr->pixel_depth, cols);
+      state->rows[pass] = rows;
+      state->rowbytes[pass] = bytes;
+
+      if (rows > 0)
+      {
+         if (bytes + 1 > (PNG_SIZE_MAX - size) / rows)
+            return 0;
+
+         size += (bytes + 1) * rows;
+      }
+   }
+
+   return size;
+}
+
+static void
+png_optimal_init(png_structrp png_ptr)
+{
+   png_optimal_encoderp state;
+   png_alloc_size_t size;
+   int i;
+
+   state = png_voidcast(png_optimal_encoderp,
+       png_malloc(png_ptr, sizeof *state));
+   memset(state, 0, sizeof *state);
+   png_ptr->optimal_encoder = state;
+
+   size = png_optimal_geometry(png_ptr, state);
+
+   if (size == 0)
+      png_error(png_ptr, "image too large to keep in memory");
+
+   state->data = png_voidcast(png_bytep, png_malloc(png_ptr, size));
+   state->allocated = size;
+
+   png_fast_length_codes(state->length_code);
+
+   for (i = 0; i < 30; ++i)
+   {
+      unsigned int d = png_optimal_dist_base[i] - 1U;
+      unsigned int e = d + (1U << png_optimal_dist_extra[i]);
+
+      for (; d < e; ++d)
+         state->dist_code[d < 256 ? d : 256 + (d >> 7)] = (png_byte)i;
+
+      state->fixed_dist_len[i] = 5;
+   }
+
+   /* RFC 1951 3.2.6; the codes of 286 and 287 are never used but are needed
+    * to get the others.
+    */
+   {
+      png_byte fixed_len[288];
+      png_uint_16 fixed_code[288];
+
+      for (i = 0; i < 288; ++i)
+         fixed_len[i] = (png_byte)(i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+
+      png_fast_codes(fixed_len, 288, fixed_code);
+      memcpy(state->fixed_len, fixed_len, sizeof state->fixed_len);
+      memcpy(state->fixed_code, fixed_code, sizeof state->fixed_code);
+   }
+
+   png_fast_codes(state->fixed_dist_len, 30, state->fixed_dist_code);
+
+   png_ptr->zowner = png_IDAT;
+}
+
+/* Allocate the memory of a worker; that of the earlier workers is kept. */
+static void
+png_optimal_worker_init(png_structrp png_ptr, png_optimal_encoderp state,
+    int filtered)
+{
+   png_optimal_workerp w = &state->worker[state->workers++];
+   png_alloc_size_t chunk = state->chunk;
+
+   w->state = state;
+   w->output = png_voidcast(png_bytep, png_malloc(png_ptr,
+       state->output_size));
+
+   if (filtered != 0)
+      w->filtered = png_voidcast(png_bytep, png_malloc(png_ptr, state->size));
+
+   w->head = png_voidcast(png_uint_32p, png_malloc(png_ptr,
+       (sizeof *w->head) << PNG_OPTIMAL_HASH_BITS));
+   w->prev = png_voidcast(png_uint_32p, png_malloc(png_ptr,
+       (sizeof *w->prev) * PNG_OPTIMAL_WINDOW));
+   w->match = png_voidcast(png_uint_32p, png_malloc(png_ptr,
+       (sizeof *w->match) * PNG_OPTIMAL_MATCHES * chunk));
+   w->nmatch = png_voidcast(png_bytep, png_malloc(png_ptr, chunk));
+   w->cost = png_voidcast(png_uint_32p, png_malloc(png_ptr,
+       (sizeof *w->cost) * (chunk+1)));
+   w->step = png_voidcast(png_uint_16p, png_malloc(png_ptr,
+       (sizeof *w->step) * (chunk+1)));
+   w->first.len = png_voidcast(png_uint_16p, png_malloc(png_ptr,
+       (sizeof *w->first.len) * chunk));
+   w->first.dist = png_voidcast(png_uint_16p, png_malloc(png_ptr,
+       (sizeof *w->first.dist) * chunk));
+   w->now.len = png_voidcast(png_uint_16p, png_malloc(png_ptr,
+       (sizeof *w->now.len) * chunk));
+   w->now.dist = png_voidcast(png_uint_16p, png_malloc(png_ptr,
+       (sizeof *w->now.dist) * chunk));
+   w->best.len = png_voidcast(png_uint_16p, png_malloc(png_ptr,
+       (sizeof *w->best.len) * chunk));
+   w->best.dist = png_voidcast(png_uint_16p, png_malloc(png_ptr,
+       (sizeof *w->best.dist) * chunk));
+}
+
+/* Run the trials and write the smallest result as IDAT chunks. */
+static void
+png_optimal_finish(png_structrp png_ptr, png_optimal_encoderp state)
+{
+   int filters[PNG_OPTIMAL_TRIALS];
+   int trials = 0, threads = 1, t, i;
+   png_alloc_size_t size = state->size, best_size = 0;
+   uLong best_adler = 0;
+
+   /* The rows as libpng filtered them, then, if more than one filter is
+    * allowed, each of them alone.
+    */
+   filters[trials++] = -1;
+
+   if ((png_ptr->do_filter & (png_ptr->do_filter - 1)) != 0)
+   {
+      state->raw = png_voidcast(png_bytep, png_malloc(png_ptr, size));
+
+      if (png_optimal_filter(state, state->data, state->raw, -1) != 0)
+      {
+         for (i = 0; i < 5; ++i)
+            if ((png_ptr->do_filter & (PNG_FILTER_NONE << i)) != 0)
+               filters[trials++] = i;
+      }
+   }
+
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+   if (png_ptr->compression_threads > 1)
+      threads = png_ptr->compression_threads;
+#endif
+
+   if (threads > trials)
+      threads = trials;
+
+   state->chunk = size < PNG_OPTIMAL_CHUNK ? (png_uint_32)size :
+       PNG_OPTIMAL_CHUNK;
+
+   if (state->chunk == 0)
+      state->chunk = 1;
+
+   /* Stored blocks are the most each block can take; the zlib header and
+    * Adler-32 are added to the result.
+    */
+   state->output_size = size + 6 * (size / 65535 +
+       (size / PNG_OPTIMAL_CHUNK + 1) * PNG_OPTIMAL_BLOCKS) + 32;
+
+   if (state->output_size < size)
+      png_error(png_ptr, "image too large to keep in memory");
+
+   state->best = png_voidcast(png_bytep, png_malloc(png_ptr,
+       state->output_size));
+
+   while (state->workers < threads)
+      png_optimal_worker_init(png_ptr, state, trials > 1);
+
+   for (t = 0; t < trials; t += threads)
+   {
+      int n = trials - t < threads ? trials - t : threads;
+
+      for (i = 0; i < n; ++i)
+      {
+         state->worker[i].filter = filters[t+i];
+         png_task_start(png_ptr, &state->worker[i].task, png_optimal_trial,
+             &state->worker[i]);
+      }
+
+      for (i = 0; i < n; ++i)
+         png_task_finish(png_ptr, &state->worker[i].task);
+
+      for (i = 0; i < n; ++i)
+      {
+         png_optimal_workerp w = &state->worker[i];
+
+         if (t+i == 0 || w->enc.out < best_size)
+         {
+            png_bytep output = w->output;
+
+            w->output = state->best;
+            state->best = output;
+            best_size = w->enc.out;
+            best_adler = w->adler;
+         }
+      }
+   }
+
+   {
+      png_bytep data = state->best;
+      png_alloc_size_t done = 0;
+
+      /* The deflate data is moved up for the zlib header (RFC 1950), which
+       * says the compressor used its slowest algorithm.
+       */
+      memmove(data + 2, data, best_size);
+      data[0] = 0x78;
+      data[1] = 0xda;
+      best_size += 2;
+      png_save_uint_32(data + best_size, (png_uint_32)best_adler);
+      best_size += 4;
+
+#ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
+      if (png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
+         optimize_cmf(data, png_image_size(png_ptr));
+#endif
+
+      while (done < best_size)
+      {
+         png_alloc_size_t piece = best_size - done;
+
+         if (piece > png_ptr->zbuffer_size)
+            piece = png_ptr->zbuffer_size;
+
+         png_write_complete_chunk(png_ptr, png_IDAT, data + done, piece);
+         done += piece;
+      }
+   }
+
+   png_ptr->mode |= PNG_HAVE_IDAT | PNG_AFTER_IDAT;
+   png_free_optimal_encoder(png_ptr);
+   png_ptr->zowner = 0;
+}
+
+/* Keep the data; it is all deflated at the end, so a flush does nothing. */
+static void
+png_optimal_IDAT(png_structrp png_ptr, png_optimal_encoderp state,
+    png_const_bytep input, png_alloc_size_t input_len, int flush)
+{
+   if (input_len > state->allocated - state->size)
+   {
+      png_alloc_size_t allocated = state->size + input_len;
+      png_bytep data;
+
+      if (allocated < input_len)
+         png_error(png_ptr, "image too large to keep in memory");
+
+      data = png_voidcast(png_bytep, png_malloc(png_ptr, allocated));
+      memcpy(data, state->data, state->size);
+      png_free(png_ptr, state->data);
+      state->data = data;
+      state->allocated = allocated;
+   }
+
+   if (input_len > 0)
+   {
+      memcpy(state->data + state->size, input, input_len);
+      state->size += input_len;
+   }
+
+   if (flush == Z_FINISH)
+      png_optimal_finish(png_ptr, state);
+}
+
+void /* PRIVATE */
+png_free_optimal_encoder(png_structrp png_ptr)
+{
+   png_optimal_encoderp state =
+       png_voidcast(png_optimal_encoderp, png_ptr->optimal_encoder);
+
+   if (state != NULL)
+   {
+      int i;
+
+      png_ptr->optimal_encoder = NULL;
+
+      for (i = 0; i < state->workers; ++i)
+      {
+         png_optimal_workerp w = &state->worker[i];
+
+         png_free(png_ptr, w->output);
+         png_free(png_ptr, w->filtered);
+         png_free(png_ptr, w->head);
+         png_free(png_ptr, w->prev);
+         png_free(png_ptr, w->match);
+         png_free(png_ptr, w->nmatch);
+         png_free(png_ptr, w->cost);
+         png_free(png_ptr, w->step);
+         png_free(png_ptr, w->first.len);
+         png_free(png_ptr, w->first.dist);
+         png_free(png_ptr, w->now.len);
+         png_free(png_ptr, w->now.dist);
+         png_free(png_ptr, w->best.len);
+         png_free(png_ptr, w->best.dist);
+      }
+
+      png_free(png_ptr, state->data);
+      png_free(png_ptr, state->raw);
+      png_free(png_ptr, state->best);
+      png_free(png_ptr, state);
+   }
+}
+#endif /* WRITE_OPTIMAL_ENCODER */
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+/* The frame cache (png_set_frame_cache) states.  MATCHING compares the rows
+ * with those of the last image without deflating them, RECORDING deflates the
+ * rows and keeps them with the output.
+ */
+#define PNG_FRAME_CACHE_OFF      0
+#define PNG_FRAME_CACHE_MATCHING 1
+#define PNG_FRAME_CACHE_RECORDING 2
+
+/* A copy of the IDAT deflate stream after 'in' bytes of input had been given to
+ * it and it had produced 'out' bytes of output.
+ */
+typedef struct
+{
+   png_alloc_size_t in;
+   png_alloc_size_t out;
+   z_stream         zstream;
+} png_frame_checkpoint;
+
+struct png_frame_cache
+{
+   int                  state;    /* PNG_FRAME_CACHE_ value */
+   int                  valid;    /* the last image was recorded completely */
+   png_zlib_settings    settings; /* of the IDAT stream of the last image */
+   png_bytep            input;    /* the filtered rows of the last image */
+   png_alloc_size_t     input_size;
+   png_alloc_size_t     input_allocated;
+   png_bytep            output;   /* the zlib data written for them */
+   png_alloc_size_t     output_size;
+   png_alloc_size_t     output_allocated;
+   png_alloc_size_t     in;       /* input bytes of this image so far */
+   png_alloc_size_t     out;      /* output bytes written in IDAT chunks */
+   png_alloc_size_t     interval; /* minimum input between checkpoints */
+   int                  checkpoints;
+   png_frame_checkpoint checkpoint[PNG_FRAME_CACHE_COPIES];
+};
+
+/* The copies of the deflate stream belong to the cache, not the png_struct, so
+ * zlib allocates them with malloc.
+ */
+static voidpf
+png_frame_zalloc(voidpf opaque, uInt items, uInt size)
+{
+   PNG_UNUSED(opaque)
+
+   if (size != 0 && items > ((size_t)-1) / size)
+      return NULL;
+
+   return malloc((size_t)items * size);
+}
+
+static void
+png_frame_zfree(voidpf opaque, voidpf ptr)
+{
+   PNG_UNUSED(opaque)
+
+   free(ptr);
+}
+
+PNG_FUNCTION(png_frame_cachep,PNGAPI
+png_create_frame_cache,(void),PNG_ALLOCATED)
+{
+   png_frame_cachep cache = png_voidcast(png_frame_cachep,
+       malloc(sizeof *cache));
+
+   if (cache != NULL)
+      memset(cache, 0, sizeof *cache);
+
+   return cache;
+}
+
+static void
+png_frame_cache_drop(png_frame_cachep cache, int checkpoints)
+{
+   while (cache->checkpoints > checkpoints)
+      deflateEnd(&cache->checkpoint[--cache->checkpoints].zstream);
+}
+
+void PNGAPI
+png_destroy_frame_cache(png_frame_cachep *cache_ptr)
+{
+   png_frame_cachep cache;
+
+   if (cache_ptr == NULL || *cache_ptr == NULL)
+      return;
+
+   cache = *cache_ptr;
+   *cache_ptr = NULL;
+
+   png_frame_cache_drop(cache, 0);
+   free(cache->input);
+   free(cache->output);
+   free(cache);
+}
+
+/* Make room for 'size' more bytes after 'used' in a buffer of the cache; 0 if
+ * there is not enough memory.
+ */
+static int
+png_frame_cache_grow(png_bytep *buffer, png_alloc_size_t *allocated,
+    png_alloc_size_t used, png_alloc_size_t size)
+{
+   if (size > *allocated - used)
+   {
+      png_alloc_size_t new_size = *allocated + (*allocated >> 1);
+      png_bytep new_buffer;
+
+      if (size > PNG_SIZE_MAX - used)
+         return 0;
+
+      if (new_size < used + size || new_size < *allocated)
+         new_size = used + size;
+
+      new_buffer = png_voidcast(png_bytep, realloc(*buffer, new_size));
+
+      if (new_buffer == NULL)
+         return 0;
+
+      *buffer = new_buffer;
+      *allocated = new_size;
+   }
+
+   return 1;
+}
+
+static void
+png_frame_cache_off(png_structrp png_ptr, png_frame_cachep cache)
+{
+   png_warning(png_ptr, "Insufficient memory for the frame cache");
+   png_frame_cache_drop(cache, 0);
+   cache->valid = 0;
+   cache->state = PNG_FRAME_CACHE_OFF;
+}
+
+/* Called when png_compress_IDAT has claimed the IDAT stream. */
+static void
+png_frame_cache_start(png_structrp png_ptr, png_frame_cachep cache)
+{
+   png_zlib_settings *set = &png_ptr->zlib_set_idat;
+   png_alloc_size_t interval = png_image_size(png_ptr) /
+       PNG_FRAME_CACHE_COPIES;
+
+   if (cache->valid != 0 &&
+       cache->settings.level == set->level &&
+       cache->settings.method == set->method &&
+       cache->settings.window_bits == set->window_bits &&
+       cache->settings.mem_level == set->mem_level &&
+       cache->settings.strategy == set->strategy)
+      cache->state = PNG_FRAME_CACHE_MATCHING;
+
+   else
+   {
+      png_frame_cache_drop(cache, 0);
+      cache->valid = 0;
+      cache->settings = *set;
+      cache->input_size = cache->output_size = 0;
+      cache->state = PNG_FRAME_CACHE_RECORDING;
+   }
+
+   cache->in = cache->out = 0;
+   cache->interval = interval > PNG_FRAME_CACHE_INTERVAL ? interval :
+       PNG_FRAME_CACHE_INTERVAL;
+}
+
+/* Called by png_write_IDAT_data with the data of each IDAT chunk. */
+static void
+png_frame_cache_output(png_structrp png_ptr, png_frame_cachep cache,
+    png_const_bytep data, uInt size)
+{
+   if (cache->state == PNG_FRAME_CACHE_RECORDING)
+   {
+      if (png_frame_cache_grow(&cache->output, &cache->output_allocated,
+          cache->out, size) == 0)
+      {
+         png_frame_cache_off(png_ptr, cache);
+         return;
+      }
+
+      memcpy(cache->output + cache->out, data, size);
+   }
+
+   if (cache->state != PNG_FRAME_CACHE_OFF)
+      cache->out += size;
+}
+#endif /* WRITE_FRAME_CACHE */
+
+/* Write 'size' bytes from the start of the compression buffer as an IDAT chunk.
+ * The first IDAT may need deflate header optimization.
+ */
+static void
+png_write_IDAT_data(png_structrp png_ptr, uInt size)
+{
+   png_bytep data = png_ptr->zbuffer_list->output;
+
+#ifdef PNG_WRITE_OPTIMIZE_CMF_SUPPORTED
+   if ((png_ptr->mode & PNG_HAVE_IDAT) == 0 &&
+       png_ptr->compression_type == PNG_COMPRESSION_TYPE_BASE)
+      optimize_cmf(data, png_image_size(png_ptr));
+#endif
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+   if (png_ptr->frame_cache != NULL)
+      png_frame_cache_output(png_ptr, png_ptr->frame_cache, data, size);
+#endif
+
+   if (size > 0)
+      png_write_complete_chunk(png_ptr, png_IDAT, data, size);
+   png_ptr->mode |= PNG_HAVE_IDAT;
+}
+
+/* Write the data left in the compression buffer at the end of the zlib stream
+ * and release the stream.
+ */
+static void
+png_write_IDAT_end(png_structrp png_ptr)
+{
+   png_write_IDAT_data(png_ptr,
+       png_ptr->zbuffer_size - png_ptr->zstream->avail_out);
+   png_ptr->zstream->avail_out = 0;
+   png_ptr->zstream->next_out = NULL;
+   png_ptr->mode |= PNG_HAVE_IDAT | PNG_AFTER_IDAT;
+
+   png_ptr->zowner = 0; /* Release the stream */
+}
+
+/* Give the IDAT stream claimed by png_compress_IDAT 'input_len' bytes, with the
+ * given flush, writing IDAT chunks as the compression buffer fills.
+ */
+static void
+png_deflate_IDAT(png_structrp png_ptr, png_const_bytep input,
+    png_alloc_size_t input_len, int flush)
+{
+   /* Now loop reading and writing until all the input is consumed or an error
+    * terminates the operation.  The _out values are maintained across calls to
+    * this function, but the input must be reset each time.
+    */
+   png_ptr->zstream->next_in = PNGZ_INPUT_CAST(input);
+   png_ptr->zstream->avail_in = 0; /* set below */
+   for (;;)
+   {
+      int ret;
+
+      /* INPUT: from the row data */
+      uInt avail = ZLIB_IO_MAX;
+
+      if (avail > input_len)
+         avail = (uInt)input_len; /* safe because of the check */
+
+      png_ptr->zstream->avail_in = avail;
+      input_len -= avail;
+
+      ret = deflate(png_ptr->zstream, input_len > 0 ? Z_NO_FLUSH : flush);
+
+      /* Include as-yet unconsumed input */
+      input_len += png_ptr->zstream->avail_in;
+      png_ptr->zstream->avail_in = 0;
+
+      /* OUTPUT: write complete IDAT chunks when avail_out drops to zero. Note
+       * that these two zstream fields are preserved across the calls, therefore
+       * there is no need to set these up on entry to the loop.
+       */
+      if (png_ptr->zstream->avail_out == 0)
+      {
+         /* Write an IDAT containing the data then reset the buffer. */
+         png_write_IDAT_data(png_ptr, png_ptr->zbuffer_size);
+
+         png_ptr->zstream->next_out = png_ptr->zbuffer_list->output;
+         png_ptr->zstream->avail_out = png_ptr->zbuffer_size;
+
+         /* For SYNC_FLUSH or FINISH it is essential to keep calling zlib with
+          * the same flush parameter until it has finished output, for NO_FLUSH
+          * it doesn't matter.
+          */
+         if (ret == Z_OK && flush != Z_NO_FLUSH)
+            continue;
+      }
+
+      /* The order of these checks doesn't matter much; it just affects which
+       * possible error might be detected if multiple things go wrong at once.
+       */
+      if (ret == Z_OK) /* most likely return code! */
+      {
+         /* If all the input has been consumed then just return.  If Z_FINISH
+          * was used as the flush parameter something has gone wrong if we get
+          * here.
+          */
+         if (input_len == 0)
+         {
+            if (flush == Z_FINISH)
+               png_error(png_ptr, "Z_OK on Z_FINISH with output space");
+
+            return;
+         }
+      }
+
+      else if (ret == Z_STREAM_END && flush == Z_FINISH)
+      {
+         /* This is the end of the IDAT data; any pending output must be
+          * flushed.  For small PNG files we may still be at the beginning.
+          */
+         png_write_IDAT_end(png_ptr);
+         return;
+      }
+
+      else
+      {
+         /* This is an error condition. */
+         png_zstream_error(png_ptr, ret);
+         png_error(png_ptr, png_ptr->zstream->msg);
+      }
+   }
+}
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+/* Write IDAT chunks of the cached output up to 'end' and leave the rest of it
+ * in the compression buffer.  The first chunk was optimized when it was
+ * recorded.
+ */
+static void
+png_frame_cache_emit(png_structrp png_ptr, png_frame_cachep cache,
+    png_alloc_size_t end)
+{
+   png_bytep buffer = png_ptr->zbuffer_list->output;
+   uInt size = png_ptr->zbuffer_size;
+   png_alloc_size_t start = 0;
+
+   while (end - start >= size)
+   {
+      memcpy(buffer, cache->output + start, size);
+      png_write_complete_chunk(png_ptr, png_IDAT, buffer, size);
+      png_ptr->mode |= PNG_HAVE_IDAT;
+      start += size;
+   }
+
+   memcpy(buffer, cache->output + start, (size_t)(end - start));
+   png_ptr->zstream->next_out = buffer + (end - start);
+   png_ptr->zstream->avail_out = size - (uInt)(end - start);
+   cache->out = start;
+}
+
+/* The rows differ from those of the last image at input byte 'diff': go back
+ * to the last copy of the deflate stream before it, write the output up to the
+ * copy from the cache and deflate the input again from the copy.
+ */
+static void
+png_frame_cache_restore(png_structrp png_ptr, png_frame_cachep cache,
+    png_alloc_size_t diff)
+{
+   png_alloc_size_t in = 0, out = 0;
+
+   while (cache->checkpoints > 0 &&
+       cache->checkpoint[cache->checkpoints-1].in > diff)
+      png_frame_cache_drop(cache, cache->checkpoints-1);
+
+   /* Without a copy the IDAT stream is still as png_deflate_claim left it. */
+   if (cache->checkpoints > 0)
+   {
+      png_frame_checkpoint *ck = &cache->checkpoint[cache->checkpoints-1];
+      int ret;
+
+      deflateEnd(png_ptr->zstream);
+
+      ck->zstream.zalloc = png_zalloc;
+      ck->zstream.zfree = png_zfree;
+      ck->zstream.opaque = png_ptr;
+      ret = deflateCopy(png_ptr->zstream, &ck->zstream);
+      ck->zstream.zalloc = png_frame_zalloc;
+      ck->zstream.zfree = png_frame_zfree;
+      ck->zstream.opaque = NULL;
+
+      if (ret != Z_OK)
+      {
+         png_ptr->flags &= ~PNG_FLAG_ZSTREAM_INITIALIZED;
+         png_frame_cache_drop(cache, 0);
+         cache->valid = 0;
+         cache->state = PNG_FRAME_CACHE_OFF;
+         png_zstream_error(png_ptr, ret);
+         png_error(png_ptr, png_ptr->zstream->msg);
+      }
+
+      png_ptr->zstream->next_in = NULL;
+      png_ptr->zstream->avail_in = 0;
+      in = ck->in;
+      out = ck->out;
+   }
+
+   png_frame_cache_emit(png_ptr, cache, out);
+   cache->output_size = cache->out;
+   cache->valid = 0;
+   cache->state = PNG_FRAME_CACHE_RECORDING;
+
+   if (diff > in)
+      png_deflate_IDAT(png_ptr, cache->input + in, diff - in, Z_NO_FLUSH);
+
+   cache->in = diff;
+}
+
+static void
+png_frame_cache_IDAT(png_structrp png_ptr, png_frame_cachep cache,
+    png_const_bytep input, png_alloc_size_t input_len, int flush)
+{
+   if (cache->state == PNG_FRAME_CACHE_MATCHING)
+   {
+      png_alloc_size_t same = cache->input_size - cache->in;
+      png_const_bytep cached = cache->input + cache->in;
+
+      if (same > input_len)
+         same = input_len;
+
+      if (same > 0 && memcmp(input, cached, same) != 0)
+      {
+         png_alloc_size_t i = 0;
+
+         while (input[i] == cached[i])
+            ++i;
+
+         same = i;
+      }
+
+      if (same == input_len)
+      {
+         if (flush == Z_NO_FLUSH)
+         {
+            cache->in += same;
+            return;
+         }
+
+         if (flush == Z_FINISH && cache->in + same == cache->input_size)
+         {
+            /* The whole image is the same. */
+            uInt size;
+
+            png_frame_cache_emit(png_ptr, cache, cache->output_size);
+            size = png_ptr->zbuffer_size - png_ptr->zstream->avail_out;
+
+            if (size > 0)
+               png_write_complete_chunk(png_ptr, png_IDAT,
+                   png_ptr->zbuffer_list->output, size);
+            png_ptr->zstream->avail_out = 0;
+            png_ptr->zstream->next_out = NULL;
+            png_ptr->mode |= PNG_HAVE_IDAT | PNG_AFTER_IDAT;
+
+            png_ptr->zowner = 0; /* Release the stream */
+            cache->state = PNG_FRAME_CACHE_OFF;
+            return;
+         }
+      }
+
+      png_frame_cache_restore(png_ptr, cache, cache->in + same);
+      input += same;
+      input_len -= same;
+
+      if (input_len == 0 && flush == Z_NO_FLUSH)
+         return;
+   }
+
+   /* RECORDING: keep the input then deflate it, copying the stream at the
+    * start of a row once 'interval' bytes have been deflated since the last
+    * copy.
+    */
+   if (cache->checkpoints < PNG_FRAME_CACHE_COPIES &&
+       cache->in - (cache->checkpoints > 0 ?
+          cache->checkpoint[cache->checkpoints-1].in : 0) >= cache->interval)
+   {
+      png_frame_checkpoint *ck = &cache->checkpoint[cache->checkpoints];
+      z_streamp zs = png_ptr->zstream;
+      alloc_func zalloc = zs->zalloc;
+      free_func zfree = zs->zfree;
+      voidpf opaque = zs->opaque;
+
+      zs->zalloc = png_frame_zalloc;
+      zs->zfree = png_frame_zfree;
+      zs->opaque = NULL;
+
+      /* A copy that cannot be made is simply skipped. */
+      if (deflateCopy(&ck->zstream, zs) == Z_OK)
+      {
+         ck->in = cache->in;
+         ck->out = cache->out + (png_ptr->zbuffer_size - zs->avail_out);
+         ++cache->checkpoints;
+      }
+
+      zs->zalloc = zalloc;
+      zs->zfree = zfree;
+      zs->opaque = opaque;
+   }
+
+   if (png_frame_cache_grow(&cache->input, &cache->input_allocated, cache->in,
+       input_len) == 0)
+      png_frame_cache_off(png_ptr, cache);
+
+   else if (input_len > 0)
+   {
+      memcpy(cache->input + cache->in, input, (size_t)input_len);
+      cache->in += input_len;
+   }
+
+   png_deflate_IDAT(png_ptr, input, input_len, flush);
+
+   /* The output of a flush part way through the image depends on where the
+    * flush was, so such an image is not kept.
+    */
+   if (flush == Z_SYNC_FLUSH || flush == Z_FULL_FLUSH)
+   {
+      png_frame_cache_drop(cache, 0);
+      cache->state = PNG_FRAME_CACHE_OFF;
+   }
+
+   else if (flush == Z_FINISH && cache->state == PNG_FRAME_CACHE_RECORDING)
+   {
+      cache->input_size = cache->in;
+      cache->output_size = cache->out;
+      cache->valid = 1;
+      cache->state = PNG_FRAME_CACHE_OFF;
+   }
+}
+#endif /* WRITE_FRAME_CACHE */
+
+/* This is similar to png_text_compress, above, except that it does not require
+ * all of the data at once and, instead of buffering the compressed result,
+ * writes it as IDAT chunks.  Unlike png_text_compress it *can* png_error out
+ * because it calls the write interface.  As a result it does its own error
+ * reporting and does not return an error code.  In the event of error it will
+ * just call png_error.  The input data length may exceed 32-bits.  The 'flush'
+ * parameter is exactly the same as that to deflate, with the following
+ * meanings:
+ *
+ * Z_NO_FLUSH: normal incremental output of compressed data
+ * Z_SYNC_FLUSH: do a SYNC_FLUSH, used by png_write_flush
+ * Z_FINISH: this is the end of the input, do a Z_FINISH and clean up
+ *
+ * The routine manages the acquire and release of the png_ptr->zstream by
+ * checking and (at the end) clearing png_ptr->zowner; it does some sanity
+ * checks on the 'mode' flags while doing this.
+ */
+void /* PRIVATE */
+png_compress_IDAT(png_structrp png_ptr, png_const_bytep input,
+    png_alloc_size_t input_len, int flush)
+{
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+   if (png_ptr->auto_sample != NULL &&
+       png_auto_hold(png_ptr, input, input_len, flush) != 0)
+      return;
+#endif
+
+#ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+   if (png_ptr->zowner != png_IDAT &&
+       png_ptr->zlib_level == PNG_COMPRESSION_LEVEL_FASTEST)
+   {
+      png_fast_init(png_ptr);
+      png_ptr->zowner = png_IDAT;
+   }
+
+   if (png_ptr->fast_encoder != NULL)
+   {
+      png_fast_IDAT(png_ptr,
+          png_voidcast(png_fast_encoderp, png_ptr->fast_encoder), input,
+          input_len, flush);
+      return;
+   }
+#endif
+
+#ifdef PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED
+   if (png_ptr->zowner != png_IDAT &&
+       png_ptr->zlib_level == PNG_COMPRESSION_LEVEL_OPTIMAL)
+      png_optimal_init(png_ptr);
+
+   if (png_ptr->optimal_encoder != NULL)
+   {
+      png_optimal_IDAT(png_ptr,
+          png_voidcast(png_optimal_encoderp, png_ptr->optimal_encoder), input,
+          input_len, flush);
+      return;
+   }
+#endif
+
+   if (png_ptr->zowner != png_IDAT)
+   {
+      /* First time.   Ensure we have a temporary buffer for compression and
+       * trim the buffer list if it has more than one entry to free memory.
+       * If 'WRITE_COMPRESSED_TEXT' is not set the list will never have been
+       * created at this point, but the check here is quick and safe.
+       */
+      if (png_ptr->zbuffer_list == NULL)
+      {
+         png_ptr->zbuffer_list = png_voidcast(png_compression_bufferp,
+             png_malloc(png_ptr, PNG_COMPRESSION_BUFFER_SIZE(png_ptr)));
+         png_ptr->zbuffer_list->next = NULL;
+      }
+
+      else
+         png_free_buffer_list(png_ptr, &png_ptr->zbuffer_list->next);
+
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+      if (png_deflate_threads_init(png_ptr) != NULL)
+      {
+         png_ptr->zowner = png_IDAT;
+         png_deflate_threads_header(png_ptr,
+             png_voidcast(png_deflate_threadsp, png_ptr->compression_state));
+      }
+
+      else
+#endif
+      {
+         /* It is a terminal error if we can't claim the zstream. */
+         if (png_deflate_claim(png_ptr, png_IDAT, png_image_size(png_ptr)) !=
+             Z_OK)
+            png_error(png_ptr, png_ptr->zstream->msg);
+
+         /* The output state is maintained in png_ptr->zstream, so it must be
+          * initialized here after the claim.
+          */
+         png_ptr->zstream->next_out = png_ptr->zbuffer_list->output;
+         png_ptr->zstream->avail_out = png_ptr->zbuffer_size;
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+         if (png_ptr->frame_cache != NULL)
+            png_frame_cache_start(png_ptr, png_ptr->frame_cache);
+#endif
+      }
+   }
+
+#ifdef PNG_WRITE_COMPRESSION_THREADS_SUPPORTED
+   if (png_ptr->compression_state != NULL)
+   {
+      png_deflate_threads_IDAT(png_ptr,
+          png_voidcast(png_deflate_threadsp, png_ptr->compression_state), input,
+          input_len, flush);
+      return;
+   }
+#endif
+
+#ifdef PNG_WRITE_FRAME_CACHE_SUPPORTED
+   if (png_ptr->frame_cache != NULL &&
+       png_ptr->frame_cache->state != PNG_FRAME_CACHE_OFF)
+   {
+      png_frame_cache_IDAT(png_ptr, png_ptr->frame_cache, input, input_len,
+          flush);
+      return;
+   }
+#endif
+
+   png_deflate_IDAT(png_ptr, input, input_len, flush);
+}
+
+/* Write an IEND chunk */
+void /* PRIVATE */
+png_write_IEND(png_structrp png_ptr)
+{
+   png_debug(1, "in png_write_IEND");
+
+   png_write_complete_chunk(png_ptr, png_IEND, NULL, 0);
+   png_ptr->mode |= PNG_HAVE_IEND;
+}
+
+#ifdef PNG_WRITE_gAMA_SUPPORTED
+/* Write a gAMA chunk */
+void /* PRIVATE */
+png_write_gAMA_fixed(png_structrp png_ptr, png_fixed_point file_gamma)
+{
+   png_byte buf[4];
+
+   png_debug(1, "in png_write_gAMA");
+
+   /* file_gamma is saved in 1/100,000ths */
+   png_save_uint_32(buf, (png_uint_32)file_gamma);
+   png_write_complete_chunk(png_ptr, png_gAMA, buf, 4);
+}
+#endif
+
+#ifdef PNG_WRITE_sRGB_SUPPORTED
+/* Write a sRGB chunk */
+void /* PRIVATE */
+png_write_sRGB(png_structrp png_ptr, int srgb_intent)
+{
+   png_byte buf[1];
+
+   png_debug(1, "in png_write_sRGB");
+
+   if (srgb_intent >= PNG_sRGB_INTENT_LAST)
+      png_warning(png_ptr,
+          "Invalid sRGB rendering intent specified");
+
+   buf[0]=(png_byte)srgb_intent;
+   png_write_complete_chunk(png_ptr, png_sRGB, buf, 1);
+}
+#endif
+
+#ifdef PNG_WRITE_iCCP_SUPPORTED
+/* Write an iCCP chunk */
+void /* PRIVATE */
+png_write_iCCP(png_structrp png_ptr, png_const_charp name,
+    png_const_bytep profile)
+{
+   png_uint_32 name_len;
+   png_uint_32 profile_len;
+   png_byte new_name[81]; /* 1 byte for the compression byte */
+   compression_state comp;
+   png_uint_32 temp;
+
+   png_debug(1, "in png_write_iCCP");
+
+   /* These are all internal problems: the profile should have been checked
+    * before when it was stored.
+    */
+   if (profile == NULL)
+      png_error(png_ptr, "No profile for iCCP chunk"); /* internal error */
+
+   profile_len = png_get_uint_32(profile);
+
+   if (profile_len < 132)
+      png_error(png_ptr, "ICC profile too short");
+
+   temp = (png_uint_32) (*(profile+8));
+   if (temp > 3 && (profile_len & 0x03))
+      png_error(png_ptr, "ICC profile length invalid (not a multiple of 4)");
+
+   {
+      png_uint_32 embedded_profile_len = png_get_uint_32(profile);
+
+      if (profile_len != embedded_profile_len)
+         png_error(png_ptr, "Profile length does not match profile");
+   }
+
+   name_len = png_check_keyword(png_ptr, name, new_name);
+
+   if (name_len == 0)
+      png_error(png_ptr, "iCCP: invalid keyword");
+
+   new_name[++name_len] = PNG_COMPRESSION_TYPE_BASE;
+
+   /* Make sure we include the NULL after the name and the compression type */
+   ++name_len;
+
+   png_text_compress_init(&comp, profile, profile_len);
+
+   /* Allow for keyword terminator and compression byte */
+   if (png_text_compress(png_ptr, png_iCCP, &comp, name_len) != Z_OK)
+      png_error(png_ptr, png_ptr->zstream->msg);
+
+   png_write_chunk_header(png_ptr, png_iCCP, name_len + comp.output_len);
+
+   png_write_chunk_data(png_ptr, new_name, name_len);
+
+   png_write_compressed_data_out(png_ptr, &comp);
+
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_sPLT_SUPPORTED
+/* Write a sPLT chunk */
+void /* PRIVATE */
+png_write_sPLT(png_structrp png_ptr, png_const_sPLT_tp spalette)
+{
+   png_uint_32 name_len;
+   png_byte new_name[80];
+   png_byte entrybuf[10];
+   size_t entry_size = (spalette->depth == 8 ? 6 : 10);
+   size_t palette_size = entry_size * (size_t)spalette->nentries;
+   png_sPLT_entryp ep;
+#ifndef PNG_POINTER_INDEXING_SUPPORTED
+   int i;
+#endif
+
+   png_debug(1, "in png_write_sPLT");
+
+   name_len = png_check_keyword(png_ptr, spalette->name, new_name);
+
+   if (name_len == 0)
+      png_error(png_ptr, "sPLT: invalid keyword");
+
+   /* Make sure we include the NULL after the name */
+   png_write_chunk_header(png_ptr, png_sPLT,
+       (png_uint_32)(name_len + 2 + palette_size));
+
+   png_write_chunk_data(png_ptr, (png_bytep)new_name, (size_t)(name_len + 1));
+
+   png_write_chunk_data(png_ptr, &spalette->depth, 1);
+
+   /* Loop through each palette entry, writing appropriately */
+#ifdef PNG_POINTER_INDEXING_SUPPORTED
+   for (ep = spalette->entries; ep<spalette->entries + spalette->nentries; ep++)
+   {
+      if (spalette->depth == 8)
+      {
+         entrybuf[0] = (png_byte)ep->red;
+         entrybuf[1] = (png_byte)ep->green;
+         entrybuf[2] = (png_byte)ep->blue;
+         entrybuf[3] = (png_byte)ep->alpha;
+         png_save_uint_16(entrybuf + 4, ep->frequency);
+      }
+
+      else
+      {
+         png_save_uint_16(entrybuf + 0, ep->red);
+         png_save_uint_16(entrybuf + 2, ep->green);
+         png_save_uint_16(entrybuf + 4, ep->blue);
+         png_save_uint_16(entrybuf + 6, ep->alpha);
+         png_save_uint_16(entrybuf + 8, ep->frequency);
+      }
+
+      png_write_chunk_data(png_ptr, entrybuf, entry_size);
+   }
+#else
+   ep=spalette->entries;
+   for (i = 0; i>spalette->nentries; i++)
+   {
+      if (spalette->depth == 8)
+      {
+         entrybuf[0] = (png_byte)ep[i].red;
+         entrybuf[1] = (png_byte)ep[i].green;
+         entrybuf[2] = (png_byte)ep[i].blue;
+         entrybuf[3] = (png_byte)ep[i].alpha;
+         png_save_uint_16(entrybuf + 4, ep[i].frequency);
+      }
+
+      else
+      {
+         png_save_uint_16(entrybuf + 0, ep[i].red);
+         png_save_uint_16(entrybuf + 2, ep[i].green);
+         png_save_uint_16(entrybuf + 4, ep[i].blue);
+         png_save_uint_16(entrybuf + 6, ep[i].alpha);
+         png_save_uint_16(entrybuf + 8, ep[i].frequency);
+      }
+
+      png_write_chunk_data(png_ptr, entrybuf, entry_size);
+   }
+#endif
+
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_sBIT_SUPPORTED
+/* Write the sBIT chunk */
+void /* PRIVATE */
+png_write_sBIT(png_structrp png_ptr, png_const_color_8p sbit, int color_type)
+{
+   png_byte buf[4];
+   size_t size;
+
+   png_debug(1, "in png_write_sBIT");
+
+   /* Make sure we don't depend upon the order of PNG_COLOR_8 */
+   if ((color_type & PNG_COLOR_MASK_COLOR) != 0)
+   {
+      png_byte maxbits;
+
+      maxbits = (png_byte)(color_type==PNG_COLOR_TYPE_PALETTE ? 8 :
+          png_ptr->usr_bit_depth);
+
+      if (sbit->red == 0 || sbit->red > maxbits ||
+          sbit->green == 0 || sbit->green > maxbits ||
+          sbit->blue == 0 || sbit->blue > maxbits)
+      {
+         png_warning(png_ptr, "Invalid sBIT depth specified");
+         return;
+      }
+
+      buf[0] = sbit->red;
+      buf[1] = sbit->green;
+      buf[2] = sbit->blue;
+      size = 3;
+   }
+
+   else
+   {
+      if (sbit->gray == 0 || sbit->gray > png_ptr->usr_bit_depth)
+      {
+         png_warning(png_ptr, "Invalid sBIT depth specified");
+         return;
+      }
+
+      buf[0] = sbit->gray;
+      size = 1;
+   }
+
+   if ((color_type & PNG_COLOR_MASK_ALPHA) != 0)
+   {
+      if (sbit->alpha == 0 || sbit->alpha > png_ptr->usr_bit_depth)
+      {
+         png_warning(png_ptr, "Invalid sBIT depth specified");
+         return;
+      }
+
+      buf[size++] = sbit->alpha;
+   }
+
+   png_write_complete_chunk(png_ptr, png_sBIT, buf, size);
+}
+#endif
+
+#ifdef PNG_WRITE_cHRM_SUPPORTED
+/* Write the cHRM chunk */
+void /* PRIVATE */
+png_write_cHRM_fixed(png_structrp png_ptr, const png_xy *xy)
+{
+   png_byte buf[32];
+
+   png_debug(1, "in png_write_cHRM");
+
+   /* Each value is saved in 1/100,000ths */
+   png_save_int_32(buf,      xy->whitex);
+   png_save_int_32(buf +  4, xy->whitey);
+
+   png_save_int_32(buf +  8, xy->redx);
+   png_save_int_32(buf + 12, xy->redy);
+
+   png_save_int_32(buf + 16, xy->greenx);
+   png_save_int_32(buf + 20, xy->greeny);
+
+   png_save_int_32(buf + 24, xy->bluex);
+   png_save_int_32(buf + 28, xy->bluey);
+
+   png_write_complete_chunk(png_ptr, png_cHRM, buf, 32);
+}
+#endif
+
+#ifdef PNG_WRITE_tRNS_SUPPORTED
+/* Write the tRNS chunk */
+void /* PRIVATE */
+png_write_tRNS(png_structrp png_ptr, png_const_bytep trans_alpha,
+    png_const_color_16p tran, int num_trans, int color_type)
+{
+   png_byte buf[6];
+
+   png_debug(1, "in png_write_tRNS");
+
+   if (color_type == PNG_COLOR_TYPE_PALETTE)
+   {
+      if (num_trans <= 0 || num_trans > (int)png_ptr->num_palette)
+      {
+         png_app_warning(png_ptr,
+             "Invalid number of transparent colors specified");
+         return;
+      }
+
+      /* Write the chunk out as it is */
+      png_write_complete_chunk(png_ptr, png_tRNS, trans_alpha,
+          (size_t)num_trans);
+   }
+
+   else if (color_type == PNG_COLOR_TYPE_GRAY)
+   {
+      /* One 16-bit value */
+      if (tran->gray >= (1 << png_ptr->bit_depth))
+      {
+         png_app_warning(png_ptr,
+             "Ignoring attempt to write tRNS chunk out-of-range for bit_depth");
+
+         return;
+      }
+
+      png_save_uint_16(buf, tran->gray);
+      png_write_complete_chunk(png_ptr, png_tRNS, buf, 2);
+   }
+
+   else if (color_type == PNG_COLOR_TYPE_RGB)
+   {
+      /* Three 16-bit values */
+      png_save_uint_16(buf, tran->red);
+      png_save_uint_16(buf + 2, tran->green);
+      png_save_uint_16(buf + 4, tran->blue);
+#ifdef PNG_WRITE_16BIT_SUPPORTED
+      if (png_ptr->bit_depth == 8 && (buf[0] | buf[2] | buf[4]) != 0)
+#else
+      if ((buf[0] | buf[2] | buf[4]) != 0)
+#endif
+      {
+         png_app_warning(png_ptr,
+             "Ignoring attempt to write 16-bit tRNS chunk when bit_depth is 8");
+         return;
+      }
+
+      png_write_complete_chunk(png_ptr, png_tRNS, buf, 6);
+   }
+
+   else
+   {
+      png_app_warning(png_ptr, "Can't write tRNS with an alpha channel");
+   }
+}
+#endif
+
+#ifdef PNG_WRITE_bKGD_SUPPORTED
+/* Write the background chunk */
+void /* PRIVATE */
+png_write_bKGD(png_structrp png_ptr, png_const_color_16p back, int color_type)
+{
+   png_byte buf[6];
+
+   png_debug(1, "in png_write_bKGD");
+
+   if (color_type == PNG_COLOR_TYPE_PALETTE)
+   {
+      if (
+#ifdef PNG_MNG_FEATURES_SUPPORTED
+          (png_ptr->num_palette != 0 ||
+          (png_ptr->mng_features_permitted & PNG_FLAG_MNG_EMPTY_PLTE) == 0) &&
+#endif
+         back->index >= png_ptr->num_palette)
+      {
+         png_warning(png_ptr, "Invalid background palette index");
+         return;
+      }
+
+      buf[0] = back->index;
+      png_write_complete_chunk(png_ptr, png_bKGD, buf, 1);
+   }
+
+   else if ((color_type & PNG_COLOR_MASK_COLOR) != 0)
+   {
+      png_save_uint_16(buf, back->red);
+      png_save_uint_16(buf + 2, back->green);
+      png_save_uint_16(buf + 4, back->blue);
+#ifdef PNG_WRITE_16BIT_SUPPORTED
+      if (png_ptr->bit_depth == 8 && (buf[0] | buf[2] | buf[4]) != 0)
+#else
+      if ((buf[0] | buf[2] | buf[4]) != 0)
+#endif
+      {
+         png_warning(png_ptr,
+             "Ignoring attempt to write 16-bit bKGD chunk "
+             "when bit_depth is 8");
+
+         return;
+      }
+
+      png_write_complete_chunk(png_ptr, png_bKGD, buf, 6);
+   }
+
+   else
+   {
+      if (back->gray >= (1 << png_ptr->bit_depth))
+      {
+         png_warning(png_ptr,
+             "Ignoring attempt to write bKGD chunk out-of-range for bit_depth");
+
+         return;
+      }
+
+      png_save_uint_16(buf, back->gray);
+      png_write_complete_chunk(png_ptr, png_bKGD, buf, 2);
+   }
+}
+#endif
+
+#ifdef PNG_WRITE_eXIf_SUPPORTED
+/* Write the Exif data */
+void /* PRIVATE */
+png_write_eXIf(png_structrp png_ptr, png_bytep exif, int num_exif)
+{
+   int i;
+   png_byte buf[1];
+
+   png_debug(1, "in png_write_eXIf");
+
+   png_write_chunk_header(png_ptr, png_eXIf, (png_uint_32)(num_exif));
+
+   for (i = 0; i < num_exif; i++)
+   {
+      buf[0] = exif[i];
+      png_write_chunk_data(png_ptr, buf, 1);
+   }
+
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_hIST_SUPPORTED
+/* Write the histogram */
+void /* PRIVATE */
+png_write_hIST(png_structrp png_ptr, png_const_uint_16p hist, int num_hist)
+{
+   int i;
+   png_byte buf[3];
+
+   png_debug(1, "in png_write_hIST");
+
+   if (num_hist > (int)png_ptr->num_palette)
+   {
+      png_debug2(3, "num_hist = %d, num_palette = %d", num_hist,
+          png_ptr->num_palette);
+
+      png_warning(png_ptr, "Invalid number of histogram entries specified");
+      return;
+   }
+
+   png_write_chunk_header(png_ptr, png_hIST, (png_uint_32)(num_hist * 2));
+
+   for (i = 0; i < num_hist; i++)
+   {
+      png_save_uint_16(buf, hist[i]);
+      png_write_chunk_data(png_ptr, buf, 2);
+   }
+
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_tEXt_SUPPORTED
+/* Write a tEXt chunk */
+void /* PRIVATE */
+png_write_tEXt(png_structrp png_ptr, png_const_charp key, png_const_charp text,
+    size_t text_len)
+{
+   png_uint_32 key_len;
+   png_byte new_key[80];
+
+   png_debug(1, "in png_write_tEXt");
+
+   key_len = png_check_keyword(png_ptr, key, new_key);
+
+   if (key_len == 0)
+      png_error(png_ptr, "tEXt: invalid keyword");
+
+   if (text == NULL || *text == '\0')
+      text_len = 0;
+
+   else
+      text_len = strlen(text);
+
+   if (text_len > PNG_UINT_31_MAX - (key_len+1))
+      png_error(png_ptr, "tEXt: text too long");
+
+   /* Make sure we include the 0 after the key */
+   png_write_chunk_header(png_ptr, png_tEXt,
+       (png_uint_32)/*checked above*/(key_len + text_len + 1));
+   /*
+    * We leave it to the application to meet PNG-1.0 requirements on the
+    * contents of the text.  PNG-1.0 through PNG-1.2 discourage the use of
+    * any non-Latin-1 characters except for NEWLINE.  ISO PNG will forbid them.
+    * The NUL character is forbidden by PNG-1.0 through PNG-1.2 and ISO PNG.
+    */
+   png_write_chunk_data(png_ptr, new_key, key_len + 1);
+
+   if (text_len != 0)
+      png_write_chunk_data(png_ptr, (png_const_bytep)text, text_len);
+
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_zTXt_SUPPORTED
+/* Write a compressed text chunk */
+void /* PRIVATE */
+png_write_zTXt(png_structrp png_ptr, png_const_charp key, png_const_charp text,
+    int compression)
+{
+   png_uint_32 key_len;
+   png_byte new_key[81];
+   compression_state comp;
+
+   png_debug(1, "in png_write_zTXt");
+
+   if (compression == PNG_TEXT_COMPRESSION_NONE)
+   {
+      png_write_tEXt(png_ptr, key, text, 0);
+      return;
+   }
+
+   if (compression != PNG_TEXT_COMPRESSION_zTXt)
+      png_error(png_ptr, "zTXt: invalid compression type");
+
+   key_len = png_check_keyword(png_ptr, key, new_key);
+
+   if (key_len == 0)
+      png_error(png_ptr, "zTXt: invalid keyword");
+
+   /* Add the compression method and 1 for the keyword separator. */
+   new_key[++key_len] = PNG_COMPRESSION_TYPE_BASE;
+   ++key_len;
+
+   /* Compute the compressed data; do it now for the length */
+   png_text_compress_init(&comp, (png_const_bytep)text,
+       text == NULL ? 0 : strlen(text));
+
+   if (png_text_compress(png_ptr, png_zTXt, &comp, key_len) != Z_OK)
+      png_error(png_ptr, png_ptr->zstream->msg);
+
+   /* Write start of chunk */
+   png_write_chunk_header(png_ptr, png_zTXt, key_len + comp.output_len);
+
+   /* Write key */
+   png_write_chunk_data(png_ptr, new_key, key_len);
+
+   /* Write the compressed data */
+   png_write_compressed_data_out(png_ptr, &comp);
+
+   /* Close the chunk */
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_iTXt_SUPPORTED
+/* Write an iTXt chunk */
+void /* PRIVATE */
+png_write_iTXt(png_structrp png_ptr, int compression, png_const_charp key,
+    png_const_charp lang, png_const_charp lang_key, png_const_charp text)
+{
+   png_uint_32 key_len, prefix_len;
+   size_t lang_len, lang_key_len;
+   png_byte new_key[82];
+   compression_state comp;
+
+   png_debug(1, "in png_write_iTXt");
+
+   key_len = png_check_keyword(png_ptr, key, new_key);
+
+   if (key_len == 0)
+      png_error(png_ptr, "iTXt: invalid keyword");
+
+   /* Set the compression flag */
+   switch (compression)
+   {
+      case PNG_ITXT_COMPRESSION_NONE:
+      case PNG_TEXT_COMPRESSION_NONE:
+         compression = new_key[++key_len] = 0; /* no compression */
+         break;
+
+      case PNG_TEXT_COMPRESSION_zTXt:
+      case PNG_ITXT_COMPRESSION_zTXt:
+         compression = new_key[++key_len] = 1; /* compressed */
+         break;
+
+      default:
+         png_error(png_ptr, "iTXt: invalid compression");
+   }
+
+   new_key[++key_len] = PNG_COMPRESSION_TYPE_BASE;
+   ++key_len; /* for the keywod separator */
+
+   /* We leave it to the application to meet PNG-1.0 requirements on the
+    * contents of the text.  PNG-1.0 through PNG-1.2 discourage the use of
+    * any non-Latin-1 characters except for NEWLINE.  ISO PNG, however,
+    * specifies that the text is UTF-8 and this really doesn't require any
+    * checking.
+    *
+    * The NUL character is forbidden by PNG-1.0 through PNG-1.2 and ISO PNG.
+    *
+    * TODO: validate the language tag correctly (see the spec.)
+    */
+   if (lang == NULL) lang = ""; /* empty language is valid */
+   lang_len = strlen(lang)+1;
+   if (lang_key == NULL) lang_key = ""; /* may be empty */
+   lang_key_len = strlen(lang_key)+1;
+   if (text == NULL) text = ""; /* may be empty */
+
+   prefix_len = key_len;
+   if (lang_len > PNG_UINT_31_MAX-prefix_len)
+      prefix_len = PNG_UINT_31_MAX;
+   else
+      prefix_len = (png_uint_32)(prefix_len + lang_len);
+
+   if (lang_key_len > PNG_UINT_31_MAX-prefix_len)
+      prefix_len = PNG_UINT_31_MAX;
+   else
+      prefix_len = (png_uint_32)(prefix_len + lang_key_len);
+
+   png_text_compress_init(&comp, (png_const_bytep)text, strlen(text));
+
+   if (compression != 0)
+   {
+      if (png_text_compress(png_ptr, png_iTXt, &comp, prefix_len) != Z_OK)
+         png_error(png_ptr, png_ptr->zstream->msg);
+   }
+
+   else
+   {
+      if (comp.input_len > PNG_UINT_31_MAX-prefix_len)
+         png_error(png_ptr, "iTXt: uncompressed text too long");
+
+      /* So the string will fit in a chunk: */
+      comp.output_len = (png_uint_32)/*SAFE*/comp.input_len;
+   }
+
+   png_write_chunk_header(png_ptr, png_iTXt, comp.output_len + prefix_len);
+
+   png_write_chunk_data(png_ptr, new_key, key_len);
+
+   png_write_chunk_data(png_ptr, (png_const_bytep)lang, lang_len);
+
+   png_write_chunk_data(png_ptr, (png_const_bytep)lang_key, lang_key_len);
+
+   if (compression != 0)
+      png_write_compressed_data_out(png_ptr, &comp);
+
+   else
+      png_write_chunk_data(png_ptr, (png_const_bytep)text, comp.output_len);
+
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_oFFs_SUPPORTED
+/* Write the oFFs chunk */
+void /* PRIVATE */
+png_write_oFFs(png_structrp png_ptr, png_int_32 x_offset, png_int_32 y_offset,
+    int unit_type)
+{
+   png_byte buf[9];
+
+   png_debug(1, "in png_write_oFFs");
+
+   if (unit_type >= PNG_OFFSET_LAST)
+      png_warning(png_ptr, "Unrecognized unit type for oFFs chunk");
+
+   png_save_int_32(buf, x_offset);
+   png_save_int_32(buf + 4, y_offset);
+   buf[8] = (png_byte)unit_type;
+
+   png_write_complete_chunk(png_ptr, png_oFFs, buf, 9);
+}
+#endif
+#ifdef PNG_WRITE_pCAL_SUPPORTED
+/* Write the pCAL chunk (described in the PNG extensions document) */
+void /* PRIVATE */
+png_write_pCAL(png_structrp png_ptr, png_charp purpose, png_int_32 X0,
+    png_int_32 X1, int type, int nparams, png_const_charp units,
+    png_charpp params)
+{
+   png_uint_32 purpose_len;
+   size_t units_len, total_len;
+   png_size_tp params_len;
+   png_byte buf[10];
+   png_byte new_purpose[80];
+   int i;
+
+   png_debug1(1, "in png_write_pCAL (%d parameters)", nparams);
+
+   if (type >= PNG_EQUATION_LAST)
+      png_error(png_ptr, "Unrecognized equation type for pCAL chunk");
+
+   purpose_len = png_check_keyword(png_ptr, purpose, new_purpose);
+
+   if (purpose_len == 0)
+      png_error(png_ptr, "pCAL: invalid keyword");
+
+   ++purpose_len; /* terminator */
+
+   png_debug1(3, "pCAL purpose length = %d", (int)purpose_len);
+   units_len = strlen(units) + (nparams == 0 ? 0 : 1);
+   png_debug1(3, "pCAL units length = %d", (int)units_len);
+   total_len = purpose_len + units_len + 10;
+
+   params_len = (png_size_tp)png_malloc(png_ptr,
+       (png_alloc_size_t)((png_alloc_size_t)nparams * (sizeof (size_t))));
+
+   /* Find the length of each parameter, making sure we don't count the
+    * null terminator for the last parameter.
+    */
+   for (i = 0; i < nparams; i++)
+   {
+      params_len[i] = strlen(params[i]) + (i == nparams - 1 ? 0 : 1);
+      png_debug2(3, "pCAL parameter %d length = %lu", i,
+          (unsigned long)params_len[i]);
+      total_len += params_len[i];
+   }
+
+   png_debug1(3, "pCAL total length = %d", (int)total_len);
+   png_write_chunk_header(png_ptr, png_pCAL, (png_uint_32)total_len);
+   png_write_chunk_data(png_ptr, new_purpose, purpose_len);
+   png_save_int_32(buf, X0);
+   png_save_int_32(buf + 4, X1);
+   buf[8] = (png_byte)type;
+   buf[9] = (png_byte)nparams;
+   png_write_chunk_data(png_ptr, buf, 10);
+   png_write_chunk_data(png_ptr, (png_const_bytep)units, (size_t)units_len);
+
+   for (i = 0; i < nparams; i++)
+   {
+      png_write_chunk_data(png_ptr, (png_const_bytep)params[i], params_len[i]);
+   }
+
+   png_free(png_ptr, params_len);
+   png_write_chunk_end(png_ptr);
+}
+#endif
+
+#ifdef PNG_WRITE_sCAL_SUPPORTED
+/* Write the sCAL chunk */
+void /* PRIVATE */
+png_write_sCAL_s(png_structrp png_ptr, int unit, png_const_charp width,
+    png_const_charp height)
+{
+   png_byte buf[64];
+   size_t wlen, hlen, total_len;
+
+   png_debug(1, "in png_write_sCAL_s");
+
+   wlen = strlen(width);
+   hlen = strlen(height);
+   total_len = wlen + hlen + 2;
+
+   if (total_len > 64)
+   {
+      png_warning(png_ptr, "Can't write sCAL (buffer too small)");
+      return;
+   }
+
+   buf[0] = (png_byte)unit;
+   memcpy(buf + 1, width, wlen + 1);      /* Append the '\0' here */
+   memcpy(buf + wlen + 2, height, hlen);  /* Do NOT append the '\0' here */
+
+   png_debug1(3, "sCAL total length = %u", (unsigned int)total_len);
+   png_write_complete_chunk(png_ptr, png_sCAL, buf, total_len);
+}
+#endif
+
+#ifdef PNG_WRITE_pHYs_SUPPORTED
+/* Write the pHYs chunk */
+void /* PRIVATE */
+png_write_pHYs(png_structrp png_ptr, png_uint_32 x_pixels_per_unit,
+    png_uint_32 y_pixels_per_unit,
+    int unit_type)
+{
+   png_byte buf[9];
+
+   png_debug(1, "in png_write_pHYs");
+
+   if (unit_type >= PNG_RESOLUTION_LAST)
+      png_warning(png_ptr, "Unrecognized unit type for pHYs chunk");
+
+   png_save_uint_32(buf, x_pixels_per_unit);
+   png_save_uint_32(buf + 4, y_pixels_per_unit);
+   buf[8] = (png_byte)unit_type;
+
+   png_write_complete_chunk(png_ptr, png_pHYs, buf, 9);
+}
+#endif
+
+#ifdef PNG_WRITE_tIME_SUPPORTED
+/* Write the tIME chunk.  Use either png_convert_from_struct_tm()
+ * or png_convert_from_time_t(), or fill in the structure yourself.
+ */
+void /* PRIVATE */
+png_write_tIME(png_structrp png_ptr, png_const_timep mod_time)
+{
+   png_byte buf[7];
+
+   png_debug(1, "in png_write_tIME");
+
+   if (mod_time->month  > 12 || mod_time->month  < 1 ||
+       mod_time->day    > 31 || mod_time->day    < 1 ||
+       mod_time->hour   > 23 || mod_time->second > 60)
+   {
+      png_warning(png_ptr, "Invalid time specified for tIME chunk");
+      return;
+   }
+
+   png_save_uint_16(buf, mod_time->year);
+   buf[2] = mod_time->month;
+   buf[3] = mod_time->day;
+   buf[4] = mod_time->hour;
+   buf[5] = mod_time->minute;
+   buf[6] = mod_time->second;
+
+   png_write_complete_chunk(png_ptr, png_tIME, buf, 7);
+}
+#endif
+
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+static void /* PRIVATE */
+png_write_pipeline_init(png_structrp png_ptr);
+#endif
+
+/* Initializes the row writing capability of libpng */
+void /* PRIVATE */
+png_write_start_row(png_structrp png_ptr)
+{
+#ifdef PNG_WRITE_INTERLACING_SUPPORTED
+   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
+
+   /* Start of interlace block */
+   static const png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+
+   /* Offset to next interlace block */
+   static const png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+
+   /* Start of interlace block in the y direction */
+   static const png_byte png_pass_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+
+   /* Offset to next interlace block in the y direction */
+   static const png_byte png_pass_yinc[7] = {8, 8, 8, 4, 4, 2, 2};
+#endif
+
+   png_alloc_size_t buf_size;
+   int usr_pixel_depth;
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+   png_byte filters;
+#endif
+
+   png_debug(1, "in png_write_start_row");
+
+   /* This cannot overflow; usr_pixel_depth is at most 64 and png_check_IHDR
+    * limits the width so that a row of 8-byte pixels fits in a size_t.
+    */
+   usr_pixel_depth = png_ptr->usr_channels * png_ptr->usr_bit_depth;
+   buf_size = PNG_ROWBYTES(usr_pixel_depth, png_ptr->width) + 1;
+
+   /* 1.5.6: added to allow checking in the row write code. */
+   png_ptr->transformed_pixel_depth = png_ptr->pixel_depth;
+   png_ptr->maximum_pixel_depth = (png_byte)usr_pixel_depth;
+
+   /* Set up row buffer */
+   png_ptr->row_buf = png_voidcast(png_bytep, png_malloc(png_ptr, buf_size));
+
+   png_ptr->row_buf[0] = PNG_FILTER_VALUE_NONE;
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+   filters = png_ptr->do_filter;
+
+   if (png_ptr->height == 1)
+      filters &= 0xff & ~(PNG_FILTER_UP|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+
+   if (png_ptr->width == 1)
+      filters &= 0xff & ~(PNG_FILTER_SUB|PNG_FILTER_AVG|PNG_FILTER_PAETH);
+
+   if (filters == 0)
+      filters = PNG_FILTER_NONE;
+
+   png_ptr->do_filter = filters;
+
+   if (((filters & (PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_AVG |
+       PNG_FILTER_PAETH)) != 0) && png_ptr->try_row == NULL)
+   {
+      int num_filters = 0;
+
+      png_ptr->try_row = png_voidcast(png_bytep, png_malloc(png_ptr, buf_size));
+
+      if (filters & PNG_FILTER_SUB)
+         num_filters++;
+
+      if (filters & PNG_FILTER_UP)
+         num_filters++;
+
+      if (filters & PNG_FILTER_AVG)
+         num_filters++;
+
+      if (filters & PNG_FILTER_PAETH)
+         num_filters++;
+
+      if (num_filters > 1)
+         png_ptr->tst_row = png_voidcast(png_bytep, png_malloc(png_ptr,
+             buf_size));
+   }
+
+   /* We only need to keep the previous row if we are using one of the following
+    * filters.
+    */
+   if ((filters & (PNG_FILTER_AVG | PNG_FILTER_UP | PNG_FILTER_PAETH)) != 0)
+      png_ptr->prev_row = png_voidcast(png_bytep,
+          png_calloc(png_ptr, buf_size));
+#endif /* WRITE_FILTER */
+
+#ifdef PNG_WRITE_INTERLACING_SUPPORTED
+   /* If interlaced, we need to set up width and height of pass */
+   if (png_ptr->interlaced != 0)
+   {
+      if ((png_ptr->transformations & PNG_INTERLACE) == 0)
+      {
+         png_ptr->num_rows = (png_ptr->height + png_pass_yinc[0] - 1 -
+             png_pass_ystart[0]) / png_pass_yinc[0];
+
+         png_ptr->usr_width = (png_ptr->width + png_pass_inc[0] - 1 -
+             png_pass_start[0]) / png_pass_inc[0];
+      }
+
+      else
+      {
+         png_ptr->num_rows = png_ptr->height;
+         png_ptr->usr_width = png_ptr->width;
+      }
+   }
+
+   else
+#endif
+   {
+      png_ptr->num_rows = png_ptr->height;
+      png_ptr->usr_width = png_ptr->width;
+   }
+
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+   png_write_pipeline_init(png_ptr);
+#endif
+}
+
+/* Internal use only.  Called when finished processing a row of data. */
+void /* PRIVATE */
+png_write_finish_row(png_structrp png_ptr)
+{
+#ifdef PNG_WRITE_INTERLACING_SUPPORTED
+   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
+
+   /* Start of interlace block */
+   static const png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+
+   /* Offset to next interlace block */
+   static const png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+
+   /* Start of interlace block in the y direction */
+   static const png_byte png_pass_ystart[7] = {0, 0, 4, 0, 2, 0, 1};
+
+   /* Offset to next interlace block in the y direction */
+   static const png_byte png_pass_yinc[7] = {8, 8, 8, 4, 4, 2, 2};
+#endif
+
+   png_debug(1, "in png_write_finish_row");
+
+   /* Next row */
+   png_ptr->row_number++;
+
+   /* See if we are done */
+   if (png_ptr->row_number < png_ptr->num_rows)
+      return;
+
+#ifdef PNG_WRITE_INTERLACING_SUPPORTED
+   /* If interlaced, go to next pass */
+   if (png_ptr->interlaced != 0)
+   {
+      png_ptr->row_number = 0;
+      if ((png_ptr->transformations & PNG_INTERLACE) != 0)
+      {
+         png_ptr->pass++;
+      }
+
+      else
+      {
+         /* Loop until we find a non-zero width or height pass */
+         do
+         {
+            png_ptr->pass++;
+
+            if (png_ptr->pass >= 7)
+               break;
+
+            png_ptr->usr_width = (png_ptr->width +
+                png_pass_inc[png_ptr->pass] - 1 -
+                png_pass_start[png_ptr->pass]) /
+                png_pass_inc[png_ptr->pass];
+
+            png_ptr->num_rows = (png_ptr->height +
+                png_pass_yinc[png_ptr->pass] - 1 -
+                png_pass_ystart[png_ptr->pass]) /
+                png_pass_yinc[png_ptr->pass];
+
+            if ((png_ptr->transformations & PNG_INTERLACE) != 0)
+               break;
+
+         } while (png_ptr->usr_width == 0 || png_ptr->num_rows == 0);
+
+      }
+
+      /* Reset the row above the image for the next pass */
+      if (png_ptr->pass < 7)
+      {
+         if (png_ptr->prev_row != NULL)
+            memset(png_ptr->prev_row, 0,
+                PNG_ROWBYTES(png_ptr->usr_channels *
+                png_ptr->usr_bit_depth, png_ptr->width) + 1);
+
+         return;
+      }
+   }
+#endif
+
+   /* If we get here, we've just written the last row, so we need
+      to flush the compressor */
+   png_compress_IDAT(png_ptr, NULL, 0, Z_FINISH);
+}
+
+#ifdef PNG_WRITE_INTERLACING_SUPPORTED
+/* Pick out the correct pixels for the interlace pass.
+ * The basic idea here is to go through the row with a source
+ * pointer and a destination pointer (sp and dp), and copy the
+ * correct pixels for the pass.  As the row gets compacted,
+ * sp will always be >= dp, so we should never overwrite anything.
+ * See the default: case for the easiest code to understand.
+ */
+void /* PRIVATE */
+png_do_write_interlace(png_row_infop row_info, png_bytep row, int pass)
+{
+   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
+
+   /* Start of interlace block */
+   static const png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+
+   /* Offset to next interlace block */
+   static const png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+
+   png_debug(1, "in png_do_write_interlace");
+
+   /* We don't have to do anything on the last pass (6) */
+   if (pass < 6)
+   {
+      /* Each pixel depth is handled separately */
+      switch (row_info->pixel_depth)
+      {
+         case 1:
+         {
+            png_bytep sp;
+            png_bytep dp;
+            unsigned int shift;
+            int d;
+            int value;
+            png_uint_32 i;
+            png_uint_32 row_width = row_info->width;
+
+            dp = row;
+            d = 0;
+            shift = 7;
+
+            for (i = png_pass_start[pass]; i < row_width;
+               i += png_pass_inc[pass])
+            {
+               sp = row + (size_t)(i >> 3);
+               value = (int)(*sp >> (7 - (int)(i & 0x07))) & 0x01;
+               d |= (value << shift);
+
+               if (shift == 0)
+               {
+                  shift = 7;
+                  *dp++ = (png_byte)d;
+                  d = 0;
+               }
+
+               else
+                  shift--;
+
+            }
+            if (shift != 7)
+               *dp = (png_byte)d;
+
+            break;
+         }
+
+         case 2:
+         {
+            png_bytep sp;
+            png_bytep dp;
+            unsigned int shift;
+            int d;
+            int value;
+            png_uint_32 i;
+            png_uint_32 row_width = row_info->width;
+
+            dp = row;
+            shift = 6;
+            d = 0;
+
+            for (i = png_pass_start[pass]; i < row_width;
+               i += png_pass_inc[pass])
+            {
+               sp = row + (size_t)(i >> 2);
+               value = (*sp >> ((3 - (int)(i & 0x03)) << 1)) & 0x03;
+               d |= (value << shift);
+
+               if (shift == 0)
+               {
+                  shift = 6;
+                  *dp++ = (png_byte)d;
+                  d = 0;
+               }
+
+               else
+                  shift -= 2;
+            }
+            if (shift != 6)
+               *dp = (png_byte)d;
+
+            break;
+         }
+
+         case 4:
+         {
+            png_bytep sp;
+            png_bytep dp;
+            unsigned int shift;
+            int d;
+            int value;
+            png_uint_32 i;
+            png_uint_32 row_width = row_info->width;
+
+            dp = row;
+            shift = 4;
+            d = 0;
+            for (i = png_pass_start[pass]; i < row_width;
+                i += png_pass_inc[pass])
+            {
+               sp = row + (size_t)(i >> 1);
+               value = (*sp >> ((1 - (int)(i & 0x01)) << 2)) & 0x0f;
+               d |= (value << shift);
+
+               if (shift == 0)
+               {
+                  shift = 4;
+                  *dp++ = (png_byte)d;
+                  d = 0;
+               }
+
+               else
+                  shift -= 4;
+            }
+            if (shift != 4)
+               *dp = (png_byte)d;
+
+            break;
+         }
+
+         default:
+         {
+            png_bytep sp;
+            png_bytep dp;
+            png_uint_32 i;
+            png_uint_32 row_width = row_info->width;
+            size_t pixel_bytes;
+
+            /* Start at the beginning */
+            dp = row;
+
+            /* Find out how many bytes each pixel takes up */
+            pixel_bytes = (row_info->pixel_depth >> 3);
+
+            /* Loop through the row, only looking at the pixels that matter */
+            for (i = png_pass_start[pass]; i < row_width;
+               i += png_pass_inc[pass])
+            {
+               /* Find out where the original pixel is */
+               sp = row + (size_t)i * pixel_bytes;
+
+               /* Move the pixel */
+               if (dp != sp)
+                  memcpy(dp, sp, pixel_bytes);
+
+               /* Next pixel */
+               dp += pixel_bytes;
+            }
+            break;
+         }
+      }
+      /* Set new row width */
+      row_info->width = (row_info->width +
+          png_pass_inc[pass] - 1 -
+          png_pass_start[pass]) /
+          png_pass_inc[pass];
+
+      row_info->rowbytes = PNG_ROWBYTES(row_info->pixel_depth,
+          row_info->width);
+   }
+}
+#endif
+
+
+/* This filters the row, chooses which filter to use, if it has not already
+ * been specified by the application, and then writes the row out with the
+ * chosen filter.
+ */
+static void /* PRIVATE */
+png_write_filtered_row(png_structrp png_ptr, png_const_bytep filtered_row,
+    size_t row_bytes);
+
+/* This counts the row, once it has been written or passed to the pipeline. */
+static void /* PRIVATE */
+png_write_end_row(png_structrp png_ptr);
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+static size_t /* PRIVATE */
+png_setup_sub_row(png_const_bytep row_buf, png_bytep try_row, png_uint_32 bpp,
+    size_t row_bytes, size_t lmins)
+{
+   png_const_bytep rp, lp;
+   png_bytep dp;
+   size_t i;
+   size_t sum = 0;
+   unsigned int v;
+
+   try_row[0] = PNG_FILTER_VALUE_SUB;
+
+   for (i = 0, rp = row_buf + 1, dp = try_row + 1; i < bpp;
+        i++, rp++, dp++)
+   {
+      v = *dp = *rp;
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+   }
+
+   for (lp = row_buf + 1; i < row_bytes;
+      i++, rp++, lp++, dp++)
+   {
+      v = *dp = (png_byte)(((int)*rp - (int)*lp) & 0xff);
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+
+      if (sum > lmins)  /* We are already worse, don't continue. */
+        break;
+   }
+
+   return (sum);
+}
+
+static void /* PRIVATE */
+png_setup_sub_row_only(png_const_bytep row_buf, png_bytep try_row,
+    png_uint_32 bpp, size_t row_bytes)
+{
+   png_const_bytep rp, lp;
+   png_bytep dp;
+   size_t i;
+
+   try_row[0] = PNG_FILTER_VALUE_SUB;
+
+   for (i = 0, rp = row_buf + 1, dp = try_row + 1; i < bpp;
+        i++, rp++, dp++)
+   {
+      *dp = *rp;
+   }
+
+   for (lp = row_buf + 1; i < row_bytes;
+      i++, rp++, lp++, dp++)
+   {
+      *dp = (png_byte)(((int)*rp - (int)*lp) & 0xff);
+   }
+}
+
+static size_t /* PRIVATE */
+png_setup_up_row(png_const_bytep row_buf, png_const_bytep prev_row,
+    png_bytep try_row, size_t row_bytes, size_t lmins)
+{
+   png_const_bytep rp, pp;
+   png_bytep dp;
+   size_t i;
+   size_t sum = 0;
+   unsigned int v;
+
+   try_row[0] = PNG_FILTER_VALUE_UP;
+
+   for (i = 0, rp = row_buf + 1, dp = try_row + 1,
+       pp = prev_row + 1; i < row_bytes;
+       i++, rp++, pp++, dp++)
+   {
+      v = *dp = (png_byte)(((int)*rp - (int)*pp) & 0xff);
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+
+      if (sum > lmins)  /* We are already worse, don't continue. */
+        break;
+   }
+
+   return (sum);
+}
+static void /* PRIVATE */
+png_setup_up_row_only(png_const_bytep row_buf, png_const_bytep prev_row,
+    png_bytep try_row, size_t row_bytes)
+{
+   png_const_bytep rp, pp;
+   png_bytep dp;
+   size_t i;
+
+   try_row[0] = PNG_FILTER_VALUE_UP;
+
+   for (i = 0, rp = row_buf + 1, dp = try_row + 1,
+       pp = prev_row + 1; i < row_bytes;
+       i++, rp++, pp++, dp++)
+   {
+      *dp = (png_byte)(((int)*rp - (int)*pp) & 0xff);
+   }
+}
+
+static size_t /* PRIVATE */
+png_setup_avg_row(png_const_bytep row_buf, png_const_bytep prev_row,
+    png_bytep try_row, png_uint_32 bpp, size_t row_bytes, size_t lmins)
+{
+   png_const_bytep rp, pp, lp;
+   png_bytep dp;
+   png_uint_32 i;
+   size_t sum = 0;
+   unsigned int v;
+
+   try_row[0] = PNG_FILTER_VALUE_AVG;
+
+   for (i = 0, rp = row_buf + 1, dp = try_row + 1,
+       pp = prev_row + 1; i < bpp; i++)
+   {
+      v = *dp++ = (png_byte)(((int)*rp++ - ((int)*pp++ / 2)) & 0xff);
+
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+   }
+
+   for (lp = row_buf + 1; i < row_bytes; i++)
+   {
+      v = *dp++ = (png_byte)(((int)*rp++ - (((int)*pp++ + (int)*lp++) / 2))
+          & 0xff);
+
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+
+      if (sum > lmins)  /* We are already worse, don't continue. */
+        break;
+   }
+
+   return (sum);
+}
+static void /* PRIVATE */
+png_setup_avg_row_only(png_const_bytep row_buf, png_const_bytep prev_row,
+    png_bytep try_row, png_uint_32 bpp, size_t row_bytes)
+{
+   png_const_bytep rp, pp, lp;
+   png_bytep dp;
+   png_uint_32 i;
+
+   try_row[0] = PNG_FILTER_VALUE_AVG;
+
+   for (i = 0, rp = row_buf + 1, dp = try_row + 1,
+       pp = prev_row + 1; i < bpp; i++)
+   {
+      *dp++ = (png_byte)(((int)*rp++ - ((int)*pp++ / 2)) & 0xff);
+   }
+
+   for (lp = row_buf + 1; i < row_bytes; i++)
+   {
+      *dp++ = (png_byte)(((int)*rp++ - (((int)*pp++ + (int)*lp++) / 2))
+          & 0xff);
+   }
+}
+
+static size_t /* PRIVATE */
+png_setup_paeth_row(png_const_bytep row_buf, png_const_bytep prev_row,
+    png_bytep try_row, png_uint_32 bpp, size_t row_bytes, size_t lmins)
+{
+   png_const_bytep rp, pp, cp, lp;
+   png_bytep dp;
+   size_t i;
+   size_t sum = 0;
+   unsigned int v;
+
+   try_row[0] = PNG_FILTER_VALUE_PAETH;
+
+   for (i = 0, rp = row_buf + 1, dp = try_row + 1,
+       pp = prev_row + 1; i < bpp; i++)
+   {
+      v = *dp++ = (png_byte)(((int)*rp++ - (int)*pp++) & 0xff);
+
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+   }
+
+   for (lp = row_buf + 1, cp = prev_row + 1; i < row_bytes;
+        i++)
+   {
+      int a, b, c, pa, pb, pc, p;
+
+      b = *pp++;
+      c = *cp++;
+      a = *lp++;
+
+      p = b - c;
+      pc = a - c;
+
+#ifdef PNG_USE_ABS
+      pa = abs(p);
+      pb = abs(pc);
+      pc = abs(p + pc);
+#else
+      pa = p < 0 ? -p : p;
+      pb = pc < 0 ? -pc : pc;
+      pc = (p + pc) < 0 ? -(p + pc) : p + pc;
+#endif
+
+      p = (pa <= pb && pa <=pc) ? a : (pb <= pc) ? b : c;
+
+      v = *dp++ = (png_byte)(((int)*rp++ - p) & 0xff);
+
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+
+      if (sum > lmins)  /* We are already worse, don't continue. */
+        break;
+   }
+
+   return (sum);
+}
+static void /* PRIVATE */
+png_setup_paeth_row_only(png_const_bytep row_buf, png_const_bytep prev_row,
+    png_bytep try_row, png_uint_32 bpp, size_t row_bytes)
+{
+   png_const_bytep rp, pp, cp, lp;
+   png_bytep dp;
+   size_t i;
+
+   try_row[0] = PNG_FILTER_VALUE_PAETH;
+
+   for (i = 0, rp = row_buf + 1, dp = try_row + 1,
+       pp = prev_row + 1; i < bpp; i++)
+   {
+      *dp++ = (png_byte)(((int)*rp++ - (int)*pp++) & 0xff);
+   }
+
+   for (lp = row_buf + 1, cp = prev_row + 1; i < row_bytes;
+        i++)
+   {
+      int a, b, c, pa, pb, pc, p;
+
+      b = *pp++;
+      c = *cp++;
+      a = *lp++;
+
+      p = b - c;
+      pc = a - c;
+
+#ifdef PNG_USE_ABS
+      pa = abs(p);
+      pb = abs(pc);
+      pc = abs(p + pc);
+#else
+      pa = p < 0 ? -p : p;
+      pb = pc < 0 ? -pc : pc;
+      pc = (p + pc) < 0 ? -(p + pc) : p + pc;
+#endif
+
+      p = (pa <= pb && pa <=pc) ? a : (pb <= pc) ? b : c;
+
+      *dp++ = (png_byte)(((int)*rp++ - p) & 0xff);
+   }
+}
+
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+/* Filter 'row_buf' into 'try_row' with the filter 'value', which is not
+ * PNG_FILTER_VALUE_NONE.
+ */
+static void
+png_setup_row_only(unsigned int value, png_const_bytep row_buf,
+    png_const_bytep prev_row, png_bytep try_row, png_uint_32 bpp,
+    size_t row_bytes)
+{
+   switch (value)
+   {
+      case PNG_FILTER_VALUE_SUB:
+         png_setup_sub_row_only(row_buf, try_row, bpp, row_bytes);
+         break;
+
+      case PNG_FILTER_VALUE_UP:
+         png_setup_up_row_only(row_buf, prev_row, try_row, row_bytes);
+         break;
+
+      case PNG_FILTER_VALUE_AVG:
+         png_setup_avg_row_only(row_buf, prev_row, try_row, bpp, row_bytes);
+         break;
+
+      default:
+         png_setup_paeth_row_only(row_buf, prev_row, try_row, bpp, row_bytes);
+         break;
+   }
+}
 
-            png_ptr->num_rows = (png_ptr->height +
-                png_pass_yinc[png_ptr->pass] - 1 -
-                png_pass_ystart[png_ptr->pass]) /
-                png_pass_yinc[png_ptr->pass];
+/* The sum of absolute differences of a filtered row, as png_setup_sub_row and
+ * the others calculate it; 'rp' points after the filter byte.
+ */
+static size_t
+png_row_sad(png_const_bytep rp, size_t row_bytes)
+{
+   size_t sum = 0;
 
-            if ((png_ptr->transformations & PNG_INTERLACE) != 0)
-               break;
+   for (; row_bytes > 0; --row_bytes)
+   {
+      unsigned int v = *rp++;
 
-         } while (png_ptr->usr_width == 0 || png_ptr->num_rows == 0);
+#ifdef PNG_USE_ABS
+      sum += 128 - abs((int)v - 128);
+#else
+      sum += (v < 128) ? v : 256 - v;
+#endif
+   }
+
+   return sum;
+}
+
+/* log2(x) in 1/256ths of a bit for x >= 1: the fraction is interpolated
+ * between log2(1 + i/8) for i = 0..8, which is good to about 1/256.
+ */
+static png_uint_32
+png_log2_256(size_t x)
+{
+   static const png_uint_16 table[9] = {0, 44, 82, 118, 150, 179, 207, 232, 256};
+   png_uint_32 k = 15, f, i;
+
+   while (x >= 0x10000)
+   {
+      x >>= 1;
+      ++k;
+   }
+
+   while (x < 0x8000)
+   {
+      x <<= 1;
+      --k;
+   }
+
+   f = (png_uint_32)x - 0x8000;
+   i = f >> 12;
+   f &= 0xfff;
+
+   return (k << 8) + table[i] + (((table[i+1] - table[i]) * f) >> 12);
+}
+
+/* The number of bits, in 1/256ths, an order zero entropy coder would need for
+ * the filtered bytes; that is the sum over each byte value of count*log2(n /
+ * count).  This is at most 8 bits a byte, so the result cannot overflow if
+ * row_bytes is less than PNG_SIZE_MAX/4096.
+ */
+static size_t
+png_row_entropy(png_const_bytep rp, size_t row_bytes)
+{
+   size_t count[256];
+   size_t cost = 0;
+   png_uint_32 log_n = png_log2_256(row_bytes);
+   size_t i;
+
+   memset(count, 0, (sizeof count));
+
+   for (i = 0; i < row_bytes; ++i)
+      ++count[rp[i]];
+
+   for (i = 0; i < 256; ++i)
+      if (count[i] > 0)
+         cost += count[i] * (log_n - png_log2_256(count[i]));
+
+   return cost;
+}
+
+/* The PNG_FILTER_HEURISTIC_ENTROPY version of png_write_select_filter: filter
+ * the row with each filter and keep the one with the lowest entropy.
+ */
+static png_const_bytep
+png_write_select_entropy(unsigned int filter_to_do, png_const_bytep row_buf,
+    png_const_bytep prev_row, png_bytepp try_rowp, png_bytepp tst_rowp,
+    png_uint_32 bpp, size_t row_bytes)
+{
+   png_const_bytep best_row = row_buf;
+   size_t mins = PNG_SIZE_MAX;
+   unsigned int v;
+
+   for (v = PNG_FILTER_VALUE_NONE; v < PNG_FILTER_VALUE_LAST; ++v)
+   {
+      png_const_bytep row = row_buf;
+      size_t cost;
 
+      if ((filter_to_do & (PNG_FILTER_NONE << v)) == 0)
+         continue;
+
+      if (v != PNG_FILTER_VALUE_NONE)
+      {
+         png_setup_row_only(v, row_buf, prev_row, *try_rowp, bpp, row_bytes);
+         row = *try_rowp;
       }
 
-      /* Reset the row above the image for the next pass */
-      if (png_ptr->pass < 7)
+      cost = png_row_entropy(row + 1, row_bytes);
+
+      if (cost < mins)
       {
-         if (png_ptr->prev_row != NULL)
-            memset(png_ptr->prev_row, 0,
-                PNG_ROWBYTES(png_ptr->usr_channels *
-                png_ptr->usr_bit_depth, png_ptr->width) + 1);
+         mins = cost;
+         best_row = row;
 
-         return;
+         if (row != row_buf && *tst_rowp != NULL)
+         {
+            png_bytep tmp = *tst_rowp;
+
+            *tst_rowp = *try_rowp;
+            *try_rowp = tmp;
+         }
       }
    }
-#endif
 
-   /* If we get here, we've just written the last row, so we need
-      to flush the compressor */
-   png_compress_IDAT(png_ptr, NULL, 0, Z_FINISH);
+   return best_row;
 }
-
-#ifdef PNG_WRITE_INTERLACING_SUPPORTED
-/* Pick out the correct pixels for the interlace pass.
- * The basic idea here is to go through the row with a source
- * pointer and a destination pointer (sp and dp), and copy the
- * correct pixels for the pass.  As the row gets compacted,
- * sp will always be >= dp, so we should never overwrite anything.
- * See the default: case for the easiest code to understand.
+#endif /* WRITE_WEIGHTED_FILTER */
+
+/* Filter 'row_buf' with each of the filters in 'filter_to_do' and return the
+ * best result, which is either 'row_buf' itself (for 'none') or one of the
+ * two trial buffers; these are exchanged as the search goes on, so the caller
+ * passes pointers to its own pointers.  'tst_row' is only needed if there is
+ * more than one filter other than 'none'.  With a 'heuristic' of
+ * PNG_FILTER_HEURISTIC_ENTROPY the filters are compared by entropy, otherwise
+ * by their sums of absolute differences.
  */
-void /* PRIVATE */
-png_do_write_interlace(png_row_infop row_info, png_bytep row, int pass)
+static png_const_bytep
+png_write_select_filter(unsigned int filter_to_do, int heuristic,
+    png_const_bytep row_buf, png_const_bytep prev_row, png_bytepp try_rowp,
+    png_bytepp tst_rowp, png_uint_32 bpp, size_t row_bytes)
 {
-   /* Arrays to facilitate easy interlacing - use pass (0 - 6) as index */
+   png_const_bytep best_row;
+   size_t mins;
 
-   /* Start of interlace block */
-   static const png_byte png_pass_start[7] = {0, 4, 0, 2, 0, 1, 0};
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+   if (heuristic == PNG_FILTER_HEURISTIC_ENTROPY &&
+       (filter_to_do & (filter_to_do - 1)) != 0 &&
+       row_bytes < PNG_SIZE_MAX/4096)
+      return png_write_select_entropy(filter_to_do, row_buf, prev_row,
+          try_rowp, tst_rowp, bpp, row_bytes);
+#else
+   PNG_UNUSED(heuristic)
+#endif
 
-   /* Offset to next interlace block */
-   static const png_byte png_pass_inc[7] = {8, 8, 4, 4, 2, 2, 1};
+   mins = PNG_SIZE_MAX - 256/* so we can detect potential overflow of the
+                               running sum */;
 
-   png_debug(1, "in png_do_write_interlace");
+   /* The prediction method we use is to find which method provides the
+    * smallest value when summing the absolute values of the distances
+    * from zero, using anything >= 128 as negative numbers.  This is known
+    * as the "minimum sum of absolute differences" heuristic.  Other
+    * heuristics, chosen with png_set_filter_heuristics, are the "weighted
+    * minimum sum of absolute differences", the minimum entropy of the
+    * filtered bytes, and the "zlib predictive" method, which does test
+    * compressions of lines using different filter methods, and then chooses
+    * the filter that gives minimum compressed data size (VERY computationally
+    * expensive).
+    *
+    * GRR 980525:  consider also
+    *
+    *   (1) minimum sum of absolute differences from running average (i.e.,
+    *       keep running sum of non-absolute differences & count of bytes)
+    *       [track dispersion, too?  restart average if dispersion too large?]
+    *
+    *  (1b) minimum sum of absolute differences from sliding average, probably
+    *       with window size <= deflate window (usually 32K)
+    *
+    *   (2) minimum sum of squared differences from zero or running average
+    *       (i.e., ~ root-mean-square approach)
+    */
 
-   /* We don't have to do anything on the last pass (6) */
-   if (pass < 6)
+
+   /* We don't need to test the 'no filter' case if this is the only filter
+    * that has been chosen, as it doesn't actually do anything to the data.
+    */
+   best_row = row_buf;
+
+   if (PNG_SIZE_MAX/128 <= row_bytes)
    {
-      /* Each pixel depth is handled separately */
-      switch (row_info->pixel_depth)
+      /* Overflow can occur in the calculation, just select the lowest set
+       * filter.
+       */
+      filter_to_do &= 0U-filter_to_do;
+   }
+   else if ((filter_to_do & PNG_FILTER_NONE) != 0 &&
+         filter_to_do != PNG_FILTER_NONE)
+   {
+      /* Overflow not possible and multiple filters in the list, including the
+       * 'none' filter.
+       */
+      png_const_bytep rp;
+      size_t sum = 0;
+      size_t i;
+      unsigned int v;
+
       {
-         case 1:
+         for (i = 0, rp = row_buf + 1; i < row_bytes; i++, rp++)
          {
-            png_bytep sp;
-            png_bytep dp;
-            unsigned int shift;
-            int d;
-            int value;
-            png_uint_32 i;
-            png_uint_32 row_width = row_info->width;
+            v = *rp;
+#ifdef PNG_USE_ABS
+            sum += 128 - abs((int)v - 128);
+#else
+            sum += (v < 128) ? v : 256 - v;
+#endif
+         }
+      }
 
-            dp = row;
-            d = 0;
-            shift = 7;
+      mins = sum;
+   }
 
-            for (i = png_pass_start[pass]; i < row_width;
-               i += png_pass_inc[pass])
-            {
-               sp = row + (size_t)(i >> 3);
-               value = (int)(*sp >> (7 - (int)(i & 0x07))) & 0x01;
-               d |= (value << shift);
+   /* Sub filter */
+   if (filter_to_do == PNG_FILTER_SUB)
+   /* It's the only filter so no testing is needed */
+   {
+      png_setup_sub_row_only(row_buf, *try_rowp, bpp, row_bytes);
+      best_row = *try_rowp;
+   }
 
-               if (shift == 0)
-               {
-                  shift = 7;
-                  *dp++ = (png_byte)d;
-                  d = 0;
-               }
+   else if ((filter_to_do & PNG_FILTER_SUB) != 0)
+   {
+      size_t sum;
+      size_t lmins = mins;
 
-               else
-                  shift--;
+      sum = png_setup_sub_row(row_buf, *try_rowp, bpp, row_bytes, lmins);
 
-            }
-            if (shift != 7)
-               *dp = (png_byte)d;
+      if (sum < mins)
+      {
+         mins = sum;
+         best_row = *try_rowp;
+         if (*tst_rowp != NULL)
+         {
+            png_bytep tmp = *tst_rowp;
+
+            *tst_rowp = *try_rowp;
+            *try_rowp = tmp;
+         }
+      }
+   }
+
+   /* Up filter */
+   if (filter_to_do == PNG_FILTER_UP)
+   {
+      png_setup_up_row_only(row_buf, prev_row, *try_rowp, row_bytes);
+      best_row = *try_rowp;
+   }
+
+   else if ((filter_to_do & PNG_FILTER_UP) != 0)
+   {
+      size_t sum;
+      size_t lmins = mins;
+
+      sum = png_setup_up_row(row_buf, prev_row, *try_rowp, row_bytes, lmins);
+
+      if (sum < mins)
+      {
+         mins = sum;
+         best_row = *try_rowp;
+         if (*tst_rowp != NULL)
+         {
+            png_bytep tmp = *tst_rowp;
+
+            *tst_rowp = *try_rowp;
+            *try_rowp = tmp;
+         }
+      }
+   }
+
+   /* Avg filter */
+   if (filter_to_do == PNG_FILTER_AVG)
+   {
+      png_setup_avg_row_only(row_buf, prev_row, *try_rowp, bpp, row_bytes);
+      best_row = *try_rowp;
+   }
+
+   else if ((filter_to_do & PNG_FILTER_AVG) != 0)
+   {
+      size_t sum;
+      size_t lmins = mins;
+
+      sum = png_setup_avg_row(row_buf, prev_row, *try_rowp, bpp, row_bytes,
+          lmins);
+
+      if (sum < mins)
+      {
+         mins = sum;
+         best_row = *try_rowp;
+         if (*tst_rowp != NULL)
+         {
+            png_bytep tmp = *tst_rowp;
+
+            *tst_rowp = *try_rowp;
+            *try_rowp = tmp;
+         }
+      }
+   }
+
+   /* Paeth filter */
+   if (filter_to_do == PNG_FILTER_PAETH)
+   {
+      png_setup_paeth_row_only(row_buf, prev_row, *try_rowp, bpp, row_bytes);
+      best_row = *try_rowp;
+   }
+
+   else if ((filter_to_do & PNG_FILTER_PAETH) != 0)
+   {
+      size_t sum;
+      size_t lmins = mins;
+
+      sum = png_setup_paeth_row(row_buf, prev_row, *try_rowp, bpp, row_bytes,
+          lmins);
+
+      if (sum < mins)
+      {
+         best_row = *try_rowp;
+         if (*tst_rowp != NULL)
+         {
+            png_bytep tmp = *tst_rowp;
+
+            *tst_rowp = *try_rowp;
+            *try_rowp = tmp;
+         }
+      }
+   }
+
+   return best_row;
+}
+
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+/* Multiply a sum of absolute differences by a factor with PNG_WEIGHT_SHIFT
+ * fractional bits, saturating as png_write_select_filter's sums do.
+ */
+static size_t
+png_weighted_sum(size_t sum, png_uint_32 factor)
+{
+   if (sum > (PNG_SIZE_MAX - 256) / factor)
+      return PNG_SIZE_MAX - 256;
+
+   return (sum * factor) >> PNG_WEIGHT_SHIFT;
+}
+
+/* The PNG_FILTER_HEURISTIC_WEIGHTED version of png_write_select_filter.  The
+ * sum for each filter is multiplied by its cost and by the weight of each of
+ * the earlier rows that used the same filter.
+ */
+static png_const_bytep
+png_write_select_weighted(png_const_structrp png_ptr, unsigned int filter_to_do,
+    png_const_bytep row_buf, png_const_bytep prev_row, png_bytepp try_rowp,
+    png_bytepp tst_rowp, png_uint_32 bpp, size_t row_bytes)
+{
+   png_const_bytep best_row = row_buf;
+   size_t mins = PNG_SIZE_MAX - 256;
+   unsigned int v;
+
+   for (v = PNG_FILTER_VALUE_NONE; v < PNG_FILTER_VALUE_LAST; ++v)
+   {
+      png_uint_32 factor = PNG_WEIGHT_FACTOR;
+      size_t lmins, sum;
+      int i;
 
-            break;
-         }
+      if ((filter_to_do & (PNG_FILTER_NONE << v)) == 0)
+         continue;
 
-         case 2:
+      for (i = 0; i < png_ptr->num_prev_filters; ++i)
+         if (png_ptr->prev_filters[i] == v)
          {
-            png_bytep sp;
-            png_bytep dp;
-            unsigned int shift;
-            int d;
-            int value;
-            png_uint_32 i;
-            png_uint_32 row_width = row_info->width;
+            factor = (factor * png_ptr->filter_weights[i]) >> PNG_WEIGHT_SHIFT;
 
-            dp = row;
-            shift = 6;
-            d = 0;
+            if (factor > 65535)
+               factor = 65535;
+         }
 
-            for (i = png_pass_start[pass]; i < row_width;
-               i += png_pass_inc[pass])
-            {
-               sp = row + (size_t)(i >> 2);
-               value = (*sp >> ((3 - (int)(i & 0x03)) << 1)) & 0x03;
-               d |= (value << shift);
+      factor = (factor * png_ptr->filter_costs[v]) >> PNG_COST_SHIFT;
 
-               if (shift == 0)
-               {
-                  shift = 6;
-                  *dp++ = (png_byte)d;
-                  d = 0;
-               }
+      if (factor < 1)
+         factor = 1;
 
-               else
-                  shift -= 2;
-            }
-            if (shift != 6)
-               *dp = (png_byte)d;
+      else if (factor > 65535)
+         factor = 65535;
 
-            break;
-         }
+      /* A row that sums to more than this cannot weigh less than 'mins': */
+      lmins = mins / factor + 1;
 
-         case 4:
-         {
-            png_bytep sp;
-            png_bytep dp;
-            unsigned int shift;
-            int d;
-            int value;
-            png_uint_32 i;
-            png_uint_32 row_width = row_info->width;
+      if (lmins > (PNG_SIZE_MAX - 256) >> PNG_WEIGHT_SHIFT)
+         lmins = PNG_SIZE_MAX - 256;
 
-            dp = row;
-            shift = 4;
-            d = 0;
-            for (i = png_pass_start[pass]; i < row_width;
-                i += png_pass_inc[pass])
-            {
-               sp = row + (size_t)(i >> 1);
-               value = (*sp >> ((1 - (int)(i & 0x01)) << 2)) & 0x0f;
-               d |= (value << shift);
+      else
+         lmins <<= PNG_WEIGHT_SHIFT;
 
-               if (shift == 0)
-               {
-                  shift = 4;
-                  *dp++ = (png_byte)d;
-                  d = 0;
-               }
+      switch (v)
+      {
+         case PNG_FILTER_VALUE_NONE:
+            sum = png_row_sad(row_buf + 1, row_bytes);
+            break;
 
-               else
-                  shift -= 4;
-            }
-            if (shift != 4)
-               *dp = (png_byte)d;
+         case PNG_FILTER_VALUE_SUB:
+            sum = png_setup_sub_row(row_buf, *try_rowp, bpp, row_bytes, lmins);
+            break;
 
+         case PNG_FILTER_VALUE_UP:
+            sum = png_setup_up_row(row_buf, prev_row, *try_rowp, row_bytes,
+                lmins);
+            break;
+
+         case PNG_FILTER_VALUE_AVG:
+            sum = png_setup_avg_row(row_buf, prev_row, *try_rowp, bpp,
+                row_bytes, lmins);
             break;
-         }
 
          default:
-         {
-            png_bytep sp;
-            png_bytep dp;
-            png_uint_32 i;
-            png_uint_32 row_width = row_info->width;
-            size_t pixel_bytes;
+            sum = png_setup_paeth_row(row_buf, prev_row, *try_rowp, bpp,
+                row_bytes, lmins);
+            break;
+      }
 
-            /* Start at the beginning */
-            dp = row;
+      sum = png_weighted_sum(sum, factor);
 
-            /* Find out how many bytes each pixel takes up */
-            pixel_bytes = (row_info->pixel_depth >> 3);
+      if (sum < mins)
+      {
+         mins = sum;
 
-            /* Loop through the row, only looking at the pixels that matter */
-            for (i = png_pass_start[pass]; i < row_width;
-               i += png_pass_inc[pass])
-            {
-               /* Find out where the original pixel is */
-               sp = row + (size_t)i * pixel_bytes;
+         if (v == PNG_FILTER_VALUE_NONE)
+            best_row = row_buf;
 
-               /* Move the pixel */
-               if (dp != sp)
-                  memcpy(dp, sp, pixel_bytes);
+         else
+         {
+            best_row = *try_rowp;
 
-               /* Next pixel */
-               dp += pixel_bytes;
+            if (*tst_rowp != NULL)
+            {
+               png_bytep tmp = *tst_rowp;
+
+               *tst_rowp = *try_rowp;
+               *try_rowp = tmp;
             }
-            break;
          }
       }
-      /* Set new row width */
-      row_info->width = (row_info->width +
-          png_pass_inc[pass] - 1 -
-          png_pass_start[pass]) /
-          png_pass_inc[pass];
-
-      row_info->rowbytes = PNG_ROWBYTES(row_info->pixel_depth,
-          row_info->width);
    }
-}
-#endif
 
+   return best_row;
+}
 
-/* This filters the row, chooses which filter to use, if it has not already
- * been specified by the application, and then writes the row out with the
- * chosen filter.
+/* The PNG_FILTER_HEURISTIC_ZLIB state.  Each row is filtered with every
+ * filter into 'row'; if there are more than PNG_FILTER_TRIALS candidates only
+ * those with the lowest entropy are kept, which limits the cost.  Each is
+ * deflated by a copy of a stream that has been given the filtered rows chosen
+ * before, so that it is compressed much as it will be in the IDAT stream, and
+ * the shortest is chosen.  The copy that deflated the chosen row then becomes
+ * the stream for the next row.  Each row ends with a Z_SYNC_FLUSH, so the
+ * copies all start a new block.
  */
-static void /* PRIVATE */
-png_write_filtered_row(png_structrp png_ptr, png_bytep filtered_row,
-    size_t row_bytes);
-
-#ifdef PNG_WRITE_FILTER_SUPPORTED
-static size_t /* PRIVATE */
-png_setup_sub_row(png_structrp png_ptr, png_uint_32 bpp,
-    size_t row_bytes, size_t lmins)
+typedef struct
 {
-   png_bytep rp, dp, lp;
-   size_t i;
-   size_t sum = 0;
-   unsigned int v;
+   z_stream      zstream[3];  /* The stream, the best copy and a spare */
+   unsigned int  live;        /* Bit i is set if zstream[i] is initialized */
+   int           current;     /* The zstream given the chosen rows */
+   png_bytep     output;      /* Output for the compressions, not kept */
+   uInt          output_size;
+   png_bytep     row[PNG_FILTER_TRIALS + 1]; /* The candidates and a spare */
+   size_t        cost[PNG_FILTER_TRIALS + 1]; /* Their entropy, in order */
+} png_filter_trials, *png_filter_trialsp;
+
+static png_filter_trialsp
+png_filter_trials_init(png_structrp png_ptr)
+{
+   png_filter_trialsp trials = png_voidcast(png_filter_trialsp,
+       png_ptr->filter_trials);
+   size_t row_size = png_ptr->rowbytes + 1;
+   int level, window_bits, mem_level, ret, i;
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_SUB;
+   if (trials != NULL)
+      return trials;
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1; i < bpp;
-        i++, rp++, dp++)
+   trials = png_voidcast(png_filter_trialsp,
+       png_malloc(png_ptr, (sizeof *trials)));
+   memset(trials, 0, (sizeof *trials));
+
+   /* From here png_free_filter_trials cleans up after an error. */
+   png_ptr->filter_trials = trials;
+
+   for (i = 0; i <= PNG_FILTER_TRIALS; ++i)
+      trials->row[i] = png_voidcast(png_bytep, png_malloc(png_ptr, row_size));
+
+   for (i = 0; i < 3; ++i)
    {
-      v = *dp = *rp;
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
+      trials->zstream[i].zalloc = png_zalloc;
+      trials->zstream[i].zfree = png_zfree;
+      trials->zstream[i].opaque = png_ptr;
    }
 
-   for (lp = png_ptr->row_buf + 1; i < row_bytes;
-      i++, rp++, lp++, dp++)
-   {
-      v = *dp = (png_byte)(((int)*rp - (int)*lp) & 0xff);
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
+   /* A raw stream with the IDAT level and strategy.  The stream is copied for
+    * every candidate, so the window is only as big as PNG_FILTER_TRIAL_ROWS
+    * rows (up to PNG_FILTER_TRIAL_WINDOW) and the hash table and symbol buffer
+    * only as big as a row needs; narrow images would otherwise spend most of
+    * the time copying.
+    */
+   level = png_ptr->zlib_level;
+
+#ifdef PNG_WRITE_FAST_ENCODER_SUPPORTED
+   if (level == PNG_COMPRESSION_LEVEL_FASTEST)
+      level = 1;
 #endif
 
-      if (sum > lmins)  /* We are already worse, don't continue. */
-        break;
-   }
+#ifdef PNG_WRITE_OPTIMAL_ENCODER_SUPPORTED
+   /* zlib's best is the nearest to what the optimal encoder will do. */
+   if (level == PNG_COMPRESSION_LEVEL_OPTIMAL)
+      level = 9;
+#endif
 
-   return (sum);
-}
+   for (window_bits = 9; window_bits < 15 &&
+       ((size_t)1 << window_bits) < PNG_FILTER_TRIAL_WINDOW &&
+       ((size_t)1 << window_bits) / PNG_FILTER_TRIAL_ROWS < row_size;
+       ++window_bits)
+      ;
 
-static void /* PRIVATE */
-png_setup_sub_row_only(png_structrp png_ptr, png_uint_32 bpp,
-    size_t row_bytes)
-{
-   png_bytep rp, dp, lp;
-   size_t i;
+   for (mem_level = 1; mem_level < png_ptr->zlib_mem_level &&
+       ((size_t)1 << (mem_level + 6)) < row_size; ++mem_level)
+      ;
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_SUB;
+   ret = deflateInit2(&trials->zstream[0], level, png_ptr->zlib_method,
+       -window_bits, mem_level, png_IDAT_strategy(png_ptr));
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1; i < bpp;
-        i++, rp++, dp++)
+   /* Without the stream the rows are chosen by their sums alone. */
+   if (ret != Z_OK)
    {
-      *dp = *rp;
+      png_warning(png_ptr, "filter trial compression not available");
+      return trials;
    }
 
-   for (lp = png_ptr->row_buf + 1; i < row_bytes;
-      i++, rp++, lp++, dp++)
-   {
-      *dp = (png_byte)(((int)*rp - (int)*lp) & 0xff);
-   }
+   trials->live = 1U;
+   trials->output_size =
+       (uInt)deflateBound(&trials->zstream[0], (uLong)row_size) + 16;
+   trials->output = png_voidcast(png_bytep,
+       png_malloc(png_ptr, trials->output_size));
+
+   return trials;
 }
 
-static size_t /* PRIVATE */
-png_setup_up_row(png_structrp png_ptr, size_t row_bytes, size_t lmins)
+/* Deflate 'row' with a Z_SYNC_FLUSH and return the number of bytes of output,
+ * or PNG_SIZE_MAX if zlib fails.
+ */
+static size_t
+png_filter_trial_deflate(png_filter_trialsp trials, z_streamp zs,
+    png_const_bytep row, size_t row_size)
 {
-   png_bytep rp, dp, pp;
-   size_t i;
-   size_t sum = 0;
-   unsigned int v;
+   size_t size = 0;
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_UP;
+   /* zlib does not change the input */
+   zs->next_in = PNGZ_INPUT_CAST(row);
+   zs->avail_in = (uInt)row_size;
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < row_bytes;
-       i++, rp++, pp++, dp++)
+   do
    {
-      v = *dp = (png_byte)(((int)*rp - (int)*pp) & 0xff);
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
+      zs->next_out = trials->output;
+      zs->avail_out = trials->output_size;
 
-      if (sum > lmins)  /* We are already worse, don't continue. */
-        break;
+      if (deflate(zs, Z_SYNC_FLUSH) != Z_OK)
+         return PNG_SIZE_MAX;
+
+      size += trials->output_size - zs->avail_out;
    }
+   while (zs->avail_out == 0);
 
-   return (sum);
+   return zs->avail_in == 0 ? size : PNG_SIZE_MAX;
 }
-static void /* PRIVATE */
-png_setup_up_row_only(png_structrp png_ptr, size_t row_bytes)
-{
-   png_bytep rp, dp, pp;
-   size_t i;
-
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_UP;
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < row_bytes;
-       i++, rp++, pp++, dp++)
+/* The number of bytes 'row' deflates to after the rows chosen before, using a
+ * copy of the stream in zstream[copy], or PNG_SIZE_MAX if zlib fails.
+ */
+static size_t
+png_filter_trial(png_filter_trialsp trials, int copy, png_const_bytep row,
+    size_t row_size)
+{
+   if ((trials->live & (1U << copy)) != 0)
    {
-      *dp = (png_byte)(((int)*rp - (int)*pp) & 0xff);
+      deflateEnd(&trials->zstream[copy]);
+      trials->live &= ~(1U << copy);
    }
+
+   if (deflateCopy(&trials->zstream[copy],
+       &trials->zstream[trials->current]) != Z_OK)
+      return PNG_SIZE_MAX;
+
+   trials->live |= 1U << copy;
+
+   return png_filter_trial_deflate(trials, &trials->zstream[copy], row,
+       row_size);
 }
 
-static size_t /* PRIVATE */
-png_setup_avg_row(png_structrp png_ptr, png_uint_32 bpp,
-    size_t row_bytes, size_t lmins)
+/* End every stream; the rows are then chosen by their entropy alone. */
+static void
+png_free_filter_trial_streams(png_filter_trialsp trials)
 {
-   png_bytep rp, dp, pp, lp;
-   png_uint_32 i;
-   size_t sum = 0;
+   int i;
+
+   for (i = 0; i < 3; ++i)
+      if ((trials->live & (1U << i)) != 0)
+         deflateEnd(&trials->zstream[i]);
+
+   trials->live = 0;
+}
+
+/* The PNG_FILTER_HEURISTIC_ZLIB version of png_write_select_filter. */
+static png_const_bytep
+png_write_select_zlib(png_structrp png_ptr, unsigned int filter_to_do,
+    png_const_bytep row_buf, png_const_bytep prev_row, png_uint_32 bpp,
+    size_t row_bytes)
+{
+   png_filter_trialsp trials = png_filter_trials_init(png_ptr);
+   png_const_bytep best_row;
+   int kept = 0, rank = 0, best = -1;
    unsigned int v;
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_AVG;
+   for (v = PNG_FILTER_VALUE_NONE; v < PNG_FILTER_VALUE_LAST; ++v)
+      if ((filter_to_do & (PNG_FILTER_NONE << v)) != 0)
+         ++rank;
+
+   /* Entropy is only needed to choose which candidates to try: */
+   rank = rank > PNG_FILTER_TRIALS && row_bytes < PNG_SIZE_MAX/4096;
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < bpp; i++)
+   for (v = PNG_FILTER_VALUE_NONE; v < PNG_FILTER_VALUE_LAST; ++v)
    {
-      v = *dp++ = (png_byte)(((int)*rp++ - ((int)*pp++ / 2)) & 0xff);
+      int i = kept < PNG_FILTER_TRIALS ? kept : PNG_FILTER_TRIALS;
 
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
+      if ((filter_to_do & (PNG_FILTER_NONE << v)) == 0)
+         continue;
+
+      if (v == PNG_FILTER_VALUE_NONE)
+         memcpy(trials->row[i], row_buf, row_bytes + 1);
+
+      else
+         png_setup_row_only(v, row_buf, prev_row, trials->row[i], bpp,
+             row_bytes);
+
+      trials->cost[i] = rank != 0 ?
+          png_row_entropy(trials->row[i] + 1, row_bytes) : 0;
+
+      /* Move the row up to its place; a row that falls off the end is in the
+       * spare slot.
+       */
+      for (; i > 0 && trials->cost[i] < trials->cost[i-1]; --i)
+      {
+         png_bytep row = trials->row[i];
+         size_t cost = trials->cost[i];
+
+         trials->row[i] = trials->row[i-1];
+         trials->cost[i] = trials->cost[i-1];
+         trials->row[i-1] = row;
+         trials->cost[i-1] = cost;
+      }
+
+      if (kept < PNG_FILTER_TRIALS)
+         ++kept;
    }
 
-   for (lp = png_ptr->row_buf + 1; i < row_bytes; i++)
+   best_row = trials->row[0];
+
+   if (trials->live == 0)
+      return best_row;
+
+   if (kept > 1)
    {
-      v = *dp++ = (png_byte)(((int)*rp++ - (((int)*pp++ + (int)*lp++) / 2))
-          & 0xff);
+      size_t mins = PNG_SIZE_MAX;
+      int i;
 
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
+      for (i = 0; i < kept; ++i)
+      {
+         /* The copy that is neither the stream nor the best so far: */
+         int copy = 0;
+         size_t size;
 
-      if (sum > lmins)  /* We are already worse, don't continue. */
-        break;
+         while (copy == trials->current || copy == best)
+            ++copy;
+
+         size = png_filter_trial(trials, copy, trials->row[i], row_bytes + 1);
+
+         if (size < mins)
+         {
+            mins = size;
+            best = copy;
+            best_row = trials->row[i];
+         }
+      }
    }
 
-   return (sum);
+   /* The copy that deflated the chosen row replaces the stream, otherwise the
+    * row is given to the stream itself.  The stream is not used again if zlib
+    * fails.
+    */
+   if (best >= 0)
+   {
+      deflateEnd(&trials->zstream[trials->current]);
+      trials->live &= ~(1U << trials->current);
+      trials->current = best;
+   }
+
+   else if (png_filter_trial_deflate(trials,
+       &trials->zstream[trials->current], best_row, row_bytes + 1) ==
+       PNG_SIZE_MAX)
+   {
+      png_free_filter_trial_streams(trials);
+   }
+
+   return best_row;
 }
-static void /* PRIVATE */
-png_setup_avg_row_only(png_structrp png_ptr, png_uint_32 bpp,
-    size_t row_bytes)
+
+void /* PRIVATE */
+png_free_filter_trials(png_structrp png_ptr)
+{
+   png_filter_trialsp trials = png_voidcast(png_filter_trialsp,
+       png_ptr->filter_trials);
+   int i;
+
+   if (trials == NULL)
+      return;
+
+   png_free_filter_trial_streams(trials);
+   png_free(png_ptr, trials->output);
+
+   for (i = 0; i <= PNG_FILTER_TRIALS; ++i)
+      png_free(png_ptr, trials->row[i]);
+
+   png_free(png_ptr, trials);
+   png_ptr->filter_trials = NULL;
+}
+#endif /* WRITE_WEIGHTED_FILTER */
+#endif /* WRITE_FILTER */
+
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+/* The pipelined writer.  png_write_row passes each transformed row to
+ * png_write_pipeline_row, which adds it to the batch being filled.  When the
+ * batch is full tasks choose the filter for each of its rows and filter them
+ * into a second buffer, while the caller compresses the rows of the previous
+ * batch and then goes on to fill that batch again.  Filtering a row needs only
+ * the row before it, so each batch keeps a copy of the last row of the batch
+ * before.  The tasks have trial buffers of their own and do nothing that
+ * might call png_error.
+ */
+typedef struct
 {
-   png_bytep rp, dp, pp, lp;
-   png_uint_32 i;
+   png_task      task;
+   png_voidp     control;     /* The png_write_pipeline_control */
+   png_voidp     batch;       /* The png_write_pipeline_batch */
+   png_bytep     try_row;     /* Trial buffers for png_write_select_filter */
+   png_bytep     tst_row;
+   png_uint_32   first;       /* The rows of the batch to filter */
+   png_uint_32   count;
+} png_write_pipeline_worker, *png_write_pipeline_workerp;
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_AVG;
+typedef struct
+{
+   png_bytep     raw;         /* The last row before the batch, then its rows */
+   png_bytep     filtered;    /* The filtered rows */
+   png_uint_32   count;       /* Number of rows added to the batch */
+   png_uint_32   pending;     /* Number of filtered rows to compress */
+   int           running;     /* Number of tasks running */
+   png_write_pipeline_worker worker[PNG_WRITE_PIPELINE_TASKS];
+} png_write_pipeline_batch, *png_write_pipeline_batchp;
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < bpp; i++)
-   {
-      *dp++ = (png_byte)(((int)*rp++ - ((int)*pp++ / 2)) & 0xff);
-   }
+typedef struct
+{
+   png_uint_32   rows;        /* Number of rows in a batch */
+   int           threads;     /* Tasks per batch */
+   size_t        row_size;    /* Bytes in a row, including the filter byte */
+   png_uint_32   bpp;         /* Bytes per pixel, rounded up */
+   unsigned int  filters;     /* The filters to choose from */
+   int           heuristic;   /* How png_write_select_filter compares them */
+   int           current;     /* The batch being filled */
+   png_write_pipeline_batch batch[2];
+} png_write_pipeline_control, *png_write_pipeline_controlp;
+
+/* The task: filter some of the rows of a batch. */
+static void PNGCBAPI
+png_write_pipeline_filter(png_voidp argument)
+{
+   png_write_pipeline_workerp worker =
+       png_voidcast(png_write_pipeline_workerp, argument);
+   png_write_pipeline_controlp control =
+       png_voidcast(png_write_pipeline_controlp, worker->control);
+   png_write_pipeline_batchp batch =
+       png_voidcast(png_write_pipeline_batchp, worker->batch);
+   size_t row_size = control->row_size;
+   png_const_bytep row = batch->raw + (worker->first + 1) * row_size;
+   png_bytep out = batch->filtered + worker->first * row_size;
+   png_uint_32 i;
 
-   for (lp = png_ptr->row_buf + 1; i < row_bytes; i++)
-   {
-      *dp++ = (png_byte)(((int)*rp++ - (((int)*pp++ + (int)*lp++) / 2))
-          & 0xff);
-   }
+   for (i = 0; i < worker->count; ++i, row += row_size, out += row_size)
+      memcpy(out, png_write_select_filter(control->filters, control->heuristic,
+          row, row - row_size, &worker->try_row, &worker->tst_row,
+          control->bpp, row_size - 1), row_size);
 }
 
-static size_t /* PRIVATE */
-png_setup_paeth_row(png_structrp png_ptr, png_uint_32 bpp,
-    size_t row_bytes, size_t lmins)
+/* Set up the pipeline, if the application asked for it, when the first row is
+ * written.
+ */
+static void
+png_write_pipeline_init(png_structrp png_ptr)
 {
-   png_bytep rp, dp, pp, cp, lp;
-   size_t i;
-   size_t sum = 0;
-   unsigned int v;
+   png_write_pipeline_controlp control;
+   png_uint_32 rows = png_ptr->write_pipeline_rows;
+   size_t row_size = png_ptr->rowbytes + 1;
+   unsigned int filters = png_ptr->do_filter &
+       (PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_AVG | PNG_FILTER_PAETH);
+   int threads = png_ptr->write_pipeline_threads;
+   int heuristic = PNG_FILTER_HEURISTIC_DEFAULT;
+   int b;
+
+   /* Interlaced images and unfiltered ones are written as before. */
+   if (rows == 0 || png_ptr->interlaced != 0 || filters == 0)
+      return;
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_PAETH;
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+   /* So are images PNG_ENCODE_PRESET_AUTO is choosing the filters for. */
+   if (png_auto_filters(png_ptr) != 0)
+      return;
+#endif
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < bpp; i++)
-   {
-      v = *dp++ = (png_byte)(((int)*rp++ - (int)*pp++) & 0xff);
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+   /* So are images with heuristics that depend on the rows before. */
+   heuristic = png_ptr->heuristic_method;
 
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
+   if (heuristic == PNG_FILTER_HEURISTIC_WEIGHTED ||
+       heuristic == PNG_FILTER_HEURISTIC_ZLIB)
+      return;
 #endif
-   }
 
-   for (lp = png_ptr->row_buf + 1, cp = png_ptr->prev_row + 1; i < row_bytes;
-        i++)
-   {
-      int a, b, c, pa, pb, pc, p;
+   /* Don't allocate more than the image needs, or than memory can hold: */
+   if (rows > png_ptr->height)
+      rows = png_ptr->height;
 
-      b = *pp++;
-      c = *cp++;
-      a = *lp++;
+   if (rows > PNG_SIZE_MAX / row_size - 1)
+      rows = (png_uint_32)(PNG_SIZE_MAX / row_size - 1);
 
-      p = b - c;
-      pc = a - c;
+   if (threads < 1)
+      threads = 1;
 
-#ifdef PNG_USE_ABS
-      pa = abs(p);
-      pb = abs(pc);
-      pc = abs(p + pc);
-#else
-      pa = p < 0 ? -p : p;
-      pb = pc < 0 ? -pc : pc;
-      pc = (p + pc) < 0 ? -(p + pc) : p + pc;
-#endif
+   else if ((png_uint_32)threads > rows)
+      threads = (int)rows;
 
-      p = (pa <= pb && pa <=pc) ? a : (pb <= pc) ? b : c;
+   control = png_voidcast(png_write_pipeline_controlp,
+       png_malloc(png_ptr, (sizeof *control)));
+   memset(control, 0, (sizeof *control));
 
-      v = *dp++ = (png_byte)(((int)*rp++ - p) & 0xff);
+   /* From here png_free_write_pipeline cleans up after an error. */
+   png_ptr->write_pipeline = control;
+   control->rows = rows;
+   control->threads = threads;
+   control->row_size = row_size;
+   control->bpp = (png_uint_32)((png_ptr->pixel_depth + 7) >> 3);
+   control->filters = png_ptr->do_filter;
+   control->heuristic = heuristic;
 
-#ifdef PNG_USE_ABS
-      sum += 128 - abs((int)v - 128);
-#else
-      sum += (v < 128) ? v : 256 - v;
-#endif
+   for (b = 0; b < 2; ++b)
+   {
+      png_write_pipeline_batchp batch = &control->batch[b];
+      int i;
 
-      if (sum > lmins)  /* We are already worse, don't continue. */
-        break;
-   }
+      /* The row before the first row of the image is all zero. */
+      batch->raw = png_voidcast(png_bytep, png_calloc(png_ptr,
+          (rows + 1) * row_size));
+      batch->filtered = png_voidcast(png_bytep, png_malloc(png_ptr,
+          rows * row_size));
 
-   return (sum);
-}
-static void /* PRIVATE */
-png_setup_paeth_row_only(png_structrp png_ptr, png_uint_32 bpp,
-    size_t row_bytes)
-{
-   png_bytep rp, dp, pp, cp, lp;
-   size_t i;
+      for (i = 0; i < control->threads; ++i)
+      {
+         png_write_pipeline_workerp worker = &batch->worker[i];
 
-   png_ptr->try_row[0] = PNG_FILTER_VALUE_PAETH;
+         worker->control = control;
+         worker->batch = batch;
+         worker->try_row = png_voidcast(png_bytep,
+             png_malloc(png_ptr, control->row_size));
 
-   for (i = 0, rp = png_ptr->row_buf + 1, dp = png_ptr->try_row + 1,
-       pp = png_ptr->prev_row + 1; i < bpp; i++)
-   {
-      *dp++ = (png_byte)(((int)*rp++ - (int)*pp++) & 0xff);
+         /* As in png_write_start_row */
+         if ((filters & (filters - 1)) != 0)
+            worker->tst_row = png_voidcast(png_bytep,
+                png_malloc(png_ptr, control->row_size));
+      }
    }
+}
 
-   for (lp = png_ptr->row_buf + 1, cp = png_ptr->prev_row + 1; i < row_bytes;
-        i++)
-   {
-      int a, b, c, pa, pb, pc, p;
+static void
+png_write_pipeline_start(png_structrp png_ptr,
+    png_write_pipeline_controlp control, png_write_pipeline_batchp batch)
+{
+   png_uint_32 first, share;
 
-      b = *pp++;
-      c = *cp++;
-      a = *lp++;
+   share = (batch->count + (png_uint_32)control->threads - 1) /
+       (png_uint_32)control->threads;
 
-      p = b - c;
-      pc = a - c;
+   for (first = 0; first < batch->count; first += share)
+   {
+      png_write_pipeline_workerp worker = &batch->worker[batch->running];
 
-#ifdef PNG_USE_ABS
-      pa = abs(p);
-      pb = abs(pc);
-      pc = abs(p + pc);
-#else
-      pa = p < 0 ? -p : p;
-      pb = pc < 0 ? -pc : pc;
-      pc = (p + pc) < 0 ? -(p + pc) : p + pc;
-#endif
+      worker->first = first;
+      worker->count = batch->count - first;
 
-      p = (pa <= pb && pa <=pc) ? a : (pb <= pc) ? b : c;
+      if (worker->count > share)
+         worker->count = share;
 
-      *dp++ = (png_byte)(((int)*rp++ - p) & 0xff);
+      png_task_start(png_ptr, &worker->task, png_write_pipeline_filter,
+          worker);
+      ++batch->running;
    }
+
+   batch->pending = batch->count;
 }
-#endif /* WRITE_FILTER */
 
-void /* PRIVATE */
-png_write_find_filter(png_structrp png_ptr, png_row_infop row_info)
+/* Wait for the tasks on a batch and compress its rows. */
+static void
+png_write_pipeline_finish(png_structrp png_ptr,
+    png_write_pipeline_controlp control, png_write_pipeline_batchp batch)
 {
-#ifndef PNG_WRITE_FILTER_SUPPORTED
-   png_write_filtered_row(png_ptr, png_ptr->row_buf, row_info->rowbytes+1);
-#else
-   unsigned int filter_to_do = png_ptr->do_filter;
-   png_bytep row_buf;
-   png_bytep best_row;
-   png_uint_32 bpp;
-   size_t mins;
-   size_t row_bytes = row_info->rowbytes;
+   png_const_bytep row = batch->filtered;
+   png_uint_32 pending = batch->pending;
 
-   png_debug(1, "in png_write_find_filter");
+   while (batch->running > 0)
+      png_task_finish(png_ptr, &batch->worker[--batch->running].task);
 
-   /* Find out how many bytes offset each pixel is */
-   bpp = (row_info->pixel_depth + 7) >> 3;
+   /* png_compress_IDAT may not return, so mark the rows done first. */
+   batch->pending = 0;
 
-   row_buf = png_ptr->row_buf;
-   mins = PNG_SIZE_MAX - 256/* so we can detect potential overflow of the
-                               running sum */;
+   for (; pending > 0; --pending, row += control->row_size)
+      png_compress_IDAT(png_ptr, row, control->row_size, Z_NO_FLUSH);
+}
 
-   /* The prediction method we use is to find which method provides the
-    * smallest value when summing the absolute values of the distances
-    * from zero, using anything >= 128 as negative numbers.  This is known
-    * as the "minimum sum of absolute differences" heuristic.  Other
-    * heuristics are the "weighted minimum sum of absolute differences"
-    * (experimental and can in theory improve compression), and the "zlib
-    * predictive" method (not implemented yet), which does test compressions
-    * of lines using different filter methods, and then chooses the
-    * (series of) filter(s) that give minimum compressed data size (VERY
-    * computationally expensive).
-    *
-    * GRR 980525:  consider also
-    *
-    *   (1) minimum sum of absolute differences from running average (i.e.,
-    *       keep running sum of non-absolute differences & count of bytes)
-    *       [track dispersion, too?  restart average if dispersion too large?]
-    *
-    *  (1b) minimum sum of absolute differences from sliding average, probably
-    *       with window size <= deflate window (usually 32K)
-    *
-    *   (2) minimum sum of squared differences from zero or running average
-    *       (i.e., ~ root-mean-square approach)
-    */
+/* Start filtering the current batch and compress the previous one.  With
+ * 'wait' the current batch is compressed too.  Then, unless the current batch
+ * was empty, the other batch becomes the one to fill.
+ */
+static void
+png_write_pipeline_step(png_structrp png_ptr,
+    png_write_pipeline_controlp control, int wait)
+{
+   png_write_pipeline_batchp batch = &control->batch[control->current];
+   png_write_pipeline_batchp other = &control->batch[1 - control->current];
 
+   if (batch->count > 0)
+      png_write_pipeline_start(png_ptr, control, batch);
 
-   /* We don't need to test the 'no filter' case if this is the only filter
-    * that has been chosen, as it doesn't actually do anything to the data.
-    */
-   best_row = png_ptr->row_buf;
+   png_write_pipeline_finish(png_ptr, control, other);
 
-   if (PNG_SIZE_MAX/128 <= row_bytes)
+   if (wait != 0)
+      png_write_pipeline_finish(png_ptr, control, batch);
+
+   if (batch->count > 0)
    {
-      /* Overflow can occur in the calculation, just select the lowest set
-       * filter.
-       */
-      filter_to_do &= 0U-filter_to_do;
+      /* The tasks only read the rows, so this can be done while they run. */
+      memcpy(other->raw, batch->raw + batch->count * control->row_size,
+          control->row_size);
+      batch->count = 0;
+      control->current = 1 - control->current;
    }
-   else if ((filter_to_do & PNG_FILTER_NONE) != 0 &&
-         filter_to_do != PNG_FILTER_NONE)
-   {
-      /* Overflow not possible and multiple filters in the list, including the
-       * 'none' filter.
-       */
-      png_bytep rp;
-      size_t sum = 0;
-      size_t i;
-      unsigned int v;
+}
 
-      {
-         for (i = 0, rp = row_buf + 1; i < row_bytes; i++, rp++)
-         {
-            v = *rp;
-#ifdef PNG_USE_ABS
-            sum += 128 - abs((int)v - 128);
-#else
-            sum += (v < 128) ? v : 256 - v;
-#endif
-         }
-      }
+static void
+png_write_pipeline_row(png_structrp png_ptr,
+    png_write_pipeline_controlp control)
+{
+   png_write_pipeline_batchp batch = &control->batch[control->current];
 
-      mins = sum;
-   }
+   memcpy(batch->raw + (batch->count + 1) * control->row_size,
+       png_ptr->row_buf, control->row_size);
 
-   /* Sub filter */
-   if (filter_to_do == PNG_FILTER_SUB)
-   /* It's the only filter so no testing is needed */
+   if (++batch->count == control->rows)
+      png_write_pipeline_step(png_ptr, control, 0/*wait*/);
+
+   /* All the rows must be compressed before png_write_finish_row finishes the
+    * zlib stream after the last one.
+    */
+   if (png_ptr->row_number + 1 >= png_ptr->num_rows)
    {
-      png_setup_sub_row_only(png_ptr, bpp, row_bytes);
-      best_row = png_ptr->try_row;
+      png_write_pipeline_step(png_ptr, control, 1/*wait*/);
+      png_free_write_pipeline(png_ptr);
    }
 
-   else if ((filter_to_do & PNG_FILTER_SUB) != 0)
-   {
-      size_t sum;
-      size_t lmins = mins;
+   png_write_end_row(png_ptr);
+}
 
-      sum = png_setup_sub_row(png_ptr, bpp, row_bytes, lmins);
+void /* PRIVATE */
+png_write_pipeline_flush(png_structrp png_ptr)
+{
+   if (png_ptr->write_pipeline != NULL)
+      png_write_pipeline_step(png_ptr, png_voidcast(png_write_pipeline_controlp,
+          png_ptr->write_pipeline), 1/*wait*/);
+}
 
-      if (sum < mins)
-      {
-         mins = sum;
-         best_row = png_ptr->try_row;
-         if (png_ptr->tst_row != NULL)
-         {
-            png_ptr->try_row = png_ptr->tst_row;
-            png_ptr->tst_row = best_row;
-         }
-      }
-   }
+void /* PRIVATE */
+png_free_write_pipeline(png_structrp png_ptr)
+{
+   png_write_pipeline_controlp control =
+       png_voidcast(png_write_pipeline_controlp, png_ptr->write_pipeline);
+   int b;
 
-   /* Up filter */
-   if (filter_to_do == PNG_FILTER_UP)
-   {
-      png_setup_up_row_only(png_ptr, row_bytes);
-      best_row = png_ptr->try_row;
-   }
+   if (control == NULL)
+      return;
 
-   else if ((filter_to_do & PNG_FILTER_UP) != 0)
+   for (b = 0; b < 2; ++b)
    {
-      size_t sum;
-      size_t lmins = mins;
+      png_write_pipeline_batchp batch = &control->batch[b];
+      int i;
 
-      sum = png_setup_up_row(png_ptr, row_bytes, lmins);
+      while (batch->running > 0)
+         png_task_finish(png_ptr, &batch->worker[--batch->running].task);
 
-      if (sum < mins)
+      for (i = 0; i < control->threads; ++i)
       {
-         mins = sum;
-         best_row = png_ptr->try_row;
-         if (png_ptr->tst_row != NULL)
-         {
-            png_ptr->try_row = png_ptr->tst_row;
-            png_ptr->tst_row = best_row;
-         }
+         png_free(png_ptr, batch->worker[i].try_row);
+         png_free(png_ptr, batch->worker[i].tst_row);
       }
+
+      png_free(png_ptr, batch->raw);
+      png_free(png_ptr, batch->filtered);
    }
 
-   /* Avg filter */
-   if (filter_to_do == PNG_FILTER_AVG)
+   png_free(png_ptr, control);
+   png_ptr->write_pipeline = NULL;
+}
+#endif /* WRITE_PIPELINE */
+
+#ifdef PNG_WRITE_FILTER_SUPPORTED
+/* Filter one row, 'prev_row' being the unfiltered row before it, with the
+ * heuristic the application chose, and return the filtered row.
+ */
+static png_const_bytep
+png_write_select_row(png_structrp png_ptr, unsigned int filter_to_do,
+    png_const_bytep row_buf, png_const_bytep prev_row, png_uint_32 bpp,
+    size_t row_bytes)
+{
+   int heuristic = PNG_FILTER_HEURISTIC_DEFAULT;
+   png_const_bytep best_row;
+
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+   heuristic = png_ptr->heuristic_method;
+
+   /* The heuristics that use the rows before can't be pipelined. */
+   if (heuristic == PNG_FILTER_HEURISTIC_WEIGHTED &&
+       (filter_to_do & (filter_to_do - 1)) != 0 &&
+       row_bytes < PNG_SIZE_MAX/128)
+      best_row = png_write_select_weighted(png_ptr, filter_to_do, row_buf,
+          prev_row, &png_ptr->try_row, &png_ptr->tst_row, bpp, row_bytes);
+
+   else if (heuristic == PNG_FILTER_HEURISTIC_ZLIB &&
+       (filter_to_do & (filter_to_do - 1)) != 0 &&
+       row_bytes < ZLIB_IO_MAX/2 && png_ptr->zlib_level != 0)
+      best_row = png_write_select_zlib(png_ptr, filter_to_do, row_buf,
+          prev_row, bpp, row_bytes);
+
+   else
+#endif
+   best_row = png_write_select_filter(filter_to_do, heuristic, row_buf,
+       prev_row, &png_ptr->try_row, &png_ptr->tst_row, bpp, row_bytes);
+
+#ifdef PNG_WRITE_WEIGHTED_FILTER_SUPPORTED
+   if (png_ptr->num_prev_filters > 0)
    {
-      png_setup_avg_row_only(png_ptr, bpp, row_bytes);
-      best_row = png_ptr->try_row;
+      /* Remember the filter for the weights of the next rows. */
+      memmove(png_ptr->prev_filters + 1, png_ptr->prev_filters,
+          png_ptr->num_prev_filters - 1U);
+      png_ptr->prev_filters[0] = best_row[0];
    }
+#endif
 
-   else if ((filter_to_do & PNG_FILTER_AVG) != 0)
-   {
-      size_t sum;
-      size_t lmins = mins;
+   return best_row;
+}
+#endif /* WRITE_FILTER */
+
+void /* PRIVATE */
+png_write_find_filter(png_structrp png_ptr, png_row_infop row_info)
+{
+#ifndef PNG_WRITE_FILTER_SUPPORTED
+   png_write_filtered_row(png_ptr, png_ptr->row_buf, row_info->rowbytes+1);
+#else
+   png_debug(1, "in png_write_find_filter");
 
-      sum= png_setup_avg_row(png_ptr, bpp, row_bytes, lmins);
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+   if (png_ptr->auto_sample != NULL)
+   {
+      png_auto_samplep sample =
+          png_voidcast(png_auto_samplep, png_ptr->auto_sample);
 
-      if (sum < mins)
+      if (sample->chosen == 0)
       {
-         mins = sum;
-         best_row = png_ptr->try_row;
-         if (png_ptr->tst_row != NULL)
-         {
-            png_ptr->try_row = png_ptr->tst_row;
-            png_ptr->tst_row = best_row;
-         }
+         png_auto_sample_row(sample, png_ptr->row_buf + 1, row_info->rowbytes,
+             (unsigned int)(row_info->pixel_depth + 7) >> 3);
+
+         if (sample->changes >= PNG_AUTO_SAMPLE_CHANGES &&
+             sample->rows >= PNG_AUTO_SAMPLE_ROWS)
+            png_auto_choose(png_ptr, NULL, 0);
       }
    }
+#endif
 
-   /* Paeth filter */
-   if (filter_to_do == PNG_FILTER_PAETH)
+#ifdef PNG_WRITE_PIPELINE_SUPPORTED
+   if (png_ptr->write_pipeline != NULL)
    {
-      png_setup_paeth_row_only(png_ptr, bpp, row_bytes);
-      best_row = png_ptr->try_row;
+      png_write_pipeline_row(png_ptr,
+          png_voidcast(png_write_pipeline_controlp, png_ptr->write_pipeline));
+      return;
    }
+#endif
 
-   else if ((filter_to_do & PNG_FILTER_PAETH) != 0)
    {
-      size_t sum;
-      size_t lmins = mins;
+      unsigned int filter_to_do = png_ptr->do_filter;
+      size_t row_bytes = row_info->rowbytes;
 
-      sum = png_setup_paeth_row(png_ptr, bpp, row_bytes, lmins);
+#ifdef PNG_WRITE_ENCODE_PRESET_SUPPORTED
+      /* The rows PNG_ENCODE_PRESET_AUTO samples are not filtered yet. */
+      if (png_auto_filters(png_ptr) != 0)
+         filter_to_do = PNG_FILTER_NONE;
+#endif
 
-      if (sum < mins)
-      {
-         best_row = png_ptr->try_row;
-         if (png_ptr->tst_row != NULL)
-         {
-            png_ptr->try_row = png_ptr->tst_row;
-            png_ptr->tst_row = best_row;
-         }
-      }
+      /* Do the actual writing of the filtered row data from the chosen
+       * filter.
+       */
+      png_write_filtered_row(png_ptr, png_write_select_row(png_ptr,
+          filter_to_do, png_ptr->row_buf, png_ptr->prev_row,
+          (row_info->pixel_depth + 7) >> 3, row_bytes), row_bytes+1);
    }
-
-   /* Do the actual writing of the filtered row data from the chosen filter. */
-   png_write_filtered_row(png_ptr, best_row, row_info->rowbytes+1);
-
 #endif /* WRITE_FILTER */
 }
 
 
 /* Do the actual writing of a previously filtered row. */
 static void
-png_write_filtered_row(png_structrp png_ptr, png_bytep filtered_row,
+png_write_filtered_row(png_structrp png_ptr, png_const_bytep filtered_row,
     size_t full_row_length/*includes filter byte*/)
 {
    png_debug(1, "in png_write_filtered_row");
@@ -2765,6 +6910,12 @@ png_write_filtered_row(png_structrp png_ptr, png_bytep filtered_row,
    }
 #endif /* WRITE_FILTER */
 
+   png_write_end_row(png_ptr);
+}
+
+static void
+png_write_end_row(png_structrp png_ptr)
+{
    /* Finish row - updates counters and flushes zlib if last row */
    png_write_finish_row(png_ptr);
 